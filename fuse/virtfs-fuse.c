@@ -0,0 +1,1358 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+/*
+ * FUSE daemon mounting an NFS export through the VirtFS library:
+ *
+ *   virtfs-fuse -o nconnect=4,readahead=1048576 nfs://server/export /mnt
+ *
+ * The export is mounted nconnect times, each mount with a connection of its
+ * own, and the requests of the multi-threaded session loop are spread over
+ * them. An open file or directory stays on the mount it was opened on.
+ *
+ * The library keeps no attribute or name cache, the kernel does: the
+ * replies carry attr_timeout and entry_timeout, names that do not exist are
+ * cached for entry_timeout as well, readdirplus fills the name cache while
+ * listing, and the writeback cache gathers small writes.
+ */
+#define FUSE_USE_VERSION 31
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <virtfs.h>
+#include <virtfs_log.h>
+
+#define VFS_NCONNECT_MAX 16
+#define VFS_HASH_MIN 1024
+
+struct vfs_conn
+{
+        virtfs_t fs;
+        pthread_mutex_t lock;           /* held across the calls on fs */
+};
+
+/*
+ * The kernel knows a file by the address of its node, and the library by
+ * its path, which is rebuilt from the names up to the root.
+ */
+struct vfs_node
+{
+        struct vfs_node *next;          /* in its hash bucket */
+        struct vfs_node *parent;
+        char *name;
+        uint64_t nlookup;               /* references of the kernel */
+        uint64_t nchild;                /* nodes of which it is the parent */
+        bool hashed;                    /* not once unlinked or replaced */
+};
+
+struct vfs_file
+{
+        struct vfs_conn *conn;
+        vfd_t vfd;
+        int flags;
+};
+
+struct vfs_dir
+{
+        struct vfs_conn *conn;
+        virtfs_dir_t dir;
+        char *path;
+        off_t offset;                   /* of ent, or of the next entry */
+        struct dirent *ent;             /* read but not returned yet */
+        struct stat st;
+};
+
+struct vfs_opts
+{
+        char *url;
+        int nconnect;
+        int readahead;
+        double attr_timeout;
+        double entry_timeout;
+        int writeback;
+};
+
+static struct vfs_opts opts = {
+        .nconnect = 1,
+        .attr_timeout = 1.0,
+        .entry_timeout = 1.0,
+        .writeback = 1,
+};
+
+static struct vfs_conn *conns;
+static unsigned int next_conn;
+static bool writeback;                  /* granted by the kernel */
+
+/* Nodes by parent and name */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vfs_node root = { .name = "", .nlookup = 1 };
+static struct vfs_node **buckets;
+static size_t nbuckets;
+static size_t nnodes;
+
+/*
+ * A mount for a call, locked: the first free one from a rotating start, or
+ * the one at the start once it is free.
+ */
+static struct vfs_conn *conn_get(void)
+{
+        unsigned int start;
+        struct vfs_conn *c;
+        int i;
+
+        start = __atomic_fetch_add(&next_conn, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < opts.nconnect; i++) {
+                c = &conns[(start + i) % opts.nconnect];
+                if (pthread_mutex_trylock(&c->lock) == 0)
+                        return c;
+        }
+
+        c = &conns[start % opts.nconnect];
+        pthread_mutex_lock(&c->lock);
+
+        return c;
+}
+
+static void conn_put(struct vfs_conn *c)
+{
+        pthread_mutex_unlock(&c->lock);
+}
+
+static inline struct vfs_node *node_of(fuse_ino_t ino)
+{
+        return ino == FUSE_ROOT_ID ? &root : (struct vfs_node *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t ino_of(struct vfs_node *n)
+{
+        return n == &root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)n;
+}
+
+/* FNV-1a of the name, seeded with the parent */
+static size_t node_hash(struct vfs_node *parent, const char *name)
+{
+        uint64_t h = 14695981039346656037ULL ^ (uintptr_t)parent;
+
+        for (; *name; name++) {
+                h ^= (unsigned char)*name;
+                h *= 1099511628211ULL;
+        }
+
+        return h & (nbuckets - 1);
+}
+
+static struct vfs_node *node_find(struct vfs_node *parent, const char *name)
+{
+        struct vfs_node *n;
+
+        for (n = buckets[node_hash(parent, name)]; n; n = n->next) {
+                if (n->parent == parent && strcmp(n->name, name) == 0)
+                        return n;
+        }
+
+        return NULL;
+}
+
+static void node_hash_add(struct vfs_node *n)
+{
+        size_t i = node_hash(n->parent, n->name);
+
+        n->next = buckets[i];
+        buckets[i] = n;
+        n->hashed = true;
+        nnodes++;
+}
+
+static void node_unhash(struct vfs_node *n)
+{
+        struct vfs_node **p;
+
+        if (!n->hashed)
+                return;
+
+        for (p = &buckets[node_hash(n->parent, n->name)]; *p != n;
+             p = &(*p)->next)
+                ;
+        *p = n->next;
+        n->hashed = false;
+        nnodes--;
+}
+
+/* Doubles the buckets once there are as many nodes */
+static void node_grow(void)
+{
+        struct vfs_node **old = buckets, *n, *next;
+        size_t i, size = nbuckets;
+
+        if (nnodes < nbuckets)
+                return;
+
+        buckets = calloc(size * 2, sizeof(*buckets));
+        if (buckets == NULL) {
+                /* Longer chains, still correct */
+                buckets = old;
+                return;
+        }
+
+        nbuckets = size * 2;
+        nnodes = 0;
+        for (i = 0; i < size; i++) {
+                for (n = old[i]; n; n = next) {
+                        next = n->next;
+                        node_hash_add(n);
+                }
+        }
+
+        free(old);
+}
+
+/* Frees n and then its parents while nothing refers to them any more */
+static void node_release(struct vfs_node *n)
+{
+        struct vfs_node *parent;
+
+        while (n != &root && n->nlookup == 0 && n->nchild == 0) {
+                node_unhash(n);
+                parent = n->parent;
+                parent->nchild--;
+                free(n->name);
+                free(n);
+                n = parent;
+        }
+}
+
+/* The node of name in parent, with one more lookup, NULL without memory */
+static struct vfs_node *node_lookup(fuse_ino_t parent, const char *name)
+{
+        struct vfs_node *n;
+
+        pthread_mutex_lock(&tree_lock);
+        n = node_find(node_of(parent), name);
+        if (n == NULL) {
+                n = calloc(1, sizeof(struct vfs_node));
+                if (n == NULL || (n->name = strdup(name)) == NULL) {
+                        free(n);
+                        n = NULL;
+                        goto out;
+                }
+
+                node_grow();
+                n->parent = node_of(parent);
+                n->parent->nchild++;
+                node_hash_add(n);
+        }
+
+        n->nlookup++;
+out:
+        pthread_mutex_unlock(&tree_lock);
+
+        return n;
+}
+
+static void node_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+        struct vfs_node *n = node_of(ino);
+
+        pthread_mutex_lock(&tree_lock);
+        n->nlookup -= nlookup;
+        node_release(n);
+        pthread_mutex_unlock(&tree_lock);
+}
+
+/* Forgets the name once its file is removed, the node lives on */
+static void node_unlink(fuse_ino_t parent, const char *name)
+{
+        struct vfs_node *n;
+
+        pthread_mutex_lock(&tree_lock);
+        n = node_find(node_of(parent), name);
+        if (n)
+                node_unhash(n);
+        pthread_mutex_unlock(&tree_lock);
+}
+
+static void node_rename(fuse_ino_t parent, const char *name,
+                        fuse_ino_t newparent, const char *newname)
+{
+        struct vfs_node *n, *old;
+        char *dup;
+
+        dup = strdup(newname);
+
+        pthread_mutex_lock(&tree_lock);
+        n = node_find(node_of(newparent), newname);
+        if (n)
+                node_unhash(n);
+
+        n = node_find(node_of(parent), name);
+        if (n == NULL)
+                goto out;
+
+        node_unhash(n);
+        if (dup == NULL) {
+                /* Unreachable by name until looked up again */
+                goto out;
+        }
+
+        old = n->parent;
+        n->parent = node_of(newparent);
+        n->parent->nchild++;
+        old->nchild--;
+        free(n->name);
+        n->name = dup;
+        dup = NULL;
+        node_grow();
+        node_hash_add(n);
+        node_release(old);
+out:
+        pthread_mutex_unlock(&tree_lock);
+        free(dup);
+}
+
+/* The path of ino, or of name in ino, NULL without memory */
+static char *node_path(fuse_ino_t ino, const char *name)
+{
+        struct vfs_node *n;
+        size_t len = 0, l;
+        char *path, *p;
+
+        pthread_mutex_lock(&tree_lock);
+        for (n = node_of(ino); n != &root; n = n->parent)
+                len += strlen(n->name) + 1;
+        if (name)
+                len += strlen(name) + 1;
+
+        path = malloc(len + 2);
+        if (path == NULL)
+                goto out;
+
+        p = path + len;
+        *p = '\0';
+        if (name) {
+                l = strlen(name);
+                p -= l;
+                memcpy(p, name, l);
+                *--p = '/';
+        }
+
+        for (n = node_of(ino); n != &root; n = n->parent) {
+                l = strlen(n->name);
+                p -= l;
+                memcpy(p, n->name, l);
+                *--p = '/';
+        }
+
+        if (len == 0)
+                strcpy(path, "/");
+out:
+        pthread_mutex_unlock(&tree_lock);
+
+        return path;
+}
+
+static inline struct vfs_file *vfs_file(struct fuse_file_info *fi)
+{
+        return (struct vfs_file *)(uintptr_t)fi->fh;
+}
+
+static inline struct vfs_dir *vfs_dir(struct fuse_file_info *fi)
+{
+        return (struct vfs_dir *)(uintptr_t)fi->fh;
+}
+
+static void vfs_entry(struct fuse_entry_param *e, struct vfs_node *n,
+                      const struct stat *st)
+{
+        bzero(e, sizeof(*e));
+        e->ino = ino_of(n);
+        e->attr = *st;
+        e->attr_timeout = opts.attr_timeout;
+        e->entry_timeout = opts.entry_timeout;
+}
+
+static void vfs_reply_entry(fuse_req_t req, fuse_ino_t parent,
+                            const char *name, const struct stat *st)
+{
+        struct fuse_entry_param e;
+        struct vfs_node *n;
+
+        n = node_lookup(parent, name);
+        if (n == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        vfs_entry(&e, n, st);
+        fuse_reply_entry(req, &e);
+}
+
+/*
+ * With the writeback cache the kernel reads the pages around the writes
+ * and places the appends itself.
+ */
+static int vfs_open_flags(int flags)
+{
+        if (writeback) {
+                if ((flags & O_ACCMODE) == O_WRONLY)
+                        flags = (flags & ~O_ACCMODE) | O_RDWR;
+                flags &= ~O_APPEND;
+        }
+
+        return flags & ~(O_CLOEXEC | O_NOCTTY | O_LARGEFILE);
+}
+
+static void vfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                       FUSE_CAP_SPLICE_WRITE |
+                                       FUSE_CAP_SPLICE_MOVE |
+                                       FUSE_CAP_READDIRPLUS |
+                                       FUSE_CAP_PARALLEL_DIROPS);
+        if (opts.writeback)
+                conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+
+        writeback = (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+}
+
+static void vfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        struct fuse_entry_param e;
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret;
+
+        path = node_path(parent, name);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = virtfs_lstat(c->fs, path, &st);
+        conn_put(c);
+        free(path);
+
+        if (ret == -ENOENT && opts.entry_timeout > 0) {
+                /* Cached as missing */
+                bzero(&e, sizeof(e));
+                e.entry_timeout = opts.entry_timeout;
+                fuse_reply_entry(req, &e);
+        } else if (ret < 0) {
+                fuse_reply_err(req, -ret);
+        } else {
+                vfs_reply_entry(req, parent, name, &st);
+        }
+}
+
+static void vfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+        node_forget(ino, nlookup);
+        fuse_reply_none(req);
+}
+
+static void vfs_forget_multi(fuse_req_t req, size_t count,
+                             struct fuse_forget_data *forgets)
+{
+        size_t i;
+
+        for (i = 0; i < count; i++)
+                node_forget(forgets[i].ino, forgets[i].nlookup);
+        fuse_reply_none(req);
+}
+
+static void vfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+        struct vfs_file *f = fi ? vfs_file(fi) : NULL;
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret;
+
+        if (f) {
+                pthread_mutex_lock(&f->conn->lock);
+                ret = virtfs_fstat(f->vfd, &st);
+                conn_put(f->conn);
+        } else {
+                path = node_path(ino, NULL);
+                if (path == NULL) {
+                        fuse_reply_err(req, ENOMEM);
+                        return;
+                }
+
+                c = conn_get();
+                ret = virtfs_lstat(c->fs, path, &st);
+                conn_put(c);
+                free(path);
+        }
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_attr(req, &st, opts.attr_timeout);
+}
+
+static void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                        int to_set, struct fuse_file_info *fi)
+{
+        struct vfs_file *f = fi ? vfs_file(fi) : NULL;
+        struct timeval tv[2], now;
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret = 0;
+
+        path = node_path(ino, NULL);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        if (f) {
+                c = f->conn;
+                pthread_mutex_lock(&c->lock);
+        } else {
+                c = conn_get();
+        }
+
+        if (to_set & FUSE_SET_ATTR_SIZE) {
+                if (f)
+                        ret = virtfs_ftruncate(f->vfd, attr->st_size);
+                else
+                        ret = virtfs_truncate(c->fs, path, attr->st_size);
+        }
+
+        if (ret == 0 && to_set & FUSE_SET_ATTR_MODE)
+                ret = virtfs_chmod(c->fs, path, attr->st_mode & 07777);
+
+        /* The attributes left alone are set to what they are */
+        if (ret == 0 && to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID |
+                                  FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+                ret = virtfs_lstat(c->fs, path, &st);
+
+        if (ret == 0 && to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+                ret = virtfs_chown(c->fs, path,
+                        to_set & FUSE_SET_ATTR_UID ? attr->st_uid : st.st_uid,
+                        to_set & FUSE_SET_ATTR_GID ? attr->st_gid : st.st_gid);
+
+        if (ret == 0 && to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+                gettimeofday(&now, NULL);
+                TIMESPEC_TO_TIMEVAL(&tv[0], &st.st_atim);
+                TIMESPEC_TO_TIMEVAL(&tv[1], &st.st_mtim);
+                if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                        tv[0] = now;
+                else if (to_set & FUSE_SET_ATTR_ATIME)
+                        TIMESPEC_TO_TIMEVAL(&tv[0], &attr->st_atim);
+                if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                        tv[1] = now;
+                else if (to_set & FUSE_SET_ATTR_MTIME)
+                        TIMESPEC_TO_TIMEVAL(&tv[1], &attr->st_mtim);
+
+                ret = virtfs_utimes(c->fs, path, tv);
+        }
+
+        if (ret == 0) {
+                if (f)
+                        ret = virtfs_fstat(f->vfd, &st);
+                else
+                        ret = virtfs_lstat(c->fs, path, &st);
+        }
+
+        conn_put(c);
+        free(path);
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_attr(req, &st, opts.attr_timeout);
+}
+
+static void vfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+        char buf[PATH_MAX + 1];
+        struct vfs_conn *c;
+        char *path;
+        int ret;
+
+        path = node_path(ino, NULL);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = virtfs_readlink(c->fs, path, buf, PATH_MAX);
+        conn_put(c);
+        free(path);
+
+        if (ret < 0) {
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+        buf[ret] = '\0';
+        fuse_reply_readlink(req, buf);
+}
+
+static void vfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode)
+{
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret;
+
+        path = node_path(parent, name);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = virtfs_mkdir(c->fs, path, mode);
+        if (ret == 0)
+                ret = virtfs_lstat(c->fs, path, &st);
+        conn_put(c);
+        free(path);
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                vfs_reply_entry(req, parent, name, &st);
+}
+
+static void vfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                        const char *name)
+{
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret;
+
+        path = node_path(parent, name);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = virtfs_symlink(c->fs, link, path);
+        if (ret == 0)
+                ret = virtfs_lstat(c->fs, path, &st);
+        conn_put(c);
+        free(path);
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                vfs_reply_entry(req, parent, name, &st);
+}
+
+static void vfs_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       int (*remove)(virtfs_t, const char *))
+{
+        struct vfs_conn *c;
+        char *path;
+        int ret;
+
+        path = node_path(parent, name);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = remove(c->fs, path);
+        conn_put(c);
+        free(path);
+
+        if (ret == 0)
+                node_unlink(parent, name);
+        fuse_reply_err(req, -ret);
+}
+
+static void vfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        vfs_remove(req, parent, name, virtfs_unlink);
+}
+
+static void vfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        vfs_remove(req, parent, name, virtfs_rmdir);
+}
+
+static void vfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname,
+                       unsigned int flags)
+{
+        struct vfs_conn *c;
+        char *path, *newpath;
+        int ret;
+
+        /* Neither RENAME_NOREPLACE nor RENAME_EXCHANGE exist in NFS */
+        if (flags) {
+                fuse_reply_err(req, EINVAL);
+                return;
+        }
+
+        path = node_path(parent, name);
+        newpath = node_path(newparent, newname);
+        if (path == NULL || newpath == NULL) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        c = conn_get();
+        ret = virtfs_rename(c->fs, path, newpath);
+        conn_put(c);
+
+        if (ret == 0)
+                node_rename(parent, name, newparent, newname);
+out:
+        free(path);
+        free(newpath);
+        fuse_reply_err(req, -ret);
+}
+
+/* Opens path on c, which is locked, into fi */
+static int vfs_do_open(struct vfs_conn *c, const char *path,
+                       struct fuse_file_info *fi, int flags, mode_t mode)
+{
+        struct vfs_file *f;
+
+        f = malloc(sizeof(struct vfs_file));
+        if (f == NULL)
+                return -ENOMEM;
+
+        f->vfd = virtfs_open(c->fs, path, flags, mode);
+        if (f->vfd == NULL) {
+                free(f);
+                return -errno;
+        }
+
+        f->conn = c;
+        f->flags = flags;
+        fi->fh = (uintptr_t)f;
+
+        return 0;
+}
+
+static void vfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode, struct fuse_file_info *fi)
+{
+        struct fuse_entry_param e;
+        struct vfs_file *f;
+        struct vfs_node *n;
+        struct vfs_conn *c;
+        struct stat st;
+        char *path;
+        int ret;
+
+        path = node_path(parent, name);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = vfs_do_open(c, path, fi, vfs_open_flags(fi->flags) | O_CREAT,
+                          mode);
+        if (ret == 0) {
+                f = vfs_file(fi);
+                ret = virtfs_fstat(f->vfd, &st);
+                if (ret < 0) {
+                        virtfs_close(f->vfd);
+                        free(f);
+                }
+        }
+        conn_put(c);
+        free(path);
+
+        if (ret < 0) {
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+        n = node_lookup(parent, name);
+        if (n == NULL) {
+                pthread_mutex_lock(&c->lock);
+                virtfs_close(f->vfd);
+                conn_put(c);
+                free(f);
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        vfs_entry(&e, n, &st);
+        fuse_reply_create(req, &e, fi);
+}
+
+static void vfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        struct vfs_conn *c;
+        char *path;
+        int ret;
+
+        path = node_path(ino, NULL);
+        if (path == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        c = conn_get();
+        ret = vfs_do_open(c, path, fi, vfs_open_flags(fi->flags), 0);
+        conn_put(c);
+        free(path);
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_open(req, fi);
+}
+
+/*
+ * The reply is spliced from memory into the device when the kernel allows
+ * it, which saves a copy of every read.
+ */
+static void vfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info *fi)
+{
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+        struct vfs_file *f = vfs_file(fi);
+        ssize_t n = 0, ret = 0;
+        char *data;
+
+        data = malloc(size);
+        if (data == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        pthread_mutex_lock(&f->conn->lock);
+        while ((size_t)n < size) {
+                ret = virtfs_pread(f->vfd, data + n, size - n, off + n);
+                if (ret <= 0)
+                        break;
+                n += ret;
+        }
+        conn_put(f->conn);
+
+        if (ret < 0 && n == 0) {
+                fuse_reply_err(req, -ret);
+        } else {
+                buf.buf[0].mem = data;
+                buf.buf[0].size = n;
+                fuse_reply_data(req, &buf, 0);
+        }
+
+        free(data);
+}
+
+/* Data spliced from the device is drained from its pipe into memory first */
+static void vfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_bufvec *in, off_t off,
+                          struct fuse_file_info *fi)
+{
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(in));
+        struct vfs_file *f = vfs_file(fi);
+        ssize_t n = 0, ret, size;
+        char *data;
+
+        data = malloc(buf.buf[0].size);
+        if (data == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        buf.buf[0].mem = data;
+        size = fuse_buf_copy(&buf, in, 0);
+        if (size < 0) {
+                fuse_reply_err(req, -size);
+                goto out;
+        }
+
+        pthread_mutex_lock(&f->conn->lock);
+        for (ret = 0; n < size; n += ret) {
+                ret = virtfs_pwrite(f->vfd, data + n, size - n, off + n);
+                if (ret <= 0)
+                        break;
+        }
+        conn_put(f->conn);
+
+        if (ret < 0 && n == 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_write(req, n);
+out:
+        free(data);
+}
+
+/* Every close(2) commits the writes, as the kernel NFS client does */
+static void vfs_flush(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+        struct vfs_file *f = vfs_file(fi);
+        int ret = 0;
+
+        if ((f->flags & O_ACCMODE) != O_RDONLY) {
+                pthread_mutex_lock(&f->conn->lock);
+                ret = virtfs_fsync(f->vfd);
+                conn_put(f->conn);
+        }
+
+        fuse_reply_err(req, -ret);
+}
+
+static void vfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi)
+{
+        struct vfs_file *f = vfs_file(fi);
+        int ret;
+
+        pthread_mutex_lock(&f->conn->lock);
+        ret = virtfs_fsync(f->vfd);
+        conn_put(f->conn);
+
+        fuse_reply_err(req, -ret);
+}
+
+static void vfs_release(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+        struct vfs_file *f = vfs_file(fi);
+
+        pthread_mutex_lock(&f->conn->lock);
+        virtfs_close(f->vfd);
+        conn_put(f->conn);
+        free(f);
+
+        fuse_reply_err(req, 0);
+}
+
+static void vfs_opendir(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+        struct vfs_dir *d;
+        int ret;
+
+        d = calloc(1, sizeof(struct vfs_dir));
+        if (d == NULL || (d->path = node_path(ino, NULL)) == NULL) {
+                free(d);
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        d->conn = conn_get();
+        ret = virtfs_opendir(d->conn->fs, d->path, &d->dir);
+        conn_put(d->conn);
+
+        if (ret < 0) {
+                free(d->path);
+                free(d);
+                fuse_reply_err(req, -ret);
+                return;
+        }
+
+        fi->fh = (uintptr_t)d;
+        fuse_reply_open(req, fi);
+}
+
+/* Moves d to the entry at off, reading the listing again if it is behind */
+static int vfs_seekdir(struct vfs_dir *d, off_t off)
+{
+        int ret;
+
+        if (off < d->offset) {
+                virtfs_closedir(d->dir);
+                d->dir = NULL;
+                free(d->ent);
+                d->ent = NULL;
+                d->offset = 0;
+
+                ret = virtfs_opendir(d->conn->fs, d->path, &d->dir);
+                if (ret < 0)
+                        return ret;
+        }
+
+        while (d->offset < off) {
+                if (d->ent == NULL)
+                        d->ent = virtfs_readdirplus(d->dir, &d->st);
+                if (d->ent == NULL)
+                        break;
+
+                free(d->ent);
+                d->ent = NULL;
+                d->offset++;
+        }
+
+        return 0;
+}
+
+static void vfs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi, bool plus)
+{
+        struct vfs_dir *d = vfs_dir(fi);
+        struct fuse_entry_param e;
+        struct vfs_node *n;
+        struct stat st;
+        size_t pos = 0, len;
+        const char *name;
+        char *buf;
+        int ret = 0;
+
+        buf = malloc(size);
+        if (buf == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        pthread_mutex_lock(&d->conn->lock);
+        if (off != d->offset || d->dir == NULL)
+                ret = vfs_seekdir(d, off);
+
+        while (ret == 0) {
+                if (d->ent == NULL)
+                        d->ent = virtfs_readdirplus(d->dir, &d->st);
+                if (d->ent == NULL)
+                        break;
+
+                name = d->ent->d_name;
+                if (plus) {
+                        bzero(&e, sizeof(e));
+                        n = NULL;
+                        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                                /* Not looked up by the kernel */
+                                e.attr.st_ino = d->st.st_ino;
+                                e.attr.st_mode = d->st.st_mode;
+                        } else {
+                                n = node_lookup(ino, name);
+                                if (n == NULL) {
+                                        ret = -ENOMEM;
+                                        break;
+                                }
+                                vfs_entry(&e, n, &d->st);
+                        }
+
+                        len = fuse_add_direntry_plus(req, buf + pos,
+                                                     size - pos, name, &e,
+                                                     d->offset + 1);
+                        if (len > size - pos) {
+                                if (n)
+                                        node_forget(ino_of(n), 1);
+                                break;
+                        }
+                } else {
+                        bzero(&st, sizeof(st));
+                        st.st_ino = d->st.st_ino;
+                        st.st_mode = d->st.st_mode;
+                        len = fuse_add_direntry(req, buf + pos, size - pos,
+                                                name, &st, d->offset + 1);
+                        if (len > size - pos)
+                                break;
+                }
+
+                pos += len;
+                free(d->ent);
+                d->ent = NULL;
+                d->offset++;
+        }
+        conn_put(d->conn);
+
+        if (ret < 0 && pos == 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_buf(req, buf, pos);
+
+        free(buf);
+}
+
+static void vfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi)
+{
+        vfs_do_readdir(req, ino, size, off, fi, false);
+}
+
+static void vfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi)
+{
+        vfs_do_readdir(req, ino, size, off, fi, true);
+}
+
+static void vfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+        struct vfs_dir *d = vfs_dir(fi);
+
+        pthread_mutex_lock(&d->conn->lock);
+        if (d->dir)
+                virtfs_closedir(d->dir);
+        conn_put(d->conn);
+
+        free(d->ent);
+        free(d->path);
+        free(d);
+
+        fuse_reply_err(req, 0);
+}
+
+static void vfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        struct statvfs buf;
+        struct vfs_conn *c;
+        int ret;
+
+        c = conn_get();
+        ret = virtfs_statvfs(c->fs, "/", &buf);
+        conn_put(c);
+
+        if (ret < 0)
+                fuse_reply_err(req, -ret);
+        else
+                fuse_reply_statfs(req, &buf);
+}
+
+static const struct fuse_lowlevel_ops vfs_ops = {
+        .init           = vfs_init,
+        .lookup         = vfs_lookup,
+        .forget         = vfs_forget,
+        .forget_multi   = vfs_forget_multi,
+        .getattr        = vfs_getattr,
+        .setattr        = vfs_setattr,
+        .readlink       = vfs_readlink,
+        .mkdir          = vfs_mkdir,
+        .symlink        = vfs_symlink,
+        .unlink         = vfs_unlink,
+        .rmdir          = vfs_rmdir,
+        .rename         = vfs_rename,
+        .create         = vfs_create,
+        .open           = vfs_open,
+        .read           = vfs_read,
+        .write_buf      = vfs_write_buf,
+        .flush          = vfs_flush,
+        .fsync          = vfs_fsync,
+        .release        = vfs_release,
+        .opendir        = vfs_opendir,
+        .readdir        = vfs_readdir,
+        .readdirplus    = vfs_readdirplus,
+        .releasedir     = vfs_releasedir,
+        .statfs         = vfs_statfs,
+};
+
+#define VFS_OPT(t, p, v) { t, offsetof(struct vfs_opts, p), v }
+
+static const struct fuse_opt vfs_opt_spec[] = {
+        VFS_OPT("nconnect=%d", nconnect, 0),
+        VFS_OPT("readahead=%d", readahead, 0),
+        VFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+        VFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+        VFS_OPT("writeback_cache", writeback, 1),
+        VFS_OPT("no_writeback_cache", writeback, 0),
+        FUSE_OPT_END
+};
+
+/* The first argument that is not an option is the URL */
+static int vfs_opt_proc(void *data, const char *arg, int key,
+                        struct fuse_args *outargs)
+{
+        struct vfs_opts *o = data;
+
+        if (key == FUSE_OPT_KEY_NONOPT && o->url == NULL) {
+                o->url = strdup(arg);
+                return 0;
+        }
+
+        return 1;
+}
+
+static void usage(const char *prog)
+{
+        printf("Usage: %s [options] URL MOUNTPOINT\n"
+               "Mount an NFS export through VirtFS.\n\n"
+               "    -o nconnect=N          mount the export N times, each on a\n"
+               "                           connection of its own (default 1,\n"
+               "                           at most %d)\n"
+               "    -o readahead=N         read ahead N bytes on sequential reads\n"
+               "    -o attr_timeout=T      cache attributes for T seconds\n"
+               "                           (default 1.0)\n"
+               "    -o entry_timeout=T     cache names, and missing ones, for T\n"
+               "                           seconds (default 1.0)\n"
+               "    -o no_writeback_cache  send every write to the server before\n"
+               "                           it returns\n\n",
+               prog, VFS_NCONNECT_MAX);
+}
+
+/* The URL with the readahead of the options added */
+static char *vfs_url(void)
+{
+        char *url;
+
+        if (opts.readahead <= 0)
+                return strdup(opts.url);
+
+        if (asprintf(&url, "%s%creadahead=%d", opts.url,
+                     strchr(opts.url, '?') ? '&' : '?', opts.readahead) < 0)
+                return NULL;
+
+        return url;
+}
+
+static int vfs_connect(const char *url)
+{
+        int i, ret;
+
+        conns = calloc(opts.nconnect, sizeof(*conns));
+        if (conns == NULL)
+                return -ENOMEM;
+
+        for (i = 0; i < opts.nconnect; i++) {
+                pthread_mutex_init(&conns[i].lock, NULL);
+
+                ret = virtfs_new(url, &conns[i].fs);
+                if (ret < 0) {
+                        conns[i].fs = NULL;
+                        return ret;
+                }
+
+                ret = virtfs_init(conns[i].fs);
+                if (ret < 0)
+                        return ret;
+        }
+
+        return 0;
+}
+
+static void vfs_disconnect(void)
+{
+        int i;
+
+        if (conns == NULL)
+                return;
+
+        for (i = 0; i < opts.nconnect; i++) {
+                if (conns[i].fs)
+                        virtfs_fini(conns[i].fs);
+                pthread_mutex_destroy(&conns[i].lock);
+        }
+
+        free(conns);
+        conns = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+        struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+        struct fuse_cmdline_opts cmd = { 0 };
+        struct fuse_loop_config config;
+        struct fuse_session *se;
+        char *url = NULL;
+        int ret = -1;
+
+        if (fuse_opt_parse(&args, &opts, vfs_opt_spec, vfs_opt_proc) != 0 ||
+            fuse_parse_cmdline(&args, &cmd) != 0)
+                goto out;
+
+        if (cmd.show_help) {
+                usage(argv[0]);
+                fuse_cmdline_help();
+                fuse_lowlevel_help();
+                ret = 0;
+                goto out;
+        }
+
+        if (cmd.show_version) {
+                printf("%s version %s\n", argv[0], PACKAGE_VERSION);
+                fuse_lowlevel_version();
+                ret = 0;
+                goto out;
+        }
+
+        if (opts.url == NULL || cmd.mountpoint == NULL) {
+                fprintf(stderr, "%s: missing operand\n"
+                        "Try --help for more information.\n", argv[0]);
+                goto out;
+        }
+
+        if (opts.nconnect < 1 || opts.nconnect > VFS_NCONNECT_MAX) {
+                fprintf(stderr, "%s: invalid nconnect: %d\n", argv[0],
+                        opts.nconnect);
+                goto out;
+        }
+
+        nbuckets = VFS_HASH_MIN;
+        buckets = calloc(nbuckets, sizeof(*buckets));
+        url = vfs_url();
+        if (buckets == NULL || url == NULL) {
+                fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOMEM));
+                goto out;
+        }
+
+        ret = vfs_connect(url);
+        if (ret < 0) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], opts.url,
+                        strerror(-ret));
+                goto out;
+        }
+
+        ret = -1;
+        se = fuse_session_new(&args, &vfs_ops, sizeof(vfs_ops), NULL);
+        if (se == NULL)
+                goto out;
+
+        if (fuse_set_signal_handlers(se) != 0)
+                goto out_destroy;
+
+        if (fuse_session_mount(se, cmd.mountpoint) != 0)
+                goto out_signals;
+
+        fuse_daemonize(cmd.foreground);
+
+        if (cmd.singlethread) {
+                ret = fuse_session_loop(se);
+        } else {
+                config.clone_fd = cmd.clone_fd;
+                config.max_idle_threads = cmd.max_idle_threads;
+                ret = fuse_session_loop_mt(se, &config);
+        }
+
+        fuse_session_unmount(se);
+out_signals:
+        fuse_remove_signal_handlers(se);
+out_destroy:
+        fuse_session_destroy(se);
+out:
+        vfs_disconnect();
+        free(buckets);
+        free(url);
+        free(cmd.mountpoint);
+        free(opts.url);
+        fuse_opt_free_args(&args);
+
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
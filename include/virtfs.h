@@ -60,6 +60,22 @@ int virtfs_init(virtfs_t fs_in) __THROW;
 /* Finish, umount & free the filesystem */
 int virtfs_fini(virtfs_t fs_in) __THROW;
 
+/* Threads: the calls on a mount, its files and the streams, pumps and
+ * mappings built on them are serialized by a lock of the mount, so a slow
+ * call delays the others of the mount, and a mount of its own per thread
+ * keeps them apart. The callbacks of asynchronous operations run with the
+ * lock held and may call the library again. Nothing may use a mount once
+ * virtfs_fini() is called. */
+
+/* Deadlines: a call that does not complete in time fails with -ETIMEDOUT.
+ * virtfs_set_timeout() bounds each call on fs to timeout milliseconds (0 for
+ * none, the default). virtfs_set_deadline() bounds every call of the calling
+ * thread to timeout milliseconds from now, until set again (-1 for none).
+ * The earlier of both applies. Closing a file or a directory is not bounded,
+ * so that it is always freed. */
+int virtfs_set_timeout(virtfs_t fs_in, int timeout) __THROW;
+void virtfs_set_deadline(int timeout) __THROW;
+
 /* Dump debug information */
 void virtfs_dump_info(virtfs_t fs_in, int verbose) __THROW;
 void virtfs_clean() __THROW;
@@ -68,18 +84,118 @@ void virtfs_clean() __THROW;
 int virtfs_stat(virtfs_t fs_in, const char *path, struct stat *buf) __THROW;
 int virtfs_lstat(virtfs_t fs_in, const char *path, struct stat *buf) __THROW;
 
+/* mkdir() */
+int virtfs_mkdir(virtfs_t fs_in, const char *path, mode_t mode) __THROW;
+
+/* rmdir(), unlink(), rename(), symlink() and readlink() */
+int virtfs_rmdir(virtfs_t fs_in, const char *path) __THROW;
+int virtfs_unlink(virtfs_t fs_in, const char *path) __THROW;
+int virtfs_rename(virtfs_t fs_in, const char *oldpath, const char *newpath) __THROW;
+int virtfs_symlink(virtfs_t fs_in, const char *target, const char *linkpath) __THROW;
+int virtfs_readlink(virtfs_t fs_in, const char *path, char *buf, size_t size) __THROW;
+
+/* truncate(), chmod(), chown(), utimes() and statvfs() */
+struct statvfs;
+struct timeval;
+int virtfs_truncate(virtfs_t fs_in, const char *path, off_t length) __THROW;
+int virtfs_chmod(virtfs_t fs_in, const char *path, mode_t mode) __THROW;
+int virtfs_chown(virtfs_t fs_in, const char *path, uid_t uid, gid_t gid) __THROW;
+int virtfs_utimes(virtfs_t fs_in, const char *path, struct timeval times[2]) __THROW;
+int virtfs_statvfs(virtfs_t fs_in, const char *path, struct statvfs *buf) __THROW;
+
 typedef struct virtfs_fd *virtfs_fd_t;
 #define vfd_t virtfs_fd_t
 
+/* open() a path of a mounted filesystem, or the file of a complete URL on a
+ * mount of its own. Both return NULL and set errno on failure. */
+vfd_t virtfs_open(virtfs_t fs_in, const char *path, int flags, ...) __THROW;
 vfd_t virtfs_openuri(const char *uri, int flags, ...) __THROW;
 int virtfs_close(vfd_t vfd) __THROW;
+/* A pipe end fed from, or drained into, a file opened O_RDONLY or O_WRONLY
+ * by a background pump starting at the offset of vfd. The pump takes vfd
+ * over and closes it once done, and virtfs_fini() waits for the pumps of
+ * the mount. Returns the fd or a negative errno. */
 int virtfs_fd_to_posix(vfd_t vfd) __THROW;
+/* A vfd for a POSIX fd, which it closes along with itself */
 vfd_t virtfs_fd_from_posix(int fd) __THROW;
 int virtfs_ftruncate(vfd_t vfd, off_t length) __THROW;
+/* fallocate(). A file of a mount takes only mode 0, emulated by writing
+ * zeros over the holes of the range and past the end of the file, so that
+ * ENOSPC shows up here; other modes fail with -EOPNOTSUPP. */
+int virtfs_fallocate(vfd_t vfd, int mode, off_t offset, off_t len) __THROW;
 int virtfs_fstat(vfd_t vfd, struct stat *buf) __THROW;
-int virtfs_read(vfd_t vfd, void *buf, size_t count) __THROW;
-int virtfs_write(vfd_t vfd, const void *buf, size_t count) __THROW;
-int virtfs_lseek(vfd_t vfd, off_t offset, int whence) __THROW;
+ssize_t virtfs_read(vfd_t vfd, void *buf, size_t count) __THROW;
+ssize_t virtfs_write(vfd_t vfd, const void *buf, size_t count) __THROW;
+ssize_t virtfs_pread(vfd_t vfd, void *buf, size_t count, off_t offset) __THROW;
+ssize_t virtfs_pwrite(vfd_t vfd, const void *buf, size_t count, off_t offset) __THROW;
+off_t virtfs_lseek(vfd_t vfd, off_t offset, int whence) __THROW;
+int virtfs_fsync(vfd_t vfd) __THROW;
+
+/* Reads and writes that complete through virtfs_poll(), from the thread
+ * driving the mount, by a call to op->cb with the count transferred or a
+ * negative errno: -ETIMEDOUT past the deadline of op, -ECANCELED when
+ * cancelled. op belongs to the caller and must stay valid until then, while
+ * the data goes through buffers the library keeps for reuse. Return 0 once
+ * queued or a negative errno, in which case op->cb is not called. */
+struct virtfs_op;
+struct virtfs_slot;
+typedef void (*virtfs_op_cb_t)(struct virtfs_op *op, ssize_t ret);
+
+struct virtfs_op
+{
+        virtfs_op_cb_t cb;
+        int timeout;            /* ms, 0 for that of the mount, -1 for none */
+        /* private to the library */
+        struct virtfs_slot *slot;
+};
+
+int virtfs_pread_async(vfd_t vfd, void *buf, size_t count, off_t offset,
+                       struct virtfs_op *op) __THROW;
+int virtfs_pwrite_async(vfd_t vfd, const void *buf, size_t count,
+                        off_t offset, struct virtfs_op *op) __THROW;
+int virtfs_fsync_async(vfd_t vfd, struct virtfs_op *op) __THROW;
+/* Completes op in flight with -ECANCELED at once; the buffer of a read is
+ * left untouched. Returns -ENOENT if op already completed. */
+int virtfs_cancel(struct virtfs_op *op) __THROW;
+/* Waits up to timeout milliseconds (-1 for ever) and delivers the
+ * completions. Returns the operations of fs still in flight. */
+int virtfs_poll(virtfs_t fs, int timeout) __THROW;
+
+/* Write-behind stream from offset: data is gathered in chunks aligned to the
+ * chunk size in the file, up to depth chunks are written at once, and the
+ * data is committed when the stream is closed. */
+typedef struct virtfs_writer *virtfs_writer_t;
+
+int virtfs_writer_new(vfd_t vfd, off_t offset, size_t chunk, int depth,
+                      virtfs_writer_t *w_out) __THROW;
+ssize_t virtfs_writer_write(virtfs_writer_t w, const void *buf, size_t count) __THROW;
+/* Reads once from a POSIX fd into the stream, returns 0 at its end */
+ssize_t virtfs_writer_fill(virtfs_writer_t w, int fd) __THROW;
+int virtfs_writer_close(virtfs_writer_t w) __THROW;
+
+/* Append stream at the end of the file. It owns vfd once open, which
+ * virtfs_append_close() closes. Records of any thread are written whole and
+ * in the order of the calls, batched up to flush_size bytes (0 for the wsize
+ * of the mount) or for at most flush_ms milliseconds. virtfs_append_sync()
+ * returns once the records appended before the call are stable, and the
+ * close syncs the rest. */
+typedef struct virtfs_append *virtfs_append_t;
+
+int virtfs_append_open(vfd_t vfd, size_t flush_size, int flush_ms,
+                       virtfs_append_t *a_out) __THROW;
+int virtfs_append(virtfs_append_t a, const void *buf, size_t count) __THROW;
+int virtfs_append_sync(virtfs_append_t a) __THROW;
+int virtfs_append_close(virtfs_append_t a) __THROW;
+
+/* Read-only private mapping of the file, filled lazily as pages are
+ * touched. System calls may fail with EFAULT on pages not touched yet.
+ * offset must be a multiple of the page size. vfd serves the faults
+ * until virtfs_munmap() and must not be used meanwhile, nor may the mount be
+ * finished. A fault reads under the lock of the mount, so the mapping must
+ * not be a buffer of other calls on the mount. A page that fails to read
+ * raises SIGSEGV. Returns MAP_FAILED and sets errno on failure. */
+void *virtfs_mmap(vfd_t vfd, off_t offset, size_t length) __THROW;
+int virtfs_munmap(void *addr, size_t length) __THROW;
 
 /* virtfs_dir_t equals to DIR * */
 typedef struct virtfs_dir *virtfs_dir_t;
@@ -95,6 +211,8 @@ struct dirent *virtfs_readdirplus(virtfs_dir_t dir, struct stat *st_out) __THROW
 /* utilities to maintain URL and path */
 char *virtfs_append_path(const char *base_path, const char *hanging_path) __THROW;
 char *virtfs_url_get_path(virtfs_t fs) __THROW;
+/* The path of the file of the URL relative to the mounted export */
+char *virtfs_url_get_file(virtfs_t fs) __THROW;
 __END_DECLS
 
 #endif /* !_VIRTFS_H */
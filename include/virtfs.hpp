@@ -0,0 +1,732 @@
+/*
+ * Copyright (c) 2016 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+/*
+ * C++20 wrapper of virtfs.h: move-only handles, and reads and writes to
+ * co_await from a Task. Errors are thrown as std::system_error.
+ *
+ *   vfs::Task<std::size_t> head(vfs::File &f, std::span<char> buf)
+ *   {
+ *           co_return co_await f.pread(buf, 0);
+ *   }
+ *
+ *   vfs::Fs fs("nfs://server/export");
+ *   vfs::File f = fs.open("/file");
+ *   std::size_t n = fs.run(head(f, buf));
+ *
+ * The operations complete from Fs::poll(), which Fs::run() calls until its
+ * tasks are done, all on the calling thread. An operation lives in the frame
+ * of the coroutine awaiting it, and its data goes through buffers the library
+ * reuses. Given a timeout in milliseconds, one past it throws ETIMEDOUT. Files
+ * and directories must not outlive the Fs they were opened on.
+ */
+
+#ifndef _VIRTFS_HPP
+#define _VIRTFS_HPP
+
+#include <virtfs.h>
+#include <fcntl.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace vfs {
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(long ret, const char *what)
+{
+        throw std::system_error(static_cast<int>(-ret),
+                                std::generic_category(), what);
+}
+
+inline long check(long ret, const char *what)
+{
+        if (ret < 0)
+                throw_errno(ret, what);
+
+        return ret;
+}
+
+/* Contiguous memory, read or written as is */
+template <typename R>
+concept Buffer = std::ranges::contiguous_range<R> &&
+                 std::ranges::sized_range<R> &&
+                 std::is_trivially_copyable_v<std::ranges::range_value_t<R>>;
+
+/* The awaiter is the operation the library completes */
+struct Op : virtfs_op
+{
+        std::coroutine_handle<> waiter;
+        ssize_t result = 0;
+
+        explicit Op(int ms) noexcept : virtfs_op{}
+        {
+                cb = &Op::complete;
+                timeout = ms;
+        }
+
+        Op(const Op &) = delete;
+        Op &operator=(const Op &) = delete;
+
+        /*
+         * A frame destroyed while its operation is in flight, as when
+         * Fs::run() throws, drops the operation without resuming anyone.
+         */
+        ~Op()
+        {
+                if (slot) {
+                        cb = &Op::discard;
+                        virtfs_cancel(this);
+                }
+        }
+
+        static void discard(virtfs_op *, ssize_t) noexcept
+        {
+        }
+
+        static void complete(virtfs_op *op, ssize_t ret) noexcept
+        {
+                auto *self = static_cast<Op *>(op);
+
+                self->result = ret;
+                self->waiter.resume();
+        }
+
+        bool await_ready() const noexcept
+        {
+                return false;
+        }
+
+        /* The waiter goes on at once if the operation was not queued */
+        bool queued(int ret) noexcept
+        {
+                if (ret < 0) {
+                        result = ret;
+                        return false;
+                }
+
+                return true;
+        }
+};
+
+struct PromiseBase
+{
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr error;
+
+        struct Final
+        {
+                bool await_ready() const noexcept
+                {
+                        return false;
+                }
+
+                template <typename P>
+                std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                        return h.promise().continuation;
+                }
+
+                void await_resume() const noexcept
+                {
+                }
+        };
+
+        std::suspend_always initial_suspend() const noexcept
+        {
+                return {};
+        }
+
+        Final final_suspend() const noexcept
+        {
+                return {};
+        }
+
+        void unhandled_exception() noexcept
+        {
+                error = std::current_exception();
+        }
+};
+
+template <typename T>
+struct Promise : PromiseBase
+{
+        std::optional<T> value;
+
+        Task<T> get_return_object() noexcept;
+
+        void return_value(T v)
+        {
+                value.emplace(std::move(v));
+        }
+
+        T result()
+        {
+                if (error)
+                        std::rethrow_exception(error);
+
+                return std::move(*value);
+        }
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+        Task<void> get_return_object() noexcept;
+
+        void return_void() const noexcept
+        {
+        }
+
+        void result() const
+        {
+                if (error)
+                        std::rethrow_exception(error);
+        }
+};
+
+} /* namespace detail */
+
+/*
+ * A coroutine started when awaited, or by Fs::run(), which resumes its
+ * awaiter once done.
+ */
+template <typename T>
+class [[nodiscard]] Task
+{
+public:
+        using promise_type = detail::Promise<T>;
+
+        explicit Task(std::coroutine_handle<promise_type> h) noexcept
+                : h_(h)
+        {
+        }
+
+        Task(Task &&o) noexcept : h_(std::exchange(o.h_, {}))
+        {
+        }
+
+        Task &operator=(Task &&o) noexcept
+        {
+                if (this != &o) {
+                        if (h_)
+                                h_.destroy();
+                        h_ = std::exchange(o.h_, {});
+                }
+
+                return *this;
+        }
+
+        ~Task()
+        {
+                if (h_)
+                        h_.destroy();
+        }
+
+        bool done() const noexcept
+        {
+                return !h_ || h_.done();
+        }
+
+        auto operator co_await() const noexcept
+        {
+                struct Awaiter
+                {
+                        std::coroutine_handle<promise_type> h;
+
+                        bool await_ready() const noexcept
+                        {
+                                return h.done();
+                        }
+
+                        std::coroutine_handle<>
+                        await_suspend(std::coroutine_handle<> waiter) noexcept
+                        {
+                                h.promise().continuation = waiter;
+                                return h;
+                        }
+
+                        T await_resume()
+                        {
+                                return h.promise().result();
+                        }
+                };
+
+                return Awaiter{h_};
+        }
+
+private:
+        friend class Fs;
+
+        std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() noexcept
+{
+        return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept
+{
+        return Task<void>(
+                std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/* co_await gives the count read or written */
+class PreadOp : public detail::Op
+{
+public:
+        PreadOp(vfd_t vfd, std::span<std::byte> buf, off_t offset,
+                int timeout = 0) noexcept
+                : Op(timeout), vfd_(vfd), buf_(buf), offset_(offset)
+        {
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept
+        {
+                waiter = h;
+                return queued(virtfs_pread_async(vfd_, buf_.data(),
+                                                 buf_.size(), offset_, this));
+        }
+
+        std::size_t await_resume() const
+        {
+                return detail::check(result, "pread");
+        }
+
+private:
+        vfd_t vfd_;
+        std::span<std::byte> buf_;
+        off_t offset_;
+};
+
+class PwriteOp : public detail::Op
+{
+public:
+        PwriteOp(vfd_t vfd, std::span<const std::byte> buf, off_t offset,
+                 int timeout = 0) noexcept
+                : Op(timeout), vfd_(vfd), buf_(buf), offset_(offset)
+        {
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept
+        {
+                waiter = h;
+                return queued(virtfs_pwrite_async(vfd_, buf_.data(),
+                                                  buf_.size(), offset_, this));
+        }
+
+        std::size_t await_resume() const
+        {
+                return detail::check(result, "pwrite");
+        }
+
+private:
+        vfd_t vfd_;
+        std::span<const std::byte> buf_;
+        off_t offset_;
+};
+
+class FsyncOp : public detail::Op
+{
+public:
+        explicit FsyncOp(vfd_t vfd, int timeout = 0) noexcept
+                : Op(timeout), vfd_(vfd)
+        {
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept
+        {
+                waiter = h;
+                return queued(virtfs_fsync_async(vfd_, this));
+        }
+
+        void await_resume() const
+        {
+                detail::check(result, "fsync");
+        }
+
+private:
+        vfd_t vfd_;
+};
+
+class File
+{
+public:
+        File() noexcept = default;
+
+        explicit File(vfd_t vfd) noexcept : vfd_(vfd)
+        {
+        }
+
+        File(const File &) = delete;
+        File &operator=(const File &) = delete;
+
+        File(File &&o) noexcept : vfd_(std::exchange(o.vfd_, nullptr))
+        {
+        }
+
+        File &operator=(File &&o) noexcept
+        {
+                if (this != &o) {
+                        reset();
+                        vfd_ = std::exchange(o.vfd_, nullptr);
+                }
+
+                return *this;
+        }
+
+        ~File()
+        {
+                reset();
+        }
+
+        vfd_t get() const noexcept
+        {
+                return vfd_;
+        }
+
+        vfd_t release() noexcept
+        {
+                return std::exchange(vfd_, nullptr);
+        }
+
+        explicit operator bool() const noexcept
+        {
+                return vfd_ != nullptr;
+        }
+
+        /* Unlike the destructor, reports the error of the close */
+        void close()
+        {
+                detail::check(virtfs_close(std::exchange(vfd_, nullptr)),
+                              "close");
+        }
+
+        template <detail::Buffer R>
+        PreadOp pread(R &&buf, off_t offset, int timeout = 0) const noexcept
+        {
+                return PreadOp(vfd_, std::as_writable_bytes(std::span(buf)),
+                               offset, timeout);
+        }
+
+        template <detail::Buffer R>
+        PwriteOp pwrite(R &&buf, off_t offset, int timeout = 0) const noexcept
+        {
+                return PwriteOp(vfd_, std::as_bytes(std::span(buf)), offset,
+                                timeout);
+        }
+
+        FsyncOp fsync(int timeout = 0) const noexcept
+        {
+                return FsyncOp(vfd_, timeout);
+        }
+
+        /* Blocking counterparts, for the code outside of a task */
+        template <detail::Buffer R>
+        std::size_t read_at(R &&buf, off_t offset) const
+        {
+                auto b = std::as_writable_bytes(std::span(buf));
+
+                return detail::check(virtfs_pread(vfd_, b.data(), b.size(),
+                                                  offset), "pread");
+        }
+
+        template <detail::Buffer R>
+        std::size_t write_at(R &&buf, off_t offset) const
+        {
+                auto b = std::as_bytes(std::span(buf));
+
+                return detail::check(virtfs_pwrite(vfd_, b.data(), b.size(),
+                                                   offset), "pwrite");
+        }
+
+        struct stat stat() const
+        {
+                struct stat st;
+
+                detail::check(virtfs_fstat(vfd_, &st), "fstat");
+
+                return st;
+        }
+
+        void truncate(off_t length) const
+        {
+                detail::check(virtfs_ftruncate(vfd_, length), "ftruncate");
+        }
+
+        void sync() const
+        {
+                detail::check(virtfs_fsync(vfd_), "fsync");
+        }
+
+private:
+        void reset() noexcept
+        {
+                if (vfd_)
+                        virtfs_close(vfd_);
+                vfd_ = nullptr;
+        }
+
+        vfd_t vfd_ = nullptr;
+};
+
+class Dir
+{
+public:
+        struct Entry
+        {
+                std::string name;
+                struct stat st;
+        };
+
+        Dir() noexcept = default;
+
+        explicit Dir(virtfs_dir_t dir) noexcept : dir_(dir)
+        {
+        }
+
+        Dir(const Dir &) = delete;
+        Dir &operator=(const Dir &) = delete;
+
+        Dir(Dir &&o) noexcept : dir_(std::exchange(o.dir_, nullptr))
+        {
+        }
+
+        Dir &operator=(Dir &&o) noexcept
+        {
+                if (this != &o) {
+                        reset();
+                        dir_ = std::exchange(o.dir_, nullptr);
+                }
+
+                return *this;
+        }
+
+        ~Dir()
+        {
+                reset();
+        }
+
+        virtfs_dir_t get() const noexcept
+        {
+                return dir_;
+        }
+
+        /* The next entry with its attributes, false past the last one */
+        bool next(Entry &e)
+        {
+                struct dirent *d;
+
+                d = virtfs_readdirplus(dir_, &e.st);
+                if (d == nullptr)
+                        return false;
+
+                e.name = d->d_name;
+                std::free(d);
+
+                return true;
+        }
+
+private:
+        void reset() noexcept
+        {
+                if (dir_)
+                        virtfs_closedir(dir_);
+                dir_ = nullptr;
+        }
+
+        virtfs_dir_t dir_ = nullptr;
+};
+
+class Fs
+{
+public:
+        Fs() noexcept = default;
+
+        /* Mounts the export of url */
+        explicit Fs(const char *url)
+        {
+                int ret;
+
+                detail::check(virtfs_new(url, &fs_), url);
+
+                ret = virtfs_init(fs_);
+                if (ret < 0) {
+                        virtfs_fini(std::exchange(fs_, nullptr));
+                        detail::throw_errno(ret, url);
+                }
+        }
+
+        explicit Fs(const std::string &url) : Fs(url.c_str())
+        {
+        }
+
+        Fs(const Fs &) = delete;
+        Fs &operator=(const Fs &) = delete;
+
+        Fs(Fs &&o) noexcept : fs_(std::exchange(o.fs_, nullptr))
+        {
+        }
+
+        Fs &operator=(Fs &&o) noexcept
+        {
+                if (this != &o) {
+                        reset();
+                        fs_ = std::exchange(o.fs_, nullptr);
+                }
+
+                return *this;
+        }
+
+        ~Fs()
+        {
+                reset();
+        }
+
+        virtfs_t get() const noexcept
+        {
+                return fs_;
+        }
+
+        explicit operator bool() const noexcept
+        {
+                return fs_ != nullptr;
+        }
+
+        File open(const char *path, int flags = O_RDONLY,
+                  mode_t mode = 0666) const
+        {
+                vfd_t vfd = virtfs_open(fs_, path, flags, mode);
+
+                if (vfd == nullptr)
+                        detail::throw_errno(-errno, path);
+
+                return File(vfd);
+        }
+
+        Dir opendir(const char *path) const
+        {
+                virtfs_dir_t dir;
+
+                detail::check(virtfs_opendir(fs_, path, &dir), path);
+
+                return Dir(dir);
+        }
+
+        struct stat stat(const char *path) const
+        {
+                struct stat st;
+
+                detail::check(virtfs_stat(fs_, path, &st), path);
+
+                return st;
+        }
+
+        void mkdir(const char *path, mode_t mode = 0777) const
+        {
+                detail::check(virtfs_mkdir(fs_, path, mode), path);
+        }
+
+        void unlink(const char *path) const
+        {
+                detail::check(virtfs_unlink(fs_, path), path);
+        }
+
+        void rename(const char *oldpath, const char *newpath) const
+        {
+                detail::check(virtfs_rename(fs_, oldpath, newpath), oldpath);
+        }
+
+        /* Bounds each call on the mount, see virtfs_set_timeout() */
+        void set_timeout(int timeout) const
+        {
+                detail::check(virtfs_set_timeout(fs_, timeout), "timeout");
+        }
+
+        /*
+         * Resumes the tasks whose operations completed, waiting up to
+         * timeout milliseconds (-1 for ever) for one. Returns the operations
+         * still in flight.
+         */
+        int poll(int timeout = -1) const
+        {
+                return detail::check(virtfs_poll(fs_, timeout), "poll");
+        }
+
+        /* Runs task until it is done and gives its result */
+        template <typename T>
+        T run(Task<T> task) const
+        {
+                task.h_.resume();
+                wait(task);
+
+                return task.h_.promise().result();
+        }
+
+        /*
+         * Runs the tasks together until all are done, then throws the first
+         * error of one, if any.
+         */
+        template <std::ranges::range R>
+        void run(R &&tasks) const
+        {
+                for (auto &t : tasks)
+                        t.h_.resume();
+                for (auto &t : tasks)
+                        wait(t);
+                for (auto &t : tasks)
+                        t.h_.promise().result();
+        }
+
+private:
+        /*
+         * A resumed task either ends or queues another operation, so none
+         * left in flight means that task waits for something else.
+         */
+        template <typename T>
+        void wait(const Task<T> &task) const
+        {
+                while (!task.done()) {
+                        if (poll(-1) == 0 && !task.done())
+                                throw std::logic_error(
+                                        "virtfs: task waits on no operation");
+                }
+        }
+
+        void reset() noexcept
+        {
+                if (fs_)
+                        virtfs_fini(fs_);
+                fs_ = nullptr;
+        }
+
+        virtfs_t fs_ = nullptr;
+};
+
+} /* namespace vfs */
+
+#endif /* !_VIRTFS_HPP */
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_XXHASH_H
+#include <xxhash.h>
+#endif
+
+#include "checksum.h"
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/*
+ * Slicing-by-8 tables for the portable implementation. They are only built
+ * when the CPU has no CRC32 instruction.
+ */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void)
+{
+        uint32_t crc;
+        int i, j;
+
+        for (i = 0; i < 256; i++) {
+                crc = i;
+                for (j = 0; j < 8; j++)
+                        crc = (crc >> 1) ^ (-(crc & 1) & CRC32C_POLY);
+                crc32c_table[0][i] = crc;
+        }
+
+        for (i = 0; i < 256; i++) {
+                crc = crc32c_table[0][i];
+                for (j = 1; j < 8; j++) {
+                        crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+                        crc32c_table[j][i] = crc;
+                }
+        }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+        uint64_t word;
+
+        pthread_once(&crc32c_once, crc32c_init_table);
+
+        while (len && ((uintptr_t)p & 7)) {
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                len--;
+        }
+
+        while (len >= 8) {
+                memcpy(&word, p, 8);
+                word ^= crc;
+                crc = crc32c_table[7][word & 0xff] ^
+                      crc32c_table[6][(word >> 8) & 0xff] ^
+                      crc32c_table[5][(word >> 16) & 0xff] ^
+                      crc32c_table[4][(word >> 24) & 0xff] ^
+                      crc32c_table[3][(word >> 32) & 0xff] ^
+                      crc32c_table[2][(word >> 40) & 0xff] ^
+                      crc32c_table[1][(word >> 48) & 0xff] ^
+                      crc32c_table[0][word >> 56];
+                p += 8;
+                len -= 8;
+        }
+
+        while (len--)
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+        return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 CRC32 instruction, eight bytes per step */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+        uint64_t word;
+        uint64_t crc64;
+
+        while (len && ((uintptr_t)p & 7)) {
+                crc = __builtin_ia32_crc32qi(crc, *p++);
+                len--;
+        }
+
+        crc64 = crc;
+        while (len >= 8) {
+                memcpy(&word, p, 8);
+                crc64 = __builtin_ia32_crc32di(crc64, word);
+                p += 8;
+                len -= 8;
+        }
+        crc = (uint32_t)crc64;
+
+        while (len--)
+                crc = __builtin_ia32_crc32qi(crc, *p++);
+
+        return crc;
+}
+
+static int crc32c_have_hw(void)
+{
+        static int have_hw = -1;
+
+        if (have_hw < 0) {
+                __builtin_cpu_init();
+                have_hw = __builtin_cpu_supports("sse4.2");
+        }
+
+        return have_hw;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        crc = ~crc;
+#if defined(__x86_64__)
+        if (crc32c_have_hw())
+                return ~crc32c_hw(crc, buf, len);
+#endif
+        return ~crc32c_sw(crc, buf, len);
+}
+
+int checksum_parse(const char *name, enum checksum_type *type)
+{
+        if (strcmp(name, "crc32c") == 0) {
+                *type = CHECKSUM_CRC32C;
+                return 0;
+        }
+
+        if (strcmp(name, "xxh3") == 0) {
+#ifdef HAVE_XXHASH_H
+                *type = CHECKSUM_XXH3;
+                return 0;
+#else
+                return -ENOTSUP;
+#endif
+        }
+
+        return -EINVAL;
+}
+
+const char *checksum_name(enum checksum_type type)
+{
+        switch (type) {
+        case CHECKSUM_CRC32C:
+                return "crc32c";
+        case CHECKSUM_XXH3:
+                return "xxh3";
+        default:
+                return "none";
+        }
+}
+
+int checksum_init(struct checksum *sum, enum checksum_type type)
+{
+        sum->type = type;
+        sum->crc = 0;
+        sum->state = NULL;
+
+        switch (type) {
+        case CHECKSUM_CRC32C:
+                return 0;
+#ifdef HAVE_XXHASH_H
+        case CHECKSUM_XXH3:
+                /* libxxhash picks the widest vector unit (AVX2, SSE2) */
+                sum->state = XXH3_createState();
+                if (!sum->state)
+                        return -ENOMEM;
+                XXH3_64bits_reset(sum->state);
+                return 0;
+#endif
+        default:
+                return -ENOTSUP;
+        }
+}
+
+void checksum_update(struct checksum *sum, const void *buf, size_t len)
+{
+        switch (sum->type) {
+        case CHECKSUM_CRC32C:
+                sum->crc = crc32c(sum->crc, buf, len);
+                break;
+#ifdef HAVE_XXHASH_H
+        case CHECKSUM_XXH3:
+                XXH3_64bits_update(sum->state, buf, len);
+                break;
+#endif
+        default:
+                break;
+        }
+}
+
+uint64_t checksum_final(struct checksum *sum)
+{
+        switch (sum->type) {
+        case CHECKSUM_CRC32C:
+                return sum->crc;
+#ifdef HAVE_XXHASH_H
+        case CHECKSUM_XXH3:
+                return XXH3_64bits_digest(sum->state);
+#endif
+        default:
+                return 0;
+        }
+}
+
+uint64_t checksum_buffer(enum checksum_type type, const void *buf, size_t len)
+{
+        switch (type) {
+        case CHECKSUM_CRC32C:
+                return crc32c(0, buf, len);
+#ifdef HAVE_XXHASH_H
+        case CHECKSUM_XXH3:
+                return XXH3_64bits(buf, len);
+#endif
+        default:
+                return 0;
+        }
+}
+
+void checksum_fini(struct checksum *sum)
+{
+#ifdef HAVE_XXHASH_H
+        if (sum->type == CHECKSUM_XXH3 && sum->state)
+                XXH3_freeState(sum->state);
+#endif
+        sum->state = NULL;
+}
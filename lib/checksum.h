@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum checksum_type {
+        CHECKSUM_NONE,
+        CHECKSUM_CRC32C,
+        CHECKSUM_XXH3
+};
+
+/* Running checksum over a stream of buffers. */
+struct checksum {
+        enum checksum_type type;
+        uint32_t crc;
+        void *state;
+};
+
+/* CRC32C (Castagnoli) of buf, continuing from crc (0 to start). */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Map "crc32c" / "xxh3" to a type; -EINVAL or -ENOTSUP on failure. */
+int checksum_parse(const char *name, enum checksum_type *type);
+const char *checksum_name(enum checksum_type type);
+
+int checksum_init(struct checksum *sum, enum checksum_type type);
+void checksum_update(struct checksum *sum, const void *buf, size_t len);
+uint64_t checksum_final(struct checksum *sum);
+void checksum_fini(struct checksum *sum);
+
+/* One-shot checksum of a single buffer. */
+uint64_t checksum_buffer(enum checksum_type type, const void *buf, size_t len);
+
+#endif /* !_CHECKSUM_H */
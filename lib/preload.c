@@ -0,0 +1,1188 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+/*
+ * LD_PRELOAD interposer serving the paths under configured prefixes from a
+ * mount of the process itself instead of the kernel NFS client:
+ *
+ *   VIRTFS_PRELOAD="/virtfs/srv/export=nfs://srv/export?readahead=1048576" \
+ *   LD_PRELOAD=libvirtfs-preload.so legacy-tool /virtfs/srv/export/data
+ *
+ * Several prefix=URL pairs are separated by ';' and each export is mounted
+ * on first use, with the options of its URL. Only absolute paths are
+ * matched.
+ *
+ * An opened file gets a real descriptor on /dev/null, so that its number is
+ * unique in the process and calls not interposed here fail harmlessly, and
+ * the interposed calls on that descriptor are served from the remote file.
+ * A libnfs context serves one call at a time, so the calls on a mount are
+ * serialized. fdopen() and fopen() streams are cookie streams, which have no
+ * fileno(). mmap() and getdents() are not served. The files are not
+ * inherited: after exec their descriptors are left on /dev/null, and a child
+ * forked without exec must not use them.
+ *
+ * On 32-bit systems only the LFS calls are served: a program must be built
+ * with _FILE_OFFSET_BITS=64, as coreutils are, or its plain open(), stat(),
+ * lseek(), pread(), readdir(), fopen() and the like go to the kernel.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <virtfs.h>
+#include <virtfs_log.h>
+#include "virtfs_i.h"
+
+#define PRELOAD_ENV "VIRTFS_PRELOAD"
+
+/*
+ * Declares preload_name as the definition of the libc symbol name, and the
+ * pointer to the next definition, resolved by REAL(name) on first use.
+ */
+#define PRELOAD_DECL(ret, name, args)                                   \
+        ret preload_##name args __asm__(#name);                         \
+        static ret (*real_##name) args
+
+#define REAL(name)                                                      \
+        ({                                                              \
+                if (real_##name == NULL)                                \
+                        real_##name = dlsym(RTLD_NEXT, #name);          \
+                real_##name;                                            \
+        })
+
+/*
+ * The functions taking or returning an off_t or a struct stat are defined
+ * under their LFS names. Where off_t is 64 bits wide anyway, the plain names
+ * are the same functions. Elsewhere the plain ones take 32-bit offsets and
+ * structures, which are not converted: they are left to libc.
+ */
+#if __WORDSIZE == 64
+#define PRELOAD_ALIAS(lfs, name)                                        \
+        extern __typeof__(preload_##lfs) preload_##name                 \
+                __asm__(#name) __attribute__((alias(#lfs)))
+#else
+#define PRELOAD_ALIAS(lfs, name)
+#endif
+
+struct preload_mount
+{
+        struct preload_mount *next;
+        char *prefix;
+        size_t len;
+        char *url;
+        virtfs_t fs;                    /* mounted on first use */
+        int error;                      /* of the mount, kept */
+        pthread_mutex_t lock;           /* held across the calls on fs */
+};
+
+struct preload_file
+{
+        struct preload_mount *mnt;
+        vfd_t vfd;
+        int refs;                       /* descriptors and calls running */
+};
+
+struct preload_dir
+{
+        struct preload_dir *next;
+        struct preload_mount *mnt;
+        char *path;
+        virtfs_dir_t dir;
+        struct dirent *ent;             /* freed by the next readdir() */
+};
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static struct preload_mount *mounts;
+
+/* Files by descriptor, and our DIR streams */
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct preload_file **files;
+static int nfiles;
+static int nopen;
+static struct preload_dir *dirs;
+
+static void _preload_init(void)
+{
+        struct preload_mount *m;
+        char *spec, *entry, *save, *eq;
+        const char *env;
+        size_t len;
+
+        env = getenv(PRELOAD_ENV);
+        if (env == NULL)
+                return;
+
+        /* The mounts keep pointers into spec, it is never freed */
+        spec = strdup(env);
+        if (spec == NULL)
+                return;
+
+        for (entry = strtok_r(spec, ";", &save); entry;
+             entry = strtok_r(NULL, ";", &save)) {
+                eq = strchr(entry, '=');
+                if (entry[0] != '/' || eq == NULL || eq[1] == '\0') {
+                        ERR("%s: ignoring \"%s\"\n", PRELOAD_ENV, entry);
+                        continue;
+                }
+
+                *eq = '\0';
+                len = eq - entry;
+                while (len > 1 && entry[len - 1] == '/')
+                        entry[--len] = '\0';
+
+                m = calloc(1, sizeof(struct preload_mount));
+                if (m == NULL)
+                        break;
+
+                m->prefix = entry;
+                m->len = len;
+                m->url = eq + 1;
+                pthread_mutex_init(&m->lock, NULL);
+                m->next = mounts;
+                mounts = m;
+        }
+}
+
+/*
+ * The mount with the longest prefix of path, and the path relative to its
+ * export in rel, or NULL if no prefix matches.
+ */
+static struct preload_mount *_mount_find(const char *path, const char **rel)
+{
+        struct preload_mount *m, *best = NULL;
+
+        pthread_once(&preload_once, _preload_init);
+        if (mounts == NULL || path == NULL || path[0] != '/')
+                return NULL;
+
+        for (m = mounts; m; m = m->next) {
+                if (strncmp(path, m->prefix, m->len) != 0)
+                        continue;
+                if (path[m->len] != '\0' && path[m->len] != '/' &&
+                    m->len > 1)
+                        continue;
+                if (best == NULL || m->len > best->len)
+                        best = m;
+        }
+
+        if (best == NULL)
+                return NULL;
+
+        /* A prefix of "/" serves every path as is */
+        if (best->len == 1)
+                *rel = path;
+        else
+                *rel = path[best->len] ? path + best->len : "/";
+
+        return best;
+}
+
+/*
+ * Locks m, mounting it on first use. Returns with the lock held on success,
+ * or a negative errno, kept for the later calls, if the mount failed.
+ */
+static int _mount_lock(struct preload_mount *m)
+{
+        int ret;
+
+        pthread_mutex_lock(&m->lock);
+        if (m->fs)
+                return 0;
+        if (m->error)
+                goto err;
+
+        ret = virtfs_new(m->url, &m->fs);
+        if (ret < 0) {
+                m->fs = NULL;
+                m->error = ret;
+                goto err;
+        }
+
+        ret = virtfs_init(m->fs);
+        if (ret < 0) {
+                ERR("%s: failed to mount %s: %s\n", PRELOAD_ENV, m->url,
+                    strerror(-ret));
+                virtfs_fini(m->fs);
+                m->fs = NULL;
+                m->error = ret;
+                goto err;
+        }
+
+        return 0;
+
+err:
+        pthread_mutex_unlock(&m->lock);
+        return m->error;
+}
+
+static inline long _preload_ret(long ret)
+{
+        if (ret < 0) {
+                errno = -ret;
+                return -1;
+        }
+
+        return ret;
+}
+
+/* Takes a reference on the file of fd, NULL if fd is not one of ours */
+static struct preload_file *_file_get(int fd)
+{
+        struct preload_file *f = NULL;
+
+        if (__atomic_load_n(&nopen, __ATOMIC_RELAXED) == 0 || fd < 0)
+                return NULL;
+
+        pthread_mutex_lock(&files_lock);
+        if (fd < nfiles && files[fd]) {
+                f = files[fd];
+                f->refs++;
+        }
+        pthread_mutex_unlock(&files_lock);
+
+        return f;
+}
+
+/* Drops a reference, closing the remote file with the last one */
+static int _file_put(struct preload_file *f)
+{
+        int refs;
+        int ret;
+
+        pthread_mutex_lock(&files_lock);
+        refs = --f->refs;
+        pthread_mutex_unlock(&files_lock);
+
+        if (refs > 0)
+                return 0;
+
+        pthread_mutex_lock(&f->mnt->lock);
+        ret = virtfs_close(f->vfd);
+        pthread_mutex_unlock(&f->mnt->lock);
+        free(f);
+
+        return ret;
+}
+
+/* Makes fd, which must be free, refer to f with a reference of its own */
+static int _file_set(int fd, struct preload_file *f)
+{
+        struct preload_file **p;
+        int n;
+
+        pthread_mutex_lock(&files_lock);
+        if (fd >= nfiles) {
+                n = nfiles ? nfiles : 64;
+                while (n <= fd)
+                        n *= 2;
+
+                p = realloc(files, n * sizeof(*files));
+                if (p == NULL) {
+                        pthread_mutex_unlock(&files_lock);
+                        return -ENOMEM;
+                }
+
+                memset(p + nfiles, 0, (n - nfiles) * sizeof(*files));
+                files = p;
+                nfiles = n;
+        }
+
+        files[fd] = f;
+        f->refs++;
+        __atomic_add_fetch(&nopen, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&files_lock);
+
+        return 0;
+}
+
+/* Forgets fd, returning its file with the reference of fd still to drop */
+static struct preload_file *_file_del(int fd)
+{
+        struct preload_file *f = NULL;
+
+        if (__atomic_load_n(&nopen, __ATOMIC_RELAXED) == 0 || fd < 0)
+                return NULL;
+
+        pthread_mutex_lock(&files_lock);
+        if (fd < nfiles && files[fd]) {
+                f = files[fd];
+                files[fd] = NULL;
+                __atomic_sub_fetch(&nopen, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&files_lock);
+
+        return f;
+}
+
+/* The file of fd with its mount locked, NULL if fd is not one of ours */
+static struct preload_file *_file_lock(int fd)
+{
+        struct preload_file *f = _file_get(fd);
+
+        if (f)
+                pthread_mutex_lock(&f->mnt->lock);
+
+        return f;
+}
+
+static void _file_unlock(struct preload_file *f)
+{
+        pthread_mutex_unlock(&f->mnt->lock);
+        _file_put(f);
+}
+
+/* Points newfd, just made a duplicate of the descriptor of f, to f */
+static int _file_dup(struct preload_file *f, int newfd)
+{
+        struct preload_file *old;
+
+        old = _file_del(newfd);
+        if (old)
+                _file_put(old);
+
+        if (f && _file_set(newfd, f) < 0) {
+                close(newfd);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        return newfd;
+}
+
+PRELOAD_DECL(int, open64, (const char *path, int flags, ...));
+PRELOAD_DECL(int, close, (int fd));
+
+static int _open(struct preload_mount *m, const char *path, int flags,
+                 mode_t mode)
+{
+        struct preload_file *f;
+        vfd_t vfd;
+        int fd, ret;
+
+        ret = _mount_lock(m);
+        if (ret < 0)
+                return _preload_ret(ret);
+
+        vfd = virtfs_open(m->fs, path,
+                          flags & ~(O_CLOEXEC | O_NOCTTY | O_LARGEFILE), mode);
+        ret = -errno;
+        pthread_mutex_unlock(&m->lock);
+        if (vfd == NULL)
+                return _preload_ret(ret);
+
+        f = calloc(1, sizeof(struct preload_file));
+        if (f == NULL) {
+                ret = -ENOMEM;
+                goto err;
+        }
+
+        f->mnt = m;
+        f->vfd = vfd;
+
+        fd = REAL(open64)("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+        if (fd < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        ret = _file_set(fd, f);
+        if (ret < 0) {
+                REAL(close)(fd);
+                goto err;
+        }
+
+        return fd;
+
+err:
+        pthread_mutex_lock(&m->lock);
+        virtfs_close(vfd);
+        pthread_mutex_unlock(&m->lock);
+        free(f);
+
+        return _preload_ret(ret);
+}
+
+#define OPEN_MODE(flags, mode)                                          \
+        do {                                                            \
+                va_list ap;                                             \
+                                                                        \
+                if ((flags) & O_CREAT ||                                \
+                    ((flags) & O_TMPFILE) == O_TMPFILE) {               \
+                        va_start(ap, flags);                            \
+                        mode = va_arg(ap, int);                         \
+                        va_end(ap);                                     \
+                }                                                       \
+        } while (0)
+
+int preload_open64(const char *path, int flags, ...)
+{
+        struct preload_mount *m;
+        const char *rel;
+        mode_t mode = 0;
+
+        OPEN_MODE(flags, mode);
+
+        m = _mount_find(path, &rel);
+        if (m == NULL)
+                return REAL(open64)(path, flags, mode);
+
+        return _open(m, rel, flags, mode);
+}
+PRELOAD_ALIAS(open64, open);
+
+PRELOAD_DECL(int, openat64, (int dirfd, const char *path, int flags, ...));
+int preload_openat64(int dirfd, const char *path, int flags, ...)
+{
+        struct preload_mount *m;
+        const char *rel;
+        mode_t mode = 0;
+
+        OPEN_MODE(flags, mode);
+
+        m = _mount_find(path, &rel);
+        if (m == NULL)
+                return REAL(openat64)(dirfd, path, flags, mode);
+
+        return _open(m, rel, flags, mode);
+}
+PRELOAD_ALIAS(openat64, openat);
+
+/* Called instead of open() by _FORTIFY_SOURCE builds */
+PRELOAD_DECL(int, __open64_2, (const char *path, int flags));
+int preload___open64_2(const char *path, int flags)
+{
+        return preload_open64(path, flags);
+}
+PRELOAD_ALIAS(__open64_2, __open_2);
+
+PRELOAD_DECL(int, creat64, (const char *path, mode_t mode));
+int preload_creat64(const char *path, mode_t mode)
+{
+        return preload_open64(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
+PRELOAD_ALIAS(creat64, creat);
+
+int preload_close(int fd)
+{
+        struct preload_file *f;
+        int ret, err;
+
+        f = _file_del(fd);
+        ret = REAL(close)(fd);
+        if (f) {
+                err = _file_put(f);
+                if (err < 0 && ret == 0)
+                        ret = _preload_ret(err);
+        }
+
+        return ret;
+}
+
+PRELOAD_DECL(int, dup, (int oldfd));
+int preload_dup(int oldfd)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_get(oldfd);
+        ret = REAL(dup)(oldfd);
+        if (f) {
+                if (ret >= 0)
+                        ret = _file_dup(f, ret);
+                _file_put(f);
+        }
+
+        return ret;
+}
+
+PRELOAD_DECL(int, dup3, (int oldfd, int newfd, int flags));
+int preload_dup3(int oldfd, int newfd, int flags)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_get(oldfd);
+        ret = REAL(dup3)(oldfd, newfd, flags);
+        if (ret >= 0)
+                ret = _file_dup(f, ret);
+        if (f)
+                _file_put(f);
+
+        return ret;
+}
+
+PRELOAD_DECL(int, dup2, (int oldfd, int newfd));
+int preload_dup2(int oldfd, int newfd)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_get(oldfd);
+        ret = REAL(dup2)(oldfd, newfd);
+        if (ret >= 0 && oldfd != newfd)
+                ret = _file_dup(f, ret);
+        if (f)
+                _file_put(f);
+
+        return ret;
+}
+
+/* Only F_DUPFD and F_DUPFD_CLOEXEC are of interest, the rest passes */
+PRELOAD_DECL(int, fcntl64, (int fd, int cmd, ...));
+int preload_fcntl64(int fd, int cmd, ...)
+{
+        struct preload_file *f = NULL;
+        va_list ap;
+        void *arg;
+        int ret;
+
+        va_start(ap, cmd);
+        arg = va_arg(ap, void *);
+        va_end(ap);
+
+        if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+                f = _file_get(fd);
+
+        if (REAL(fcntl64) == NULL)
+                real_fcntl64 = dlsym(RTLD_NEXT, "fcntl");
+        ret = real_fcntl64(fd, cmd, arg);
+        if (f) {
+                if (ret >= 0)
+                        ret = _file_dup(f, ret);
+                _file_put(f);
+        }
+
+        return ret;
+}
+PRELOAD_ALIAS(fcntl64, fcntl);
+
+PRELOAD_DECL(ssize_t, read, (int fd, void *buf, size_t count));
+ssize_t preload_read(int fd, void *buf, size_t count)
+{
+        struct preload_file *f;
+        ssize_t ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(read)(fd, buf, count);
+
+        ret = virtfs_read(f->vfd, buf, count);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+
+PRELOAD_DECL(ssize_t, write, (int fd, const void *buf, size_t count));
+ssize_t preload_write(int fd, const void *buf, size_t count)
+{
+        struct preload_file *f;
+        ssize_t ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(write)(fd, buf, count);
+
+        ret = virtfs_write(f->vfd, buf, count);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+
+PRELOAD_DECL(ssize_t, pread64, (int fd, void *buf, size_t count,
+                                off_t offset));
+ssize_t preload_pread64(int fd, void *buf, size_t count, off_t offset)
+{
+        struct preload_file *f;
+        ssize_t ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(pread64)(fd, buf, count, offset);
+
+        ret = virtfs_pread(f->vfd, buf, count, offset);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+PRELOAD_ALIAS(pread64, pread);
+
+PRELOAD_DECL(ssize_t, pwrite64, (int fd, const void *buf, size_t count,
+                                 off_t offset));
+ssize_t preload_pwrite64(int fd, const void *buf, size_t count, off_t offset)
+{
+        struct preload_file *f;
+        ssize_t ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(pwrite64)(fd, buf, count, offset);
+
+        ret = virtfs_pwrite(f->vfd, buf, count, offset);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+PRELOAD_ALIAS(pwrite64, pwrite);
+
+PRELOAD_DECL(off_t, lseek64, (int fd, off_t offset, int whence));
+off_t preload_lseek64(int fd, off_t offset, int whence)
+{
+        struct preload_file *f;
+        off_t ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(lseek64)(fd, offset, whence);
+
+        ret = virtfs_lseek(f->vfd, offset, whence);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+PRELOAD_ALIAS(lseek64, lseek);
+
+PRELOAD_DECL(int, ftruncate64, (int fd, off_t length));
+int preload_ftruncate64(int fd, off_t length)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(ftruncate64)(fd, length);
+
+        ret = virtfs_ftruncate(f->vfd, length);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+PRELOAD_ALIAS(ftruncate64, ftruncate);
+
+PRELOAD_DECL(int, fsync, (int fd));
+int preload_fsync(int fd)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(fsync)(fd);
+
+        ret = virtfs_fsync(f->vfd);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+
+PRELOAD_DECL(int, fdatasync, (int fd));
+int preload_fdatasync(int fd)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return REAL(fdatasync)(fd);
+
+        ret = virtfs_fsync(f->vfd);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+
+/*
+ * stat() and friends, under their LFS names as well as the __xstat() ones
+ * of binaries built against glibc before 2.33. The passthrough of the ones
+ * missing at run time goes to the other kind.
+ */
+
+/* stat() or lstat() of path, 1 if path is not under a prefix */
+static int _path_stat(const char *path, struct stat *buf, int follow)
+{
+        struct preload_mount *m;
+        const char *rel;
+        int ret;
+
+        m = _mount_find(path, &rel);
+        if (m == NULL)
+                return 1;
+
+        ret = _mount_lock(m);
+        if (ret < 0)
+                return _preload_ret(ret);
+
+        if (follow)
+                ret = virtfs_stat(m->fs, rel, buf);
+        else
+                ret = virtfs_lstat(m->fs, rel, buf);
+        pthread_mutex_unlock(&m->lock);
+
+        return _preload_ret(ret);
+}
+
+/* fstat() of fd, 1 if fd is not one of ours */
+static int _fd_stat(int fd, struct stat *buf)
+{
+        struct preload_file *f;
+        int ret;
+
+        f = _file_lock(fd);
+        if (f == NULL)
+                return 1;
+
+        ret = virtfs_fstat(f->vfd, buf);
+        _file_unlock(f);
+
+        return _preload_ret(ret);
+}
+
+PRELOAD_DECL(int, stat64, (const char *path, struct stat *buf));
+PRELOAD_DECL(int, lstat64, (const char *path, struct stat *buf));
+PRELOAD_DECL(int, fstat64, (int fd, struct stat *buf));
+PRELOAD_DECL(int, __xstat64, (int ver, const char *path, struct stat *buf));
+PRELOAD_DECL(int, __lxstat64, (int ver, const char *path, struct stat *buf));
+PRELOAD_DECL(int, __fxstat64, (int ver, int fd, struct stat *buf));
+
+static int _real_stat(const char *path, struct stat *buf, int follow)
+{
+        if (follow && REAL(stat64))
+                return real_stat64(path, buf);
+        if (!follow && REAL(lstat64))
+                return real_lstat64(path, buf);
+#ifdef _STAT_VER
+        if (follow)
+                return REAL(__xstat64)(_STAT_VER, path, buf);
+        return REAL(__lxstat64)(_STAT_VER, path, buf);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+static int _real_fstat(int fd, struct stat *buf)
+{
+        if (REAL(fstat64))
+                return real_fstat64(fd, buf);
+#ifdef _STAT_VER
+        return REAL(__fxstat64)(_STAT_VER, fd, buf);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+int preload_stat64(const char *path, struct stat *buf)
+{
+        int ret = _path_stat(path, buf, 1);
+
+        return ret == 1 ? _real_stat(path, buf, 1) : ret;
+}
+PRELOAD_ALIAS(stat64, stat);
+
+int preload_lstat64(const char *path, struct stat *buf)
+{
+        int ret = _path_stat(path, buf, 0);
+
+        return ret == 1 ? _real_stat(path, buf, 0) : ret;
+}
+PRELOAD_ALIAS(lstat64, lstat);
+
+int preload_fstat64(int fd, struct stat *buf)
+{
+        int ret = _fd_stat(fd, buf);
+
+        return ret == 1 ? _real_fstat(fd, buf) : ret;
+}
+PRELOAD_ALIAS(fstat64, fstat);
+
+int preload___xstat64(int ver, const char *path, struct stat *buf)
+{
+        int ret = _path_stat(path, buf, 1);
+
+        if (ret == 1)
+                ret = REAL(__xstat64) ? real___xstat64(ver, path, buf) :
+                      _real_stat(path, buf, 1);
+
+        return ret;
+}
+PRELOAD_ALIAS(__xstat64, __xstat);
+
+int preload___lxstat64(int ver, const char *path, struct stat *buf)
+{
+        int ret = _path_stat(path, buf, 0);
+
+        if (ret == 1)
+                ret = REAL(__lxstat64) ? real___lxstat64(ver, path, buf) :
+                      _real_stat(path, buf, 0);
+
+        return ret;
+}
+PRELOAD_ALIAS(__lxstat64, __lxstat);
+
+int preload___fxstat64(int ver, int fd, struct stat *buf)
+{
+        int ret = _fd_stat(fd, buf);
+
+        if (ret == 1)
+                ret = REAL(__fxstat64) ? real___fxstat64(ver, fd, buf) :
+                      _real_fstat(fd, buf);
+
+        return ret;
+}
+PRELOAD_ALIAS(__fxstat64, __fxstat);
+
+PRELOAD_DECL(int, fstatat64, (int dirfd, const char *path, struct stat *buf,
+                              int flags));
+int preload_fstatat64(int dirfd, const char *path, struct stat *buf,
+                      int flags)
+{
+        int ret;
+
+        if (flags & AT_EMPTY_PATH && path && path[0] == '\0')
+                ret = _fd_stat(dirfd, buf);
+        else
+                ret = _path_stat(path, buf, !(flags & AT_SYMLINK_NOFOLLOW));
+
+        return ret == 1 ? REAL(fstatat64)(dirfd, path, buf, flags) : ret;
+}
+PRELOAD_ALIAS(fstatat64, fstatat);
+
+#ifdef STATX_BASIC_STATS
+#define __COPY_TIME(x)                                                  \
+        do {                                                            \
+                stx->stx_##x##time.tv_sec = st.st_##x##tim.tv_sec;      \
+                stx->stx_##x##time.tv_nsec = st.st_##x##tim.tv_nsec;    \
+        } while (0)
+
+PRELOAD_DECL(int, statx, (int dirfd, const char *path, int flags,
+                          unsigned int mask, struct statx *stx));
+int preload_statx(int dirfd, const char *path, int flags, unsigned int mask,
+                  struct statx *stx)
+{
+        struct stat st;
+        int ret;
+
+        if (flags & AT_EMPTY_PATH && path && path[0] == '\0')
+                ret = _fd_stat(dirfd, &st);
+        else
+                ret = _path_stat(path, &st, !(flags & AT_SYMLINK_NOFOLLOW));
+
+        if (ret == 1)
+                return REAL(statx)(dirfd, path, flags, mask, stx);
+        if (ret < 0)
+                return ret;
+
+        memset(stx, 0, sizeof(*stx));
+        stx->stx_mask = STATX_BASIC_STATS;
+        stx->stx_blksize = st.st_blksize;
+        stx->stx_nlink = st.st_nlink;
+        stx->stx_uid = st.st_uid;
+        stx->stx_gid = st.st_gid;
+        stx->stx_mode = st.st_mode;
+        stx->stx_ino = st.st_ino;
+        stx->stx_size = st.st_size;
+        stx->stx_blocks = st.st_blocks;
+        __COPY_TIME(a);
+        __COPY_TIME(m);
+        __COPY_TIME(c);
+        stx->stx_rdev_major = major(st.st_rdev);
+        stx->stx_rdev_minor = minor(st.st_rdev);
+        stx->stx_dev_major = major(st.st_dev);
+        stx->stx_dev_minor = minor(st.st_dev);
+
+        return 0;
+}
+#undef __COPY_TIME
+#endif /* STATX_BASIC_STATS */
+
+/* Permissions are left to the server, which checks them on open */
+PRELOAD_DECL(int, access, (const char *path, int mode));
+int preload_access(const char *path, int mode)
+{
+        struct stat st;
+        int ret = _path_stat(path, &st, 1);
+
+        return ret == 1 ? REAL(access)(path, mode) : ret;
+}
+
+/* Our DIR streams are struct preload_dir, told apart by address */
+static struct preload_dir *_dir_find(DIR *dirp)
+{
+        struct preload_dir *d;
+
+        if (__atomic_load_n(&dirs, __ATOMIC_RELAXED) == NULL)
+                return NULL;
+
+        pthread_mutex_lock(&files_lock);
+        for (d = dirs; d; d = d->next) {
+                if ((DIR *)d == dirp)
+                        break;
+        }
+        pthread_mutex_unlock(&files_lock);
+
+        return d;
+}
+
+PRELOAD_DECL(DIR *, opendir, (const char *path));
+DIR *preload_opendir(const char *path)
+{
+        struct preload_mount *m;
+        struct preload_dir *d;
+        const char *rel;
+        int ret;
+
+        m = _mount_find(path, &rel);
+        if (m == NULL)
+                return REAL(opendir)(path);
+
+        d = calloc(1, sizeof(struct preload_dir));
+        if (d == NULL || (d->path = strdup(rel)) == NULL) {
+                ret = -ENOMEM;
+                goto err;
+        }
+
+        ret = _mount_lock(m);
+        if (ret < 0)
+                goto err;
+
+        ret = virtfs_opendir(m->fs, rel, &d->dir);
+        pthread_mutex_unlock(&m->lock);
+        if (ret < 0)
+                goto err;
+
+        d->mnt = m;
+        pthread_mutex_lock(&files_lock);
+        d->next = dirs;
+        __atomic_store_n(&dirs, d, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&files_lock);
+
+        return (DIR *)d;
+
+err:
+        if (d)
+                free(d->path);
+        free(d);
+        errno = -ret;
+        return NULL;
+}
+
+PRELOAD_DECL(struct dirent *, readdir64, (DIR *dirp));
+struct dirent *preload_readdir64(DIR *dirp)
+{
+        struct preload_dir *d;
+        struct stat st;
+
+        d = _dir_find(dirp);
+        if (d == NULL)
+                return REAL(readdir64)(dirp);
+
+        pthread_mutex_lock(&d->mnt->lock);
+        free(d->ent);
+        d->ent = d->dir ? virtfs_readdirplus(d->dir, &st) : NULL;
+        pthread_mutex_unlock(&d->mnt->lock);
+
+        return d->ent;
+}
+PRELOAD_ALIAS(readdir64, readdir);
+
+/* The listing is read again from the start */
+PRELOAD_DECL(void, rewinddir, (DIR *dirp));
+void preload_rewinddir(DIR *dirp)
+{
+        struct preload_dir *d;
+
+        d = _dir_find(dirp);
+        if (d == NULL) {
+                REAL(rewinddir)(dirp);
+                return;
+        }
+
+        pthread_mutex_lock(&d->mnt->lock);
+        if (d->dir)
+                virtfs_closedir(d->dir);
+        if (virtfs_opendir(d->mnt->fs, d->path, &d->dir) < 0)
+                d->dir = NULL;
+        pthread_mutex_unlock(&d->mnt->lock);
+}
+
+PRELOAD_DECL(int, dirfd, (DIR *dirp));
+int preload_dirfd(DIR *dirp)
+{
+        if (_dir_find(dirp) == NULL)
+                return REAL(dirfd)(dirp);
+
+        errno = ENOTSUP;
+        return -1;
+}
+
+PRELOAD_DECL(int, closedir, (DIR *dirp));
+int preload_closedir(DIR *dirp)
+{
+        struct preload_dir *d, **p;
+        int ret = 0;
+
+        d = _dir_find(dirp);
+        if (d == NULL)
+                return REAL(closedir)(dirp);
+
+        pthread_mutex_lock(&files_lock);
+        for (p = &dirs; *p != d; p = &(*p)->next)
+                ;
+        *p = d->next;
+        pthread_mutex_unlock(&files_lock);
+
+        pthread_mutex_lock(&d->mnt->lock);
+        if (d->dir)
+                ret = virtfs_closedir(d->dir);
+        pthread_mutex_unlock(&d->mnt->lock);
+
+        free(d->ent);
+        free(d->path);
+        free(d);
+
+        return _preload_ret(ret);
+}
+
+/*
+ * stdio does not go through the interposed calls, so the streams on our
+ * files are cookie streams on their descriptors.
+ */
+static ssize_t _cookie_read(void *cookie, char *buf, size_t size)
+{
+        return preload_read((intptr_t)cookie, buf, size);
+}
+
+static ssize_t _cookie_write(void *cookie, const char *buf, size_t size)
+{
+        ssize_t ret = preload_write((intptr_t)cookie, buf, size);
+
+        return ret < 0 ? 0 : ret;
+}
+
+static int _cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+        off_t ret = preload_lseek64((intptr_t)cookie, *offset, whence);
+
+        if (ret < 0)
+                return -1;
+
+        *offset = ret;
+        return 0;
+}
+
+static int _cookie_close(void *cookie)
+{
+        return preload_close((intptr_t)cookie);
+}
+
+static FILE *_cookie_open(int fd, const char *mode)
+{
+        cookie_io_functions_t io = {
+                .read = _cookie_read,
+                .write = _cookie_write,
+                .seek = _cookie_seek,
+                .close = _cookie_close,
+        };
+
+        return fopencookie((void *)(intptr_t)fd, mode, io);
+}
+
+static int _fopen_flags(const char *mode)
+{
+        const char *p;
+        int flags;
+
+        switch (mode[0]) {
+        case 'r':
+                flags = O_RDONLY;
+                break;
+        case 'w':
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+        case 'a':
+                flags = O_WRONLY | O_CREAT | O_APPEND;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        for (p = mode + 1; *p && *p != ','; p++) {
+                switch (*p) {
+                case '+':
+                        flags = (flags & ~O_ACCMODE) | O_RDWR;
+                        break;
+                case 'e':
+                        flags |= O_CLOEXEC;
+                        break;
+                case 'x':
+                        flags |= O_EXCL;
+                        break;
+                }
+        }
+
+        return flags;
+}
+
+PRELOAD_DECL(FILE *, fopen64, (const char *path, const char *mode));
+FILE *preload_fopen64(const char *path, const char *mode)
+{
+        struct preload_mount *m;
+        const char *rel;
+        FILE *fp;
+        int flags, fd;
+
+        m = _mount_find(path, &rel);
+        if (m == NULL)
+                return REAL(fopen64)(path, mode);
+
+        flags = _fopen_flags(mode);
+        if (flags < 0) {
+                errno = -flags;
+                return NULL;
+        }
+
+        fd = _open(m, rel, flags, 0666);
+        if (fd < 0)
+                return NULL;
+
+        fp = _cookie_open(fd, mode);
+        if (fp == NULL)
+                preload_close(fd);
+
+        return fp;
+}
+PRELOAD_ALIAS(fopen64, fopen);
+
+PRELOAD_DECL(FILE *, fdopen, (int fd, const char *mode));
+FILE *preload_fdopen(int fd, const char *mode)
+{
+        struct preload_file *f;
+
+        f = _file_get(fd);
+        if (f == NULL)
+                return REAL(fdopen)(fd, mode);
+
+        _file_put(f);
+
+        return _cookie_open(fd, mode);
+}
@@ -16,6 +16,21 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#ifdef HAVE_LINUX_USERFAULTFD_H
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #include <nfsc/libnfs.h>
 #include <virtfs.h>
@@ -88,10 +103,116 @@ struct virtfs
         enum virtfs_log_level log;
         struct nfs_context *nfs;
         struct nfs_url *url;
+        pthread_mutex_t lock;           /* held across the calls into libnfs */
+        pthread_cond_t pumps_done;
+        int pumps;                      /* of virtfs_fd_to_posix() */
+        int inflight;                   /* virtfs_*_async() operations */
+        int timeout;                    /* of each call, 0 for none */
+        int nfs_timeout;                /* the default of libnfs */
+        struct virtfs_slot *slots;      /* queued to libnfs */
+        struct virtfs_slot *free_slots;
+};
+
+/*
+ * The library side of an asynchronous operation. libnfs reads into and
+ * writes from the data of the slot rather than the buffer of the caller, so
+ * that an operation cancelled or past its deadline returns at once and
+ * leaves its slot behind until libnfs is done with it.
+ */
+struct virtfs_slot
+{
+        struct virtfs_slot *next;
+        struct virtfs_slot **pprev;
+        struct virtfs *fs;
+        struct virtfs_op *op;           /* NULL once completed */
+        void *buf;                      /* of the caller, to read into */
+        int64_t deadline;               /* 0 for none */
+        char *data;
+        size_t size;
 };
 
+/* Milliseconds since boot, 0 for none as set by virtfs_set_deadline() */
+static __thread int64_t thread_deadline;
+
+static int64_t _now_ms(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * The deadline of a call of timeout milliseconds starting now, bounded by
+ * that of the thread: 0 for none, -1 when it already passed.
+ */
+static int64_t _deadline(int timeout)
+{
+        int64_t now, deadline = 0;
+
+        if (timeout <= 0 && thread_deadline == 0)
+                return 0;
+
+        now = _now_ms();
+        if (timeout > 0)
+                deadline = now + timeout;
+        if (thread_deadline && (deadline == 0 || thread_deadline < deadline))
+                deadline = thread_deadline;
+
+        return deadline > now ? deadline : -1;
+}
+
+/*
+ * libnfs bounds its synchronous calls by the timeout of the context, which
+ * is that of the mount, and narrowed to the deadline of the thread around
+ * each call. A call failing past its deadline timed out.
+ *
+ * The deadline may pass while the call waits for the mount, and libnfs
+ * takes a timeout of 0 for none: the call is not made then.
+ */
+static int _timed_begin(virtfs_t fs, int64_t deadline)
+{
+        int64_t left;
+
+        if (thread_deadline == 0 || deadline == 0)
+                return 0;
+
+        left = deadline - _now_ms();
+        if (left <= 0)
+                return -ETIMEDOUT;
+
+        nfs_set_timeout(fs->nfs, left);
+        return 0;
+}
+
+static int _timed_end(virtfs_t fs, int64_t deadline, int ret)
+{
+        if (thread_deadline && deadline)
+                nfs_set_timeout(fs->nfs, fs->timeout > 0 ? fs->timeout :
+                                fs->nfs_timeout);
+        if (ret < 0 && deadline && _now_ms() >= deadline)
+                return -ETIMEDOUT;
+
+        return ret;
+}
+
+#define TIMED(fs, call) ({                                              \
+        int64_t __deadline = _deadline((fs)->timeout);                  \
+        int __ret = -ETIMEDOUT;                                         \
+                                                                        \
+        if (__deadline >= 0) {                                          \
+                pthread_mutex_lock(&(fs)->lock);                        \
+                __ret = _timed_begin(fs, __deadline);                   \
+                if (__ret == 0)                                         \
+                        __ret = _timed_end(fs, __deadline, (call));     \
+                pthread_mutex_unlock(&(fs)->lock);                      \
+        }                                                               \
+        __ret; })
+
 int virtfs_new(const char *url, virtfs_t *fs_out)
 {
+        pthread_mutexattr_t attr;
         struct virtfs *fsp;
         int ret = -1;
 
@@ -106,6 +227,7 @@ int virtfs_new(const char *url, virtfs_t *fs_out)
                 ret = -ENOMEM;
                 goto err;
         }
+        fsp->nfs_timeout = nfs_get_timeout(fsp->nfs);
 
         fsp->url = nfs_parse_url_incomplete(fsp->nfs, url);
         if (fsp->url == NULL ||
@@ -116,6 +238,13 @@ int virtfs_new(const char *url, virtfs_t *fs_out)
                 goto err2;
         }
 
+        /* Callbacks run with the lock held may call back into the library */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&fsp->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        pthread_cond_init(&fsp->pumps_done, NULL);
+
         *fs_out = fsp;
         return 0;
 
@@ -149,6 +278,7 @@ err:
 
 int virtfs_fini(virtfs_t fs)
 {
+        struct virtfs_slot *s;
         struct virtfs *fsp;
         int ret = -EINVAL;
 
@@ -158,44 +288,69 @@ int virtfs_fini(virtfs_t fs)
 
         ret = 0;
 
+        /* The pumps own files of the mount until they are done */
+        pthread_mutex_lock(&fsp->lock);
+        while (fsp->pumps > 0)
+                pthread_cond_wait(&fsp->pumps_done, &fsp->lock);
+        pthread_mutex_unlock(&fsp->lock);
+
 #ifdef HAVE_NFS_UMOUNT
         if ((fsp->flags & VIRTFS_NFS_FLAG_MOUNT) != 0)
                 ret = nfs_umount(fsp->nfs);
 #endif /* HAVE_NFS_UMOUNT */
 
+        /* The operations in flight are dropped, without callbacks */
+        for (s = fsp->slots; s; s = s->next) {
+                if (s->op)
+                        s->op->slot = NULL;
+                s->op = NULL;
+        }
+
         if (fsp->url)
                 nfs_destroy_url(fsp->url);
         if (fsp->nfs)
                 nfs_destroy_context(fsp->nfs);
+
+        /* No callback comes once the context is gone */
+        while ((s = fsp->slots) != NULL) {
+                fsp->slots = s->next;
+                free(s->data);
+                free(s);
+        }
+        while ((s = fsp->free_slots) != NULL) {
+                fsp->free_slots = s->next;
+                free(s->data);
+                free(s);
+        }
+        pthread_cond_destroy(&fsp->pumps_done);
+        pthread_mutex_destroy(&fsp->lock);
+        free(fsp);
 err:
         return ret;
 }
 
-int virtfs_close(vfd_t vfd)
+int virtfs_set_timeout(virtfs_t fs, int timeout)
 {
-        return -ENOTSUP;
-}
+        if (fs == NULL)
+                return -EINVAL;
 
-#define __COPY_ATTR(x) buf->st_##x = buf64.nfs_##x
-#define __COPY_ATTR2(x, y) buf->x = buf64.y
-static int _do_nfs_stat(virtfs_t fs, const char *path, struct stat *buf,
-        int (*f)(struct nfs_context *, const char *, struct nfs_stat_64 *))
-{
-        struct nfs_stat_64 buf64;
-        struct virtfs *fsp;
-        int ret = -EINVAL;
+        pthread_mutex_lock(&fs->lock);
+        fs->timeout = timeout > 0 ? timeout : 0;
+        nfs_set_timeout(fs->nfs, timeout > 0 ? timeout : fs->nfs_timeout);
+        pthread_mutex_unlock(&fs->lock);
 
-        fsp = fs;
-        if (fs == NULL)
-                goto err;
+        return 0;
+}
 
-        if (path)
-                ret = f(fsp->nfs, path, &buf64);
-        else if (fsp->url->file)
-                ret = f(fsp->nfs, fsp->url->file, &buf64);
-        else
-                ret = f(fsp->nfs, "/", &buf64);
+void virtfs_set_deadline(int timeout)
+{
+        thread_deadline = timeout < 0 ? 0 : _now_ms() + timeout;
+}
 
+#define __COPY_ATTR(x) buf->st_##x = buf64->nfs_##x
+#define __COPY_ATTR2(x, y) buf->x = buf64->y
+static void _copy_nfs_stat(struct stat *buf, const struct nfs_stat_64 *buf64)
+{
         __COPY_ATTR(dev);
         __COPY_ATTR(ino);
         __COPY_ATTR(mode);
@@ -216,12 +371,32 @@ static int _do_nfs_stat(virtfs_t fs, const char *path, struct stat *buf,
 #else
         /* Apple? */
 #endif
+}
+#undef __COPY_ATTR
+#undef __COPY_ATTR2
+
+static int _do_nfs_stat(virtfs_t fs, const char *path, struct stat *buf,
+        int (*f)(struct nfs_context *, const char *, struct nfs_stat_64 *))
+{
+        struct nfs_stat_64 buf64;
+        struct virtfs *fsp;
+        int ret = -EINVAL;
+
+        fsp = fs;
+        if (fs == NULL)
+                goto err;
+
+        if (path == NULL)
+                path = fsp->url->file ? fsp->url->file : "/";
+
+        ret = TIMED(fsp, f(fsp->nfs, path, &buf64));
+
+        if (ret == 0)
+                _copy_nfs_stat(buf, &buf64);
 
 err:
         return ret;
 }
-#undef __COPY_ATTR
-#undef __COPY_ATTR2
 
 int virtfs_stat(virtfs_t fs, const char *path, struct stat *buf)
 {
@@ -233,159 +408,2147 @@ int virtfs_lstat(virtfs_t fs, const char *path, struct stat *buf)
         return _do_nfs_stat(fs, path, buf, nfs_lstat64);
 }
 
-void virtfs_dump_info(virtfs_t fs, int verbose)
+int virtfs_mkdir(virtfs_t fs, const char *path, mode_t mode)
 {
-        struct virtfs *fsp;
-        int ret = -EINVAL;
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
 
-        fsp = fs;
-        DEBUG("fs: %p, ", fsp);
-        if (fs == NULL)
-                goto err;
+        return TIMED(fs, nfs_mkdir2(fs->nfs, path, mode));
+}
 
-        DEBUG("flags: %x, server: %s, path: %s, file: %s\n", fsp->flags,
-              fsp->url->server, fsp->url->path, fsp->url->file);
+int virtfs_rmdir(virtfs_t fs, const char *path)
+{
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
 
-err:
-        return;
+        return TIMED(fs, nfs_rmdir(fs->nfs, path));
 }
 
-struct virtfs_dir
+int virtfs_unlink(virtfs_t fs, const char *path)
 {
-        struct nfs_context *nfs;
-        struct nfsdir *nfsdir;
-};
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
 
-int virtfs_opendir(virtfs_t fs_in, const char *path, virtfs_dir_t *dir_out)
+        return TIMED(fs, nfs_unlink(fs->nfs, path));
+}
+
+int virtfs_rename(virtfs_t fs, const char *oldpath, const char *newpath)
 {
-        struct virtfs *fsp;
-        struct virtfs_dir *dir;
-        int ret = -EINVAL;
+        if (fs == NULL || oldpath == NULL || newpath == NULL)
+                return -EINVAL;
 
-        fsp = fs_in;
-        if (fsp == NULL)
-                goto err;
+        return TIMED(fs, nfs_rename(fs->nfs, oldpath, newpath));
+}
 
-        dir = malloc(sizeof(struct virtfs_dir));
-        if (!dir)
-                return alloc_failed();
-        dir->nfs = fsp->nfs;
-        ret = nfs_opendir(dir->nfs, path, &(dir->nfsdir));
-        if (ret)
-                goto err2;
-        *dir_out = dir;
+int virtfs_symlink(virtfs_t fs, const char *target, const char *linkpath)
+{
+        if (fs == NULL || target == NULL || linkpath == NULL)
+                return -EINVAL;
 
-        return 0;
-err2:
-        free(dir);
-err:
-        return ret;
+        return TIMED(fs, nfs_symlink(fs->nfs, target, linkpath));
 }
 
-int virtfs_closedir(virtfs_dir_t dir_in)
+/* Returns the length of the target, which is not NUL terminated if cut */
+int virtfs_readlink(virtfs_t fs, const char *path, char *buf, size_t size)
 {
-        int ret = -EINVAL;
+        int ret;
 
-        if (dir_in->nfs == NULL || dir_in->nfsdir == NULL)
-                goto out;
-        nfs_closedir(dir_in->nfs, dir_in->nfsdir);
-        ret = 0;
-out:
-        free(dir_in);
-        return ret;
+        if (fs == NULL || path == NULL || size == 0)
+                return -EINVAL;
+
+        bzero(buf, size);
+        ret = TIMED(fs, nfs_readlink(fs->nfs, path, buf, size));
+        if (ret < 0)
+                return ret;
+
+        return strnlen(buf, size);
 }
 
-struct virtfs_dirent
+int virtfs_truncate(virtfs_t fs, const char *path, off_t length)
 {
-        struct dirent ent;
-        struct nfsdirent *nfsent;
+        if (fs == NULL || path == NULL || length < 0)
+                return -EINVAL;
+
+        return TIMED(fs, nfs_truncate(fs->nfs, path, length));
+}
+
+int virtfs_chmod(virtfs_t fs, const char *path, mode_t mode)
+{
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
+
+        return TIMED(fs, nfs_chmod(fs->nfs, path, mode));
+}
+
+int virtfs_chown(virtfs_t fs, const char *path, uid_t uid, gid_t gid)
+{
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
+
+        return TIMED(fs, nfs_chown(fs->nfs, path, uid, gid));
+}
+
+/* times[0] is the access time and times[1] the modification time */
+int virtfs_utimes(virtfs_t fs, const char *path, struct timeval times[2])
+{
+        if (fs == NULL || path == NULL || times == NULL)
+                return -EINVAL;
+
+        return TIMED(fs, nfs_utimes(fs->nfs, path, times));
+}
+
+int virtfs_statvfs(virtfs_t fs, const char *path, struct statvfs *buf)
+{
+        if (fs == NULL || path == NULL)
+                return -EINVAL;
+
+        return TIMED(fs, nfs_statvfs(fs->nfs, path, buf));
+}
+
+/*
+ * A file of a mounted filesystem, or a POSIX fd wrapped by
+ * virtfs_fd_from_posix(), which has no filesystem.
+ */
+#define VIRTFS_FD_FLAG_OWNS_FS 0x0001
+struct virtfs_fd
+{
+        int flags;
+        int mode;                       /* O_RDONLY, O_WRONLY or O_RDWR */
+        struct virtfs *fs;
+        struct nfsfh *nfsfh;
+        int posix;
 };
 
-#define __COPY_ATTR2(x, y) buf->x = ndirp->y
-struct dirent *virtfs_readdirplus(virtfs_dir_t dir, struct stat *buf)
+/* Turns the result of a POSIX call on a wrapped fd into our convention */
+static inline ssize_t _posix_ret(ssize_t ret)
 {
-        struct virtfs_dirent *dirp;
-        struct nfsdirent *ndirp;
+        return ret < 0 ? -errno : ret;
+}
 
-        ndirp = nfs_readdir(dir->nfs, dir->nfsdir);
-        if (!ndirp)
+vfd_t virtfs_open(virtfs_t fs, const char *path, int flags, ...)
+{
+        struct virtfs_fd *vfd;
+        va_list ap;
+        int mode = 0;
+        int ret;
+
+        if (fs == NULL || path == NULL) {
+                errno = EINVAL;
                 return NULL;
+        }
 
-        dirp = malloc(sizeof(struct virtfs_dirent));
-        if (!dirp) {
-                free(ndirp);
+        if (flags & O_CREAT) {
+                va_start(ap, flags);
+                mode = va_arg(ap, int);
+                va_end(ap);
+        }
+
+        vfd = malloc(sizeof(struct virtfs_fd));
+        if (!vfd) {
                 alloc_failed();
+                errno = ENOMEM;
                 return NULL;
         }
 
-        bzero(dirp, sizeof(struct virtfs_dirent));
-        dirp->nfsent = ndirp;
-        dirp->ent.d_ino = ndirp->inode;
-        strncpy(dirp->ent.d_name, ndirp->name, 255);
-
-        __COPY_ATTR2(st_dev, dev);
-        __COPY_ATTR2(st_ino, inode);
-        __COPY_ATTR2(st_mode, mode);
-        __COPY_ATTR2(st_nlink, nlink);
-        __COPY_ATTR2(st_uid, uid);
-        __COPY_ATTR2(st_gid, gid);
-        __COPY_ATTR2(st_rdev, rdev);
-        __COPY_ATTR2(st_size, size);
-        __COPY_ATTR2(st_blksize, blksize);
-        __COPY_ATTR2(st_blocks, blocks);
-        __COPY_ATTR2(st_atime, atime.tv_sec);
-        __COPY_ATTR2(st_mtime, mtime.tv_sec);
-        __COPY_ATTR2(st_ctime, ctime.tv_sec);
-#ifdef HAVE_STRUCT_STAT_ST_ATIM
-        buf->st_atim.tv_nsec = ndirp->atime.tv_usec * 1000 + ndirp->atime_nsec;
-        buf->st_mtim.tv_nsec = ndirp->mtime.tv_usec * 1000 + ndirp->mtime_nsec;
-        buf->st_ctim.tv_nsec = ndirp->ctime.tv_usec * 1000 + ndirp->ctime_nsec;
-#else
-        /* Apple? */
-#endif
-        dirp->ent.d_type = IFTODT(buf->st_mode);
+        bzero(vfd, sizeof(struct virtfs_fd));
+        vfd->fs = fs;
+        vfd->mode = flags & O_ACCMODE;
+        vfd->posix = -1;
+        if (flags & O_CREAT)
+                ret = TIMED(fs, nfs_create(fs->nfs, path, flags, mode,
+                                           &vfd->nfsfh));
+        else
+                ret = TIMED(fs, nfs_open(fs->nfs, path, flags, &vfd->nfsfh));
+        if (ret < 0) {
+                free(vfd);
+                errno = -ret;
+                return NULL;
+        }
 
-        return &(dirp->ent);
+        return vfd;
 }
 
-char *
-virtfs_append_path (const char *base_path, const char *hanging_path)
+/*
+ * Opens the file of a complete URL on a mount of its own, released along
+ * with the file.
+ */
+vfd_t virtfs_openuri(const char *uri, int flags, ...)
 {
-        size_t new_length;
-        size_t base_path_length = strlen (base_path);
-        size_t hanging_path_length = strlen (hanging_path);
-        const char *fmt;
-        char *new_path;
+        struct virtfs_fd *vfd;
+        virtfs_t fs;
+        va_list ap;
+        int mode = 0;
+        int ret;
+
+        if (flags & O_CREAT) {
+                va_start(ap, flags);
+                mode = va_arg(ap, int);
+                va_end(ap);
+        }
 
-        if (base_path_length > 0 && base_path[base_path_length - 1] == '/') {
-                new_length = base_path_length + hanging_path_length + 1;
-                fmt = "%s%s";
-        } else {
-                new_length = base_path_length + hanging_path_length + 2;
-                fmt = "%s/%s";
+        ret = virtfs_new(uri, &fs);
+        if (ret < 0) {
+                errno = -ret;
+                return NULL;
         }
 
-        new_path = malloc (new_length);
-        if (new_path == NULL) {
-                goto out;
+        if (fs->url->file == NULL) {
+                ret = -EISDIR;
+                goto err;
         }
 
-        snprintf (new_path, new_length, fmt, base_path, hanging_path);
+        ret = virtfs_init(fs);
+        if (ret < 0)
+                goto err;
 
-out:
-        return new_path;
+        vfd = virtfs_open(fs, fs->url->file, flags, mode);
+        if (vfd == NULL) {
+                ret = -errno;
+                goto err;
+        }
+
+        vfd->flags |= VIRTFS_FD_FLAG_OWNS_FS;
+        return vfd;
+
+err:
+        virtfs_fini(fs);
+        errno = -ret;
+        return NULL;
 }
 
-char *virtfs_url_get_path(virtfs_t fs)
+int virtfs_close(vfd_t vfd)
 {
-        struct nfs_url *nfs_url = fs->url;
+        int ret;
 
-        if (!nfs_url || !nfs_url->path)
-                return NULL;
-        if (!nfs_url->file)
-                return strdup(nfs_url->path);
+        if (vfd == NULL)
+                return -EINVAL;
 
-        return virtfs_append_path(nfs_url->path, nfs_url->file);
+        if (vfd->fs == NULL) {
+                ret = _posix_ret(close(vfd->posix));
+                free(vfd);
+                return ret;
+        }
+
+        /* Not timed: the handle is freed with vfd whatever the deadline */
+        pthread_mutex_lock(&vfd->fs->lock);
+        ret = nfs_close(vfd->fs->nfs, vfd->nfsfh);
+        pthread_mutex_unlock(&vfd->fs->lock);
+        if (vfd->flags & VIRTFS_FD_FLAG_OWNS_FS)
+                virtfs_fini(vfd->fs);
+
+        free(vfd);
+        return ret;
+}
+
+int virtfs_fstat(vfd_t vfd, struct stat *buf)
+{
+        struct nfs_stat_64 buf64;
+        int ret;
+
+        if (vfd == NULL)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(fstat(vfd->posix, buf));
+
+        ret = TIMED(vfd->fs, nfs_fstat64(vfd->fs->nfs, vfd->nfsfh, &buf64));
+        if (ret == 0)
+                _copy_nfs_stat(buf, &buf64);
+
+        return ret;
+}
+
+int virtfs_ftruncate(vfd_t vfd, off_t length)
+{
+        if (vfd == NULL || length < 0)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(ftruncate(vfd->posix, length));
+
+        return TIMED(vfd->fs, nfs_ftruncate(vfd->fs->nfs, vfd->nfsfh, length));
+}
+
+/* The zeros written by virtfs_fallocate() at a time */
+#define VIRTFS_ZERO_SIZE (1024 * 1024)
+
+/* Writes the zeros of buf over [offset, end) of vfd */
+static int _write_zeros(vfd_t vfd, const char *buf, off_t offset, off_t end)
+{
+        ssize_t ret;
+
+        while (offset < end) {
+                ret = virtfs_pwrite(vfd, buf, end - offset < VIRTFS_ZERO_SIZE ?
+                                    end - offset : VIRTFS_ZERO_SIZE, offset);
+                if (ret < 0)
+                        return ret;
+                offset += ret;
+        }
+
+        return 0;
+}
+
+/*
+ * libnfs has neither ALLOCATE nor DEALLOCATE. Space is reserved by writing
+ * it: the holes the server reports within the file, none when it cannot
+ * seek them as with NFSv3, and the range past the end of the file.
+ */
+int virtfs_fallocate(vfd_t vfd, int mode, off_t offset, off_t len)
+{
+        off_t end, hole, data;
+        struct stat st;
+        char *zeros;
+        int ret;
+
+        if (vfd == NULL || offset < 0 || len <= 0)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(fallocate(vfd->posix, mode, offset, len));
+        if (mode != 0)
+                return -EOPNOTSUPP;
+
+        ret = virtfs_fstat(vfd, &st);
+        if (ret < 0)
+                return ret;
+
+        zeros = calloc(1, VIRTFS_ZERO_SIZE);
+        if (zeros == NULL)
+                return -ENOMEM;
+
+        end = offset + len;
+        for (hole = offset; hole < end && hole < st.st_size; hole = data) {
+                hole = virtfs_lseek(vfd, hole, SEEK_HOLE);
+                if (hole < 0 || hole >= st.st_size || hole >= end)
+                        break;
+
+                data = virtfs_lseek(vfd, hole, SEEK_DATA);
+                if (data <= hole || data > st.st_size)
+                        data = st.st_size;
+                ret = _write_zeros(vfd, zeros, hole, data < end ? data : end);
+                if (ret < 0)
+                        goto out;
+        }
+
+        ret = _write_zeros(vfd, zeros, offset > st.st_size ? offset : st.st_size,
+                           end);
+out:
+        free(zeros);
+        return ret;
+}
+
+/* The order of the arguments of the data calls changed with libnfs 6 */
+ssize_t virtfs_read(vfd_t vfd, void *buf, size_t count)
+{
+        if (vfd == NULL)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(read(vfd->posix, buf, count));
+
+#ifdef LIBNFS_API_V2
+        return TIMED(vfd->fs, nfs_read(vfd->fs->nfs, vfd->nfsfh, buf, count));
+#else
+        return TIMED(vfd->fs, nfs_read(vfd->fs->nfs, vfd->nfsfh, count, buf));
+#endif
+}
+
+ssize_t virtfs_write(vfd_t vfd, const void *buf, size_t count)
+{
+        if (vfd == NULL)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(write(vfd->posix, buf, count));
+
+#ifdef LIBNFS_API_V2
+        return TIMED(vfd->fs, nfs_write(vfd->fs->nfs, vfd->nfsfh, buf, count));
+#else
+        return TIMED(vfd->fs, nfs_write(vfd->fs->nfs, vfd->nfsfh, count, buf));
+#endif
+}
+
+ssize_t virtfs_pread(vfd_t vfd, void *buf, size_t count, off_t offset)
+{
+        if (vfd == NULL || offset < 0)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(pread(vfd->posix, buf, count, offset));
+
+#ifdef LIBNFS_API_V2
+        return TIMED(vfd->fs, nfs_pread(vfd->fs->nfs, vfd->nfsfh, buf, count,
+                                        offset));
+#else
+        return TIMED(vfd->fs, nfs_pread(vfd->fs->nfs, vfd->nfsfh, offset,
+                                        count, buf));
+#endif
+}
+
+ssize_t virtfs_pwrite(vfd_t vfd, const void *buf, size_t count, off_t offset)
+{
+        if (vfd == NULL || offset < 0)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(pwrite(vfd->posix, buf, count, offset));
+
+#ifdef LIBNFS_API_V2
+        return TIMED(vfd->fs, nfs_pwrite(vfd->fs->nfs, vfd->nfsfh, buf, count,
+                                         offset));
+#else
+        return TIMED(vfd->fs, nfs_pwrite(vfd->fs->nfs, vfd->nfsfh, offset,
+                                         count, buf));
+#endif
+}
+
+off_t virtfs_lseek(vfd_t vfd, off_t offset, int whence)
+{
+        uint64_t current;
+        int ret;
+
+        if (vfd == NULL)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(lseek(vfd->posix, offset, whence));
+
+        ret = TIMED(vfd->fs, nfs_lseek(vfd->fs->nfs, vfd->nfsfh, offset,
+                                        whence, &current));
+        if (ret < 0)
+                return ret;
+
+        return current;
+}
+
+int virtfs_fsync(vfd_t vfd)
+{
+        if (vfd == NULL)
+                return -EINVAL;
+        if (vfd->fs == NULL)
+                return _posix_ret(fsync(vfd->posix));
+
+        return TIMED(vfd->fs, nfs_fsync(vfd->fs->nfs, vfd->nfsfh));
+}
+
+/*
+ * The longest wait for the socket of a mount with the lock released. Other
+ * threads may run the callbacks of the waiting one meanwhile, which then
+ * only notices on its next look.
+ */
+#define VIRTFS_SERVICE_MS 100
+
+/*
+ * Waits up to timeout milliseconds (-1 for ever) for the socket of fs, or
+ * for events on fd unless it is -1, and lets libnfs send the queued requests
+ * and run the callbacks of the replies. Called with the lock of fs held,
+ * which is released for the wait. Returns the events of fd.
+ */
+static int _nfs_service_fd(struct virtfs *fs, int fd, short events,
+                           int timeout)
+{
+        struct pollfd pfd[2];
+        int ret;
+
+        if (timeout < 0 || timeout > VIRTFS_SERVICE_MS)
+                timeout = VIRTFS_SERVICE_MS;
+
+        pfd[0].fd = nfs_get_fd(fs->nfs);
+        pfd[0].events = nfs_which_events(fs->nfs);
+        pfd[1].fd = fd;
+        pfd[1].events = events;
+        pthread_mutex_unlock(&fs->lock);
+        ret = poll(pfd, 2, timeout);
+        if (ret < 0)
+                ret = errno == EINTR ? 0 : -errno;
+        pthread_mutex_lock(&fs->lock);
+        if (ret <= 0)
+                return ret;
+
+        /* The replies may have been taken by another thread meanwhile */
+        if (pfd[0].revents) {
+                pfd[0].events = nfs_which_events(fs->nfs);
+                if (poll(pfd, 1, 0) > 0 &&
+                    nfs_service(fs->nfs, pfd[0].revents) < 0) {
+                        ERR("nfs_service failed: %s\n",
+                            nfs_get_error(fs->nfs));
+                        return -EIO;
+                }
+        }
+
+        return pfd[1].revents;
+}
+
+static int _nfs_service(struct virtfs *fs, int timeout)
+{
+        return _nfs_service_fd(fs, -1, 0, timeout);
+}
+
+static struct virtfs_slot *_slot_get(struct virtfs *fs, size_t size)
+{
+        struct virtfs_slot *s;
+        char *data;
+
+        s = fs->free_slots;
+        if (s == NULL) {
+                s = malloc(sizeof(struct virtfs_slot));
+                if (!s) {
+                        alloc_failed();
+                        return NULL;
+                }
+
+                bzero(s, sizeof(struct virtfs_slot));
+                s->fs = fs;
+        } else {
+                fs->free_slots = s->next;
+        }
+
+        if (size > s->size) {
+                data = realloc(s->data, size);
+                if (!data) {
+                        s->next = fs->free_slots;
+                        fs->free_slots = s;
+                        alloc_failed();
+                        return NULL;
+                }
+
+                s->data = data;
+                s->size = size;
+        }
+
+        s->next = fs->slots;
+        if (s->next)
+                s->next->pprev = &s->next;
+        s->pprev = &fs->slots;
+        fs->slots = s;
+
+        return s;
+}
+
+static void _slot_put(struct virtfs_slot *s)
+{
+        struct virtfs *fs = s->fs;
+
+        *s->pprev = s->next;
+        if (s->next)
+                s->next->pprev = s->pprev;
+
+        s->op = NULL;
+        s->next = fs->free_slots;
+        fs->free_slots = s;
+}
+
+static void _op_done(struct virtfs *fs, struct virtfs_op *op, ssize_t ret)
+{
+        op->slot = NULL;
+        fs->inflight--;
+        op->cb(op, ret);
+}
+
+/* Completes op before libnfs does, which then completes the slot alone */
+static void _op_abort(struct virtfs_op *op, int ret)
+{
+        struct virtfs_slot *s = op->slot;
+
+        s->op = NULL;
+        _op_done(s->fs, op, ret);
+}
+
+static void _op_cb(int status, struct nfs_context *nfs, void *data,
+                   void *private_data)
+{
+        struct virtfs_slot *s = private_data;
+        struct virtfs *fs = s->fs;
+        struct virtfs_op *op = s->op;
+
+        if (op && status > 0 && s->buf)
+#ifdef LIBNFS_API_V2
+                memcpy(s->buf, s->data, status);
+#else
+                memcpy(s->buf, data, status);
+#endif
+        _slot_put(s);
+
+        if (op)
+                _op_done(fs, op, status);
+}
+
+/*
+ * Takes a slot of size bytes for op, unless its deadline is already past.
+ * Returns with the lock of the mount held on success, for _op_queued().
+ */
+static int _op_start(vfd_t vfd, struct virtfs_op *op, size_t size)
+{
+        struct virtfs_slot *s;
+        int64_t deadline;
+
+        if (vfd == NULL || op == NULL || op->cb == NULL)
+                return -EINVAL;
+
+        op->slot = NULL;
+
+        /* A POSIX fd has no mount to complete on */
+        if (vfd->fs == NULL)
+                return -EOPNOTSUPP;
+
+        deadline = _deadline(op->timeout ? op->timeout : vfd->fs->timeout);
+        if (deadline < 0)
+                return -ETIMEDOUT;
+
+        pthread_mutex_lock(&vfd->fs->lock);
+        s = _slot_get(vfd->fs, size);
+        if (s == NULL) {
+                pthread_mutex_unlock(&vfd->fs->lock);
+                return -ENOMEM;
+        }
+
+        s->op = op;
+        s->buf = NULL;
+        s->deadline = deadline;
+        op->slot = s;
+
+        return 0;
+}
+
+static int _op_queued(vfd_t vfd, struct virtfs_op *op, int ret)
+{
+        if (ret < 0) {
+                ERR("failed to queue operation: %s\n",
+                    nfs_get_error(vfd->fs->nfs));
+                _slot_put(op->slot);
+                op->slot = NULL;
+                ret = -EIO;
+        } else {
+                vfd->fs->inflight++;
+        }
+
+        pthread_mutex_unlock(&vfd->fs->lock);
+
+        return ret;
+}
+
+int virtfs_pread_async(vfd_t vfd, void *buf, size_t count, off_t offset,
+                       struct virtfs_op *op)
+{
+        struct virtfs_slot *s;
+        int ret;
+
+        if (offset < 0)
+                return -EINVAL;
+
+#ifdef LIBNFS_API_V2
+        ret = _op_start(vfd, op, count);
+#else
+        ret = _op_start(vfd, op, 0);
+#endif
+        if (ret < 0)
+                return ret;
+
+        s = op->slot;
+        s->buf = buf;
+#ifdef LIBNFS_API_V2
+        ret = nfs_pread_async(vfd->fs->nfs, vfd->nfsfh, s->data, count, offset,
+                              _op_cb, s);
+#else
+        ret = nfs_pread_async(vfd->fs->nfs, vfd->nfsfh, offset, count,
+                              _op_cb, s);
+#endif
+
+        return _op_queued(vfd, op, ret);
+}
+
+int virtfs_pwrite_async(vfd_t vfd, const void *buf, size_t count,
+                        off_t offset, struct virtfs_op *op)
+{
+        struct virtfs_slot *s;
+        int ret;
+
+        if (offset < 0)
+                return -EINVAL;
+
+        ret = _op_start(vfd, op, count);
+        if (ret < 0)
+                return ret;
+
+        s = op->slot;
+        memcpy(s->data, buf, count);
+#ifdef LIBNFS_API_V2
+        ret = nfs_pwrite_async(vfd->fs->nfs, vfd->nfsfh, s->data, count,
+                               offset, _op_cb, s);
+#else
+        ret = nfs_pwrite_async(vfd->fs->nfs, vfd->nfsfh, offset, count,
+                               s->data, _op_cb, s);
+#endif
+
+        return _op_queued(vfd, op, ret);
+}
+
+int virtfs_fsync_async(vfd_t vfd, struct virtfs_op *op)
+{
+        int ret;
+
+        ret = _op_start(vfd, op, 0);
+        if (ret < 0)
+                return ret;
+
+        ret = nfs_fsync_async(vfd->fs->nfs, vfd->nfsfh, _op_cb, op->slot);
+
+        return _op_queued(vfd, op, ret);
+}
+
+int virtfs_cancel(struct virtfs_op *op)
+{
+        struct virtfs_slot *s;
+        struct virtfs *fs;
+
+        if (op == NULL)
+                return -EINVAL;
+
+        /* Slots outlive their operations, until the mount is gone */
+        s = op->slot;
+        if (s == NULL)
+                return -ENOENT;
+
+        fs = s->fs;
+        pthread_mutex_lock(&fs->lock);
+        if (op->slot == NULL) {
+                pthread_mutex_unlock(&fs->lock);
+                return -ENOENT;
+        }
+
+        _op_abort(op, -ECANCELED);
+        pthread_mutex_unlock(&fs->lock);
+
+        return 0;
+}
+
+/* The first deadline of the operations in flight, 0 for none */
+static int64_t _op_next_deadline(struct virtfs *fs)
+{
+        struct virtfs_slot *s;
+        int64_t next = 0;
+
+        for (s = fs->slots; s; s = s->next) {
+                if (s->op && s->deadline && (next == 0 || s->deadline < next))
+                        next = s->deadline;
+        }
+
+        return next;
+}
+
+static void _op_expire(struct virtfs *fs)
+{
+        struct virtfs_slot *s;
+        int64_t now = _now_ms();
+
+        /* A callback may queue or cancel operations, start over after it */
+again:
+        for (s = fs->slots; s; s = s->next) {
+                if (s->op && s->deadline && s->deadline <= now) {
+                        _op_abort(s->op, -ETIMEDOUT);
+                        goto again;
+                }
+        }
+}
+
+int virtfs_poll(virtfs_t fs, int timeout)
+{
+        int64_t next, now;
+        int ret;
+
+        if (fs == NULL)
+                return -EINVAL;
+
+        pthread_mutex_lock(&fs->lock);
+        ret = fs->inflight;
+        if (ret == 0)
+                goto out;
+
+        /* Wake up for the first deadline */
+        next = _op_next_deadline(fs);
+        if (next) {
+                now = _now_ms();
+                if (timeout < 0 || next - now < timeout)
+                        timeout = next > now ? next - now : 0;
+        }
+
+        ret = _nfs_service(fs, timeout);
+        if (ret < 0)
+                goto out;
+
+        if (next)
+                _op_expire(fs);
+
+        ret = fs->inflight;
+out:
+        pthread_mutex_unlock(&fs->lock);
+        return ret;
+}
+
+/*
+ * Write-behind streams. The data is gathered in chunks whose boundaries are
+ * aligned to the chunk size in the file, so that the server sees whole
+ * blocks, and each full chunk is sent as an UNSTABLE positional write while
+ * the next ones are gathered. Up to depth chunks are in flight, and a single
+ * COMMIT makes the whole stream stable once it is closed.
+ */
+struct virtfs_chunk
+{
+        struct virtfs_writer *w;
+        char *buf;
+        off_t offset;
+        size_t len;
+        size_t done;
+        int busy;
+};
+
+struct virtfs_writer
+{
+        struct virtfs_fd *vfd;
+        struct virtfs_chunk *chunks;
+        char *bufs;
+        size_t size;
+        int depth;
+        int cur;
+        int inflight;
+        off_t offset;
+        int err;
+};
+
+static int _writer_send(struct virtfs_chunk *c);
+
+static void _writer_cb(int status, struct nfs_context *nfs, void *data,
+                       void *private_data)
+{
+        struct virtfs_chunk *c = private_data;
+        struct virtfs_writer *w = c->w;
+
+        if (status > 0) {
+                c->done += status;
+                if (c->done == c->len)
+                        goto done;
+
+                /* Short write, send the rest */
+                status = _writer_send(c);
+                if (status == 0)
+                        return;
+        } else {
+                ERR("write failed at %lld: %s\n",
+                    (long long)(c->offset + c->done), nfs_get_error(nfs));
+                if (status == 0)
+                        status = -EIO;
+        }
+
+        if (w->err == 0)
+                w->err = status;
+done:
+        c->busy = 0;
+        w->inflight--;
+}
+
+static int _writer_send(struct virtfs_chunk *c)
+{
+        struct virtfs_fd *vfd = c->w->vfd;
+        int ret;
+
+#ifdef LIBNFS_API_V2
+        ret = nfs_pwrite_async(vfd->fs->nfs, vfd->nfsfh, c->buf + c->done,
+                               c->len - c->done, c->offset + c->done,
+                               _writer_cb, c);
+#else
+        ret = nfs_pwrite_async(vfd->fs->nfs, vfd->nfsfh, c->offset + c->done,
+                               c->len - c->done, c->buf + c->done,
+                               _writer_cb, c);
+#endif
+        if (ret < 0) {
+                ERR("failed to queue write: %s\n", nfs_get_error(vfd->fs->nfs));
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static size_t _writer_room(struct virtfs_writer *w)
+{
+        struct virtfs_chunk *c = &w->chunks[w->cur];
+
+        return w->size - c->offset % w->size - c->len;
+}
+
+/*
+ * Breaks the stream with err unless it already is: no write is sent once
+ * it is, as a chunk may still be in flight.
+ */
+static int _writer_fail(struct virtfs_writer *w, int err)
+{
+        if (w->err == 0)
+                w->err = err;
+
+        return w->err;
+}
+
+/*
+ * Sends the chunk being gathered and waits for the next one to be free, with
+ * the lock of the mount held.
+ */
+static int _writer_flush(struct virtfs_writer *w)
+{
+        struct virtfs *fs = w->vfd->fs;
+        struct virtfs_chunk *c = &w->chunks[w->cur];
+        int ret;
+
+        c->done = 0;
+        ret = _writer_send(c);
+        if (ret < 0)
+                return _writer_fail(w, ret);
+
+        c->busy = 1;
+        w->inflight++;
+
+        /* Get the request on the wire before gathering more */
+        ret = _nfs_service(fs, 0);
+        if (ret < 0)
+                return _writer_fail(w, ret);
+
+        w->cur = (w->cur + 1) % w->depth;
+        c = &w->chunks[w->cur];
+        while (c->busy && w->err == 0) {
+                ret = _nfs_service(fs, -1);
+                if (ret < 0)
+                        return _writer_fail(w, ret);
+        }
+
+        c->offset = w->offset;
+        c->len = 0;
+
+        return w->err;
+}
+
+int virtfs_writer_new(vfd_t vfd, off_t offset, size_t chunk, int depth,
+                      virtfs_writer_t *w_out)
+{
+        struct virtfs_writer *w;
+        void *bufs;
+        int i;
+
+        if (vfd == NULL || vfd->fs == NULL || offset < 0 || chunk == 0 ||
+            depth <= 0)
+                return -EINVAL;
+
+        w = malloc(sizeof(struct virtfs_writer));
+        if (!w)
+                return -ENOMEM;
+
+        bzero(w, sizeof(struct virtfs_writer));
+        w->chunks = calloc(depth, sizeof(struct virtfs_chunk));
+        if (!w->chunks ||
+            posix_memalign(&bufs, sysconf(_SC_PAGESIZE), chunk * depth) != 0) {
+                free(w->chunks);
+                free(w);
+                return -ENOMEM;
+        }
+
+        w->vfd = vfd;
+        w->bufs = bufs;
+        w->size = chunk;
+        w->depth = depth;
+        w->offset = offset;
+        for (i = 0; i < depth; i++) {
+                w->chunks[i].w = w;
+                w->chunks[i].buf = w->bufs + i * chunk;
+        }
+        w->chunks[0].offset = offset;
+
+        *w_out = w;
+        return 0;
+}
+
+ssize_t virtfs_writer_write(virtfs_writer_t w, const void *buf, size_t count)
+{
+        struct virtfs_chunk *c;
+        size_t total = 0;
+        size_t n;
+        ssize_t ret;
+
+        pthread_mutex_lock(&w->vfd->fs->lock);
+        ret = w->err;
+        while (ret == 0 && total < count) {
+                c = &w->chunks[w->cur];
+                n = _writer_room(w);
+                if (n > count - total)
+                        n = count - total;
+
+                memcpy(c->buf + c->len, (const char *)buf + total, n);
+                c->len += n;
+                w->offset += n;
+                total += n;
+
+                if (_writer_room(w) == 0)
+                        ret = _writer_flush(w);
+        }
+        pthread_mutex_unlock(&w->vfd->fs->lock);
+
+        return ret < 0 ? ret : (ssize_t)total;
+}
+
+/*
+ * Reads once from fd into the stream, servicing the writes in flight while
+ * fd has no data. Returns the number of bytes read, 0 at the end of fd.
+ */
+ssize_t virtfs_writer_fill(virtfs_writer_t w, int fd)
+{
+        struct virtfs *fs = w->vfd->fs;
+        struct virtfs_chunk *c;
+        ssize_t n;
+        int ret;
+
+        pthread_mutex_lock(&fs->lock);
+        while (w->inflight > 0 && w->err == 0) {
+                ret = _nfs_service_fd(fs, fd, POLLIN, -1);
+                if (ret < 0) {
+                        n = _writer_fail(w, ret);
+                        goto out;
+                }
+
+                if (ret)
+                        break;
+        }
+
+        n = w->err;
+        if (n < 0)
+                goto out;
+
+        /* The chunk being gathered is ours alone, read without the lock */
+        c = &w->chunks[w->cur];
+        pthread_mutex_unlock(&fs->lock);
+        do {
+                n = read(fd, c->buf + c->len, _writer_room(w));
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0)
+                n = -errno;
+        pthread_mutex_lock(&fs->lock);
+        if (n <= 0)
+                goto out;
+
+        c->len += n;
+        w->offset += n;
+        if (_writer_room(w) == 0) {
+                ret = _writer_flush(w);
+                if (ret < 0)
+                        n = ret;
+        }
+
+out:
+        pthread_mutex_unlock(&fs->lock);
+        return n;
+}
+
+int virtfs_writer_close(virtfs_writer_t w)
+{
+        struct virtfs *fs = w->vfd->fs;
+        int ret;
+        int err;
+
+        pthread_mutex_lock(&fs->lock);
+        ret = w->err;
+        if (ret == 0 && w->chunks[w->cur].len > 0)
+                ret = _writer_flush(w);
+
+        while (w->inflight > 0) {
+                err = _nfs_service(fs, -1);
+                if (err < 0) {
+                        ret = ret ? ret : err;
+                        break;
+                }
+        }
+
+        if (ret == 0)
+                ret = w->err;
+        if (ret == 0)
+                ret = virtfs_fsync(w->vfd);
+
+        /* The callbacks of writes still in flight point into the writer */
+        err = w->inflight;
+        pthread_mutex_unlock(&fs->lock);
+        if (err > 0)
+                return ret;
+
+        free(w->bufs);
+        free(w->chunks);
+        free(w);
+
+        return ret;
+}
+
+/*
+ * Pumps between a file and a pipe, for code that needs a kernel fd. Reading
+ * files are streamed into the pipe through a window of VIRTFS_PUMP_DEPTH
+ * asynchronous READs, and the data written to the pipe of writing files
+ * goes through a write-behind stream. The pump owns the file, and closes it
+ * along with its end of the pipe once done.
+ */
+#define VIRTFS_PUMP_CHUNK (1024 * 1024)
+#define VIRTFS_PUMP_DEPTH 8
+
+struct virtfs_pump_chunk
+{
+        struct virtfs_pump *p;
+        char *buf;
+        off_t offset;
+        size_t len;
+        size_t got;
+        size_t sent;
+        int busy;
+};
+
+struct virtfs_pump
+{
+        struct virtfs_fd *vfd;
+        int fd;                         /* the end of the pipe of the pump */
+        off_t offset;                   /* next offset to read or write */
+        off_t end;
+        struct virtfs_pump_chunk chunks[VIRTFS_PUMP_DEPTH];
+        char *bufs;
+        int inflight;
+        int err;
+};
+
+static int _pump_send(struct virtfs_pump_chunk *c);
+
+static void _pump_cb(int status, struct nfs_context *nfs, void *data,
+                     void *private_data)
+{
+        struct virtfs_pump_chunk *c = private_data;
+        struct virtfs_pump *p = c->p;
+
+        if (status > 0) {
+#ifndef LIBNFS_API_V2
+                memcpy(c->buf + c->got, data, status);
+#endif
+                c->got += status;
+                if (c->got == c->len)
+                        goto done;
+
+                /* Short read, ask for the rest */
+                status = _pump_send(c);
+                if (status == 0)
+                        return;
+        }
+
+        /* Zero is the end of a file that shrank */
+        if (status < 0) {
+                ERR("read failed at %lld: %s\n",
+                    (long long)(c->offset + c->got), nfs_get_error(nfs));
+                if (p->err == 0)
+                        p->err = status;
+        }
+done:
+        c->busy = 0;
+        p->inflight--;
+}
+
+static int _pump_send(struct virtfs_pump_chunk *c)
+{
+        struct virtfs_fd *vfd = c->p->vfd;
+        int ret;
+
+#ifdef LIBNFS_API_V2
+        ret = nfs_pread_async(vfd->fs->nfs, vfd->nfsfh, c->buf + c->got,
+                              c->len - c->got, c->offset + c->got,
+                              _pump_cb, c);
+#else
+        ret = nfs_pread_async(vfd->fs->nfs, vfd->nfsfh, c->offset + c->got,
+                              c->len - c->got, _pump_cb, c);
+#endif
+        if (ret < 0) {
+                ERR("failed to queue read: %s\n", nfs_get_error(vfd->fs->nfs));
+                return -EIO;
+        }
+
+        return 0;
+}
+
+/*
+ * Feeds the pipe with the lock of the mount held, except while waiting for
+ * the replies or for room in the pipe.
+ */
+static void _pump_read(struct virtfs_pump *p)
+{
+        struct virtfs *fs = p->vfd->fs;
+        struct virtfs_pump_chunk *c;
+        unsigned head = 0;
+        unsigned tail = 0;
+        ssize_t n;
+        int ret;
+
+        pthread_mutex_lock(&fs->lock);
+        while (p->err == 0) {
+                /* Keep the window of READs full */
+                while (tail - head < VIRTFS_PUMP_DEPTH && p->offset < p->end) {
+                        c = &p->chunks[tail % VIRTFS_PUMP_DEPTH];
+                        c->offset = p->offset;
+                        c->len = p->end - p->offset < VIRTFS_PUMP_CHUNK ?
+                                 p->end - p->offset : VIRTFS_PUMP_CHUNK;
+                        c->got = 0;
+                        c->sent = 0;
+                        if (_pump_send(c) < 0) {
+                                p->err = -EIO;
+                                goto out;
+                        }
+
+                        c->busy = 1;
+                        p->inflight++;
+                        p->offset += c->len;
+                        tail++;
+                }
+
+                if (head == tail)
+                        break;
+
+                /* Hand the oldest chunk over to the pipe, in order */
+                c = &p->chunks[head % VIRTFS_PUMP_DEPTH];
+                if (!c->busy) {
+                        /* Past the end of a file that shrank */
+                        if (c->offset >= p->end) {
+                                head++;
+                                continue;
+                        }
+
+                        n = write(p->fd, c->buf + c->sent, c->got - c->sent);
+                        if (n < 0 && errno != EAGAIN) {
+                                /* EPIPE: the reader is gone */
+                                ret = errno;
+                                if (ret != EPIPE)
+                                        ERR("failed to feed the pipe: %s\n",
+                                            strerror(ret));
+                                p->err = -ret;
+                                goto out;
+                        }
+
+                        if (n > 0)
+                                c->sent += n;
+                        if (c->sent == c->got) {
+                                if (c->got < c->len)
+                                        p->end = p->offset = c->offset + c->got;
+                                head++;
+                                continue;
+                        }
+                }
+
+                ret = _nfs_service_fd(fs, c->busy ? -1 : p->fd, POLLOUT, -1);
+                if (ret < 0) {
+                        p->err = ret;
+                        goto out;
+                }
+        }
+
+out:
+        /* The READs in flight land in the buffers and use the file */
+        while (p->inflight > 0 && _nfs_service(fs, -1) == 0)
+                ;
+        pthread_mutex_unlock(&fs->lock);
+}
+
+static void _pump_write(struct virtfs_pump *p)
+{
+        virtfs_writer_t w;
+        ssize_t n;
+        int ret;
+
+        ret = virtfs_writer_new(p->vfd, p->offset, VIRTFS_PUMP_CHUNK,
+                                VIRTFS_PUMP_DEPTH, &w);
+        if (ret < 0)
+                goto err;
+
+        do {
+                n = virtfs_writer_fill(w, p->fd);
+        } while (n > 0);
+
+        ret = virtfs_writer_close(w);
+        if (n < 0)
+                ret = n;
+        if (ret == 0)
+                return;
+err:
+        ERR("failed to write the pipe to the file: %s\n", strerror(-ret));
+}
+
+static void *_pump_thread(void *arg)
+{
+        struct virtfs_pump *p = arg;
+        struct virtfs *fs = p->vfd->fs;
+        int owns_fs = p->vfd->flags & VIRTFS_FD_FLAG_OWNS_FS;
+        sigset_t set;
+
+        /* Report a closed pipe as EPIPE rather than killing the process */
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        if (p->vfd->mode == O_RDONLY)
+                _pump_read(p);
+        else
+                _pump_write(p);
+
+        close(p->fd);
+
+        /* READs the broken mount never completes keep the file and the
+         * buffers, which are leaked */
+        if (p->inflight == 0) {
+                virtfs_close(p->vfd);
+                free(p->bufs);
+                free(p);
+        }
+
+        /* A mount of the file alone is gone along with it */
+        if (!owns_fs) {
+                pthread_mutex_lock(&fs->lock);
+                if (--fs->pumps == 0)
+                        pthread_cond_broadcast(&fs->pumps_done);
+                pthread_mutex_unlock(&fs->lock);
+        }
+
+        return NULL;
+}
+
+int virtfs_fd_to_posix(vfd_t vfd)
+{
+        struct virtfs_pump *p;
+        pthread_attr_t attr;
+        struct stat st;
+        int fds[2];
+        int ret;
+        int i;
+
+        if (vfd == NULL || vfd->fs == NULL || vfd->mode == O_RDWR)
+                return -EINVAL;
+
+        p = malloc(sizeof(struct virtfs_pump));
+        if (!p)
+                return -ENOMEM;
+
+        bzero(p, sizeof(struct virtfs_pump));
+        p->vfd = vfd;
+        p->offset = virtfs_lseek(vfd, 0, SEEK_CUR);
+        if (p->offset < 0) {
+                ret = p->offset;
+                goto err;
+        }
+
+        if (vfd->mode == O_RDONLY) {
+                ret = virtfs_fstat(vfd, &st);
+                if (ret < 0)
+                        goto err;
+
+                p->end = st.st_size;
+                p->bufs = malloc(VIRTFS_PUMP_CHUNK * VIRTFS_PUMP_DEPTH);
+                if (!p->bufs) {
+                        ret = -ENOMEM;
+                        goto err;
+                }
+
+                for (i = 0; i < VIRTFS_PUMP_DEPTH; i++) {
+                        p->chunks[i].p = p;
+                        p->chunks[i].buf = p->bufs + i * VIRTFS_PUMP_CHUNK;
+                }
+        }
+
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        /* Large pipes keep the pump and its reader from ping-ponging */
+        fcntl(fds[1], F_SETPIPE_SZ, VIRTFS_PUMP_CHUNK);
+        if (vfd->mode == O_RDONLY) {
+                p->fd = fds[1];
+                fcntl(p->fd, F_SETFL, O_NONBLOCK);
+                ret = fds[0];
+        } else {
+                p->fd = fds[0];
+                ret = fds[1];
+        }
+
+        if (!(vfd->flags & VIRTFS_FD_FLAG_OWNS_FS)) {
+                pthread_mutex_lock(&vfd->fs->lock);
+                vfd->fs->pumps++;
+                pthread_mutex_unlock(&vfd->fs->lock);
+        }
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        i = pthread_create(&(pthread_t){0}, &attr, _pump_thread, p);
+        pthread_attr_destroy(&attr);
+        if (i != 0) {
+                if (!(vfd->flags & VIRTFS_FD_FLAG_OWNS_FS)) {
+                        pthread_mutex_lock(&vfd->fs->lock);
+                        vfd->fs->pumps--;
+                        pthread_mutex_unlock(&vfd->fs->lock);
+                }
+                close(fds[0]);
+                close(fds[1]);
+                ret = -i;
+                goto err;
+        }
+
+        return ret;
+
+err:
+        free(p->bufs);
+        free(p);
+        return ret;
+}
+
+vfd_t virtfs_fd_from_posix(int fd)
+{
+        struct virtfs_fd *vfd;
+        int flags;
+
+        flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+                return NULL;
+
+        vfd = malloc(sizeof(struct virtfs_fd));
+        if (!vfd) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        bzero(vfd, sizeof(struct virtfs_fd));
+        vfd->mode = flags & O_ACCMODE;
+        vfd->posix = fd;
+
+        return vfd;
+}
+
+/*
+ * Append streams. Records from any number of threads are copied into a
+ * batch, and a flusher thread writes each batch with a single positional
+ * write at the end of the file it tracks, while the next batch fills up.
+ * A batch is written once it reaches the flush size, once the oldest of
+ * its records is flush_ms old, or as soon as someone needs it: a producer
+ * without room, a sync or the close. Syncs of concurrent producers are
+ * served by a single COMMIT.
+ */
+struct virtfs_append
+{
+        struct virtfs_fd *vfd;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;            /* wakes the flusher */
+        pthread_cond_t done;            /* wakes the producers */
+        char *buf;                      /* batch being filled */
+        size_t len;
+        size_t size;
+        char *spare;                    /* batch being written */
+        size_t spare_size;
+        size_t flush_size;
+        int flush_ms;
+        struct timespec first;          /* when the batch got its first record */
+        off_t offset;                   /* end of the file */
+        uint64_t appended;              /* bytes accepted, written and synced */
+        uint64_t written;
+        uint64_t synced;
+        uint64_t sync_wanted;
+        int waiting;                    /* producers waiting for room */
+        int closing;
+        int err;
+};
+
+static void *_append_flusher(void *arg)
+{
+        struct virtfs_append *a = arg;
+        struct timespec deadline;
+        uint64_t target;
+        size_t done, len;
+        ssize_t n = 0;
+        char *buf;
+        int ret;
+
+        pthread_mutex_lock(&a->lock);
+        while (a->err == 0) {
+                if (a->len == 0) {
+                        if (a->sync_wanted > a->synced) {
+                                target = a->written;
+                                pthread_mutex_unlock(&a->lock);
+                                ret = virtfs_fsync(a->vfd);
+                                pthread_mutex_lock(&a->lock);
+                                if (ret < 0) {
+                                        a->err = ret;
+                                        break;
+                                }
+
+                                a->synced = target;
+                                pthread_cond_broadcast(&a->done);
+                                continue;
+                        }
+
+                        if (a->closing)
+                                break;
+
+                        pthread_cond_wait(&a->cond, &a->lock);
+                        continue;
+                }
+
+                if (a->len < a->flush_size && !a->waiting && !a->closing &&
+                    a->sync_wanted <= a->written) {
+                        deadline = a->first;
+                        deadline.tv_sec += a->flush_ms / 1000;
+                        deadline.tv_nsec += a->flush_ms % 1000 * 1000000L;
+                        if (deadline.tv_nsec >= 1000000000L) {
+                                deadline.tv_sec++;
+                                deadline.tv_nsec -= 1000000000L;
+                        }
+
+                        if (pthread_cond_timedwait(&a->cond, &a->lock,
+                                                   &deadline) != ETIMEDOUT)
+                                continue;
+                }
+
+                /* Take the batch, the producers fill the other buffer */
+                buf = a->buf;
+                a->buf = a->spare;
+                a->spare = buf;
+                len = a->size;
+                a->size = a->spare_size;
+                a->spare_size = len;
+                len = a->len;
+                a->len = 0;
+                pthread_cond_broadcast(&a->done);
+                pthread_mutex_unlock(&a->lock);
+
+                for (done = 0; done < len; done += n) {
+                        n = virtfs_pwrite(a->vfd, buf + done, len - done,
+                                          a->offset + done);
+                        if (n <= 0)
+                                break;
+                }
+
+                pthread_mutex_lock(&a->lock);
+                if (done < len) {
+                        ERR("append failed at %lld\n",
+                            (long long)(a->offset + done));
+                        a->err = n < 0 ? n : -EIO;
+                        break;
+                }
+
+                a->offset += len;
+                a->written += len;
+        }
+
+        pthread_cond_broadcast(&a->done);
+        pthread_mutex_unlock(&a->lock);
+
+        return NULL;
+}
+
+int virtfs_append_open(vfd_t vfd, size_t flush_size, int flush_ms,
+                       virtfs_append_t *a_out)
+{
+        struct virtfs_append *a;
+        pthread_condattr_t attr;
+        struct stat st;
+        int ret;
+
+        if (vfd == NULL || flush_ms < 0)
+                return -EINVAL;
+
+        ret = virtfs_fstat(vfd, &st);
+        if (ret < 0)
+                return ret;
+
+        if (flush_size == 0)
+                flush_size = vfd->fs ? nfs_get_writemax(vfd->fs->nfs) :
+                                       1024 * 1024;
+
+        a = malloc(sizeof(struct virtfs_append));
+        if (!a)
+                return -ENOMEM;
+
+        bzero(a, sizeof(struct virtfs_append));
+        a->vfd = vfd;
+        a->flush_size = flush_size;
+        a->flush_ms = flush_ms;
+        a->offset = st.st_size;
+        a->size = a->spare_size = flush_size;
+        a->buf = malloc(flush_size);
+        a->spare = malloc(flush_size);
+        if (!a->buf || !a->spare) {
+                ret = -ENOMEM;
+                goto err;
+        }
+
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&a->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_cond_init(&a->done, NULL);
+
+        ret = -pthread_create(&a->thread, NULL, _append_flusher, a);
+        if (ret < 0) {
+                pthread_cond_destroy(&a->done);
+                pthread_cond_destroy(&a->cond);
+                pthread_mutex_destroy(&a->lock);
+                goto err;
+        }
+
+        *a_out = a;
+        return 0;
+
+err:
+        free(a->spare);
+        free(a->buf);
+        free(a);
+        return ret;
+}
+
+int virtfs_append(virtfs_append_t a, const void *buf, size_t count)
+{
+        char *grown;
+        int ret;
+
+        pthread_mutex_lock(&a->lock);
+        while (a->err == 0 && a->len > 0 && a->len + count > a->size) {
+                a->waiting++;
+                pthread_cond_signal(&a->cond);
+                pthread_cond_wait(&a->done, &a->lock);
+                a->waiting--;
+        }
+
+        ret = a->err;
+        if (ret < 0)
+                goto out;
+
+        /* A record larger than a batch is written on its own */
+        if (count > a->size) {
+                grown = realloc(a->buf, count);
+                if (!grown) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+
+                a->buf = grown;
+                a->size = count;
+        }
+
+        if (a->len == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &a->first);
+                pthread_cond_signal(&a->cond);
+        }
+
+        memcpy(a->buf + a->len, buf, count);
+        a->len += count;
+        a->appended += count;
+        if (a->len >= a->flush_size)
+                pthread_cond_signal(&a->cond);
+
+out:
+        pthread_mutex_unlock(&a->lock);
+        return ret;
+}
+
+int virtfs_append_sync(virtfs_append_t a)
+{
+        uint64_t target;
+        int ret;
+
+        pthread_mutex_lock(&a->lock);
+        target = a->appended;
+        if (a->sync_wanted < target)
+                a->sync_wanted = target;
+
+        pthread_cond_signal(&a->cond);
+        while (a->err == 0 && a->synced < target)
+                pthread_cond_wait(&a->done, &a->lock);
+
+        ret = a->err;
+        pthread_mutex_unlock(&a->lock);
+
+        return ret;
+}
+
+int virtfs_append_close(virtfs_append_t a)
+{
+        int ret;
+        int err;
+
+        pthread_mutex_lock(&a->lock);
+        a->sync_wanted = a->appended;
+        a->closing = 1;
+        pthread_cond_signal(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+
+        pthread_join(a->thread, NULL);
+        ret = a->err;
+        err = virtfs_close(a->vfd);
+        if (ret == 0)
+                ret = err;
+
+        pthread_cond_destroy(&a->done);
+        pthread_cond_destroy(&a->cond);
+        pthread_mutex_destroy(&a->lock);
+        free(a->spare);
+        free(a->buf);
+        free(a);
+
+        return ret;
+}
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+/*
+ * Lazy mappings. The memory is anonymous and registered with userfaultfd,
+ * and a handler thread fills each faulting page from READs of the file.
+ * A random fault fetches the VIRTFS_MAP_AROUND bytes around it, and faults
+ * that follow the previous fetch double the window up to
+ * VIRTFS_MAP_READAHEAD bytes. Pages already filled are never fetched again.
+ */
+#define VIRTFS_MAP_AROUND (64 * 1024)
+#define VIRTFS_MAP_READAHEAD (4 * 1024 * 1024)
+
+struct virtfs_map
+{
+        struct virtfs_map *next;
+        struct virtfs_fd *vfd;
+        char *addr;
+        size_t length;
+        off_t offset;
+        size_t page;
+        int uffd;
+        int stopfd;
+        pthread_t thread;
+        unsigned char *present;         /* bitmap of the pages filled */
+        char *bounce;
+        size_t next_page;               /* page following the last fetch */
+        size_t window;                  /* pages of the next sequential fetch */
+};
+
+static struct virtfs_map *maps;
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define _MAP_PRESENT(m, i) ((m)->present[(i) / 8] & (1 << (i) % 8))
+
+static int _map_copy(struct virtfs_map *m, size_t first, size_t count)
+{
+        struct uffdio_copy copy;
+
+        copy.dst = (uintptr_t)(m->addr + first * m->page);
+        copy.src = (uintptr_t)m->bounce;
+        copy.len = count * m->page;
+        copy.mode = 0;
+
+        return ioctl(m->uffd, UFFDIO_COPY, &copy);
+}
+
+static void _map_fault(struct virtfs_map *m, size_t page)
+{
+        size_t pages = m->length / m->page;
+        size_t around = VIRTFS_MAP_AROUND / m->page;
+        size_t first, end, done, i;
+        struct uffdio_range range;
+        ssize_t n = 0;
+
+        if (page == m->next_page) {
+                first = page;
+                if (m->window * 2 <= VIRTFS_MAP_READAHEAD / m->page)
+                        m->window *= 2;
+        } else {
+                first = page - page % around;
+                m->window = around;
+        }
+
+        end = first + m->window;
+        if (end > pages)
+                end = pages;
+
+        /* The faulting page and the missing pages next to it */
+        for (i = page; i > first && !_MAP_PRESENT(m, i - 1); i--)
+                ;
+        first = i;
+        for (i = page + 1; i < end && !_MAP_PRESENT(m, i); i++)
+                ;
+        end = i;
+
+        /* Under the lock of the mount, which a faulting thread in a call on
+         * the mount holds for ever */
+        for (done = 0; done < (end - first) * m->page; done += n) {
+                n = virtfs_pread(m->vfd, m->bounce + done,
+                                 (end - first) * m->page - done,
+                                 m->offset + first * m->page + done);
+                if (n <= 0)
+                        break;
+        }
+
+        range.start = (uintptr_t)(m->addr + page * m->page);
+        range.len = m->page;
+        if (n < 0) {
+                /* The faulting thread gets SIGSEGV instead of bad data */
+                ERR("failed to read page %zu of mapping %p\n", page, m->addr);
+                mprotect(m->addr + page * m->page, m->page, PROT_NONE);
+                ioctl(m->uffd, UFFDIO_WAKE, &range);
+                return;
+        }
+
+        /* Past the end of the file reads as zeroes */
+        memset(m->bounce + done, 0, (end - first) * m->page - done);
+
+        if (_map_copy(m, first, end - first) < 0) {
+                /* Raced with another fault, fill the faulting page alone */
+                memmove(m->bounce, m->bounce + (page - first) * m->page,
+                        m->page);
+                first = page;
+                end = page + 1;
+                if (_map_copy(m, first, 1) < 0)
+                        ioctl(m->uffd, UFFDIO_WAKE, &range);
+        }
+
+        for (i = first; i < end; i++)
+                m->present[i / 8] |= 1 << i % 8;
+        m->next_page = end;
+}
+
+static void *_map_handler(void *arg)
+{
+        struct virtfs_map *m = arg;
+        struct uffd_msg msg;
+        struct pollfd pfd[2];
+
+        pfd[0].fd = m->uffd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = m->stopfd;
+        pfd[1].events = POLLIN;
+
+        for (;;) {
+                if (poll(pfd, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                if (pfd[1].revents)
+                        break;
+
+                if (read(m->uffd, &msg, sizeof(msg)) != sizeof(msg))
+                        continue;
+
+                if (msg.event == UFFD_EVENT_PAGEFAULT)
+                        _map_fault(m, (msg.arg.pagefault.address -
+                                       (uintptr_t)m->addr) / m->page);
+        }
+
+        return NULL;
+}
+
+static int _map_userfaultfd(void)
+{
+        int fd = -1;
+
+#ifdef UFFD_USER_MODE_ONLY
+        /* Allowed to unprivileged users even with
+         * vm.unprivileged_userfaultfd = 0 */
+        fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK |
+                     UFFD_USER_MODE_ONLY);
+#endif
+        if (fd < 0)
+                fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+        return fd;
+}
+
+void *virtfs_mmap(vfd_t vfd, off_t offset, size_t length)
+{
+        struct virtfs_map *m;
+        struct uffdio_api api;
+        struct uffdio_register reg;
+        size_t page = sysconf(_SC_PAGESIZE);
+        int ret;
+
+        if (vfd == NULL || offset < 0 || offset % page != 0 || length == 0) {
+                errno = EINVAL;
+                return MAP_FAILED;
+        }
+
+        m = malloc(sizeof(struct virtfs_map));
+        if (!m) {
+                errno = ENOMEM;
+                return MAP_FAILED;
+        }
+
+        bzero(m, sizeof(struct virtfs_map));
+        m->vfd = vfd;
+        m->offset = offset;
+        m->page = page;
+        m->length = (length + page - 1) / page * page;
+        m->window = VIRTFS_MAP_AROUND / page;
+        m->next_page = -1;
+        m->uffd = -1;
+        m->stopfd = -1;
+
+        m->addr = mmap(NULL, m->length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS |
+                       MAP_NORESERVE, -1, 0);
+        if (m->addr == MAP_FAILED) {
+                ret = -errno;
+                goto err;
+        }
+
+        m->present = calloc(m->length / page / 8 + 1, 1);
+        m->bounce = malloc(VIRTFS_MAP_READAHEAD);
+        if (!m->present || !m->bounce) {
+                ret = -ENOMEM;
+                goto err;
+        }
+
+        m->uffd = _map_userfaultfd();
+        if (m->uffd < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        bzero(&api, sizeof(api));
+        api.api = UFFD_API;
+        reg.range.start = (uintptr_t)m->addr;
+        reg.range.len = m->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(m->uffd, UFFDIO_API, &api) < 0 ||
+            ioctl(m->uffd, UFFDIO_REGISTER, &reg) < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        m->stopfd = eventfd(0, EFD_CLOEXEC);
+        if (m->stopfd < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        ret = -pthread_create(&m->thread, NULL, _map_handler, m);
+        if (ret < 0)
+                goto err;
+
+        pthread_mutex_lock(&maps_lock);
+        m->next = maps;
+        maps = m;
+        pthread_mutex_unlock(&maps_lock);
+
+        return m->addr;
+
+err:
+        if (m->stopfd >= 0)
+                close(m->stopfd);
+        if (m->uffd >= 0)
+                close(m->uffd);
+        if (m->addr != MAP_FAILED && m->addr != NULL)
+                munmap(m->addr, m->length);
+        free(m->bounce);
+        free(m->present);
+        free(m);
+        errno = -ret;
+        return MAP_FAILED;
+}
+
+int virtfs_munmap(void *addr, size_t length)
+{
+        struct virtfs_map **p;
+        struct virtfs_map *m;
+        uint64_t one = 1;
+
+        pthread_mutex_lock(&maps_lock);
+        for (p = &maps; *p != NULL && (*p)->addr != addr; p = &(*p)->next)
+                ;
+        m = *p;
+        if (m)
+                *p = m->next;
+        pthread_mutex_unlock(&maps_lock);
+
+        if (!m)
+                return -EINVAL;
+
+        if (write(m->stopfd, &one, sizeof(one)) != sizeof(one))
+                ERR("failed to stop the handler of mapping %p\n", addr);
+        pthread_join(m->thread, NULL);
+
+        munmap(m->addr, m->length);
+        close(m->stopfd);
+        close(m->uffd);
+        free(m->bounce);
+        free(m->present);
+        free(m);
+
+        return 0;
+}
+#else
+void *virtfs_mmap(vfd_t vfd, off_t offset, size_t length)
+{
+        errno = ENOSYS;
+        return MAP_FAILED;
+}
+
+int virtfs_munmap(void *addr, size_t length)
+{
+        return -ENOSYS;
+}
+#endif /* HAVE_LINUX_USERFAULTFD_H */
+
+void virtfs_dump_info(virtfs_t fs, int verbose)
+{
+        struct virtfs *fsp;
+        int ret = -EINVAL;
+
+        fsp = fs;
+        DEBUG("fs: %p, ", fsp);
+        if (fs == NULL)
+                goto err;
+
+        DEBUG("flags: %x, server: %s, path: %s, file: %s\n", fsp->flags,
+              fsp->url->server, fsp->url->path, fsp->url->file);
+
+err:
+        return;
+}
+
+struct virtfs_dir
+{
+        struct virtfs *fs;
+        struct nfs_context *nfs;
+        struct nfsdir *nfsdir;
+};
+
+int virtfs_opendir(virtfs_t fs_in, const char *path, virtfs_dir_t *dir_out)
+{
+        struct virtfs *fsp;
+        struct virtfs_dir *dir;
+        int ret = -EINVAL;
+
+        fsp = fs_in;
+        if (fsp == NULL)
+                goto err;
+
+        dir = malloc(sizeof(struct virtfs_dir));
+        if (!dir)
+                return alloc_failed();
+        dir->fs = fsp;
+        dir->nfs = fsp->nfs;
+        ret = TIMED(fsp, nfs_opendir(dir->nfs, path, &(dir->nfsdir)));
+        if (ret)
+                goto err2;
+        *dir_out = dir;
+
+        return 0;
+err2:
+        free(dir);
+err:
+        return ret;
+}
+
+int virtfs_closedir(virtfs_dir_t dir_in)
+{
+        int ret = -EINVAL;
+
+        if (dir_in->nfs == NULL || dir_in->nfsdir == NULL)
+                goto out;
+        pthread_mutex_lock(&dir_in->fs->lock);
+        nfs_closedir(dir_in->nfs, dir_in->nfsdir);
+        pthread_mutex_unlock(&dir_in->fs->lock);
+        ret = 0;
+out:
+        free(dir_in);
+        return ret;
+}
+
+struct virtfs_dirent
+{
+        struct dirent ent;
+        struct nfsdirent *nfsent;
+};
+
+#define __COPY_ATTR2(x, y) buf->x = ndirp->y
+struct dirent *virtfs_readdirplus(virtfs_dir_t dir, struct stat *buf)
+{
+        struct virtfs_dirent *dirp;
+        struct nfsdirent *ndirp;
+
+        ndirp = nfs_readdir(dir->nfs, dir->nfsdir);
+        if (!ndirp)
+                return NULL;
+
+        dirp = malloc(sizeof(struct virtfs_dirent));
+        if (!dirp) {
+                free(ndirp);
+                alloc_failed();
+                return NULL;
+        }
+
+        bzero(dirp, sizeof(struct virtfs_dirent));
+        dirp->nfsent = ndirp;
+        dirp->ent.d_ino = ndirp->inode;
+        strncpy(dirp->ent.d_name, ndirp->name, 255);
+
+        __COPY_ATTR2(st_dev, dev);
+        __COPY_ATTR2(st_ino, inode);
+        __COPY_ATTR2(st_mode, mode);
+        __COPY_ATTR2(st_nlink, nlink);
+        __COPY_ATTR2(st_uid, uid);
+        __COPY_ATTR2(st_gid, gid);
+        __COPY_ATTR2(st_rdev, rdev);
+        __COPY_ATTR2(st_size, size);
+        __COPY_ATTR2(st_blksize, blksize);
+        __COPY_ATTR2(st_blocks, blocks);
+        __COPY_ATTR2(st_atime, atime.tv_sec);
+        __COPY_ATTR2(st_mtime, mtime.tv_sec);
+        __COPY_ATTR2(st_ctime, ctime.tv_sec);
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+        buf->st_atim.tv_nsec = ndirp->atime.tv_usec * 1000 + ndirp->atime_nsec;
+        buf->st_mtim.tv_nsec = ndirp->mtime.tv_usec * 1000 + ndirp->mtime_nsec;
+        buf->st_ctim.tv_nsec = ndirp->ctime.tv_usec * 1000 + ndirp->ctime_nsec;
+#else
+        /* Apple? */
+#endif
+        dirp->ent.d_type = IFTODT(buf->st_mode);
+
+        return &(dirp->ent);
+}
+
+char *
+virtfs_append_path (const char *base_path, const char *hanging_path)
+{
+        size_t new_length;
+        size_t base_path_length = strlen (base_path);
+        size_t hanging_path_length = strlen (hanging_path);
+        const char *fmt;
+        char *new_path;
+
+        if (base_path_length > 0 && base_path[base_path_length - 1] == '/') {
+                new_length = base_path_length + hanging_path_length + 1;
+                fmt = "%s%s";
+        } else {
+                new_length = base_path_length + hanging_path_length + 2;
+                fmt = "%s/%s";
+        }
+
+        new_path = malloc (new_length);
+        if (new_path == NULL) {
+                goto out;
+        }
+
+        snprintf (new_path, new_length, fmt, base_path, hanging_path);
+
+out:
+        return new_path;
+}
+
+char *virtfs_url_get_path(virtfs_t fs)
+{
+        struct nfs_url *nfs_url = fs->url;
+
+        if (!nfs_url || !nfs_url->path)
+                return NULL;
+        if (!nfs_url->file)
+                return strdup(nfs_url->path);
+
+        return virtfs_append_path(nfs_url->path, nfs_url->file);
+}
+
+char *virtfs_url_get_file(virtfs_t fs)
+{
+        struct nfs_url *nfs_url = fs->url;
+
+        if (!nfs_url || !nfs_url->file)
+                return NULL;
+
+        return strdup(nfs_url->file);
 }
 
 int virtfs_set_log_level(virtfs_t fs, enum virtfs_log_level level)
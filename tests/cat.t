@@ -121,3 +121,57 @@ teardown() {
         [ "$status" -eq 1 ]
         [ "$output" == "gfcat: glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/no_such_file: No such file or directory" ]
 }
+
+@test "cat several files in order" {
+        echo "first" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR/b"
+        echo "second" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR/a"
+
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_CAT_DIR/b" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_CAT_DIR/a"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(printf "first\nsecond")" ]
+}
+
+@test "cat files matching a pattern" {
+        for i in $(seq -w 1 50); do
+                echo "part $i" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR/part-$i"
+        done
+        echo "other" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR/other"
+
+        result=$($CMD -j 4 "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_CAT_DIR/part-*" | md5sum | awk '{print $1}')
+        expected_result=$(cat "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR"/part-* | md5sum | awk '{print $1}')
+
+        [ "$result" == "$expected_result" ]
+}
+
+@test "cat continues after a missing file" {
+        echo "data" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_CAT_DIR/file"
+
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_CAT_DIR/missing" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_CAT_DIR/file"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "missing: No such file or directory" ]]
+        [[ "$output" =~ "data" ]]
+}
+
+@test "cat a range of a file" {
+        result=$($CMD --offset=1000 --length=100K "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_MEDIUM" | md5sum | awk '{print $1}')
+        expected_result=$(tail -c +1001 "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_MEDIUM" | head -c 102400 | md5sum | awk '{print $1}')
+
+        [ "$result" == "$expected_result" ]
+}
+
+@test "cat file with several streams" {
+        result=$($CMD --streams=8 "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_MEDIUM" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_MEDIUM_HASH" ]
+}
+
+@test "cat with invalid offset" {
+        run $CMD --offset=abc "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_MEDIUM"
+
+        [ "$status" -eq 1 ]
+        [ "${lines[0]}" == "gfcat: invalid offset: \"abc\"" ]
+}
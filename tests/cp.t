@@ -10,6 +10,7 @@ setup() {
 
 teardown() {
         rm -rf "$TEMP_FILE"
+        rm -f "$TEMP_FILE.gfcp-resume"
         rm -rf "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test"
 }
 
@@ -161,3 +162,193 @@ teardown() {
         [ "$status" -eq 0 ]
         [ "$result" == "$TEST_FILE_LARGE_HASH" ]
 }
+
+@test "invalid sparse flag" {
+        run $CMD "--sparse=sometimes" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfcp: invalid argument \"sometimes\" for --sparse" ]]
+}
+
+@test "cp sparse local file to remote destination" {
+        truncate -s 64M "$TEMP_FILE"
+        echo "tail" >> "$TEMP_FILE"
+        source_hash=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        run $CMD "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        result=$(md5sum "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test" | awk '{print $1}')
+        allocated=$(du -k "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$source_hash" ]
+        [ "$allocated" -lt 1024 ]
+}
+
+@test "cp preallocate reserves the space of sparse files" {
+        truncate -s 8M "$TEMP_FILE"
+        echo "tail" >> "$TEMP_FILE"
+        source_hash=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        run $CMD "--preallocate" "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        result=$(md5sum "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test" | awk '{print $1}')
+        allocated=$(du -k "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$source_hash" ]
+        [ "$allocated" -ge 8192 ]
+}
+
+@test "invalid verify flag" {
+        run $CMD "--verify=md5" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfcp: invalid argument \"md5\" for --verify" ]]
+}
+
+@test "cp large remote file to local destination with verify" {
+        run $CMD "--verify" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_LARGE" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "cp resume completes a partial local destination" {
+        head -c 1000 "$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_MEDIUM" > "$TEMP_FILE"
+
+        run $CMD "--resume" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_MEDIUM" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_MEDIUM_HASH" ]
+        [ ! -e "$TEMP_FILE.gfcp-resume" ]
+}
+
+@test "cp resume skips the chunks recorded in the manifest" {
+        source="$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_LARGE"
+        head -c 8388608 "$source" > "$TEMP_FILE"
+        sum=$(python3 -c '
+import sys
+table = []
+for i in range(256):
+    crc = i
+    for _ in range(8):
+        crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+    table.append(crc)
+crc = 0xffffffff
+for b in open(sys.argv[1], "rb").read():
+    crc = table[(crc ^ b) & 0xff] ^ (crc >> 8)
+print("%016x" % (crc ^ 0xffffffff))' "$TEMP_FILE")
+        printf "gfcp-resume 1\nsize %d\nmtime %d\nchunk 8388608\nchecksum crc32c\n0 %s\n" \
+                "$(stat -c %s "$source")" "$(stat -c %Y "$source")" "$sum" > "$TEMP_FILE.gfcp-resume"
+
+        run $CMD "--resume" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_LARGE" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "1 of" ]]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+        [ ! -e "$TEMP_FILE.gfcp-resume" ]
+}
+
+@test "cp delta local file over an older remote destination" {
+        cp "$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_MEDIUM" "$TEMP_FILE"
+        run $CMD "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        [ "$status" -eq 0 ]
+
+        printf "changed" | dd of="$TEMP_FILE" bs=1 seek=4096 conv=notrunc
+        source_hash=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        run $CMD "--delta" "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        result=$(md5sum "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$source_hash" ]
+}
+
+@test "cp delta from a pipe over a longer destination" {
+        cp "$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_MEDIUM" "$TEMP_FILE"
+        run $CMD "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        [ "$status" -eq 0 ]
+
+        run bash -c "printf short | $CMD --delta /dev/stdin glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+
+        [ "$status" -eq 0 ]
+        [ "$(cat "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test")" == "short" ]
+}
+
+@test "cp update skips a current local destination" {
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+        [ "$status" -eq 0 ]
+
+        # Same size and time: the edit must survive an update.
+        printf "X" | dd of="$TEMP_FILE" bs=1 seek=0 conv=notrunc
+        touch -r "$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+        edited_hash=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        run $CMD "--update" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$edited_hash" ]
+}
+
+@test "cp update with checksum replaces a modified destination" {
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+        [ "$status" -eq 0 ]
+
+        printf "X" | dd of="$TEMP_FILE" bs=1 seek=0 conv=notrunc
+        touch -r "$GLUSTER_BRICK_DIR$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+
+        run $CMD "--update" "--checksum" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_SMALL_HASH" ]
+}
+
+@test "checksum without update" {
+        run $CMD "--checksum" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_FILE_SMALL" "$TEMP_FILE"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfcp: --checksum requires --update" ]]
+}
+
+@test "cp directory without recursive flag" {
+        rm -f "$TEMP_FILE"
+        mkdir -p "$TEMP_FILE/dir"
+
+        run $CMD "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfcp: -r not specified; omitting directory '$TEMP_FILE'" ]]
+}
+
+@test "cp recursive local tree to remote directory" {
+        rm -f "$TEMP_FILE"
+        mkdir -p "$TEMP_FILE/a/b"
+        for i in $(seq 1 50); do
+                echo "$i" > "$TEMP_FILE/a/file$i"
+        done
+        echo "nested" > "$TEMP_FILE/a/b/nested"
+        ln -s "a/file1" "$TEMP_FILE/link"
+
+        run $CMD "-r" "-j" "8" "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+
+        [ "$status" -eq 0 ]
+        diff -r --no-dereference "$TEMP_FILE" "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test"
+}
+
+@test "cp recursive preserves hard links" {
+        rm -f "$TEMP_FILE"
+        mkdir -p "$TEMP_FILE/a" "$TEMP_FILE/b"
+        echo "shared" > "$TEMP_FILE/a/file"
+        ln "$TEMP_FILE/a/file" "$TEMP_FILE/b/link"
+
+        run $CMD "-r" "$TEMP_FILE" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfcp_test"
+        first=$(stat -c %i "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test/a/file")
+        second=$(stat -c %i "$GLUSTER_BRICK_DIR$ROOT_DIR/gfcp_test/b/link")
+
+        [ "$status" -eq 0 ]
+        [ "$first" == "$second" ]
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/env bats
+
+CMD="$BUILD_DIR/bin/virtfs-fuse"
+URL="nfs://$HOST$NFS_EXPORT"
+
+setup() {
+        if [ ! -c /dev/fuse ] || [ ! -x "$CMD" ]; then
+                skip "no /dev/fuse or virtfs-fuse"
+        fi
+
+        MOUNT_DIR=$(mktemp -d)
+        # Returns once mounted, serving from the background
+        $CMD "$URL" "$MOUNT_DIR"
+        mountpoint -q "$MOUNT_DIR"
+        FUSE_DIR="$MOUNT_DIR$ROOT_DIR"
+}
+
+teardown() {
+        if [ -n "$MOUNT_DIR" ]; then
+                fusermount3 -u "$MOUNT_DIR"
+                rmdir "$MOUNT_DIR"
+        fi
+        rm -f "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test"
+        rm -f "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_renamed"
+        rm -rf "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir"
+}
+
+@test "read a large file through the mount" {
+        result=$(md5sum "$FUSE_DIR/$TEST_FILE_LARGE" | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "write a large file through the mount" {
+        run cp "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE" "$FUSE_DIR/fuse_test"
+        result=$(md5sum "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "stat a file through the mount" {
+        run stat -c "%s %F" "$FUSE_DIR/$TEST_FILE_LARGE"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(stat -c "%s %F" "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE")" ]
+}
+
+@test "list a directory through the mount" {
+        mkdir "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir"
+        touch "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir/"{a,b,c}
+        mkdir "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir/d"
+
+        run ls -aF "$FUSE_DIR/fuse_test_dir"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(ls -aF "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir")" ]
+}
+
+@test "rename a file through the mount" {
+        echo "hello" > "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test"
+
+        run mv "$FUSE_DIR/fuse_test" "$FUSE_DIR/fuse_test_renamed"
+
+        [ "$status" -eq 0 ]
+        [ ! -e "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test" ]
+        [ "$(cat "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_renamed")" == "hello" ]
+}
+
+@test "unlink a file through the mount" {
+        echo "hello" > "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test"
+
+        run rm "$FUSE_DIR/fuse_test"
+
+        [ "$status" -eq 0 ]
+        [ ! -e "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test" ]
+}
+
+@test "make and remove a directory through the mount" {
+        run mkdir "$FUSE_DIR/fuse_test_dir"
+        status_mkdir=$status
+        [ -d "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir" ]
+
+        run rmdir "$FUSE_DIR/fuse_test_dir"
+
+        [ "$status_mkdir" -eq 0 ]
+        [ "$status" -eq 0 ]
+        [ ! -e "$NFS_MOUNT_DIR$ROOT_DIR/fuse_test_dir" ]
+}
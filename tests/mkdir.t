@@ -120,3 +120,22 @@ teardown() {
         [ "$status" -eq 1 ]
         [ "$output" == "gfmkdir: cannot create directory \`glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_DIR': File exists" ]
 }
+
+@test "mkdir directories of a manifest" {
+        printf 'a/b/c\na/d\n/e//f/\n\na/b\n' > "$BATS_TMPDIR/gfmkdir_manifest"
+
+        run $CMD "-m" "$BATS_TMPDIR/gfmkdir_manifest" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/test_dir"
+        rm -f "$BATS_TMPDIR/gfmkdir_manifest"
+
+        [ "$status" -eq 0 ]
+        [ -d "$GLUSTER_MOUNT_DIR$ROOT_DIR/test_dir/a/b/c" ]
+        [ -d "$GLUSTER_MOUNT_DIR$ROOT_DIR/test_dir/a/d" ]
+        [ -d "$GLUSTER_MOUNT_DIR$ROOT_DIR/test_dir/e/f" ]
+}
+
+@test "mkdir directories of a manifest from standard input" {
+        run bash -c "printf 'x/y\n' | $CMD -m - glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/test_dir"
+
+        [ "$status" -eq 0 ]
+        [ -d "$GLUSTER_MOUNT_DIR$ROOT_DIR/test_dir/x/y" ]
+}
@@ -0,0 +1,76 @@
+#!/usr/bin/env bats
+
+CMD="$CMD_PREFIX $BUILD_DIR/bin/gfmv"
+USAGE="Usage: gfmv [OPTION]... SOURCE DEST"
+USAGE_ERROR="gfmv: missing operand"
+
+setup() {
+        TEMP_DIR=$(mktemp -d)
+}
+
+teardown() {
+        rm -rf "$TEMP_DIR"
+        rm -rf "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test"
+}
+
+@test "no arguments" {
+        run $CMD
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "$USAGE_ERROR" ]]
+}
+
+@test "long help flag" {
+        run $CMD "--help"
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "$USAGE" ]]
+}
+
+@test "invalid jobs flag" {
+        run $CMD "-j" "0" "$TEMP_DIR/a" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfmv: invalid number of jobs: \"0\"" ]]
+}
+
+@test "several sources to a file" {
+        echo "one" > "$TEMP_DIR/one"
+        echo "two" > "$TEMP_DIR/two"
+
+        run $CMD "$TEMP_DIR/one" "$TEMP_DIR/two" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test"
+
+        [ "$status" -eq 1 ]
+        [ -f "$TEMP_DIR/one" ]
+        [ -f "$TEMP_DIR/two" ]
+}
+
+@test "move local tree to remote" {
+        mkdir -p "$TEMP_DIR/src/a/b" "$TEMP_DIR/ref"
+        echo "one" > "$TEMP_DIR/src/a/one"
+        echo "two" > "$TEMP_DIR/src/a/b/two"
+        ln -s one "$TEMP_DIR/src/a/link"
+        cp -a "$TEMP_DIR/src/a" "$TEMP_DIR/ref/"
+        mkdir -p "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test"
+
+        run $CMD "$TEMP_DIR/src/a" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test"
+
+        [ "$status" -eq 0 ]
+        [ ! -e "$TEMP_DIR/src/a" ]
+        diff -r --no-dereference "$TEMP_DIR/ref/a" "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/a"
+}
+
+@test "rename several remote files into a directory" {
+        mkdir -p "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/dir"
+        echo "one" > "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/one"
+        echo "two" > "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/two"
+
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test/one" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test/two" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfmv_test/dir"
+
+        [ "$status" -eq 0 ]
+        [ ! -e "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/one" ]
+        [ "$(cat "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/dir/one")" == "one" ]
+        [ "$(cat "$GLUSTER_BRICK_DIR$ROOT_DIR/gfmv_test/dir/two")" == "two" ]
+}
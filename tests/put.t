@@ -1,11 +1,14 @@
 #!/usr/bin/env bats
 
-CMD="$CMD_PREFIX $BUILD_DIR/bin/gfput"
-USAGE="Usage: gfput [OPTION]... URL"
-USAGE_ERROR=$"gfput: missing operand"
+CMD="$CMD_PREFIX $BUILD_DIR/bin/virtfs-put"
+USAGE="Usage: virtfs-put [OPTION]... URL"
+USAGE_ERROR=$"virtfs-put: missing operand"
+
+URL="nfs://$HOST$NFS_EXPORT$ROOT_DIR"
 
 teardown() {
-        rm -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gfput_test"
+        rm -f "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test"
+        rm -rf "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_DIR/virtfs_put_test"
 }
 
 @test "no arguments" {
@@ -22,107 +25,132 @@ teardown() {
         [[ "$output" =~ "$USAGE" ]]
 }
 
-@test "invalid port flag" {
-        run $CMD "-p" "test"
+@test "invalid jobs flag" {
+        run $CMD "-j" "test" "$URL/virtfs_put_test"
 
         [ "$status" -eq 1 ]
-        [ "$output" == "gfput: invalid port number: \"test\"" ]
+        [[ "$output" =~ "virtfs-put: invalid number of jobs: \"test\"" ]]
 }
 
-@test "uri only" {
-        run $CMD "glfs://"
+@test "zero jobs" {
+        run $CMD "--jobs=0" "$URL/virtfs_put_test"
 
         [ "$status" -eq 1 ]
-        [[ "$output" =~ "gfput: glfs://: Invalid argument" ]]
+        [[ "$output" =~ "virtfs-put: invalid number of jobs: \"0\"" ]]
 }
 
-@test "uri with host" {
-        run $CMD "glfs://host"
+@test "uri only" {
+        run $CMD "nfs://"
 
         [ "$status" -eq 1 ]
-        [[ "$output" =~ "gfput: glfs://host: Invalid argument" ]]
+        [[ "$output" =~ "virtfs-put: nfs://: Invalid argument" ]]
 }
 
-@test "uri with host trailing slash" {
-        run $CMD "glfs://host/"
+@test "uri with host" {
+        run $CMD "nfs://host"
 
         [ "$status" -eq 1 ]
-        [[ "$output" =~ "gfput: glfs://host/: Invalid argument" ]]
+        [[ "$output" =~ "virtfs-put: nfs://host: Invalid argument" ]]
 }
 
-@test "uri with host and empty volume" {
-        run $CMD "glfs://host//"
+@test "put small file" {
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_SMALL\" | $CMD \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
 
-        [ "$status" -eq 1 ]
-        [[ "$output" =~ "gfput: glfs://host//: Invalid argument" ]]
+        [ "$result" == "$TEST_FILE_SMALL_HASH" ]
 }
 
-@test "uri with host and volume" {
-        run $CMD "glfs://$HOST/$GLUSTER_VOLUME"
+@test "put medium file" {
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_MEDIUM\" | $CMD \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
 
-        [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://$HOST/$GLUSTER_VOLUME: File exists" ]
+        [ "$result" == "$TEST_FILE_MEDIUM_HASH" ]
 }
 
-@test "uri with host and volume with trailing slash" {
-        run $CMD "glfs://$HOST/$GLUSTER_VOLUME/"
+@test "put large file" {
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\" | $CMD \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
 
-        [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://$HOST/$GLUSTER_VOLUME/: File exists" ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
 }
 
-@test "uri with host, volume, and empty path" {
-        run $CMD "glfs://$HOST/$GLUSTER_VOLUME//"
-
-        [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://$HOST/$GLUSTER_VOLUME//: File exists" ]
-}
+@test "put existing file" {
+        echo "first" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test"
 
-@test "put small file" {
-        run bash -c "cat \"$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_SMALL\" | $CMD \"glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfput_test\""
-        result=$(md5sum $GLUSTER_MOUNT_DIR$ROOT_DIR/gfput_test | awk '{print $1}')
+        run bash -c "echo second | $CMD \"$URL/virtfs_put_test\""
 
-        [ "$result" == "$TEST_FILE_SMALL_HASH" ]
+        [ "$status" -eq 1 ]
+        [ "$output" == "virtfs-put: $URL/virtfs_put_test: File exists" ]
+        [ "$(cat "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test")" == "first" ]
 }
 
-@test "put medium file" {
-        run bash -c "cat \"$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_MEDIUM\" | $CMD \"glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfput_test\""
-        result=$(md5sum $GLUSTER_MOUNT_DIR$ROOT_DIR/gfput_test | awk '{print $1}')
+@test "put existing file with overwrite flag" {
+        echo "first line that is longer" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test"
 
-        [ "$result" == "$TEST_FILE_MEDIUM_HASH" ]
-}
+        run bash -c "echo second | $CMD -f \"$URL/virtfs_put_test\""
 
-@test "put large file" {
-        run bash -c "cat \"$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\" | $CMD \"glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfput_test\""
-        result=$(md5sum $GLUSTER_MOUNT_DIR$ROOT_DIR/gfput_test | awk '{print $1}')
-
-        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+        [ "$status" -eq 0 ]
+        [ "$(cat "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test")" == "second" ]
 }
 
 @test "put file into subdir that does not exist with parent flag" {
-        run bash -c "cat \"$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_SMALL\" | $CMD \"-r\" \"glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_DIR/gfput_test\""
-        result=$(md5sum $GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_DIR/gfput_test | awk '{print $1}')
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_SMALL\" | $CMD \"-r\" \"$URL/$TEST_DIR/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/$TEST_DIR/virtfs_put_test | awk '{print $1}')
 
         [ "$result" == "$TEST_FILE_SMALL_HASH" ]
 }
 
 @test "put file into subdir that does not exist without parent flag" {
-        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/subdir/file"
+        run $CMD "$URL/subdir/file"
 
         [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/subdir/file: No such file or directory" ]
+        [ "$output" == "virtfs-put: $URL/subdir/file: No such file or directory" ]
 }
 
 @test "put file into subdir that does exist" {
-        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_DIR"
+        run $CMD "$URL/$TEST_DIR"
 
         [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_DIR: File exists" ]
+        [ "$output" == "virtfs-put: $URL/$TEST_DIR: File exists" ]
 }
 
 @test "put with host that does not exist" {
-        run $CMD "glfs://host/volume/file"
+        run $CMD "nfs://host/export/file"
 
         [ "$status" -eq 1 ]
-        [ "$output" == "gfput: glfs://host/volume/file: Transport endpoint is not connected" ]
+        [[ "$output" =~ "virtfs-put: nfs://host/export/file: " ]]
+}
+
+@test "put append to file" {
+        echo "first" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test"
+
+        run bash -c "echo second | $CMD -a \"$URL/virtfs_put_test\""
+
+        [ "$status" -eq 0 ]
+        [ "$(cat "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test")" == "$(printf "first\nsecond")" ]
+}
+
+@test "put large file with one write in flight" {
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\" | $CMD -j 1 \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "put large file with many writes in flight" {
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\" | $CMD --jobs=64 \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "append large file with several writes in flight" {
+        echo "first" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test"
+        expected_result=$( (echo "first"; cat "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE") | md5sum | awk '{print $1}')
+
+        run bash -c "cat \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\" | $CMD -a -j 4 \"$URL/virtfs_put_test\""
+        result=$(md5sum $NFS_MOUNT_DIR$ROOT_DIR/virtfs_put_test | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$expected_result" ]
 }
@@ -115,6 +115,24 @@ teardown() {
         [ "$status" -eq 0 ]
 }
 
+@test "rm a directory tree with recursive flag" {
+        mkdir -p "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR/a/b" "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR/c"
+        touch "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR/one" "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR/a/b/two"
+        ln -s one "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR/c/link"
+
+        run $CMD "-r" "-j" "4" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_RM_DIR"
+
+        [ "$status" -eq 0 ]
+        [ ! -e "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_RM_DIR" ]
+}
+
+@test "invalid jobs flag" {
+        run $CMD "-r" "-j" "0" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/$TEST_RM_DIR"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfrm: invalid number of jobs: \"0\"" ]]
+}
+
 @test "rm a path that does not exist" {
         run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/no_such_file"
 
@@ -0,0 +1,61 @@
+#!/usr/bin/env bats
+
+CMD="$CMD_PREFIX $BUILD_DIR/bin/gfsync"
+USAGE="Usage: gfsync [OPTION]... SOURCE DEST"
+USAGE_ERROR="gfsync: missing operand"
+
+setup() {
+        TEMP_DIR=$(mktemp -d)
+}
+
+teardown() {
+        rm -rf "$TEMP_DIR"
+        rm -rf "$GLUSTER_BRICK_DIR$ROOT_DIR/gfsync_test"
+}
+
+@test "no arguments" {
+        run $CMD
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "$USAGE_ERROR" ]]
+}
+
+@test "long help flag" {
+        run $CMD "--help"
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "$USAGE" ]]
+}
+
+@test "invalid jobs flag" {
+        run $CMD "-j" "0" "$TEMP_DIR" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfsync_test"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gfsync: invalid number of jobs: \"0\"" ]]
+}
+
+@test "sync local tree to remote directory" {
+        mkdir -p "$TEMP_DIR/a/b"
+        echo "one" > "$TEMP_DIR/a/one"
+        echo "two" > "$TEMP_DIR/a/b/two"
+
+        run $CMD "$TEMP_DIR" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfsync_test"
+
+        [ "$status" -eq 0 ]
+        diff -r "$TEMP_DIR" "$GLUSTER_BRICK_DIR$ROOT_DIR/gfsync_test"
+}
+
+@test "sync only prints changed files on dry run" {
+        mkdir -p "$TEMP_DIR/a"
+        echo "one" > "$TEMP_DIR/a/one"
+        echo "two" > "$TEMP_DIR/two"
+
+        run $CMD "$TEMP_DIR" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfsync_test"
+        [ "$status" -eq 0 ]
+
+        echo "changed" > "$TEMP_DIR/two"
+        run $CMD "--dry-run" "$TEMP_DIR" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gfsync_test"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$ROOT_DIR/gfsync_test/two" ]
+}
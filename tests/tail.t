@@ -136,3 +136,44 @@ BASE_URL="glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR"
 
         [ "$status" -eq 0 ]
 }
+
+@test "tail many lines" {
+        result=$($CMD -n 5000 "$BASE_URL/$TEST_FILE_MEDIUM" | md5sum | awk '{print $1}')
+        expected_result=$(tail -n 5000 "$GLUSTER_MOUNT_DIR$ROOT_DIR/$TEST_FILE_MEDIUM" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$expected_result" ]
+}
+
+@test "tail lines without a trailing newline" {
+        printf "one\ntwo\nthree" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_no_newline"
+        run $CMD -n 2 "$BASE_URL/gftail_no_newline"
+        rm -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_no_newline"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(printf "two\nthree")" ]
+}
+
+@test "tail several files" {
+        printf "a1\na2\n" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_a"
+        printf "b1\nb2\n" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_b"
+        run $CMD -n 1 "$BASE_URL/gftail_a" "$BASE_URL/gftail_b"
+        rm -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_a" "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_b"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(printf "==> $BASE_URL/gftail_a <==\na2\n\n==> $BASE_URL/gftail_b <==\nb2")" ]
+}
+
+@test "follow several files" {
+        printf "a1\n" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_a"
+        printf "b1\n" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_b"
+        $CMD -f -s 10000 "$BASE_URL/gftail_a" "$BASE_URL/gftail_b" > "$BATS_TMPDIR/gftail_follow" &
+        pid=$!
+        sleep 2
+        echo "b2" >> "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_b"
+        sleep 2
+        kill -INT $pid
+        wait $pid || true
+        rm -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_a" "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftail_b"
+
+        [ "$(tail -n 2 "$BATS_TMPDIR/gftail_follow")" == "$(printf "==> $BASE_URL/gftail_b <==\nb2")" ]
+}
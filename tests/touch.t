@@ -0,0 +1,57 @@
+#!/usr/bin/env bats
+
+CMD="$CMD_PREFIX $BUILD_DIR/bin/gftouch"
+USAGE="Usage: gftouch [OPTION]... URL..."
+USAGE_ERROR="gftouch: missing operand"
+
+setup() {
+        mkdir -p "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test"
+}
+
+teardown() {
+        rm -rf "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test"
+}
+
+@test "no arguments" {
+        run $CMD
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "$USAGE_ERROR" ]]
+}
+
+@test "long help flag" {
+        run $CMD "--help"
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "$USAGE" ]]
+}
+
+@test "touch several files" {
+        echo "data" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/existing"
+        touch -d "2000-01-01" "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/existing"
+
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/existing" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/new"
+
+        [ "$status" -eq 0 ]
+        [ -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/new" ]
+        [ "$(cat "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/existing")" == "data" ]
+        [ "$(stat -c %Y "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/existing")" -gt 946684800 ]
+}
+
+@test "touch files listed on standard input" {
+        run bash -c "printf 'glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/a\nglfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/b\n' | $CMD --files-from=-"
+
+        [ "$status" -eq 0 ]
+        [ -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/a" ]
+        [ -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/b" ]
+}
+
+@test "touch reports each failing file" {
+        run $CMD "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/no_dir/a" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftouch_test/c"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "gftouch_test/no_dir/a" ]]
+        [ -f "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftouch_test/c" ]
+}
@@ -0,0 +1,60 @@
+#!/usr/bin/env bats
+
+CMD="$CMD_PREFIX $BUILD_DIR/bin/gftruncate"
+USAGE="Usage: gftruncate [OPTION]... URL..."
+USAGE_ERROR="gftruncate: missing operand"
+
+setup() {
+        mkdir -p "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test"
+}
+
+teardown() {
+        rm -rf "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test"
+}
+
+@test "long help flag" {
+        run $CMD "--help"
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "$USAGE" ]]
+}
+
+@test "truncate several files" {
+        echo "data" > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/existing"
+
+        run $CMD "--size=1K" "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftruncate_test/existing" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftruncate_test/new"
+
+        [ "$status" -eq 0 ]
+        [ "$(stat -c %s "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/existing")" -eq 1024 ]
+        [ "$(stat -c %s "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/new")" -eq 1024 ]
+}
+
+@test "punch a hole keeping the size" {
+        head -c 4194304 /dev/urandom > "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/file"
+
+        run $CMD "--punch-hole" "--offset=1M" "--size=2M" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftruncate_test/file"
+        zeroes=$(dd if="$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/file" bs=1M skip=1 count=2 2>/dev/null | tr -d '\0' | wc -c)
+
+        [ "$status" -eq 0 ]
+        [ "$(stat -c %s "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/file")" -eq 4194304 ]
+        [ "$zeroes" -eq 0 ]
+}
+
+@test "punch a hole in a missing file" {
+        run $CMD "--punch-hole" "--size=1M" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftruncate_test/missing"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "cannot open" ]]
+        [ ! -e "$GLUSTER_MOUNT_DIR$ROOT_DIR/gftruncate_test/missing" ]
+}
+
+@test "offset without punch hole" {
+        run $CMD "--offset=1M" "--size=2M" \
+                "glfs://$HOST/$GLUSTER_VOLUME$ROOT_DIR/gftruncate_test/file"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "--offset requires --punch-hole" ]]
+}
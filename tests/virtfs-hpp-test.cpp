@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+/*
+ * Drives the C++ wrapper for the bats tests, like virtfs-test does the
+ * library: each command works on the file of a URL, and exits 1 with the
+ * error on standard error on failure.
+ */
+#include <virtfs.hpp>
+
+#include <libgen.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t chunk = 1024 * 1024;
+constexpr std::size_t tasks = 8;
+
+/* The file of the URL fs was mounted from */
+std::string file_of(const vfs::Fs &fs)
+{
+        std::unique_ptr<char, decltype(&std::free)> path(
+                virtfs_url_get_file(fs.get()), &std::free);
+
+        if (!path)
+                throw std::system_error(EISDIR, std::generic_category(),
+                                        "url");
+
+        return path.get();
+}
+
+/* Reads every tasks-th chunk from the first one, shorter at the end */
+vfs::Task<> read_chunks(const vfs::File &f, std::vector<char> &data,
+                        std::size_t first)
+{
+        for (std::size_t start = first * chunk; start < data.size();
+             start += tasks * chunk) {
+                std::span<char> buf(data.data() + start,
+                                    std::min(chunk, data.size() - start));
+                off_t off = start;
+
+                while (!buf.empty()) {
+                        std::size_t n = co_await f.pread(buf, off);
+
+                        if (n == 0)
+                                throw std::runtime_error("file shrank");
+                        buf = buf.subspan(n);
+                        off += n;
+                }
+        }
+}
+
+vfs::Task<> write_all(const vfs::File &f, std::span<const char> buf,
+                      off_t off)
+{
+        while (!buf.empty()) {
+                std::size_t n = co_await f.pwrite(buf, off);
+
+                buf = buf.subspan(n);
+                off += n;
+        }
+}
+
+/* The file to standard output, read by several tasks at once */
+int do_cat(const char *url)
+{
+        vfs::Fs fs(url);
+        vfs::File f = fs.open(file_of(fs).c_str());
+        std::vector<char> data(f.stat().st_size);
+        std::vector<vfs::Task<>> readers;
+
+        for (std::size_t i = 0; i < tasks; i++)
+                readers.push_back(read_chunks(f, data, i));
+        fs.run(readers);
+
+        if (std::fwrite(data.data(), 1, data.size(), stdout) != data.size())
+                throw std::system_error(errno, std::generic_category(),
+                                        "write");
+
+        return 0;
+}
+
+/* Standard input to the file, a chunk per task, synced once */
+int do_put(const char *url)
+{
+        vfs::Fs fs(url);
+        vfs::File f = fs.open(file_of(fs).c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        std::vector<std::vector<char>> chunks;
+        std::vector<vfs::Task<>> writers;
+        off_t off = 0;
+        ssize_t n;
+
+        do {
+                chunks.clear();
+                writers.clear();
+                while (chunks.size() < tasks) {
+                        std::vector<char> &c = chunks.emplace_back(chunk);
+
+                        n = read(STDIN_FILENO, c.data(), c.size());
+                        if (n < 0)
+                                throw std::system_error(
+                                        errno, std::generic_category(),
+                                        "read");
+                        c.resize(n);
+                        if (n == 0)
+                                break;
+                }
+
+                for (auto &c : chunks) {
+                        writers.push_back(write_all(f, c, off));
+                        off += c.size();
+                }
+                fs.run(writers);
+        } while (n > 0);
+
+        fs.run([](const vfs::File &f) -> vfs::Task<> {
+                co_await f.fsync();
+        }(f));
+        f.close();
+
+        return 0;
+}
+
+/*
+ * A task awaiting a read on another mount than the one running it makes
+ * Fs::run() throw, and its frame goes while the read is in flight.
+ */
+int do_abandon(const char *url)
+{
+        vfs::Fs fs(url);
+        vfs::Fs other(url);
+        vfs::File f = other.open(file_of(other).c_str());
+        std::vector<char> data(chunk);
+
+        try {
+                fs.run(read_chunks(f, data, 0));
+                std::printf("not abandoned\n");
+                return 1;
+        } catch (const std::logic_error &e) {
+                std::printf("%s\n", e.what());
+        }
+
+        /* The read lands in the buffers of the library alone */
+        if (f.read_at(data, 0) > 0)
+                std::printf("mount still usable\n");
+
+        return 0;
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+        const char *name = basename(argv[0]);
+        std::string cmd = argc > 1 ? argv[1] : "";
+
+        try {
+                if (argc == 3 && cmd == "cat")
+                        return do_cat(argv[2]);
+                if (argc == 3 && cmd == "put")
+                        return do_put(argv[2]);
+                if (argc == 3 && cmd == "abandon")
+                        return do_abandon(argv[2]);
+        } catch (const std::exception &e) {
+                std::fprintf(stderr, "%s: %s\n", name, e.what());
+                return 1;
+        }
+
+        std::fprintf(stderr, "Usage: %s COMMAND URL\n"
+                     "  cat URL       write the file to standard output\n"
+                     "  put URL       write standard input to the file\n"
+                     "  abandon URL   drop a task with a read in flight\n",
+                     name);
+
+        return 1;
+}
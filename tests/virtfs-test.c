@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ * This file is part of VirtFS.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 3 or any later version (LGPLv3 or
+ * later), or the GNU General Public License, version 2 (GPLv2), in
+ * all cases as published by the Free Software Foundation.
+ */
+
+/*
+ * Drives the parts of the library the utilities do not reach, for the bats
+ * tests: each command works on the file of a URL and reports on standard
+ * output, exiting 1 on failure.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <virtfs.h>
+
+static virtfs_t fs;
+static char *url;
+static char *path;
+
+static void usage(void)
+{
+        fprintf(stderr, "Usage: %s COMMAND URL [ARG]...\n"
+                "  cat URL [N]            write the file to standard output,\n"
+                "                         read by N pumps at once (default 1)\n"
+                "  cat-head URL BYTES     read BYTES of the file from a pump\n"
+                "                         and close the pipe before its end\n"
+                "  put URL                write standard input to the file\n"
+                "                         through a pump\n"
+                "  map URL [backward]     write the file to standard output\n"
+                "                         from a mapping, faulted in from the\n"
+                "                         start or from the end\n"
+                "  map-stale URL          unlink the mapped file and report\n"
+                "                         the fault of its first page\n"
+                "  deadline URL MS        read the file over and over with a\n"
+                "                         deadline of MS milliseconds\n"
+                "  append URL N RECORDS   append RECORDS records to the file\n"
+                "                         from each of N threads\n"
+                "  allocate URL OFF LEN [punch]\n"
+                "                         allocate or punch a range of the\n"
+                "                         file and report its size\n"
+                "  cancel URL             cancel a read at once\n"
+                "  expire URL N           read N chunks of the file at once\n"
+                "                         within 1 millisecond each\n",
+                program_invocation_name);
+        exit(EXIT_FAILURE);
+}
+
+/* Opens the file of the URL, on a mount shared by all the calls */
+static vfd_t open_file(int flags)
+{
+        vfd_t vfd;
+        int ret;
+
+        if (fs == NULL) {
+                ret = virtfs_new(url, &fs);
+                if (ret == 0)
+                        ret = virtfs_init(fs);
+                if (ret < 0)
+                        error(EXIT_FAILURE, -ret, "%s", url);
+
+                path = virtfs_url_get_file(fs);
+                if (path == NULL)
+                        error(EXIT_FAILURE, EISDIR, "%s", url);
+        }
+
+        vfd = virtfs_open(fs, path, flags, 0644);
+        if (vfd == NULL)
+                error(EXIT_FAILURE, errno, "%s", url);
+
+        return vfd;
+}
+
+static int pump(vfd_t vfd)
+{
+        int fd;
+
+        fd = virtfs_fd_to_posix(vfd);
+        if (fd < 0)
+                error(EXIT_FAILURE, -fd, "%s: pump", url);
+
+        return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t count)
+{
+        ssize_t n;
+
+        for (; count > 0; count -= n, buf += n) {
+                n = write(fd, buf, count);
+                if (n < 0)
+                        error(EXIT_FAILURE, errno, "write");
+        }
+}
+
+/*
+ * The pumps share the mount and read the file at once; the first one goes
+ * to standard output, the others must give as many bytes.
+ */
+static int do_cat(int argc, char *argv[])
+{
+        struct pollfd *pfd;
+        struct stat st;
+        long long *got;
+        char buf[65536];
+        vfd_t vfd;
+        int n = 1;
+        int left;
+        ssize_t r;
+        int ret;
+        int i;
+
+        if (argc > 1)
+                n = atoi(argv[1]);
+        if (n < 1)
+                usage();
+
+        pfd = calloc(n, sizeof(*pfd));
+        got = calloc(n, sizeof(*got));
+        if (!pfd || !got)
+                error(EXIT_FAILURE, ENOMEM, "calloc");
+
+        for (i = 0; i < n; i++) {
+                vfd = open_file(O_RDONLY);
+                ret = i == 0 ? virtfs_fstat(vfd, &st) : 0;
+                if (ret < 0)
+                        error(EXIT_FAILURE, -ret, "%s", url);
+
+                pfd[i].fd = pump(vfd);
+                pfd[i].events = POLLIN;
+        }
+
+        for (left = n; left > 0; ) {
+                if (poll(pfd, n, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        error(EXIT_FAILURE, errno, "poll");
+                }
+
+                for (i = 0; i < n; i++) {
+                        if (pfd[i].fd < 0 || pfd[i].revents == 0)
+                                continue;
+
+                        r = read(pfd[i].fd, buf, sizeof(buf));
+                        if (r < 0)
+                                error(EXIT_FAILURE, errno, "read");
+                        if (r == 0) {
+                                close(pfd[i].fd);
+                                pfd[i].fd = -1;
+                                left--;
+                                continue;
+                        }
+
+                        if (i == 0)
+                                write_all(STDOUT_FILENO, buf, r);
+                        got[i] += r;
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                if (got[i] != st.st_size)
+                        error(EXIT_FAILURE, 0, "pump %d: %lld of %lld bytes",
+                              i, got[i], (long long)st.st_size);
+        }
+
+        free(got);
+        free(pfd);
+
+        return 0;
+}
+
+/*
+ * The pump fails on the closed pipe with READs in flight, and the mount is
+ * released once it has drained them.
+ */
+static int do_cat_head(int argc, char *argv[])
+{
+        char buf[65536];
+        long long want, got = 0;
+        ssize_t r;
+        int fd;
+
+        if (argc < 2)
+                usage();
+
+        want = atoll(argv[1]);
+        fd = pump(open_file(O_RDONLY));
+        while (got < want) {
+                r = read(fd, buf, want - got < (long long)sizeof(buf) ?
+                         want - got : (long long)sizeof(buf));
+                if (r < 0)
+                        error(EXIT_FAILURE, errno, "read");
+                if (r == 0)
+                        break;
+                got += r;
+        }
+
+        close(fd);
+        printf("%lld\n", got);
+
+        return 0;
+}
+
+/* virtfs_fini() returns once the pump wrote and closed the file */
+static int do_put(int argc, char *argv[])
+{
+        char buf[65536];
+        ssize_t n;
+        int fd;
+
+        fd = pump(open_file(O_WRONLY | O_CREAT | O_TRUNC));
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+                write_all(fd, buf, n);
+        if (n < 0)
+                error(EXIT_FAILURE, errno, "read");
+
+        close(fd);
+
+        return 0;
+}
+
+static void *map_file(vfd_t vfd, size_t *length)
+{
+        struct stat st;
+        void *addr;
+        int ret;
+
+        ret = virtfs_fstat(vfd, &st);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s", url);
+        if (st.st_size == 0)
+                error(EXIT_FAILURE, 0, "%s: empty file", url);
+
+        addr = virtfs_mmap(vfd, 0, st.st_size);
+        if (addr == MAP_FAILED)
+                error(EXIT_FAILURE, errno, "%s: mmap", url);
+
+        *length = st.st_size;
+        return addr;
+}
+
+/*
+ * Faults from the start follow the readahead, those from the end fetch the
+ * pages around each one. All are touched before the write, which cannot
+ * fault them in.
+ */
+static int do_map(int argc, char *argv[])
+{
+        volatile char sum = 0;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t length;
+        size_t i;
+        vfd_t vfd;
+        char *addr;
+
+        vfd = open_file(O_RDONLY);
+        addr = map_file(vfd, &length);
+        if (argc > 1 && strcmp(argv[1], "backward") == 0) {
+                for (i = (length - 1) / page + 1; i > 0; i--)
+                        sum += addr[(i - 1) * page];
+        } else {
+                for (i = 0; i < length; i += page)
+                        sum += addr[i];
+        }
+
+        write_all(STDOUT_FILENO, addr, length);
+        virtfs_munmap(addr, length);
+        virtfs_close(vfd);
+
+        return 0;
+}
+
+static sigjmp_buf fault;
+
+static void on_fault(int sig)
+{
+        siglongjmp(fault, 1);
+}
+
+/* The page the handler cannot read faults with SIGSEGV, not zeroes */
+static int do_map_stale(int argc, char *argv[])
+{
+        volatile char c = 0;
+        size_t length;
+        vfd_t vfd;
+        char *addr;
+        int ret;
+
+        vfd = open_file(O_RDONLY);
+        addr = map_file(vfd, &length);
+        ret = virtfs_unlink(fs, path);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: unlink", url);
+
+        signal(SIGSEGV, on_fault);
+        if (sigsetjmp(fault, 1) == 0) {
+                c = addr[0];
+                printf("read %d\n", c);
+        } else {
+                printf("SIGSEGV\n");
+        }
+        signal(SIGSEGV, SIG_DFL);
+
+        virtfs_munmap(addr, length);
+        virtfs_close(vfd);
+
+        return 0;
+}
+
+/*
+ * Each call fails with ETIMEDOUT once the deadline passed, never hangs, but
+ * the close, which must free the file all the same.
+ */
+static int do_deadline(int argc, char *argv[])
+{
+        char buf[65536];
+        off_t off = 0;
+        ssize_t r;
+        vfd_t vfd;
+        int ret;
+
+        if (argc < 2)
+                usage();
+
+        vfd = open_file(O_RDONLY);
+        virtfs_set_deadline(atoi(argv[1]));
+        do {
+                r = virtfs_pread(vfd, buf, sizeof(buf), off);
+                off = r > 0 ? off + r : 0;
+        } while (r >= 0);
+        printf("%s\n", strerror(-r));
+
+        ret = virtfs_close(vfd);
+        virtfs_set_deadline(-1);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: close", url);
+
+        return 0;
+}
+
+/* Records of an appending thread, every APPEND_SYNC of which it syncs */
+#define APPEND_SYNC 64
+
+struct producer
+{
+        pthread_t thread;
+        virtfs_append_t a;
+        int id;
+        int records;
+        int ret;
+};
+
+/*
+ * "ID SEQ PAD\n", where PAD is SEQ % 50 + 1 letters: a record torn or
+ * interleaved with another does not parse back.
+ */
+static void *produce(void *arg)
+{
+        struct producer *p = arg;
+        char rec[128];
+        int len;
+        int i;
+
+        for (i = 0; i < p->records && p->ret == 0; i++) {
+                len = snprintf(rec, sizeof(rec), "%d %d ", p->id, i);
+                memset(rec + len, 'a' + p->id % 26, i % 50 + 1);
+                len += i % 50 + 1;
+                rec[len++] = '\n';
+
+                p->ret = virtfs_append(p->a, rec, len);
+                if (p->ret == 0 && i % APPEND_SYNC == APPEND_SYNC - 1)
+                        p->ret = virtfs_append_sync(p->a);
+        }
+
+        return NULL;
+}
+
+/* The threads share one stream, which batches their records */
+static int do_append(int argc, char *argv[])
+{
+        struct producer *p;
+        virtfs_append_t a;
+        int n, records;
+        int ret;
+        int i;
+
+        if (argc < 3)
+                usage();
+
+        n = atoi(argv[1]);
+        records = atoi(argv[2]);
+        if (n < 1 || records < 0)
+                usage();
+
+        p = calloc(n, sizeof(*p));
+        if (p == NULL)
+                error(EXIT_FAILURE, ENOMEM, "calloc");
+
+        ret = virtfs_append_open(open_file(O_WRONLY), 0, 10, &a);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: append", url);
+
+        for (i = 0; i < n; i++) {
+                p[i].a = a;
+                p[i].id = i;
+                p[i].records = records;
+                ret = pthread_create(&p[i].thread, NULL, produce, &p[i]);
+                if (ret != 0)
+                        error(EXIT_FAILURE, ret, "pthread_create");
+        }
+
+        for (i = 0; i < n; i++) {
+                pthread_join(p[i].thread, NULL);
+                if (p[i].ret < 0)
+                        error(EXIT_FAILURE, -p[i].ret, "%s: producer %d",
+                              url, i);
+        }
+
+        ret = virtfs_append_close(a);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: close", url);
+        free(p);
+
+        return 0;
+}
+
+/* Allocation past the end extends the file, with zeros */
+static int do_allocate(int argc, char *argv[])
+{
+        struct stat st;
+        int mode = 0;
+        vfd_t vfd;
+        int ret;
+
+        if (argc < 3)
+                usage();
+        if (argc > 3 && strcmp(argv[3], "punch") == 0)
+                mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+        vfd = open_file(O_RDWR);
+        ret = virtfs_fallocate(vfd, mode, atoll(argv[1]), atoll(argv[2]));
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: fallocate", url);
+
+        ret = virtfs_fstat(vfd, &st);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s", url);
+        printf("%lld\n", (long long)st.st_size);
+        virtfs_close(vfd);
+
+        return 0;
+}
+
+#define CHUNK (1024 * 1024)
+
+struct read_op
+{
+        struct virtfs_op op;
+        ssize_t ret;
+        int done;
+};
+
+static void on_read(struct virtfs_op *op, ssize_t ret)
+{
+        struct read_op *r = (struct read_op *)op;
+
+        r->ret = ret;
+        r->done++;
+}
+
+static struct read_op *read_async(vfd_t vfd, char *buf, off_t offset,
+                                  int timeout)
+{
+        struct read_op *r;
+        int ret;
+
+        r = calloc(1, sizeof(*r));
+        if (r == NULL)
+                error(EXIT_FAILURE, ENOMEM, "calloc");
+
+        r->op.cb = on_read;
+        r->op.timeout = timeout;
+        ret = virtfs_pread_async(vfd, buf, CHUNK, offset, &r->op);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "%s: read", url);
+
+        return r;
+}
+
+/*
+ * The read completes within the call, once, and its buffer is left alone
+ * when the reply lands. The file stays open for the READ still in flight,
+ * which goes with the mount.
+ */
+static int do_cancel(int argc, char *argv[])
+{
+        struct read_op *r;
+        char *buf;
+        int ret;
+        int i;
+
+        buf = malloc(CHUNK);
+        if (buf == NULL)
+                error(EXIT_FAILURE, ENOMEM, "malloc");
+        memset(buf, 0xaa, CHUNK);
+
+        r = read_async(open_file(O_RDONLY), buf, 0, -1);
+        ret = virtfs_cancel(&r->op);
+        if (ret < 0)
+                error(EXIT_FAILURE, -ret, "cancel");
+        printf("%s\n", strerror(-r->ret));
+
+        if (virtfs_cancel(&r->op) != -ENOENT)
+                error(EXIT_FAILURE, 0, "cancelled twice");
+        while (virtfs_poll(fs, 100) > 0)
+                ;
+
+        for (i = 0; i < CHUNK; i++) {
+                if (buf[i] != (char)0xaa)
+                        error(EXIT_FAILURE, 0, "buffer written at %d", i);
+        }
+        if (r->done != 1)
+                error(EXIT_FAILURE, 0, "%d completions", r->done);
+
+        free(r);
+        free(buf);
+
+        return 0;
+}
+
+/*
+ * The reads queued together cannot all be served in 1 millisecond: those
+ * left when it passes complete with ETIMEDOUT, the others with their data,
+ * each once. The file stays open as for cancel.
+ */
+static int do_expire(int argc, char *argv[])
+{
+        struct read_op **r;
+        int read = 0, expired = 0;
+        vfd_t vfd;
+        char *buf;
+        int n;
+        int i;
+
+        if (argc < 2)
+                usage();
+
+        n = atoi(argv[1]);
+        if (n < 1)
+                usage();
+
+        r = calloc(n, sizeof(*r));
+        buf = malloc((size_t)n * CHUNK);
+        if (!r || !buf)
+                error(EXIT_FAILURE, ENOMEM, "calloc");
+
+        vfd = open_file(O_RDONLY);
+        for (i = 0; i < n; i++) {
+                r[i] = read_async(vfd, buf + (size_t)i * CHUNK,
+                                  (off_t)i * CHUNK, 1);
+        }
+        while (virtfs_poll(fs, -1) > 0)
+                ;
+
+        for (i = 0; i < n; i++) {
+                if (r[i]->done != 1)
+                        error(EXIT_FAILURE, 0, "read %d: %d completions",
+                              i, r[i]->done);
+                if (r[i]->ret == -ETIMEDOUT)
+                        expired++;
+                else if (r[i]->ret >= 0)
+                        read++;
+                else
+                        error(EXIT_FAILURE, -r[i]->ret, "read %d", i);
+                free(r[i]);
+        }
+        printf("%d read, %d expired\n", read, expired);
+
+        free(buf);
+        free(r);
+
+        return 0;
+}
+
+static const struct command
+{
+        const char *name;
+        int (*fn)(int argc, char *argv[]);
+} commands[] = {
+        { "cat", do_cat },
+        { "cat-head", do_cat_head },
+        { "put", do_put },
+        { "map", do_map },
+        { "map-stale", do_map_stale },
+        { "deadline", do_deadline },
+        { "append", do_append },
+        { "allocate", do_allocate },
+        { "cancel", do_cancel },
+        { "expire", do_expire },
+        { NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+        const struct command *c;
+        int ret;
+
+        program_invocation_name = basename(argv[0]);
+        if (argc < 3)
+                usage();
+
+        for (c = commands; c->name; c++) {
+                if (strcmp(c->name, argv[1]) == 0)
+                        break;
+        }
+        if (c->name == NULL)
+                usage();
+
+        url = argv[2];
+        ret = c->fn(argc - 2, argv + 2);
+
+        if (fs)
+                virtfs_fini(fs);
+        free(path);
+
+        return ret;
+}
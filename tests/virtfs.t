@@ -0,0 +1,254 @@
+#!/usr/bin/env bats
+
+CMD="$CMD_PREFIX $BUILD_DIR/bin/virtfs-test"
+HPP_CMD="$CMD_PREFIX $BUILD_DIR/bin/virtfs-hpp-test"
+URL="nfs://$HOST$NFS_EXPORT$ROOT_DIR"
+
+# Stock tools on the export through the interposer, under /virtfs/test
+PRELOAD="env LD_PRELOAD=$BUILD_DIR/lib/libvirtfs-preload.so VIRTFS_PRELOAD=/virtfs/test=nfs://$HOST$NFS_EXPORT"
+PRELOAD_DIR="/virtfs/test$ROOT_DIR"
+
+teardown() {
+        rm -f "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+        rm -rf "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test_dir"
+}
+
+@test "no arguments" {
+        run $CMD
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "Usage: virtfs-test COMMAND URL" ]]
+}
+
+@test "pump a large file" {
+        result=$($CMD cat "$URL/$TEST_FILE_LARGE" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "pump a file from several pumps on one mount" {
+        run bash -c "set -o pipefail; $CMD cat \"$URL/$TEST_FILE_LARGE\" 4 | md5sum"
+
+        [ "$status" -eq 0 ]
+        [ "$(echo "$output" | awk '{print $1}')" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "pump an empty file" {
+        touch "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD cat "$URL/virtfs_test"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "" ]
+}
+
+@test "close the pipe of a pump before the end of the file" {
+        run $CMD cat-head "$URL/$TEST_FILE_LARGE" 1000
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "1000" ]
+}
+
+@test "pump a file that does not exist" {
+        run $CMD cat "$URL/virtfs_test"
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "virtfs-test: $URL/virtfs_test: No such file or directory" ]]
+}
+
+@test "pump a large file into a file" {
+        run bash -c "$CMD put \"$URL/virtfs_test\" < \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\""
+        result=$(md5sum "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "map a large file from its start" {
+        result=$($CMD map "$URL/$TEST_FILE_LARGE" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "map a large file from its end" {
+        result=$($CMD map "$URL/$TEST_FILE_LARGE" backward | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "map a small file" {
+        result=$($CMD map "$URL/$TEST_FILE_SMALL" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_SMALL_HASH" ]
+}
+
+@test "fault a page of a mapped file that was removed" {
+        cp "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_SMALL" "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD map-stale "$URL/virtfs_test"
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ "SIGSEGV" ]]
+}
+
+@test "append records from several threads" {
+        echo "header" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD append "$URL/virtfs_test" 8 1000
+
+        [ "$status" -eq 0 ]
+
+        # Each record whole, in the order of its thread, after the header
+        run awk -v n=8 -v records=1000 '
+                NR == 1 { header = $0 == "header"; next }
+                NF != 3 || $2 != seq[$1]++ || length($3) != $2 % 50 + 1 { bad++ }
+                END {
+                        for (i = 0; i < n; i++)
+                                if (seq[i] != records)
+                                        bad++
+                        print header && !bad ? "ok" : "bad"
+                }' "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        [ "$output" == "ok" ]
+}
+
+@test "allocate past the end of a file" {
+        printf "data" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD allocate "$URL/virtfs_test" 2 1048576
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "1048578" ]
+        [ "$(head -c 4 "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test")" == "data" ]
+        [ "$(tail -c +5 "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test" | tr -d '\0' | wc -c)" -eq 0 ]
+}
+
+@test "allocate within a file" {
+        printf "data" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD allocate "$URL/virtfs_test" 0 2
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "4" ]
+        [ "$(cat "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test")" == "data" ]
+}
+
+@test "punch a hole in a file" {
+        printf "data" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        run $CMD allocate "$URL/virtfs_test" 0 2 punch
+
+        [ "$status" -eq 1 ]
+        [[ "$output" =~ "Operation not supported" ]]
+}
+
+@test "call past the deadline of the thread" {
+        run $CMD deadline "$URL/$TEST_FILE_LARGE" 0
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "Connection timed out" ]
+}
+
+@test "call until the deadline of the thread passes" {
+        run $CMD deadline "$URL/$TEST_FILE_LARGE" 200
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "Connection timed out" ]
+}
+
+@test "cancel a read in flight" {
+        run $CMD cancel "$URL/$TEST_FILE_LARGE"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "Operation canceled" ]
+}
+
+@test "expire reads past their timeout" {
+        run $CMD expire "$URL/$TEST_FILE_LARGE" 64
+
+        [ "$status" -eq 0 ]
+        [[ "$output" =~ ^[0-9]+\ read,\ [1-9][0-9]*\ expired$ ]]
+}
+
+@test "read a large file from C++ tasks" {
+        result=$($HPP_CMD cat "$URL/$TEST_FILE_LARGE" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "write a large file from C++ tasks" {
+        run bash -c "$HPP_CMD put \"$URL/virtfs_test\" < \"$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE\""
+        result=$(md5sum "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "drop a C++ task with a read in flight" {
+        run $HPP_CMD abandon "$URL/$TEST_FILE_LARGE"
+
+        [ "$status" -eq 0 ]
+        [ "${lines[0]}" == "virtfs: task waits on no operation" ]
+        [ "${lines[1]}" == "mount still usable" ]
+}
+
+@test "md5sum a file through the preload library" {
+        result=$($PRELOAD md5sum "$PRELOAD_DIR/$TEST_FILE_LARGE" | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "cat a file through the preload library" {
+        result=$($PRELOAD cat "$PRELOAD_DIR/$TEST_FILE_LARGE" | md5sum | awk '{print $1}')
+
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "stat a file through the preload library" {
+        run $PRELOAD stat -c "%s %F %i" "$PRELOAD_DIR/$TEST_FILE_LARGE"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(stat -c "%s %F %i" "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE")" ]
+}
+
+@test "list a directory through the preload library" {
+        mkdir "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test_dir"
+        touch "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test_dir/"{a,b,c}
+        mkdir "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test_dir/d"
+
+        run $PRELOAD ls -aF "$PRELOAD_DIR/virtfs_test_dir"
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "$(ls -aF "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test_dir")" ]
+}
+
+@test "write a file with dd through the preload library" {
+        run $PRELOAD dd if="$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE" of="$PRELOAD_DIR/virtfs_test" bs=1M status=none
+        result=$(md5sum "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test" | awk '{print $1}')
+
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "copy a file to and from the preload library" {
+        TEMP_FILE=$(mktemp)
+        run $PRELOAD cp "$NFS_MOUNT_DIR$ROOT_DIR/$TEST_FILE_LARGE" "$PRELOAD_DIR/virtfs_test"
+        status_to=$status
+        run $PRELOAD cp "$PRELOAD_DIR/virtfs_test" "$TEMP_FILE"
+        result=$(md5sum "$TEMP_FILE" | awk '{print $1}')
+        rm -f "$TEMP_FILE"
+
+        [ "$status_to" -eq 0 ]
+        [ "$status" -eq 0 ]
+        [ "$result" == "$TEST_FILE_LARGE_HASH" ]
+}
+
+@test "read through a duplicated descriptor of the preload library" {
+        printf "first\nsecond\n" > "$NFS_MOUNT_DIR$ROOT_DIR/virtfs_test"
+
+        # The builtin read of the shell runs on the dup2()ed descriptor
+        run $PRELOAD bash -c "exec 7< \"$PRELOAD_DIR/virtfs_test\"; exec 8<&7; exec 7<&-; read -r line <&8; echo \"\$line\""
+
+        [ "$status" -eq 0 ]
+        [ "$output" == "first" ]
+}
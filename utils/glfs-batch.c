@@ -0,0 +1,296 @@
+/**
+ * Concurrent application of one operation to many paths.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-batch.h"
+#include "glfs-pool.h"
+
+#include <errno.h>
+#include <error.h>
+#include <glusterfs/api/glfs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The operation on one path, run by the workers of the pool of the batch.
+ */
+struct batch_job {
+        struct batch *batch;
+        struct batch_path *path;
+        batch_func_t func;
+        void *data;
+};
+
+void
+batch_init (struct batch *batch)
+{
+        memset (batch, 0, sizeof (*batch));
+        batch->jobs = BATCH_JOBS;
+        pthread_mutex_init (&batch->lock, NULL);
+}
+
+void
+batch_fini (struct batch *batch)
+{
+        struct batch_path *path;
+
+        for (size_t i = 0; i < batch->count; i++) {
+                path = &batch->paths[i];
+                if (path->owns_fs) {
+                        glfs_fini (path->fs);
+                }
+
+                gluster_url_free (path->url);
+                free (path->arg);
+                free (path->path);
+        }
+
+        free (batch->paths);
+        pthread_mutex_destroy (&batch->lock);
+}
+
+/**
+ * Adds arg, a glfs:// url or, in the shell, a path on the volume of the
+ * connection. Returns -1 after reporting an invalid url.
+ */
+int
+batch_add (struct batch *batch, const char *arg, uint16_t port,
+           bool has_connection)
+{
+        struct batch_path *path;
+        size_t alloc;
+
+        if (batch->count == batch->alloc) {
+                alloc = batch->alloc ? batch->alloc * 2 : 16;
+                path = realloc (batch->paths, alloc * sizeof (*path));
+                if (path == NULL) {
+                        error (0, errno, "realloc");
+                        return -1;
+                }
+
+                batch->paths = path;
+                batch->alloc = alloc;
+        }
+
+        path = &batch->paths[batch->count];
+        memset (path, 0, sizeof (*path));
+
+        path->arg = strdup (arg);
+        if (path->arg == NULL) {
+                error (0, errno, "strdup");
+                return -1;
+        }
+
+        if (gluster_parse_url (path->arg, &path->url) == 0) {
+                path->url->port = port;
+                path->path = strdup (path->url->path);
+        } else if (has_connection) {
+                path->url = NULL;
+                path->path = strdup (arg);
+        } else {
+                error (0, EINVAL, "%s", arg);
+                free (path->arg);
+                return -1;
+        }
+
+        if (path->path == NULL) {
+                error (0, errno, "strdup");
+                gluster_url_free (path->url);
+                free (path->arg);
+                return -1;
+        }
+
+        batch->count++;
+
+        return 0;
+}
+
+/**
+ * Adds the urls or paths listed in file, one per line, or in standard input
+ * when file is -.
+ */
+int
+batch_add_files_from (struct batch *batch, const char *file, uint16_t port,
+                      bool has_connection)
+{
+        FILE *stream;
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        int ret = 0;
+
+        if (strcmp (file, "-") == 0) {
+                stream = stdin;
+        } else {
+                stream = fopen (file, "r");
+                if (stream == NULL) {
+                        error (0, errno, "%s", file);
+                        return -1;
+                }
+        }
+
+        while (ret == 0 && (len = getline (&line, &size, stream)) != -1) {
+                if (len > 0 && line[len - 1] == '\n') {
+                        line[--len] = '\0';
+                }
+
+                if (len > 0) {
+                        ret = batch_add (batch, line, port, has_connection);
+                }
+        }
+
+        if (ret == 0 && ferror (stream)) {
+                error (0, errno, "%s", file);
+                ret = -1;
+        }
+
+        free (line);
+
+        if (stream != stdin) {
+                fclose (stream);
+        }
+
+        return ret;
+}
+
+/**
+ * Connects each path to its volume, once per volume. Paths without a url
+ * live on connected, the volume of the shell.
+ */
+int
+batch_connect (struct batch *batch, glfs_t *connected,
+               struct xlator_option **options, bool debug)
+{
+        struct batch_path *path;
+        struct batch_path *other;
+        size_t j;
+
+        for (size_t i = 0; i < batch->count; i++) {
+                path = &batch->paths[i];
+                if (path->url == NULL) {
+                        path->fs = connected;
+                        continue;
+                }
+
+                for (j = 0; j < i; j++) {
+                        other = &batch->paths[j];
+                        if (other->url != NULL &&
+                            other->url->port == path->url->port &&
+                            strcmp (other->url->host, path->url->host) == 0 &&
+                            strcmp (other->url->volume, path->url->volume) == 0) {
+                                break;
+                        }
+                }
+
+                if (j < i) {
+                        path->fs = batch->paths[j].fs;
+                        continue;
+                }
+
+                if (gluster_getfs (&path->fs, path->url) == -1) {
+                        error (0, errno, "%s", path->arg);
+                        return -1;
+                }
+
+                path->owns_fs = true;
+
+                if (apply_xlator_options (path->fs, options) == -1) {
+                        error (0, errno, "failed to apply translator options");
+                        return -1;
+                }
+
+                if (debug &&
+                    glfs_set_logging (path->fs, "/dev/stderr", GF_LOG_DEBUG) == -1) {
+                        error (0, errno, "failed to set logging level");
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void
+batch_job (void *arg)
+{
+        struct batch_job *job = arg;
+
+        if (job->func (job->path->fs, job->path->path, job->path->arg,
+                       job->data) == -1) {
+                pthread_mutex_lock (&job->batch->lock);
+                job->batch->errors++;
+                pthread_mutex_unlock (&job->batch->lock);
+        }
+}
+
+/**
+ * Applies func to every path of the batch. The requests of independent
+ * paths are kept in flight together, instead of each waiting for the
+ * replies to the previous one. Returns -1 if func failed on any path.
+ */
+int
+batch_run (struct batch *batch, batch_func_t func, void *data)
+{
+        struct batch_job *jobs;
+        struct pool *pool;
+        int threads;
+
+        // A single path is not worth starting threads for.
+        if (batch->count == 1) {
+                return func (batch->paths[0].fs, batch->paths[0].path,
+                             batch->paths[0].arg, data) == -1 ? -1 : 0;
+        }
+
+        jobs = calloc (batch->count, sizeof (*jobs));
+        if (jobs == NULL) {
+                error (0, errno, "calloc");
+                return -1;
+        }
+
+        threads = batch->count < (size_t) batch->jobs ? (int) batch->count :
+                batch->jobs;
+        pool = pool_create (threads, threads * 4);
+        if (pool == NULL) {
+                error (0, errno, "failed to start threads");
+                free (jobs);
+                return -1;
+        }
+
+        for (size_t i = 0; i < batch->count; i++) {
+                jobs[i].batch = batch;
+                jobs[i].path = &batch->paths[i];
+                jobs[i].func = func;
+                jobs[i].data = data;
+
+                if (pool_submit (pool, batch_job, &jobs[i]) == -1) {
+                        error (0, errno, "failed to queue %s", batch->paths[i].arg);
+                        pthread_mutex_lock (&batch->lock);
+                        batch->errors++;
+                        pthread_mutex_unlock (&batch->lock);
+                }
+        }
+
+        pool_destroy (pool);
+        free (jobs);
+
+        return batch->errors == 0 ? 0 : -1;
+}
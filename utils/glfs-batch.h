@@ -0,0 +1,98 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_BATCH_H
+#define GLFS_BATCH_H
+
+#include "glfs-util.h"
+
+#include <glusterfs/api/glfs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of paths a batch operates on concurrently by default. Each path
+ * takes one or two requests, so the rate scales with the number in flight.
+ */
+#define BATCH_JOBS 32
+
+/**
+ * A path of a batch.
+ *
+ * arg: The url or path as supplied by the user, for messages.
+ * url: The parsed url, or NULL for a path on the volume of the shell
+ *      connection.
+ * fs: The volume holding the path.
+ * path: The path on its volume.
+ * owns_fs: Whether fs was connected for this path, and is closed with it.
+ */
+struct batch_path {
+        char *arg;
+        struct gluster_url *url;
+        glfs_t *fs;
+        char *path;
+        bool owns_fs;
+};
+
+/**
+ * Paths, possibly spread over several volumes, to which one operation is
+ * applied concurrently. Paths on the same volume share one connection.
+ *
+ * jobs: Number of paths operated on concurrently.
+ * errors: Number of paths on which the operation failed.
+ */
+struct batch {
+        struct batch_path *paths;
+        size_t count;
+        size_t alloc;
+        int jobs;
+        pthread_mutex_t lock;
+        uintmax_t errors;
+};
+
+/**
+ * Applies the operation of a batch to path on fs. Failures are reported by
+ * the operation, in terms of arg.
+ */
+typedef int (*batch_func_t) (glfs_t *fs, const char *path, const char *arg,
+                             void *data);
+
+void
+batch_init (struct batch *batch);
+
+int
+batch_add (struct batch *batch, const char *arg, uint16_t port,
+           bool has_connection);
+
+int
+batch_add_files_from (struct batch *batch, const char *file, uint16_t port,
+                      bool has_connection);
+
+int
+batch_connect (struct batch *batch, glfs_t *connected,
+               struct xlator_option **options, bool debug);
+
+int
+batch_run (struct batch *batch, batch_func_t func, void *data);
+
+void
+batch_fini (struct batch *batch);
+
+#endif /* GLFS_BATCH_H */
@@ -1,5 +1,5 @@
 /**
- * A utility to read a file from a remote Gluster volume and stream it to
+ * A utility to read files from a remote Gluster volume and stream them to
  * stdout.
  *
  * Copyright (C) 2015 Facebook Inc.
@@ -22,31 +22,59 @@
 #include <config.h>
 
 #include "glfs-cat.h"
+#include "glfs-batch.h"
+#include "glfs-copy.h"
+#include "glfs-pool.h"
+#include "glfs-tree.h"
 #include "glfs-util.h"
 
 #include <errno.h>
 #include <error.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <glusterfs/api/glfs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define AUTHORS "Written by Craig Cabrey."
 
+/**
+ * Number of files opened and read ahead of the one being written by default.
+ * Concatenating many small files is bound by the requests needed to open,
+ * lock and close each of them rather than by their data, so those requests
+ * are issued for the next files while the current one is written.
+ */
+#define CAT_PREFETCH 8
+
+/**
+ * Ranges of a file are read CAT_CHUNK_SIZE bytes at a time by each stream,
+ * and up to twice as many chunks as streams are buffered, waiting to be
+ * written in order.
+ */
+#define CAT_CHUNK_SIZE (1024 * 1024)
+
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_url: Struct of the parsed url supplied by the user.
- * url: Full url used to find the remote file (supplied by user).
+ * files: The files to concatenate, supplied by the user.
+ * prefetch: Number of files opened and read ahead.
+ * offset, length: The range of each file written, length being -1 to write
+ *                 up to the end of the files.
+ * streams: Number of ranges of a file read concurrently.
  * debug: Whether to log additional debug information.
  */
 struct state {
-        struct gluster_url *gluster_url;
+        struct batch files;
         struct xlator_option *xlator_options;
-        char *url;
+        int prefetch;
+        off_t offset;
+        off_t length;
+        int streams;
         bool debug;
 };
 
@@ -56,69 +84,119 @@ static struct option const long_options[] =
 {
         {"debug", no_argument, NULL, 'd'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"length", required_argument, NULL, 'L'},
+        {"offset", required_argument, NULL, 'O'},
         {"port", required_argument, NULL, 'p'},
+        {"streams", required_argument, NULL, 'S'},
         {"version", no_argument, NULL, 'v'},
         {"xlator-option", required_argument, NULL, 'o'},
         {NULL, no_argument, NULL, 0}
 };
 
-static int
-gluster_get (glfs_t *fs, const char *filename) {
-        glfs_fd_t *fd = NULL;
-        int ret = -1;
-
-        fd = glfs_open (fs, filename, O_RDONLY);
-        if (fd == NULL) {
-                error (0, errno, "%s", state->url);
-                goto out;
-        }
-
-        // don't allow concurrent reads and writes.
-        ret = gluster_lock (fd, F_WRLCK, false);
-        if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto out;
-        }
-
-        if ((ret = gluster_read (fd, STDOUT_FILENO)) == -1) {
-                error (0, errno, "write error");
-                goto out;
-        }
-
-        ret = 0;
+/**
+ * A file to write to stdout, after the expansion of patterns.
+ *
+ * cat: The concatenation the file is part of.
+ * arg: The file as supplied by the user, for messages.
+ * fs, path: The volume of the file and its path on it.
+ * fd: The open file, until it is handed over to be closed.
+ * buf, len, eof: The data read ahead from the start of the file, and whether
+ *                it holds the whole file.
+ * err: The error that stopped the read ahead, or 0.
+ * done: Whether the read ahead is complete.
+ */
+struct cat_file {
+        struct cat *cat;
+        char *arg;
+        glfs_t *fs;
+        char *path;
+        glfs_fd_t *fd;
+        char *buf;
+        size_t len;
+        bool eof;
+        int err;
+        bool done;
+};
 
-out:
-        if (fd) {
-                if (glfs_close (fd) == -1) {
-                        ret = -1;
-                        error (0, errno, "cannot close file %s",
-                                        state->gluster_url->path);
-                }
-        }
+/**
+ * A range of a file read by one of the streams.
+ *
+ * offset, len: The range to read.
+ * got: Number of bytes read, short of len at the end of the file.
+ * err: The error that stopped the read, or 0.
+ * done: Whether the read is complete.
+ */
+struct cat_chunk {
+        struct cat *cat;
+        struct cat_file *file;
+        char *buf;
+        off_t offset;
+        size_t len;
+        size_t got;
+        int err;
+        bool done;
+};
 
-        return ret;
-}
+/**
+ * The files being concatenated, and the read ahead of the next ones.
+ *
+ * pool: Opens and reads ahead the next files, and closes the written ones.
+ * streams: Reads the chunks of the current file, when ranges are requested.
+ * chunks, window: The chunks of the current file being read, or NULL to
+ *                 stream files sequentially.
+ * lock, cond: Protect and signal the completion of the read ahead of each
+ *             file and of each chunk, and errors.
+ * errors: Number of files that could not be closed.
+ */
+struct cat {
+        struct cat_file *files;
+        size_t count;
+        size_t alloc;
+        struct pool *pool;
+        struct pool *streams;
+        struct cat_chunk *chunks;
+        size_t window;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        uintmax_t errors;
+};
 
 static void
 usage ()
 {
-        printf ("Usage: %s [OPTION]... URL\n"
-                "Read a file on a remote Gluster volume and write it to standard output.\n\n"
+        printf ("Usage: %s [OPTION]... URL...\n"
+                "Read files on a remote Gluster volume and write them to standard output,\n"
+                "in order. The last component of each URL may be a pattern, which is\n"
+                "expanded to the matching entries in name order.\n\n"
+                "  -j, --jobs=N                 open and read ahead up to N files while the\n"
+                "                               current one is written (default %d)\n"
+                "      --length=LENGTH          write at most LENGTH bytes of each file\n"
+                "      --offset=OFFSET          start writing each file at byte OFFSET\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
                 "  -p, --port=PORT              specify the port on which to connect\n"
+                "      --streams=N              read N ranges of each file concurrently,\n"
+                "                               writing them in order\n"
+                "  OFFSET and LENGTH may be followed by K, M, G or T for powers of 1024.\n\n"
                 "      --help     display this help and exit\n"
                 "      --version  output version information and exit\n\n"
                 "Examples:\n"
                 "  gfcat glfs://localhost/groot/path/to/file\n"
                 "        Write the contents of /path/to/file on the Gluster volume\n"
                 "        of groot on host localhost to standard output.\n"
+                "  gfcat 'glfs://localhost/groot/output/part-*'\n"
+                "        Write the files of /output whose name starts with part-,\n"
+                "        in name order.\n"
+                "  gfcat --streams=16 --offset=1G --length=4G glfs://localhost/groot/big\n"
+                "        Write the 4GiB of /big following its first GiB, reading 16\n"
+                "        ranges of it at once.\n"
                 "  gfcli (localhost/groot)> cat /file\n"
                 "        In the context of a shell with a connection established,\n"
                 "        cat the file on the root of the Gluster volume groot\n"
                 "        on localhost.\n",
-                program_invocation_name);
+                program_invocation_name, CAT_PREFETCH);
 }
 
 static int
@@ -128,12 +206,14 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt since other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "do:p:", long_options,
+                opt = getopt_long (argc, argv, "dj:o:p:", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -144,6 +224,44 @@ parse_options (int argc, char *argv[], bool has_connection)
                         case 'd':
                                 state->debug = true;
                                 break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->prefetch = jobs;
+                                break;
+                        case 'L':
+                                state->length = strtosize (optarg);
+                                if (state->length == -1) {
+                                        error (0, 0, "invalid length: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                break;
+                        case 'O':
+                                state->offset = strtosize (optarg);
+                                if (state->offset == -1) {
+                                        error (0, 0, "invalid offset: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                break;
+                        case 'S':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of streams: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->streams = jobs;
+                                break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
                                 if (option == NULL) {
@@ -183,42 +301,18 @@ parse_options (int argc, char *argv[], bool has_connection)
                 }
         }
 
-        if ((argc - option_index) < 2) {
+        if (optind == argc) {
                 error (0, 0, "missing operand");
                 goto err;
-        } else {
-                state->url = strdup (argv[argc - 1]);
-                if (state->url == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
-
-                if (has_connection) {
-                        state->gluster_url = gluster_url_init ();
-                        if (state->gluster_url == NULL) {
-                                error (0, errno, "gluster_url_init");
-                                goto out;
-                        }
-
-                        state->gluster_url->path = strdup (argv[argc - 1]);
-                        if (state->gluster_url->path == NULL) {
-                                error (0, errno, "strdup");
-                                goto out;
-                        }
-
-                        ret = 0;
-                        goto out;
-                }
+        }
 
-                ret = gluster_parse_url (argv[argc - 1], &(state->gluster_url));
-                if (ret == -1) {
-                        error (0, EINVAL, "%s", state->url);
+        for (int i = optind; i < argc; i++) {
+                if (batch_add (&state->files, argv[i], port, has_connection) == -1) {
                         goto err;
                 }
-
-                state->gluster_url->port = port;
         }
 
+        ret = 0;
         goto out;
 
 err:
@@ -236,9 +330,12 @@ init_state ()
                 goto out;
         }
 
+        batch_init (&state->files);
         state->debug = false;
-        state->gluster_url = NULL;
-        state->url = NULL;
+        state->prefetch = CAT_PREFETCH;
+        state->offset = 0;
+        state->length = -1;
+        state->streams = 1;
         state->xlator_options = NULL;
 
 out:
@@ -246,44 +343,520 @@ out:
 }
 
 static int
-cat_without_context ()
+cat_add (struct cat *cat, const char *arg, size_t arg_len, const char *name,
+         glfs_t *fs, const char *path, size_t path_len)
 {
-        glfs_t *fs = NULL;
-        int ret = -1;
+        struct cat_file *file;
+        size_t alloc;
+
+        if (cat->count == cat->alloc) {
+                alloc = cat->alloc ? cat->alloc * 2 : 16;
+                file = realloc (cat->files, alloc * sizeof (*file));
+                if (file == NULL) {
+                        error (0, errno, "realloc");
+                        return -1;
+                }
 
-        ret = gluster_getfs (&fs, state->gluster_url);
-        if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto out;
+                cat->files = file;
+                cat->alloc = alloc;
         }
 
-        ret = apply_xlator_options (fs, &state->xlator_options);
-        if (ret == -1) {
-                error (0, errno, "failed to apply translator options");
+        file = &cat->files[cat->count];
+        memset (file, 0, sizeof (*file));
+        file->cat = cat;
+        file->fs = fs;
+
+        if (asprintf (&file->arg, "%.*s%s", (int) arg_len, arg, name) == -1) {
+                file->arg = NULL;
+                error (0, errno, "asprintf");
+                return -1;
+        }
+
+        if (asprintf (&file->path, "%.*s%s", (int) path_len, path, name) == -1) {
+                file->path = NULL;
+                free (file->arg);
+                error (0, errno, "asprintf");
+                return -1;
+        }
+
+        cat->count++;
+
+        return 0;
+}
+
+/**
+ * Adds the file of path, expanding a pattern in its last component to the
+ * matching entries of the directory, in name order. Like the shell, a pattern
+ * that matches nothing is kept as it is.
+ */
+static int
+cat_expand (struct cat *cat, struct batch_path *path)
+{
+        const char *name = strrchr (path->path, '/');
+        const char *arg_name = strrchr (path->arg, '/');
+        struct tree_dir dir;
+        size_t path_len;
+        size_t arg_len;
+        size_t count = cat->count;
+        char *parent;
+        int ret = 0;
+
+        name = name ? name + 1 : path->path;
+        arg_name = arg_name ? arg_name + 1 : path->arg;
+        if (strpbrk (name, "*?[") == NULL || strcmp (name, arg_name) != 0) {
+                return cat_add (cat, path->arg, strlen (path->arg), "", path->fs,
+                                path->path, strlen (path->path));
+        }
+
+        path_len = name - path->path;
+        arg_len = arg_name - path->arg;
+
+        parent = strndup (path->path, path_len);
+        if (parent == NULL) {
+                error (0, errno, "strndup");
+                return -1;
+        }
+
+        if (tree_list_dir (path->fs, path_len > 0 ? parent : ".", &dir) == -1) {
+                error (0, errno, "%.*s", (int) arg_len, path->arg);
+                free (parent);
+                return -1;
+        }
+
+        for (size_t i = 0; i < dir.count && ret == 0; i++) {
+                if (fnmatch (name, dir.entries[i].name, FNM_PERIOD) == 0) {
+                        ret = cat_add (cat, path->arg, arg_len, dir.entries[i].name,
+                                       path->fs, path->path, path_len);
+                }
+        }
+
+        if (ret == 0 && cat->count == count) {
+                ret = cat_add (cat, path->arg, strlen (path->arg), "",
+                               path->fs, path->path, strlen (path->path));
+        }
+
+        tree_dir_free (&dir);
+        free (parent);
+
+        return ret;
+}
+
+/**
+ * Opens a file, locks it and reads the first block of the range to write.
+ * Runs on the pool ahead of the writes, so errors are kept for the writer to
+ * report in order.
+ */
+static void
+cat_prefetch (void *arg)
+{
+        struct cat_file *file = arg;
+        struct cat *cat = file->cat;
+        struct copy_file src;
+        size_t want = BUFSIZE;
+        ssize_t ret;
+
+        if (state->length != -1 && state->length < want) {
+                want = state->length;
+        }
+
+        file->fd = glfs_open (file->fs, file->path, O_RDONLY);
+        if (file->fd == NULL) {
+                file->err = errno;
                 goto out;
         }
 
-        if (state->debug) {
-                ret = glfs_set_logging (fs, "/dev/stderr", GF_LOG_DEBUG);
+        // don't allow concurrent reads and writes.
+        if (gluster_lock (file->fd, F_WRLCK, false) == -1) {
+                file->err = errno;
+                goto out;
+        }
 
+        src = COPY_FILE_REMOTE (file->fs, file->fd, file->path);
+        while (file->len < want) {
+                ret = copy_pread (&src, &file->buf[file->len], want - file->len,
+                                  state->offset + file->len);
                 if (ret == -1) {
-                        error (0, errno, "failed to set logging level");
+                        file->err = errno;
                         goto out;
                 }
+
+                if (ret == 0) {
+                        break;
+                }
+
+                file->len += ret;
         }
 
-        ret = gluster_get (fs, state->gluster_url->path);
-        if (ret == -1) {
+        // The block holds the whole range when it ends short of a full one.
+        file->eof = file->len < BUFSIZE;
+
+out:
+        pthread_mutex_lock (&cat->lock);
+        file->done = true;
+        pthread_cond_broadcast (&cat->cond);
+        pthread_mutex_unlock (&cat->lock);
+}
+
+/**
+ * Closes a file once it has been written, off the path of the writer.
+ */
+static void
+cat_close (void *arg)
+{
+        struct cat_file *file = arg;
+        struct cat *cat = file->cat;
+
+        if (glfs_close (file->fd) == -1) {
+                error (0, errno, "cannot close file %s", file->path);
+                pthread_mutex_lock (&cat->lock);
+                cat->errors++;
+                pthread_mutex_unlock (&cat->lock);
+        }
+
+        file->fd = NULL;
+}
+
+static int
+write_all (const char *buf, size_t len)
+{
+        ssize_t ret;
+
+        for (size_t done = 0; done < len; done += ret) {
+                ret = write (STDOUT_FILENO, &buf[done], len - done);
+                if (ret == -1) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Reads a chunk of a file on one of the streams.
+ */
+static void
+cat_read_chunk (void *arg)
+{
+        struct cat_chunk *chunk = arg;
+        struct cat *cat = chunk->cat;
+        struct copy_file src = COPY_FILE_REMOTE (chunk->file->fs,
+                                                 chunk->file->fd,
+                                                 chunk->file->path);
+        ssize_t ret;
+
+        while (chunk->got < chunk->len) {
+                ret = copy_pread (&src, &chunk->buf[chunk->got],
+                                  chunk->len - chunk->got,
+                                  chunk->offset + chunk->got);
+                if (ret == -1) {
+                        chunk->err = errno;
+                        break;
+                }
+
+                if (ret == 0) {
+                        break;
+                }
+
+                chunk->got += ret;
+        }
+
+        pthread_mutex_lock (&cat->lock);
+        chunk->done = true;
+        pthread_cond_broadcast (&cat->cond);
+        pthread_mutex_unlock (&cat->lock);
+}
+
+static void
+cat_submit_chunk (struct cat *cat, struct cat_chunk *chunk,
+                  struct cat_file *file, off_t offset, off_t end)
+{
+        chunk->cat = cat;
+        chunk->file = file;
+        chunk->offset = offset;
+        chunk->len = end - offset < CAT_CHUNK_SIZE ? end - offset : CAT_CHUNK_SIZE;
+        chunk->got = 0;
+        chunk->err = 0;
+        chunk->done = false;
+
+        pool_submit (cat->streams, cat_read_chunk, chunk);
+}
+
+static void
+cat_wait_chunk (struct cat *cat, struct cat_chunk *chunk)
+{
+        pthread_mutex_lock (&cat->lock);
+        while (!chunk->done) {
+                pthread_cond_wait (&cat->cond, &cat->lock);
+        }
+        pthread_mutex_unlock (&cat->lock);
+}
+
+/**
+ * Writes the range [start, end) of a file, end being -1 for the end of the
+ * file. The range is split in chunks read concurrently by the streams, and
+ * the chunks are written in order as they complete, through a window that
+ * bounds the data buffered. Returns -1 on read errors, after which the next
+ * files may still be written, and -2 on write errors.
+ */
+static int
+cat_range (struct cat *cat, struct cat_file *file, off_t start, off_t end)
+{
+        struct cat_chunk *chunk;
+        struct stat statbuf;
+        off_t next = start;
+        size_t head = 0;
+        size_t tail = 0;
+        int ret = 0;
+
+        if (glfs_fstat (file->fd, &statbuf) == -1) {
+                error (0, errno, "%s", file->arg);
+                return -1;
+        }
+
+        if (end == -1 || end > statbuf.st_size) {
+                end = statbuf.st_size;
+        }
+
+        // Chunks head to tail - 1 are in flight, in the order of the file.
+        for (; tail < cat->window && next < end; tail++) {
+                cat_submit_chunk (cat, &cat->chunks[tail % cat->window], file,
+                                  next, end);
+                next += cat->chunks[tail % cat->window].len;
+        }
+
+        for (; head < tail; head++) {
+                chunk = &cat->chunks[head % cat->window];
+                cat_wait_chunk (cat, chunk);
+
+                if (chunk->err != 0) {
+                        error (0, chunk->err, "%s", file->arg);
+                        ret = -1;
+                        break;
+                }
+
+                if (write_all (chunk->buf, chunk->got) == -1) {
+                        error (0, errno, "write error");
+                        ret = -2;
+                        break;
+                }
+
+                // The file shrank since its size was fetched.
+                if (chunk->got < chunk->len) {
+                        break;
+                }
+
+                if (next < end) {
+                        cat_submit_chunk (cat, chunk, file, next, end);
+                        next += chunk->len;
+                        tail++;
+                }
+        }
+
+        // Chunks still in flight use the file and the buffers.
+        for (head++; head < tail; head++) {
+                cat_wait_chunk (cat, &cat->chunks[head % cat->window]);
+        }
+
+        return ret;
+}
+
+/**
+ * Writes a file whose first block has been read ahead. Returns -1 on read
+ * errors, after which the next files may still be written, and -2 on write
+ * errors.
+ */
+static int
+cat_write (struct cat *cat, struct cat_file *file)
+{
+        off_t start = state->offset + file->len;
+
+        if (write_all (file->buf, file->len) == -1) {
+                error (0, errno, "write error");
+                return -2;
+        }
+
+        if (file->eof) {
+                return 0;
+        }
+
+        if (cat->chunks != NULL) {
+                return cat_range (cat, file, start, state->length == -1 ? -1 :
+                                  state->offset + state->length);
+        }
+
+        if (glfs_lseek (file->fd, start, SEEK_SET) == -1) {
+                error (0, errno, "%s", file->arg);
+                return -1;
+        }
+
+        if (gluster_read (file->fd, STDOUT_FILENO) == -1) {
+                error (0, errno, "write error");
+                return -2;
+        }
+
+        return 0;
+}
+
+/**
+ * Writes the files to stdout in order. The files after the current one are
+ * opened and read ahead on the pool, each with a slot of buffers, so that
+ * small files are written without waiting for any request and the link
+ * stays busy across files.
+ */
+static int
+cat_files (struct cat *cat)
+{
+        size_t depth = state->prefetch;
+        char *buffers = NULL;
+        char *chunk_buffers = NULL;
+        struct cat_file *file;
+        size_t next = 0;
+        int ret = 0;
+
+        if (depth > cat->count) {
+                depth = cat->count;
+        }
+
+        buffers = malloc (depth * BUFSIZE);
+        if (buffers == NULL) {
+                error (0, errno, "malloc");
+                ret = -1;
                 goto out;
         }
 
-        ret = 0;
+        cat->pool = pool_create (depth, depth * 2);
+        if (cat->pool == NULL) {
+                error (0, errno, "failed to start read threads");
+                ret = -1;
+                goto out;
+        }
+
+        // A bounded range, or several streams, go through the chunks; the
+        // rest of a whole file is otherwise streamed sequentially.
+        if (state->streams > 1 || state->length != -1) {
+                cat->window = state->streams * 2;
+                cat->chunks = calloc (cat->window, sizeof (*cat->chunks));
+                chunk_buffers = malloc (cat->window * CAT_CHUNK_SIZE);
+                if (cat->chunks == NULL || chunk_buffers == NULL) {
+                        error (0, errno, "malloc");
+                        ret = -1;
+                        goto out;
+                }
+
+                for (size_t i = 0; i < cat->window; i++) {
+                        cat->chunks[i].buf = &chunk_buffers[i * CAT_CHUNK_SIZE];
+                }
+
+                cat->streams = pool_create (state->streams, cat->window);
+                if (cat->streams == NULL) {
+                        error (0, errno, "failed to start read threads");
+                        ret = -1;
+                        goto out;
+                }
+        }
+
+        // The slot of a file is reused by the file depth places after it,
+        // which is only queued once the file has been written.
+        for (; next < depth; next++) {
+                cat->files[next].buf = &buffers[next * BUFSIZE];
+                pool_submit (cat->pool, cat_prefetch, &cat->files[next]);
+        }
+
+        for (size_t i = 0; i < cat->count; i++) {
+                file = &cat->files[i];
+
+                pthread_mutex_lock (&cat->lock);
+                while (!file->done) {
+                        pthread_cond_wait (&cat->cond, &cat->lock);
+                }
+                pthread_mutex_unlock (&cat->lock);
+
+                if (file->err != 0) {
+                        error (0, file->err, "%s", file->arg);
+                        ret = -1;
+                } else {
+                        switch (cat_write (cat, file)) {
+                                case -1:
+                                        ret = -1;
+                                        break;
+                                case -2:
+                                        ret = -1;
+                                        goto out;
+                        }
+                }
+
+                if (file->fd != NULL) {
+                        pool_submit (cat->pool, cat_close, file);
+                }
+
+                if (next < cat->count) {
+                        cat->files[next].buf = file->buf;
+                        pool_submit (cat->pool, cat_prefetch, &cat->files[next]);
+                        next++;
+                }
+        }
 
 out:
-        if (fs) {
-                glfs_fini (fs);
+        // Wait for the closes, and for read ahead cut short by a write error.
+        pool_destroy (cat->pool);
+        cat->pool = NULL;
+        pool_destroy (cat->streams);
+        cat->streams = NULL;
+
+        for (size_t i = 0; i < cat->count; i++) {
+                file = &cat->files[i];
+                if (file->fd != NULL && file->done && glfs_close (file->fd) == -1) {
+                        error (0, errno, "cannot close file %s", file->path);
+                        ret = -1;
+                }
+
+                file->fd = NULL;
+        }
+
+        if (cat->errors > 0) {
+                ret = -1;
+        }
+
+        free (cat->chunks);
+        cat->chunks = NULL;
+        free (chunk_buffers);
+        free (buffers);
+
+        return ret;
+}
+
+static int
+cat_with_fs (glfs_t *fs)
+{
+        struct cat cat = { 0 };
+        int ret;
+
+        ret = batch_connect (&state->files, fs, &state->xlator_options,
+                             state->debug);
+        if (ret == -1) {
+                return -1;
         }
 
+        pthread_mutex_init (&cat.lock, NULL);
+        pthread_cond_init (&cat.cond, NULL);
+
+        for (size_t i = 0; i < state->files.count && ret == 0; i++) {
+                ret = cat_expand (&cat, &state->files.paths[i]);
+        }
+
+        if (ret == 0) {
+                ret = cat_files (&cat);
+        }
+
+        for (size_t i = 0; i < cat.count; i++) {
+                free (cat.files[i].arg);
+                free (cat.files[i].path);
+        }
+
+        free (cat.files);
+        pthread_mutex_destroy (&cat.lock);
+        pthread_cond_destroy (&cat.cond);
+
         return ret;
 }
 
@@ -300,31 +873,23 @@ do_cat (struct cli_context *ctx)
                 goto out;
         }
 
-        if (ctx->fs) {
-                ret = parse_options (argc, argv, true);
-                if (ret != 0) {
-                        goto out;
-                }
-
-                ret = gluster_get (ctx->fs, state->gluster_url->path);
-        } else {
-                state->debug = ctx->options->debug;
-                ret = parse_options (argc, argv, false);
-                switch (ret) {
-                        case -2:
-                                // Fall through
-                                ret = 0;
-                        case -1:
-                                goto out;
-                }
+        state->debug = ctx->options->debug;
 
-                ret = cat_without_context ();
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
+                        ret = 0;
+                case -1:
+                        goto out;
         }
 
+        ret = cat_with_fs (ctx->fs);
+
 out:
         if (state) {
-                gluster_url_free (state->gluster_url);
-                free (state->url);
+                batch_fini (&state->files);
+                free_xlator_options (&state->xlator_options);
         }
 
         free (state);
@@ -48,6 +48,7 @@
 #include "glfs-touch.h"
 #include "glfs-rm.h"
 #include "glfs-stat.h"
+#include "glfs-sync.h"
 #include "glfs-tail.h"
 #include "glfs-rmdir.h"
 #include "glfs-mv.h"
@@ -79,6 +80,7 @@ shell_usage ()
                 "* quit\n"
                 "* rm\n"
                 "* stat\n"
+                "* sync\n"
                 "* tail\n"
                 "* truncate\n"
                 "* clear\n"
@@ -108,6 +110,7 @@ static struct cmd const cmds[] =
 #endif
         { .alias = "virtfs-stat", .name = "stat", .execute = do_stat },
 #if 0
+        { .alias = "gfsync", .name = "sync", .execute = do_sync },
         { .alias = "gftail", .name = "tail", .execute = do_tail },
         { .name = "flock", .execute = do_flock },
         { .alias = "gftruncate", .name = "truncate", .execute = do_truncate },
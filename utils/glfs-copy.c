@@ -0,0 +1,1773 @@
+/**
+ * Data transfer engine shared by the utilities that copy file contents
+ * between local files and remote Gluster volumes.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-copy.h"
+#include "glfs-delta.h"
+#include "glfs-pool.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <glusterfs/api/glfs.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_EVERY_SECS 30
+
+/**
+ * Granularity of the zero block detection. Runs of zeroes shorter than this
+ * are always written, which keeps the number of write calls bounded.
+ */
+#define SPARSE_BLOCK_SIZE 4096
+
+/**
+ * Largest range handed to the server in one server side copy request.
+ */
+#define SERVER_COPY_SIZE 64*1024*1024
+
+/**
+ * The manifest of a resumable transfer is kept next to the destination and
+ * rewritten at most every RESUME_COMMIT_SECS.
+ */
+#define RESUME_SUFFIX ".gfcp-resume"
+#define RESUME_MAGIC "gfcp-resume 1"
+#define RESUME_COMMIT_SECS 5
+
+/**
+ * State of a single copy_file_data () call.
+ *
+ * buf, buf_size: Bounce buffer, of COPY_BUFFER_SIZE bytes unless the source
+ *                is known to be smaller.
+ * punch_zeroes: Whether blocks of zeroes are turned into holes.
+ * server_copy: Whether ranges are still offered to the server first; cleared
+ *              as soon as the server refuses.
+ * sparse, looks_sparse: How holes are kept, and whether the source has fewer
+ *                       blocks allocated than its size implies.
+ * dense: Whether the source reports blocks allocated for all of its size,
+ *        so that it cannot have holes.
+ * seek_unsupported: Set once the source failed to report its extents.
+ * total_written, time_start, time_last: Progress reported on stderr, in the
+ *              same format as gluster_write () and gluster_read ().
+ * sum_type: Checksum computed over the source data as it passes through
+ *           buf, for --verify and --resume.
+ * verify_inline: Cleared when a range was copied by the server, in which case
+ *                the source has to be read back like the destination.
+ * verify_pos: Offset up to which the source has been fed to sum.
+ * chunk_sums, chunk_count, chunk_alloc: Checksums of the completed chunks,
+ *                                       indexed by chunk.
+ * zero_sum: Checksum of a chunk made of zeroes, computed once for holes.
+ */
+struct transfer {
+        struct copy_file *src;
+        struct copy_file *dst;
+        char *buf;
+        size_t buf_size;
+        bool punch_zeroes;
+        bool server_copy;
+        enum sparse_mode sparse;
+        bool looks_sparse;
+        bool dense;
+        bool seek_unsupported;
+        size_t total_written;
+        time_t time_start;
+        time_t time_last;
+        enum checksum_type sum_type;
+        bool verify_inline;
+        struct checksum sum;
+        off_t verify_pos;
+        uint64_t *chunk_sums;
+        size_t chunk_count;
+        size_t chunk_alloc;
+        bool zero_sum_valid;
+        uint64_t zero_sum;
+};
+
+/**
+ * A chunk checksummed by one of the verify threads.
+ */
+struct verify_job {
+        struct copy_file *file;
+        enum checksum_type type;
+        off_t offset;
+        size_t length;
+        uint64_t sum;
+        int err;
+};
+
+/**
+ * Chunks of a resumable transfer, as recorded in its manifest.
+ *
+ * path, tmp_path: The manifest, and the file it is written to before being
+ *                 renamed over it.
+ * size, mtime: Identify the version of the source the chunks were copied from.
+ * done, sums: Which of the count chunks were copied, and their checksums.
+ */
+struct manifest {
+        struct copy_file *dst;
+        char *path;
+        char *tmp_path;
+        intmax_t size;
+        intmax_t mtime;
+        enum checksum_type type;
+        size_t count;
+        bool *done;
+        uint64_t *sums;
+};
+
+static const char zeroes[SPARSE_BLOCK_SIZE];
+
+void
+copy_options_init (struct copy_options *options)
+{
+        options->sparse = SPARSE_AUTO;
+        options->server_copy = false;
+        options->verify = CHECKSUM_NONE;
+        options->resume = false;
+        options->delta = false;
+        options->update = false;
+        options->compare = CHECKSUM_NONE;
+        options->preserve_times = false;
+        options->preallocate = false;
+}
+
+/**
+ * Returns whether the existing contents of the destination are used by the
+ * transfer, in which case it must be opened without truncating it.
+ */
+bool
+copy_keeps_dest (const struct copy_options *options)
+{
+        return options->resume || options->delta || options->update;
+}
+
+int
+parse_sparse_mode (const char *arg, enum sparse_mode *mode)
+{
+        if (strcmp (arg, "never") == 0) {
+                *mode = SPARSE_NEVER;
+        } else if (strcmp (arg, "auto") == 0) {
+                *mode = SPARSE_AUTO;
+        } else if (strcmp (arg, "always") == 0) {
+                *mode = SPARSE_ALWAYS;
+        } else {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return 0;
+}
+
+ssize_t
+copy_pread (struct copy_file *file, void *buf, size_t count, off_t offset)
+{
+        if (file->glfd == NULL) {
+                return pread (file->fd, buf, count, offset);
+        }
+
+#ifdef HAVE_GLFS_7_6
+        return glfs_pread (file->glfd, buf, count, offset, 0, NULL);
+#else
+        return glfs_pread (file->glfd, buf, count, offset, 0);
+#endif
+}
+
+ssize_t
+copy_pwrite (struct copy_file *file, const void *buf, size_t count, off_t offset)
+{
+        if (file->glfd == NULL) {
+                return pwrite (file->fd, buf, count, offset);
+        }
+
+#ifdef HAVE_GLFS_7_6
+        return glfs_pwrite (file->glfd, buf, count, offset, 0, NULL, NULL);
+#else
+        return glfs_pwrite (file->glfd, buf, count, offset, 0);
+#endif
+}
+
+off_t
+copy_lseek (struct copy_file *file, off_t offset, int whence)
+{
+        if (file->glfd == NULL) {
+                return lseek (file->fd, offset, whence);
+        }
+
+        return glfs_lseek (file->glfd, offset, whence);
+}
+
+int
+copy_fstat (struct copy_file *file, struct stat *statbuf)
+{
+        if (file->glfd == NULL) {
+                return fstat (file->fd, statbuf);
+        }
+
+        return glfs_fstat (file->glfd, statbuf);
+}
+
+int
+copy_ftruncate (struct copy_file *file, off_t length)
+{
+        if (file->glfd == NULL) {
+                return ftruncate (file->fd, length);
+        }
+
+#ifdef HAVE_GLFS_7_6
+        return glfs_ftruncate (file->glfd, length, NULL, NULL);
+#else
+        return glfs_ftruncate (file->glfd, length);
+#endif
+}
+
+/**
+ * Reserves or deallocates a range of the file, with the FALLOC_FL_* modes of
+ * fallocate(2). Volumes only support the two modes gfapi exposes: allocating,
+ * optionally keeping the size, and punching a hole that keeps the size.
+ */
+int
+copy_fallocate (struct copy_file *file, int mode, off_t offset, off_t len)
+{
+        if (file->glfd == NULL) {
+                return fallocate (file->fd, mode, offset, len);
+        }
+
+        if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+                return glfs_discard (file->glfd, offset, len);
+        }
+
+        if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+                errno = EOPNOTSUPP;
+                return -1;
+        }
+
+        return glfs_fallocate (file->glfd, mode != 0, offset, len);
+}
+
+/**
+ * Returns whether the buffer only contains zeroes.
+ *
+ * The bulk of the buffer is OR-ed together 64 bytes at a time through GCC
+ * vector types, which the compiler lowers to SSE2 or AVX2 instructions
+ * depending on the target. Non-zero data is usually found within the first
+ * few bytes, so the early exit keeps the common case cheap.
+ */
+bool
+buffer_is_zero (const void *buf, size_t len)
+{
+        typedef uint64_t vec_t __attribute__ ((vector_size (32), aligned (1)));
+        const unsigned char *p = buf;
+        const unsigned char *end = p + len;
+
+        // Check the unaligned head byte by byte; it also catches most
+        // non-zero buffers before any vector work is done.
+        while (p < end && ((uintptr_t) p & (sizeof (vec_t) - 1)) != 0) {
+                if (*p++ != 0) {
+                        return false;
+                }
+        }
+
+        while (end - p >= 2 * (ptrdiff_t) sizeof (vec_t)) {
+                const vec_t *v = (const vec_t *) p;
+                vec_t acc = v[0] | v[1];
+
+                if ((acc[0] | acc[1] | acc[2] | acc[3]) != 0) {
+                        return false;
+                }
+
+                p += 2 * sizeof (vec_t);
+        }
+
+        while (p < end) {
+                if (*p++ != 0) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static void
+progress_update (struct transfer *xfer, size_t written)
+{
+        time_t time_cur = time (NULL);
+
+        xfer->total_written += written;
+        if (time_cur - xfer->time_last > LOG_EVERY_SECS) {
+                xfer->time_last = time_cur;
+                fprintf (stderr,
+                         "Wrote: %zu. Time: %zu\n",
+                         xfer->total_written,
+                         time_cur - xfer->time_start);
+        }
+}
+
+static int
+verify_store_chunk (struct transfer *xfer, size_t index, uint64_t sum)
+{
+        uint64_t *chunk_sums;
+        size_t alloc;
+
+        if (index >= xfer->chunk_alloc) {
+                alloc = xfer->chunk_alloc ? xfer->chunk_alloc * 2 : 64;
+                if (alloc <= index) {
+                        alloc = index + 1;
+                }
+
+                chunk_sums = realloc (xfer->chunk_sums,
+                                      alloc * sizeof (*chunk_sums));
+                if (chunk_sums == NULL) {
+                        error (0, errno, "realloc");
+                        return -1;
+                }
+
+                memset (&chunk_sums[xfer->chunk_alloc], 0,
+                        (alloc - xfer->chunk_alloc) * sizeof (*chunk_sums));
+                xfer->chunk_sums = chunk_sums;
+                xfer->chunk_alloc = alloc;
+        }
+
+        xfer->chunk_sums[index] = sum;
+        if (index >= xfer->chunk_count) {
+                xfer->chunk_count = index + 1;
+        }
+
+        return 0;
+}
+
+/**
+ * Closes the chunk in progress and starts the next one.
+ */
+static int
+verify_end_chunk (struct transfer *xfer)
+{
+        uint64_t sum = checksum_final (&xfer->sum);
+        int ret;
+
+        checksum_fini (&xfer->sum);
+        ret = checksum_init (&xfer->sum, xfer->sum_type);
+        if (ret < 0) {
+                error (0, -ret, "failed to initialize checksum");
+                return -1;
+        }
+
+        return verify_store_chunk (xfer, (xfer->verify_pos - 1) / VERIFY_CHUNK_SIZE,
+                                   sum);
+}
+
+/**
+ * Adds the data at verify_pos to the checksum of the source.
+ */
+static int
+verify_update (struct transfer *xfer, const char *buf, size_t count)
+{
+        size_t len;
+
+        while (count > 0) {
+                len = VERIFY_CHUNK_SIZE - xfer->verify_pos % VERIFY_CHUNK_SIZE;
+                if (len > count) {
+                        len = count;
+                }
+
+                checksum_update (&xfer->sum, buf, len);
+                xfer->verify_pos += len;
+                buf += len;
+                count -= len;
+
+                if (xfer->verify_pos % VERIFY_CHUNK_SIZE == 0 &&
+                    verify_end_chunk (xfer) == -1) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Adds the zeroes of a hole ending at offset to the checksum of the source.
+ * Whole chunks within the hole reuse the checksum of a zero chunk, so that
+ * large holes are not hashed byte by byte.
+ */
+static int
+verify_update_hole (struct transfer *xfer, off_t offset)
+{
+        struct checksum sum;
+        size_t len;
+        int ret;
+
+        while (xfer->verify_pos < offset) {
+                if (xfer->verify_pos % VERIFY_CHUNK_SIZE == 0 &&
+                    offset - xfer->verify_pos >= VERIFY_CHUNK_SIZE) {
+                        if (!xfer->zero_sum_valid) {
+                                ret = checksum_init (&sum, xfer->sum_type);
+                                if (ret < 0) {
+                                        error (0, -ret, "failed to initialize checksum");
+                                        return -1;
+                                }
+
+                                for (len = 0; len < VERIFY_CHUNK_SIZE; len += sizeof (zeroes)) {
+                                        checksum_update (&sum, zeroes, sizeof (zeroes));
+                                }
+
+                                xfer->zero_sum = checksum_final (&sum);
+                                xfer->zero_sum_valid = true;
+                                checksum_fini (&sum);
+                        }
+
+                        if (verify_store_chunk (xfer,
+                                                xfer->verify_pos / VERIFY_CHUNK_SIZE,
+                                                xfer->zero_sum) == -1) {
+                                return -1;
+                        }
+
+                        xfer->verify_pos += VERIFY_CHUNK_SIZE;
+                        continue;
+                }
+
+                len = offset - xfer->verify_pos < (off_t) sizeof (zeroes) ?
+                        offset - xfer->verify_pos : sizeof (zeroes);
+                if (verify_update (xfer, zeroes, len) == -1) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Feeds data read from the source at the given offset to the checksum, along
+ * with any hole skipped since the previous read.
+ */
+static int
+verify_data (struct transfer *xfer, const char *buf, size_t count, off_t offset)
+{
+        if (xfer->sum_type == CHECKSUM_NONE || !xfer->verify_inline) {
+                return 0;
+        }
+
+        if (verify_update_hole (xfer, offset) == -1) {
+                return -1;
+        }
+
+        return verify_update (xfer, buf, count);
+}
+
+/**
+ * Completes the checksum of the chunk ending at offset, which is the end of
+ * the file or a chunk boundary.
+ */
+static int
+verify_finish_chunk (struct transfer *xfer, off_t offset)
+{
+        if (xfer->sum_type == CHECKSUM_NONE || !xfer->verify_inline) {
+                return 0;
+        }
+
+        if (verify_update_hole (xfer, offset) == -1) {
+                return -1;
+        }
+
+        // Chunks ending on a boundary were completed by verify_update ().
+        if (xfer->verify_pos % VERIFY_CHUNK_SIZE != 0) {
+                return verify_end_chunk (xfer);
+        }
+
+        return 0;
+}
+
+static void
+verify_chunk (void *arg)
+{
+        struct verify_job *job = arg;
+        struct checksum sum;
+        char *buf;
+        size_t done = 0;
+        ssize_t ret;
+
+        buf = malloc (COPY_BUFFER_SIZE);
+        if (buf == NULL) {
+                job->err = errno;
+                return;
+        }
+
+        ret = checksum_init (&sum, job->type);
+        if (ret < 0) {
+                job->err = -ret;
+                goto out;
+        }
+
+        while (done < job->length) {
+                ret = copy_pread (job->file, buf,
+                                  job->length - done < COPY_BUFFER_SIZE ?
+                                  job->length - done : COPY_BUFFER_SIZE,
+                                  job->offset + done);
+                if (ret == -1) {
+                        job->err = errno;
+                        break;
+                }
+
+                // The file is shorter than expected.
+                if (ret == 0) {
+                        job->err = EIO;
+                        break;
+                }
+
+                checksum_update (&sum, buf, ret);
+                done += ret;
+        }
+
+        job->sum = checksum_final (&sum);
+        checksum_fini (&sum);
+
+out:
+        free (buf);
+}
+
+/**
+ * Computes the checksum of each chunk of the first size bytes of file, using
+ * VERIFY_THREADS parallel ranged reads. When select is not NULL, only the
+ * chunks for which it is true are read. Returns an array of chunk checksums,
+ * or NULL on error.
+ */
+static uint64_t *
+checksum_chunks (struct copy_file *file, enum checksum_type type, off_t size,
+                 size_t count, const bool *select)
+{
+        struct verify_job *jobs = NULL;
+        struct pool *pool = NULL;
+        uint64_t *sums = NULL;
+        size_t i;
+
+        jobs = calloc (count ? count : 1, sizeof (*jobs));
+        sums = calloc (count ? count : 1, sizeof (*sums));
+        if (jobs == NULL || sums == NULL) {
+                error (0, errno, "calloc");
+                goto err;
+        }
+
+        // Small files are compared by the thousands when syncing trees, so
+        // do not start threads for a single chunk.
+        if (count > 1) {
+                pool = pool_create (count < VERIFY_THREADS ? count : VERIFY_THREADS,
+                                    VERIFY_THREADS * 2);
+                if (pool == NULL) {
+                        error (0, errno, "failed to start verify threads");
+                        goto err;
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                if (select != NULL && !select[i]) {
+                        continue;
+                }
+
+                jobs[i].file = file;
+                jobs[i].type = type;
+                jobs[i].offset = (off_t) i * VERIFY_CHUNK_SIZE;
+                jobs[i].length = size - jobs[i].offset < VERIFY_CHUNK_SIZE ?
+                        size - jobs[i].offset : VERIFY_CHUNK_SIZE;
+                if (pool == NULL) {
+                        verify_chunk (&jobs[i]);
+                } else {
+                        pool_submit (pool, verify_chunk, &jobs[i]);
+                }
+        }
+
+        if (pool != NULL) {
+                pool_wait (pool);
+                pool_destroy (pool);
+        }
+
+        for (i = 0; i < count; i++) {
+                if (jobs[i].err != 0) {
+                        error (0, jobs[i].err, "verify read error: %s at offset %jd",
+                               file->path, (intmax_t) jobs[i].offset);
+                        goto err;
+                }
+
+                sums[i] = jobs[i].sum;
+        }
+
+        free (jobs);
+
+        return sums;
+
+err:
+        free (jobs);
+        free (sums);
+
+        return NULL;
+}
+
+/**
+ * Compares the destination with the source once size bytes were transferred.
+ * The source checksums were computed while the data moved through the client,
+ * so only the destination has to be read back, in parallel chunks.
+ */
+static int
+verify_transfer (struct transfer *xfer, off_t size)
+{
+        uint64_t *src_sums = NULL;
+        uint64_t *dst_sums = NULL;
+        struct stat statbuf;
+        size_t count;
+        size_t i;
+        int ret = -1;
+
+        count = (size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+
+        if (xfer->verify_inline) {
+                src_sums = xfer->chunk_sums;
+                xfer->chunk_sums = NULL;
+        } else {
+                src_sums = checksum_chunks (xfer->src, xfer->sum_type, size, count,
+                                            NULL);
+                if (src_sums == NULL) {
+                        goto out;
+                }
+        }
+
+        if (copy_fstat (xfer->dst, &statbuf) == -1) {
+                error (0, errno, "%s", xfer->dst->path);
+                goto out;
+        }
+
+        if (statbuf.st_size != size) {
+                error (0, 0, "verify failed: %s: size is %jd, expected %jd",
+                       xfer->dst->path, (intmax_t) statbuf.st_size,
+                       (intmax_t) size);
+                errno = EIO;
+                goto out;
+        }
+
+        dst_sums = checksum_chunks (xfer->dst, xfer->sum_type, size, count, NULL);
+        if (dst_sums == NULL) {
+                goto out;
+        }
+
+        ret = 0;
+        for (i = 0; i < count; i++) {
+                if (src_sums[i] != dst_sums[i]) {
+                        error (0, 0, "verify failed: %s: %s mismatch at offset %jd",
+                               xfer->dst->path, checksum_name (xfer->sum_type),
+                               (intmax_t) i * VERIFY_CHUNK_SIZE);
+                        errno = EIO;
+                        ret = -1;
+                }
+        }
+
+out:
+        free (src_sums);
+        free (dst_sums);
+
+        return ret;
+}
+
+/**
+ * Returns whether a destination with the given attributes holds the same
+ * version of the source: it has the same size and was not modified before
+ * the source. Transfers with preserve_times set give the destination the
+ * modification time of the source, so the rule holds exactly after a copy.
+ */
+bool
+copy_stat_is_current (const struct stat *src, const struct stat *dst)
+{
+        if (src->st_size != dst->st_size) {
+                return false;
+        }
+
+        if (dst->st_mtim.tv_sec != src->st_mtim.tv_sec) {
+                return dst->st_mtim.tv_sec > src->st_mtim.tv_sec;
+        }
+
+        return dst->st_mtim.tv_nsec >= src->st_mtim.tv_nsec;
+}
+
+/**
+ * Returns 1 when dst already holds the contents of src, 0 when it must be
+ * copied, or -1 on error. With compare set, files of the same size are
+ * compared by checksumming both in parallel chunks rather than trusting the
+ * modification times.
+ */
+int
+copy_is_current (struct copy_file *src, struct copy_file *dst,
+                 const struct stat *src_stat, enum checksum_type compare)
+{
+        struct stat dst_stat;
+        uint64_t *src_sums = NULL;
+        uint64_t *dst_sums = NULL;
+        size_t count;
+        int ret = -1;
+
+        if (copy_fstat (dst, &dst_stat) == -1) {
+                error (0, errno, "%s", dst->path);
+                return -1;
+        }
+
+        if (compare == CHECKSUM_NONE) {
+                return copy_stat_is_current (src_stat, &dst_stat);
+        }
+
+        if (src_stat->st_size != dst_stat.st_size) {
+                return 0;
+        }
+
+        count = (src_stat->st_size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+
+        src_sums = checksum_chunks (src, compare, src_stat->st_size, count, NULL);
+        if (src_sums == NULL) {
+                goto out;
+        }
+
+        dst_sums = checksum_chunks (dst, compare, src_stat->st_size, count, NULL);
+        if (dst_sums == NULL) {
+                goto out;
+        }
+
+        ret = memcmp (src_sums, dst_sums, count * sizeof (*src_sums)) == 0;
+
+out:
+        free (src_sums);
+        free (dst_sums);
+
+        return ret;
+}
+
+/**
+ * Writes count bytes at the given offset, retrying short writes. Errors are
+ * reported on stderr.
+ */
+int
+copy_pwrite_all (struct copy_file *dst, const void *buf, size_t count,
+                 off_t offset)
+{
+        const char *data = buf;
+        ssize_t ret;
+        size_t num_written = 0;
+
+        while (num_written < count) {
+                ret = copy_pwrite (dst, &data[num_written], count - num_written,
+                                   offset + num_written);
+                if (ret == -1) {
+                        error (0, errno, "write error: %s", dst->path);
+                        return -1;
+                }
+
+                num_written += ret;
+        }
+
+        return 0;
+}
+
+/**
+ * Writes the buffer at the given offset, skipping blocks of zeroes when
+ * punch_zeroes is set. Skipped blocks become holes since the destination is
+ * always empty (or truncated) before the transfer starts.
+ */
+static int
+write_buffer (struct transfer *xfer, const char *buf, size_t count,
+              off_t offset, bool punch_zeroes)
+{
+        struct copy_file *dst = xfer->dst;
+        size_t pos = 0;
+        size_t run_start = 0;
+        size_t block;
+
+        if (!punch_zeroes) {
+                if (copy_pwrite_all (dst, buf, count, offset) == -1) {
+                        return -1;
+                }
+
+                progress_update (xfer, count);
+                return 0;
+        }
+
+        while (pos < count) {
+                block = count - pos < SPARSE_BLOCK_SIZE ?
+                        count - pos : SPARSE_BLOCK_SIZE;
+
+                if (buffer_is_zero (&buf[pos], block)) {
+                        if (pos > run_start &&
+                            copy_pwrite_all (dst, &buf[run_start],
+                                             pos - run_start,
+                                             offset + run_start) == -1) {
+                                return -1;
+                        }
+
+                        progress_update (xfer, pos - run_start);
+                        run_start = pos + block;
+                }
+
+                pos += block;
+        }
+
+        if (pos > run_start) {
+                if (copy_pwrite_all (dst, &buf[run_start], pos - run_start,
+                                     offset + run_start) == -1) {
+                        return -1;
+                }
+
+                progress_update (xfer, pos - run_start);
+        }
+
+        return 0;
+}
+
+/**
+ * Asks the server to copy [start, end) without the data passing through the
+ * client. Returns the offset reached, or -1 with errno set. Each call is
+ * bounded to SERVER_COPY_SIZE bytes so that progress is reported while a
+ * large copy is running.
+ */
+static off_t
+server_copy_range (struct transfer *xfer, off_t start, off_t end)
+{
+#ifdef HAVE_GLFS_COPY_FILE_RANGE
+        ssize_t ret;
+        off_t off_in;
+        off_t off_out;
+        size_t count;
+
+        while (start < end) {
+                count = end - start < SERVER_COPY_SIZE ?
+                        end - start : SERVER_COPY_SIZE;
+                off_in = start;
+                off_out = start;
+
+                ret = glfs_copy_file_range (xfer->src->glfd, &off_in,
+                                            xfer->dst->glfd, &off_out,
+                                            count, 0, NULL, NULL, NULL);
+                if (ret == -1) {
+                        return -1;
+                }
+
+                if (ret == 0) {
+                        break;
+                }
+
+                progress_update (xfer, ret);
+                start += ret;
+        }
+
+        return start;
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+static bool
+server_copy_unsupported (int err)
+{
+        return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP ||
+                err == EXDEV || err == EINVAL;
+}
+
+/**
+ * Copies [start, end) of the source to the same range of the destination.
+ * Returns the offset reached, which is short of end if the source shrank
+ * during the transfer, or -1 on error.
+ */
+static off_t
+copy_range (struct transfer *xfer, off_t start, off_t end, bool punch_zeroes)
+{
+        ssize_t num_read;
+        size_t count;
+        off_t reached;
+
+        // Holes inside the data have to be found by reading it, so only
+        // offload ranges that are copied verbatim.
+        if (xfer->server_copy && !punch_zeroes) {
+                reached = server_copy_range (xfer, start, end);
+                if (reached != -1) {
+                        xfer->verify_inline = false;
+                        return reached;
+                }
+
+                if (!server_copy_unsupported (errno)) {
+                        error (0, errno, "copy error: %s", xfer->dst->path);
+                        return -1;
+                }
+
+                // Stream the rest of the file through the client instead.
+                xfer->server_copy = false;
+        }
+
+        while (start < end) {
+                count = end - start < xfer->buf_size ?
+                        end - start : xfer->buf_size;
+
+                num_read = copy_pread (xfer->src, xfer->buf, count, start);
+                if (num_read == -1) {
+                        error (0, errno, "read error: %s", xfer->src->path);
+                        return -1;
+                }
+
+                if (num_read == 0) {
+                        break;
+                }
+
+                if (verify_data (xfer, xfer->buf, num_read, start) == -1) {
+                        return -1;
+                }
+
+                if (write_buffer (xfer, xfer->buf, num_read, start,
+                                  punch_zeroes) == -1) {
+                        return -1;
+                }
+
+                start += num_read;
+        }
+
+        return start;
+}
+
+/**
+ * Copies a source that cannot be read positionally (a pipe or a character
+ * device) until end of file. Returns the number of bytes copied, or -1.
+ */
+static off_t
+copy_stream (struct transfer *xfer)
+{
+        struct copy_file *src = xfer->src;
+        char *buf = xfer->buf;
+        ssize_t num_read;
+        off_t offset = 0;
+
+        while (true) {
+                if (src->glfd == NULL) {
+                        num_read = read (src->fd, buf, xfer->buf_size);
+                } else {
+                        num_read = glfs_read (src->glfd, buf,
+                                              xfer->buf_size, 0);
+                }
+
+                if (num_read == -1) {
+                        error (0, errno, "read error: %s", src->path);
+                        return -1;
+                }
+
+                if (num_read == 0) {
+                        return offset;
+                }
+
+                if (verify_data (xfer, buf, num_read, offset) == -1) {
+                        return -1;
+                }
+
+                if (write_buffer (xfer, buf, num_read, offset, false) == -1) {
+                        return -1;
+                }
+
+                offset += num_read;
+        }
+}
+
+static bool
+seek_unsupported (int err)
+{
+        return err == EINVAL || err == ENOTSUP || err == EOPNOTSUPP ||
+                err == ENOSYS;
+}
+
+/**
+ * Copies only the data extents of [start, end) reported by SEEK_DATA and
+ * SEEK_HOLE. Returns 1 if the source cannot report its extents, so that the
+ * caller can fall back to a full scan.
+ */
+static int
+copy_extents (struct transfer *xfer, off_t start, off_t end)
+{
+        struct copy_file *src = xfer->src;
+        off_t pos = start;
+        off_t data;
+        off_t hole;
+
+        while (pos < end) {
+                data = copy_lseek (src, pos, SEEK_DATA);
+                if (data == -1) {
+                        // Nothing but a hole up to the end of the file.
+                        if (errno == ENXIO) {
+                                break;
+                        }
+
+                        if (pos == start && seek_unsupported (errno)) {
+                                return 1;
+                        }
+
+                        error (0, errno, "seek error: %s", src->path);
+                        return -1;
+                }
+
+                if (data >= end) {
+                        break;
+                }
+
+                hole = copy_lseek (src, data, SEEK_HOLE);
+                if (hole == -1) {
+                        if (pos == start && seek_unsupported (errno)) {
+                                return 1;
+                        }
+
+                        error (0, errno, "seek error: %s", src->path);
+                        return -1;
+                }
+
+                if (hole > end) {
+                        hole = end;
+                }
+
+                if (copy_range (xfer, data, hole, xfer->punch_zeroes) == -1) {
+                        return -1;
+                }
+
+                pos = hole;
+        }
+
+        return 0;
+}
+
+/**
+ * Copies [start, end) of a regular source, keeping its holes according to
+ * xfer->sparse. With overwrite set the destination may hold stale data in
+ * that range, so holes are written out as zeroes instead.
+ */
+static int
+copy_region (struct transfer *xfer, off_t start, off_t end, bool overwrite)
+{
+        int ret;
+
+        if (overwrite || xfer->sparse == SPARSE_NEVER) {
+                return copy_range (xfer, start, end, false) == -1 ? -1 : 0;
+        }
+
+        // A source with all of its blocks allocated has no holes to look
+        // for, which saves two seek requests per file on small files.
+        if (xfer->dense && !xfer->punch_zeroes) {
+                return copy_range (xfer, start, end, false) == -1 ? -1 : 0;
+        }
+
+        if (!xfer->seek_unsupported) {
+                ret = copy_extents (xfer, start, end);
+                if (ret != 1) {
+                        return ret;
+                }
+
+                xfer->seek_unsupported = true;
+        }
+
+        // The source cannot report its holes, so find them by scanning for
+        // blocks of zeroes instead.
+        return copy_range (xfer, start, end,
+                           xfer->punch_zeroes || xfer->looks_sparse) == -1 ?
+                -1 : 0;
+}
+
+/**
+ * Flushes the data of file to stable storage.
+ */
+int
+copy_fsync (struct copy_file *file)
+{
+        if (file->glfd == NULL) {
+                return fsync (file->fd);
+        }
+
+#ifdef HAVE_GLFS_7_6
+        return glfs_fsync (file->glfd, NULL, NULL);
+#else
+        return glfs_fsync (file->glfd);
+#endif
+}
+
+/**
+ * Applies the access and modification times of statbuf to file.
+ */
+int
+copy_set_times (struct copy_file *file, const struct stat *statbuf)
+{
+        const struct timespec times[2] = {statbuf->st_atim, statbuf->st_mtim};
+
+        if (file->glfd == NULL) {
+                return futimens (file->fd, times);
+        }
+
+        return glfs_futimens (file->glfd, times);
+}
+
+/**
+ * Opens a file living next to the given one, on the same volume for remote
+ * files.
+ */
+static int
+sidecar_open (struct copy_file *file, const char *path, int flags,
+              struct copy_file *sidecar)
+{
+        if (file->glfd == NULL) {
+                *sidecar = COPY_FILE_LOCAL (open (path, flags, 0644), path);
+                return sidecar->fd == -1 ? -1 : 0;
+        }
+
+        *sidecar = COPY_FILE_REMOTE (file->fs, NULL, path);
+        if (flags & O_CREAT) {
+                sidecar->glfd = glfs_creat (file->fs, path, flags, 0644);
+        } else {
+                sidecar->glfd = glfs_open (file->fs, path, flags);
+        }
+
+        return sidecar->glfd == NULL ? -1 : 0;
+}
+
+static void
+sidecar_close (struct copy_file *sidecar)
+{
+        if (sidecar->glfd == NULL) {
+                close (sidecar->fd);
+        } else {
+                glfs_close (sidecar->glfd);
+        }
+}
+
+static int
+sidecar_rename (struct copy_file *file, const char *oldpath,
+                const char *newpath)
+{
+        if (file->glfd == NULL) {
+                return rename (oldpath, newpath);
+        }
+
+        return glfs_rename (file->fs, oldpath, newpath);
+}
+
+static int
+sidecar_unlink (struct copy_file *file, const char *path)
+{
+        if (file->glfd == NULL) {
+                return unlink (path);
+        }
+
+        return glfs_unlink (file->fs, path);
+}
+
+static char *
+manifest_path (struct copy_file *dst, const char *suffix)
+{
+        size_t length = strlen (dst->path) + strlen (suffix) + 1;
+        char *path = malloc (length);
+
+        if (path == NULL) {
+                error (0, errno, "malloc");
+                return NULL;
+        }
+
+        snprintf (path, length, "%s%s", dst->path, suffix);
+
+        return path;
+}
+
+static void
+manifest_free (struct manifest *manifest)
+{
+        free (manifest->path);
+        free (manifest->tmp_path);
+        free (manifest->done);
+        free (manifest->sums);
+}
+
+static int
+manifest_init (struct manifest *manifest, struct copy_file *dst,
+               const struct stat *statbuf, enum checksum_type type)
+{
+        memset (manifest, 0, sizeof (*manifest));
+        manifest->dst = dst;
+        manifest->size = statbuf->st_size;
+        manifest->mtime = statbuf->st_mtime;
+        manifest->type = type;
+        manifest->count = (statbuf->st_size + VERIFY_CHUNK_SIZE - 1) /
+                VERIFY_CHUNK_SIZE;
+
+        manifest->path = manifest_path (dst, RESUME_SUFFIX);
+        manifest->tmp_path = manifest_path (dst, RESUME_SUFFIX ".tmp");
+        if (manifest->path == NULL || manifest->tmp_path == NULL) {
+                goto err;
+        }
+
+        manifest->done = calloc (manifest->count + 1, sizeof (*manifest->done));
+        manifest->sums = calloc (manifest->count + 1, sizeof (*manifest->sums));
+        if (manifest->done == NULL || manifest->sums == NULL) {
+                error (0, errno, "calloc");
+                goto err;
+        }
+
+        return 0;
+
+err:
+        manifest_free (manifest);
+
+        return -1;
+}
+
+/**
+ * Reads the manifest left next to the destination by an interrupted transfer.
+ * Returns 1 if it records chunks of the same source (same size, modification
+ * time and checksum), 0 if there is no usable manifest and -1 on error.
+ */
+static int
+manifest_load (struct manifest *manifest)
+{
+        struct copy_file sidecar;
+        struct stat statbuf;
+        char name[16];
+        char *buf = NULL;
+        char *line;
+        char *saveptr;
+        intmax_t size;
+        intmax_t mtime;
+        int chunk_size;
+        int header = 0;
+        size_t len = 0;
+        size_t index;
+        uint64_t sum;
+        ssize_t num_read;
+        int ret = -1;
+
+        if (sidecar_open (manifest->dst, manifest->path, O_RDONLY,
+                          &sidecar) == -1) {
+                if (errno == ENOENT) {
+                        return 0;
+                }
+
+                error (0, errno, "%s", manifest->path);
+                return -1;
+        }
+
+        if (copy_fstat (&sidecar, &statbuf) == -1) {
+                error (0, errno, "%s", manifest->path);
+                goto out;
+        }
+
+        buf = malloc (statbuf.st_size + 1);
+        if (buf == NULL) {
+                error (0, errno, "malloc");
+                goto out;
+        }
+
+        while (len < (size_t) statbuf.st_size) {
+                num_read = copy_pread (&sidecar, &buf[len],
+                                       statbuf.st_size - len, len);
+                if (num_read == -1) {
+                        error (0, errno, "read error: %s", manifest->path);
+                        goto out;
+                }
+
+                if (num_read == 0) {
+                        break;
+                }
+
+                len += num_read;
+        }
+
+        buf[len] = '\0';
+        ret = 0;
+
+        if (sscanf (buf, RESUME_MAGIC "\nsize %jd\nmtime %jd\nchunk %d\n"
+                    "checksum %15s\n%n", &size, &mtime, &chunk_size, name,
+                    &header) != 4 || header == 0) {
+                goto out;
+        }
+
+        // The source changed since the manifest was written, so none of the
+        // recorded chunks can be trusted.
+        if (size != manifest->size || mtime != manifest->mtime ||
+            chunk_size != VERIFY_CHUNK_SIZE ||
+            strcmp (name, checksum_name (manifest->type)) != 0) {
+                goto out;
+        }
+
+        for (line = strtok_r (&buf[header], "\n", &saveptr); line != NULL;
+             line = strtok_r (NULL, "\n", &saveptr)) {
+                if (sscanf (line, "%zu %" SCNx64, &index, &sum) != 2 ||
+                    index >= manifest->count) {
+                        continue;
+                }
+
+                manifest->done[index] = true;
+                manifest->sums[index] = sum;
+                ret = 1;
+        }
+
+out:
+        free (buf);
+        sidecar_close (&sidecar);
+
+        return ret;
+}
+
+/**
+ * Atomically replaces the manifest with the chunks completed so far. The
+ * destination is synced first, so that every chunk listed is on stable
+ * storage.
+ */
+static int
+manifest_commit (struct manifest *manifest)
+{
+        struct copy_file sidecar;
+        char *buf;
+        size_t max;
+        size_t len;
+        size_t i;
+        int ret = -1;
+
+        if (copy_fsync (manifest->dst) == -1) {
+                error (0, errno, "failed to sync %s", manifest->dst->path);
+                return -1;
+        }
+
+        // Each chunk line holds at most 20 digits, a space, 16 hex digits
+        // and a newline.
+        max = 256 + manifest->count * 40;
+        buf = malloc (max);
+        if (buf == NULL) {
+                error (0, errno, "malloc");
+                return -1;
+        }
+
+        len = snprintf (buf, max, RESUME_MAGIC "\nsize %jd\nmtime %jd\n"
+                        "chunk %d\nchecksum %s\n", manifest->size,
+                        manifest->mtime, VERIFY_CHUNK_SIZE,
+                        checksum_name (manifest->type));
+
+        for (i = 0; i < manifest->count; i++) {
+                if (manifest->done[i]) {
+                        len += snprintf (&buf[len], max - len,
+                                         "%zu %016" PRIx64 "\n",
+                                         i, manifest->sums[i]);
+                }
+        }
+
+        if (sidecar_open (manifest->dst, manifest->tmp_path,
+                          O_CREAT | O_WRONLY | O_TRUNC, &sidecar) == -1) {
+                error (0, errno, "failed to create %s", manifest->tmp_path);
+                goto out;
+        }
+
+        if (copy_pwrite_all (&sidecar, buf, len, 0) == -1) {
+                sidecar_close (&sidecar);
+                goto out;
+        }
+
+        if (copy_fsync (&sidecar) == -1) {
+                error (0, errno, "failed to sync %s", manifest->tmp_path);
+                sidecar_close (&sidecar);
+                goto out;
+        }
+
+        sidecar_close (&sidecar);
+
+        if (sidecar_rename (manifest->dst, manifest->tmp_path,
+                            manifest->path) == -1) {
+                error (0, errno, "failed to rename %s", manifest->tmp_path);
+                goto out;
+        }
+
+        ret = 0;
+
+out:
+        free (buf);
+
+        return ret;
+}
+
+/**
+ * Removes the manifest of a transfer that completed.
+ */
+static int
+manifest_remove (struct copy_file *dst)
+{
+        char *path = manifest_path (dst, RESUME_SUFFIX);
+        int ret = 0;
+
+        if (path == NULL) {
+                return -1;
+        }
+
+        if (sidecar_unlink (dst, path) == -1 && errno != ENOENT) {
+                error (0, errno, "failed to remove %s", path);
+                ret = -1;
+        }
+
+        free (path);
+
+        return ret;
+}
+
+/**
+ * Checks the chunks recorded in a loaded manifest against the destination,
+ * reading them back in parallel. Chunks that do not match their recorded
+ * checksum are copied again.
+ */
+static int
+manifest_check (struct manifest *manifest)
+{
+        uint64_t *sums;
+        size_t i;
+
+        sums = checksum_chunks (manifest->dst, manifest->type, manifest->size,
+                                manifest->count, manifest->done);
+        if (sums == NULL) {
+                return -1;
+        }
+
+        for (i = 0; i < manifest->count; i++) {
+                if (manifest->done[i] && sums[i] != manifest->sums[i]) {
+                        manifest->done[i] = false;
+                }
+        }
+
+        free (sums);
+
+        return 0;
+}
+
+/**
+ * Copies the chunks of a regular source that are not recorded as complete in
+ * the manifest next to the destination. The manifest is committed every
+ * RESUME_COMMIT_SECS and when the transfer fails, so that a later run only
+ * has to copy what is missing.
+ */
+static int
+copy_resumable (struct transfer *xfer, const struct stat *statbuf)
+{
+        struct manifest manifest;
+        struct stat dst_stat;
+        off_t start;
+        off_t end;
+        off_t dst_size = 0;
+        time_t time_commit;
+        size_t resumed = 0;
+        size_t i;
+        int ret = -1;
+
+        if (manifest_init (&manifest, xfer->dst, statbuf,
+                           xfer->sum_type) == -1) {
+                return -1;
+        }
+
+        // An unreadable manifest may still record progress, so leave it in
+        // place rather than committing one without any chunk.
+        ret = manifest_load (&manifest);
+        if (ret == -1) {
+                manifest_free (&manifest);
+                return -1;
+        }
+
+        if (ret == 1) {
+                if (copy_fstat (xfer->dst, &dst_stat) == -1) {
+                        error (0, errno, "%s", xfer->dst->path);
+                        ret = -1;
+                        goto out;
+                }
+
+                // Trailing holes of a sparse copy were never written, so
+                // extend the file to read them back as zeroes.
+                dst_size = dst_stat.st_size;
+                if (dst_size < statbuf->st_size) {
+                        ret = copy_ftruncate (xfer->dst, statbuf->st_size);
+                        if (ret == -1) {
+                                error (0, errno, "failed to truncate %s",
+                                       xfer->dst->path);
+                                goto out;
+                        }
+                }
+
+                ret = manifest_check (&manifest);
+                if (ret == -1) {
+                        goto out;
+                }
+
+                for (i = 0; i < manifest.count; i++) {
+                        resumed += manifest.done[i];
+                }
+
+                fprintf (stderr, "Resuming %s: %zu of %zu chunks already copied.\n",
+                         xfer->dst->path, resumed, manifest.count);
+        } else {
+                // Nothing to resume from, so start with an empty file.
+                ret = copy_ftruncate (xfer->dst, 0);
+                if (ret == -1) {
+                        error (0, errno, "failed to truncate %s", xfer->dst->path);
+                        goto out;
+                }
+        }
+
+        ret = -1;
+        time_commit = time (NULL);
+
+        for (i = 0; i < manifest.count; i++) {
+                if (manifest.done[i]) {
+                        if (verify_store_chunk (xfer, i, manifest.sums[i]) == -1) {
+                                goto out;
+                        }
+
+                        continue;
+                }
+
+                start = (off_t) i * VERIFY_CHUNK_SIZE;
+                end = statbuf->st_size - start < VERIFY_CHUNK_SIZE ?
+                        statbuf->st_size : start + VERIFY_CHUNK_SIZE;
+
+                xfer->verify_pos = start;
+                if (copy_region (xfer, start, end, start < dst_size) == -1 ||
+                    verify_finish_chunk (xfer, end) == -1) {
+                        goto out;
+                }
+
+                manifest.done[i] = true;
+                manifest.sums[i] = xfer->chunk_sums[i];
+
+                if (time (NULL) - time_commit >= RESUME_COMMIT_SECS) {
+                        if (manifest_commit (&manifest) == -1) {
+                                goto out;
+                        }
+
+                        time_commit = time (NULL);
+                }
+        }
+
+        xfer->verify_pos = statbuf->st_size;
+
+        // Skipped ranges at the end of the file do not extend it, and a
+        // previous destination may have been longer.
+        ret = copy_ftruncate (xfer->dst, statbuf->st_size);
+        if (ret == -1) {
+                error (0, errno, "failed to truncate %s", xfer->dst->path);
+        }
+
+out:
+        if (ret == -1) {
+                // Keep the progress made so far for the next attempt.
+                manifest_commit (&manifest);
+        }
+
+        manifest_free (&manifest);
+
+        return ret;
+}
+
+/**
+ * Copies the contents of src to dst, which must be empty. Holes in the source
+ * are recreated at the destination according to options->sparse, so the
+ * transfer time scales with the allocated data rather than the file size.
+ * With options->verify set, the destination is then compared with the source.
+ * With options->resume set, dst may hold a partial copy described by its
+ * manifest, and only the missing chunks are copied. With options->delta set,
+ * dst may hold an older version of src, and only the changes are written.
+ * With options->update set, nothing is written when dst is already current.
+ */
+int
+copy_file_data (struct copy_file *src, struct copy_file *dst,
+                const struct copy_options *options)
+{
+        int ret = -1;
+        int err;
+        struct stat statbuf;
+        struct stat dst_stat;
+        off_t size;
+        struct transfer xfer = {
+                .src = src,
+                .dst = dst,
+                .punch_zeroes = options->sparse == SPARSE_ALWAYS,
+                // Ranges copied by the server are not seen by the client, so
+                // they cannot be checksummed for the resume manifest.
+                .server_copy = options->server_copy && !options->resume &&
+                        src->glfd != NULL && dst->glfd != NULL,
+                .sparse = options->sparse,
+                .total_written = 0,
+                .time_start = time (NULL),
+                .sum_type = options->verify,
+                .verify_inline = true,
+        };
+
+        xfer.time_last = xfer.time_start;
+
+        if (options->resume && xfer.sum_type == CHECKSUM_NONE) {
+                xfer.sum_type = CHECKSUM_CRC32C;
+        }
+
+        if (xfer.sum_type != CHECKSUM_NONE) {
+                err = checksum_init (&xfer.sum, xfer.sum_type);
+                if (err < 0) {
+                        error (0, -err, "failed to initialize checksum");
+                        xfer.sum_type = CHECKSUM_NONE;
+                        goto out;
+                }
+        }
+
+        if (copy_fstat (src, &statbuf) == -1) {
+                error (0, errno, "%s", src->path);
+                goto out;
+        }
+
+        if (options->update) {
+                if (S_ISREG (statbuf.st_mode)) {
+                        ret = copy_is_current (src, dst, &statbuf,
+                                               options->compare);
+                        if (ret != 0) {
+                                ret = ret == 1 ? 0 : -1;
+                                goto out;
+                        }
+
+                        ret = -1;
+                }
+
+                // The destination was kept open for the comparison only.
+                if (!options->resume && !options->delta &&
+                    copy_ftruncate (dst, 0) == -1) {
+                        error (0, errno, "failed to truncate %s", dst->path);
+                        goto out;
+                }
+        }
+
+        // Trees of small files are copied by many threads at once, so do
+        // not hand each of them a full sized buffer.
+        xfer.buf_size = COPY_BUFFER_SIZE;
+        if (S_ISREG (statbuf.st_mode) && !options->delta &&
+            statbuf.st_size < COPY_BUFFER_SIZE) {
+                xfer.buf_size = statbuf.st_size < SPARSE_BLOCK_SIZE ?
+                        SPARSE_BLOCK_SIZE : statbuf.st_size;
+        }
+
+        xfer.buf = malloc (xfer.buf_size);
+        if (xfer.buf == NULL) {
+                error (0, errno, "malloc");
+                goto out;
+        }
+
+        if (!S_ISREG (statbuf.st_mode)) {
+                size = copy_stream (&xfer);
+                if (size == -1) {
+                        goto out;
+                }
+
+                // A destination kept open without truncating may have been
+                // longer than what the stream gave.
+                if (copy_keeps_dest (options) &&
+                    copy_fstat (dst, &dst_stat) == 0 &&
+                    S_ISREG (dst_stat.st_mode) && dst_stat.st_size > size &&
+                    copy_ftruncate (dst, size) == -1) {
+                        error (0, errno, "failed to truncate %s", dst->path);
+                        goto out;
+                }
+
+                ret = verify_finish_chunk (&xfer, size);
+                goto verify;
+        }
+
+        // Same heuristic as GNU cp: fewer allocated blocks than the size
+        // implies means the file has holes.
+        xfer.looks_sparse = statbuf.st_blocks > 0 &&
+                statbuf.st_blocks < statbuf.st_size / 512;
+        xfer.dense = statbuf.st_blocks > 0 && !xfer.looks_sparse;
+        size = statbuf.st_size;
+
+        // Reserving the space up front keeps the extents contiguous and
+        // reports ENOSPC before anything is written. Volumes and local file
+        // systems without fallocate are written to as usual.
+        if (options->preallocate && size > 0 &&
+            copy_fallocate (dst, FALLOC_FL_KEEP_SIZE, 0, size) == -1 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+                error (0, errno, "failed to preallocate %s", dst->path);
+                goto out;
+        }
+
+        if (options->resume) {
+                ret = copy_resumable (&xfer, &statbuf);
+                goto verify;
+        }
+
+        if (options->delta) {
+                if (copy_fstat (dst, &dst_stat) == -1) {
+                        error (0, errno, "%s", dst->path);
+                        goto out;
+                }
+
+                if (dst_stat.st_size > 0) {
+                        // The source is scanned without going through
+                        // copy_range (), so --verify reads it back.
+                        xfer.verify_inline = false;
+                        ret = copy_file_delta (src, dst, &statbuf,
+                                               dst_stat.st_size);
+                        goto verify;
+                }
+        }
+
+        ret = copy_region (&xfer, 0, size, false);
+        if (ret == -1) {
+                goto out;
+        }
+
+        // Skipped ranges at the end of the file do not extend it.
+        if (options->sparse != SPARSE_NEVER &&
+            (!xfer.dense || xfer.punch_zeroes)) {
+                ret = copy_ftruncate (dst, size);
+                if (ret == -1) {
+                        error (0, errno, "failed to truncate %s", dst->path);
+                        goto out;
+                }
+        }
+
+        ret = verify_finish_chunk (&xfer, size);
+
+verify:
+        if (ret == 0 && options->verify != CHECKSUM_NONE) {
+                ret = verify_transfer (&xfer, size);
+        }
+
+        if (ret == 0 && options->resume && S_ISREG (statbuf.st_mode)) {
+                ret = manifest_remove (dst);
+        }
+
+        if (ret == 0 && options->preserve_times) {
+                ret = copy_set_times (dst, &statbuf);
+                if (ret == -1) {
+                        error (0, errno, "failed to set times of %s", dst->path);
+                }
+        }
+
+out:
+        if (xfer.sum_type != CHECKSUM_NONE) {
+                checksum_fini (&xfer.sum);
+        }
+
+        free (xfer.chunk_sums);
+        free (xfer.buf);
+
+        return ret;
+}
@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_COPY_H
+#define GLFS_COPY_H
+
+#include "checksum.h"
+
+#include <glusterfs/api/glfs.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define COPY_BUFFER_SIZE 1024*1024
+
+/**
+ * Granularity of --verify. Each chunk is checksummed separately, so that the
+ * destination can be read back in parallel and a mismatch can be located.
+ */
+#define VERIFY_CHUNK_SIZE (8*1024*1024)
+#define VERIFY_THREADS 4
+
+/**
+ * Controls how runs of zeroes in the source are treated, with the same
+ * meaning as the --sparse option of GNU cp.
+ *
+ * SPARSE_NEVER: write every byte of the source.
+ * SPARSE_AUTO: keep the holes the source reports through SEEK_DATA and
+ *              SEEK_HOLE; only scan for zero blocks when the source cannot
+ *              report its holes but looks sparse.
+ * SPARSE_ALWAYS: additionally turn any block of zeroes into a hole.
+ */
+enum sparse_mode {
+        SPARSE_NEVER,
+        SPARSE_AUTO,
+        SPARSE_ALWAYS
+};
+
+/**
+ * One end of a transfer. Remote files are accessed through glfd, local files
+ * through fd when glfd is NULL. path is the path of the file on its volume
+ * (or locally); fs is the volume of remote files, used to create files next
+ * to them.
+ */
+struct copy_file {
+        glfs_t *fs;
+        glfs_fd_t *glfd;
+        int fd;
+        const char *path;
+};
+
+/**
+ * Options of a single data transfer.
+ *
+ * sparse: How holes in the source are recreated at the destination.
+ * server_copy: Whether source and destination live on the same volume, so
+ *              that the data can be copied by the server itself. The
+ *              transfer falls back to streaming when the server refuses.
+ * verify: Checksum used to compare the destination with the source once the
+ *         transfer is complete, or CHECKSUM_NONE.
+ * resume: Whether progress is recorded in a manifest next to the destination,
+ *         so that an interrupted transfer only copies the missing chunks when
+ *         it is restarted.
+ * delta: Whether an existing destination is updated in place, writing only
+ *        the blocks that changed.
+ * update: Whether the transfer is skipped when the destination is already
+ *         current; see copy_is_current ().
+ * compare: Checksum used by update to compare the contents of the two files,
+ *          or CHECKSUM_NONE to only compare their size and modification time.
+ * preserve_times: Whether the access and modification times of the source
+ *                 are applied to the destination after the transfer.
+ * preallocate: Whether space for the whole source is reserved at the
+ *              destination before any data is written, so that the file
+ *              lands in contiguous extents and a lack of space is reported
+ *              before the transfer starts. Holes of the source are
+ *              allocated as well.
+ *
+ * With resume, delta or update set, the destination must not be truncated
+ * before the transfer; see copy_keeps_dest ().
+ */
+struct copy_options {
+        enum sparse_mode sparse;
+        bool server_copy;
+        enum checksum_type verify;
+        bool resume;
+        bool delta;
+        bool update;
+        enum checksum_type compare;
+        bool preserve_times;
+        bool preallocate;
+};
+
+#define COPY_FILE_LOCAL(_fd, _path) \
+        ((struct copy_file) { .fs = NULL, .glfd = NULL, .fd = (_fd), \
+                              .path = (_path) })
+#define COPY_FILE_REMOTE(_fs, _glfd, _path) \
+        ((struct copy_file) { .fs = (_fs), .glfd = (_glfd), .fd = -1, \
+                              .path = (_path) })
+
+void
+copy_options_init (struct copy_options *options);
+
+bool
+copy_keeps_dest (const struct copy_options *options);
+
+int
+parse_sparse_mode (const char *arg, enum sparse_mode *mode);
+
+ssize_t
+copy_pread (struct copy_file *file, void *buf, size_t count, off_t offset);
+
+ssize_t
+copy_pwrite (struct copy_file *file, const void *buf, size_t count, off_t offset);
+
+int
+copy_pwrite_all (struct copy_file *dst, const void *buf, size_t count,
+                 off_t offset);
+
+off_t
+copy_lseek (struct copy_file *file, off_t offset, int whence);
+
+int
+copy_fstat (struct copy_file *file, struct stat *statbuf);
+
+int
+copy_ftruncate (struct copy_file *file, off_t length);
+
+int
+copy_fallocate (struct copy_file *file, int mode, off_t offset, off_t len);
+
+bool
+buffer_is_zero (const void *buf, size_t len);
+
+bool
+copy_stat_is_current (const struct stat *src, const struct stat *dst);
+
+int
+copy_is_current (struct copy_file *src, struct copy_file *dst,
+                 const struct stat *src_stat, enum checksum_type compare);
+
+int
+copy_fsync (struct copy_file *file);
+
+int
+copy_set_times (struct copy_file *file, const struct stat *statbuf);
+
+int
+copy_file_data (struct copy_file *src, struct copy_file *dst,
+                const struct copy_options *options);
+
+#endif /* GLFS_COPY_H */
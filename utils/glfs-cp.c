@@ -22,6 +22,8 @@
 #include <config.h>
 
 #include "glfs-cp.h"
+#include "glfs-copy.h"
+#include "glfs-tree.h"
 #include "glfs-util.h"
 
 #include <errno.h>
@@ -39,7 +41,6 @@
 #include <unistd.h>
 
 #define AUTHORS "Written by Craig Cabrey."
-#define BUFFER_SIZE 1024*1024
 
 /**
  * Represents the various transfer modes supported by gfcp.
@@ -67,6 +68,10 @@ enum transfer_mode {
  * source: Raw source string supplied by the user.
  * debug: Whether to log additional debug information.
  * mode: The detected transfer mode (deduced from the supplied source and dest).
+ * compare: Whether --update compares the contents of the files (--checksum).
+ * recursive: Whether directories are copied along with their contents.
+ * jobs: Number of files copied concurrently by recursive copies.
+ * copy_options: Options of the data transfer engine (see glfs-copy.h).
  */
 struct state {
         struct gluster_url *gluster_dest;
@@ -76,14 +81,27 @@ struct state {
         char *source;
         bool debug;
         enum transfer_mode mode;
+        bool compare;
+        bool recursive;
+        int jobs;
+        struct copy_options copy_options;
 };
 
 static struct state *state;
 static struct option const long_options[] =
 {
+        {"checksum", no_argument, NULL, 'K'},
         {"debug", no_argument, NULL, 'd'},
+        {"delta", no_argument, NULL, 'D'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
         {"port", required_argument, NULL, 'p'},
+        {"preallocate", no_argument, NULL, 'P'},
+        {"recursive", no_argument, NULL, 'r'},
+        {"resume", no_argument, NULL, 'R'},
+        {"sparse", required_argument, NULL, 'S'},
+        {"update", no_argument, NULL, 'u'},
+        {"verify", optional_argument, NULL, 'C'},
         {"version", no_argument, NULL, 'v'},
         {"xlator-option", required_argument, NULL, 'o'},
         {NULL, no_argument, NULL, 0}
@@ -119,6 +137,13 @@ usage ()
 {
         printf ("Usage: %s [OPTION]... SOURCE DEST\n"
                 "Copy SOURCE to DEST; one of local to remote, remote to local, or remote to remote.\n\n"
+                "      --checksum               with --update, compare the contents of\n"
+                "                               SOURCE and DEST instead of their size and\n"
+                "                               modification time\n"
+                "      --delta                  when DEST exists, only write the parts of\n"
+                "                               it that differ from SOURCE\n"
+                "  -j, --jobs=N                 copy up to N files concurrently when\n"
+                "                               copying directories (default %d)\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
@@ -126,6 +151,23 @@ usage ()
                 "                               destination being Gluster URLs, the options\n"
                 "                               will be applied to both connections.\n"
                 "  -p, --port=PORT              specify the port on which to connect\n"
+                "      --preallocate            reserve the space of SOURCE at DEST before\n"
+                "                               copying, failing early when it is missing\n"
+                "  -r, --recursive              copy directories recursively; files with\n"
+                "                               several names are copied once and linked\n"
+                "      --resume                 record progress next to DEST, and only\n"
+                "                               copy the missing parts of a previously\n"
+                "                               interrupted copy to DEST\n"
+                "      --sparse=WHEN            control creation of sparse files: 'auto'\n"
+                "                               (default) keeps the holes of the source,\n"
+                "                               'always' also turns blocks of zeroes into\n"
+                "                               holes, 'never' writes every byte\n"
+                "  -u, --update                 copy only when DEST is missing, differs in\n"
+                "                               size or is older than SOURCE, and give\n"
+                "                               DEST the timestamps of SOURCE\n"
+                "      --verify[=SUM]           compare the destination with the source\n"
+                "                               after the copy, using the 'crc32c'\n"
+                "                               (default) or 'xxh3' checksum\n"
                 "      --help     display this help and exit\n"
                 "      --version  output version information and exit\n\n"
                 "Examples:\n"
@@ -139,13 +181,16 @@ usage ()
                 "       Copies the file 'remote_file' on the remote Gluster gluster\n"
                 "       volume of groot on the host localhost to a second remote Gluster\n"
                 "       volume of groot on the host remote_host to the file 'file'.\n"
+                "  gfcp -r ./dir glfs://localhost/groot/\n"
+                "       Copies the local directory 'dir' and its contents to the directory\n"
+                "       '/dir' on the remote Gluster volume of groot on the host localhost.\n"
                 "  gfcli (localhost/groot)> cp /example file://example\n"
                 "       Copy the file example relative to the root of the connected\n"
                 "       Gluster volume to a local file called example.\n"
                 "  gfcli (localhost/groot)> cp file://example glfs://host/volume/example\n"
                 "       Copy the local file example to a remote Gluster volume on the\n"
                 "       host 'host'.\n",
-                program_invocation_name);
+                program_invocation_name, TREE_COPY_JOBS);
 }
 
 /**
@@ -158,12 +203,14 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt as other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "o:p:", long_options,
+                opt = getopt_long (argc, argv, "j:o:p:ru", long_options,
                                 &option_index);
 
                 if (opt == -1) {
@@ -174,6 +221,23 @@ parse_options (int argc, char *argv[], bool has_connection)
                         case 'd':
                                 state->debug = true;
                                 break;
+                        case 'D':
+                                state->copy_options.delta = true;
+                                break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->jobs = jobs;
+                                break;
+                        case 'K':
+                                state->compare = true;
+                                break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
                                 if (option == NULL) {
@@ -193,6 +257,40 @@ parse_options (int argc, char *argv[], bool has_connection)
                                         goto out;
                                 }
 
+                                break;
+                        case 'C':
+                                ret = checksum_parse (optarg ? optarg : "crc32c",
+                                                      &state->copy_options.verify);
+                                if (ret == -ENOTSUP) {
+                                        error (0, 0, "checksum \"%s\" is not supported by this build", optarg);
+                                        ret = -1;
+                                        goto err;
+                                } else if (ret < 0) {
+                                        error (0, 0, "invalid argument \"%s\" for --verify", optarg);
+                                        ret = -1;
+                                        goto err;
+                                }
+
+                                break;
+                        case 'P':
+                                state->copy_options.preallocate = true;
+                                break;
+                        case 'R':
+                                state->copy_options.resume = true;
+                                break;
+                        case 'r':
+                                state->recursive = true;
+                                break;
+                        case 'u':
+                                state->copy_options.update = true;
+                                state->copy_options.preserve_times = true;
+                                break;
+                        case 'S':
+                                if (parse_sparse_mode (optarg, &state->copy_options.sparse) == -1) {
+                                        error (0, 0, "invalid argument \"%s\" for --sparse", optarg);
+                                        goto err;
+                                }
+
                                 break;
                         case 'v':
                                 printf ("%s (%s) %s\n%s\n%s\n%s\n",
@@ -213,6 +311,22 @@ parse_options (int argc, char *argv[], bool has_connection)
                 }
         }
 
+        if (state->copy_options.resume && state->copy_options.delta) {
+                error (0, 0, "--resume and --delta are mutually exclusive");
+                goto err;
+        }
+
+        if (state->compare) {
+                if (!state->copy_options.update) {
+                        error (0, 0, "--checksum requires --update");
+                        goto err;
+                }
+
+                state->copy_options.compare =
+                        state->copy_options.verify != CHECKSUM_NONE ?
+                        state->copy_options.verify : CHECKSUM_CRC32C;
+        }
+
         if ((argc - option_index) < 3) {
                 error (0, 0, "missing operand");
                 goto err;
@@ -459,12 +573,16 @@ init_state ()
                 goto out;
         }
 
+        state->compare = false;
         state->debug = false;
+        state->recursive = false;
+        state->jobs = TREE_COPY_JOBS;
         state->dest = NULL;
         state->gluster_dest = NULL;
         state->gluster_source = NULL;
         state->source = NULL;
         state->xlator_options = NULL;
+        copy_options_init (&state->copy_options);
 
 out:
         return state;
@@ -522,6 +640,48 @@ out:
         return full_path;
 }
 
+/**
+ * Copies the directory source_path to dest_path, or into it when dest_path is
+ * an existing directory, the same way as GNU cp -r. Files are copied
+ * concurrently by state->jobs threads.
+ */
+static int
+copy_directory (glfs_t *source_fs, const char *source_path, glfs_t *dest_fs,
+                const char *dest_path, bool server_copy)
+{
+        struct tree_copy tc;
+        struct stat statbuf;
+        char *full_path;
+        int ret;
+
+        if (!state->recursive) {
+                error (0, 0, "-r not specified; omitting directory '%s'", source_path);
+                return -1;
+        }
+
+        if (tree_stat (dest_fs, dest_path, &statbuf) == 0) {
+                full_path = complete_path (source_path, dest_path, &statbuf);
+        } else {
+                full_path = complete_path (source_path, dest_path, NULL);
+        }
+
+        if (full_path == NULL) {
+                return -1;
+        }
+
+        tree_copy_init (&tc, source_fs, dest_fs);
+        tc.jobs = state->jobs;
+        tc.options = state->copy_options;
+        tc.options.server_copy = server_copy;
+
+        ret = tree_copy (&tc, source_path, full_path);
+
+        tree_copy_fini (&tc);
+        free (full_path);
+
+        return ret;
+}
+
 /**
  * Perform a LOCAL_TO_REMOTE transfer, given the local source and remote
  * destination, and an active connection to the remote destination.
@@ -533,8 +693,14 @@ local_to_remote (const char *local_path, const char *remote_path, glfs_t *fs)
         int fd;
         glfs_fd_t *remote_fd = NULL;
         struct stat statbuf;
+        struct copy_file src;
+        struct copy_file dst;
         char *full_path = NULL;
 
+        if (stat (local_path, &statbuf) == 0 && S_ISDIR (statbuf.st_mode)) {
+                return copy_directory (NULL, local_path, fs, remote_path, false);
+        }
+
         fd = open (local_path, O_RDONLY);
         if (fd == -1) {
                 error (0, errno, "%s", local_path);
@@ -566,19 +732,26 @@ local_to_remote (const char *local_path, const char *remote_path, glfs_t *fs)
                 error (0, errno, "failed to lock %s", full_path);
                 goto out;
         }
+
+        // Resumed and delta copies build on what DEST already holds.
+        if (!copy_keeps_dest (&state->copy_options)) {
 #ifdef HAVE_GLFS_7_6
-        ret = glfs_ftruncate (remote_fd, 0, NULL, NULL);
+                ret = glfs_ftruncate (remote_fd, 0, NULL, NULL);
 #else
-        ret = glfs_ftruncate (remote_fd, 0);
+                ret = glfs_ftruncate (remote_fd, 0);
 #endif
-        if (ret == -1) {
-                error (0, errno, "failed to truncate %s", full_path);
-                goto out;
+                if (ret == -1) {
+                        error (0, errno, "failed to truncate %s", full_path);
+                        goto out;
+                }
         }
 
-        if (gluster_write (fd, remote_fd) == 0) {
-                ret = -1;
-                error (0, errno, "failed to transfer %s", local_path);
+        src = COPY_FILE_LOCAL (fd, local_path);
+        dst = COPY_FILE_REMOTE (fs, remote_fd, full_path);
+
+        ret = copy_file_data (&src, &dst, &state->copy_options);
+        if (ret == -1) {
+                error (0, 0, "failed to transfer %s", local_path);
         }
 
 out:
@@ -606,8 +779,14 @@ remote_to_local (const char *remote_path, const char *local_path, glfs_t *fs)
         int local_fd = -1;
         glfs_fd_t *remote_fd = NULL;
         struct stat statbuf;
+        struct copy_file src;
+        struct copy_file dst;
         char *full_path;
 
+        if (glfs_stat (fs, remote_path, &statbuf) == 0 && S_ISDIR (statbuf.st_mode)) {
+                return copy_directory (fs, remote_path, NULL, local_path, false);
+        }
+
         ret = stat (local_path, &statbuf);
         if (ret == -1) {
                 full_path = complete_path (remote_path, local_path, NULL);
@@ -626,7 +805,9 @@ remote_to_local (const char *remote_path, const char *local_path, glfs_t *fs)
                 goto out;
         }
 
-        local_fd = open (full_path, O_CREAT | O_WRONLY, get_default_file_mode_perm ());
+        local_fd = open (full_path,
+                         O_CREAT | O_RDWR | (copy_keeps_dest (&state->copy_options) ? 0 : O_TRUNC),
+                         get_default_file_mode_perm ());
         if (local_fd == -1) {
                 error (0, errno, "%s", full_path);
                 goto out;
@@ -638,9 +819,10 @@ remote_to_local (const char *remote_path, const char *local_path, glfs_t *fs)
                 goto out;
         }
 
-        if ((ret = gluster_read (remote_fd, local_fd)) == -1) {
-                error (0, errno, "write error");
-        }
+        src = COPY_FILE_REMOTE (fs, remote_fd, remote_path);
+        dst = COPY_FILE_LOCAL (local_fd, full_path);
+
+        ret = copy_file_data (&src, &dst, &state->copy_options);
 
 out:
         free (full_path);
@@ -658,20 +840,28 @@ out:
 
 /**
  * Perform a REMOTE_TO_REMOTE transfer, given both source and destination remote
- * paths and active connections to both the source and destination.
+ * paths and active connections to both the source and destination. When both
+ * connections are the same, the transfer is offloaded to the server if it
+ * supports copy_file_range.
  */
 static int
 remote_to_remote (const char *source_path, const char *dest_path, glfs_t *source_fs, glfs_t *dest_fs)
 {
         int ret = -1;
-        size_t num_read = 0;
-        size_t num_written = 0;
         glfs_fd_t *source_fd = NULL;
         glfs_fd_t *dest_fd = NULL;
         struct stat statbuf;
-        char buf[BUFFER_SIZE];
+        struct copy_file src;
+        struct copy_file dst;
+        struct copy_options options;
         char *full_path;
 
+        if (glfs_stat (source_fs, source_path, &statbuf) == 0 &&
+            S_ISDIR (statbuf.st_mode)) {
+                return copy_directory (source_fs, source_path, dest_fs,
+                                       dest_path, source_fs == dest_fs);
+        }
+
         ret = glfs_lstat (dest_fs, dest_path, &statbuf);
 
         if (ret == -1) {
@@ -691,35 +881,33 @@ remote_to_remote (const char *source_path, const char *dest_path, glfs_t *source
                 goto out;
         }
 
-        dest_fd = glfs_creat (dest_fs, full_path, O_CREAT | O_WRONLY, get_default_file_mode_perm ());
+        dest_fd = glfs_creat (dest_fs, full_path, O_CREAT | O_RDWR, get_default_file_mode_perm ());
         if (dest_fd == NULL) {
                 error (0, errno, "%s", full_path);
                 goto out;
         }
 
-        while (true) {
-                num_read = glfs_read (source_fd, buf, BUFFER_SIZE, 0);
-                if (num_read == -1) {
-                        ret = -1;
+        if (!copy_keeps_dest (&state->copy_options)) {
+#ifdef HAVE_GLFS_7_6
+                ret = glfs_ftruncate (dest_fd, 0, NULL, NULL);
+#else
+                ret = glfs_ftruncate (dest_fd, 0);
+#endif
+                if (ret == -1) {
+                        error (0, errno, "failed to truncate %s", full_path);
                         goto out;
                 }
+        }
 
-                if (num_read == 0) {
-                        goto out;
-                }
+        src = COPY_FILE_REMOTE (source_fs, source_fd, source_path);
+        dst = COPY_FILE_REMOTE (dest_fs, dest_fd, full_path);
 
-                for (num_written = 0; num_written < num_read;) {
-                        ret = glfs_write (dest_fd,
-                                        &buf[num_written],
-                                        num_read - num_written, 0);
-                        if (ret == -1) {
-                                error (0, errno, "write error");
-                                goto out;
-                        }
+        // When both paths are on the same volume, let the server copy the
+        // data instead of pulling it through the client and back.
+        options = state->copy_options;
+        options.server_copy = source_fs == dest_fs;
 
-                        num_written += ret;
-                }
-        }
+        ret = copy_file_data (&src, &dst, &options);
 
 out:
         free (full_path);
@@ -0,0 +1,610 @@
+/**
+ * Delta transfer for copies over an older version of the same file. The
+ * destination is updated in place, writing only the blocks of the source it
+ * does not already hold at the same offset, like rsync --inplace.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-delta.h"
+#include "glfs-pool.h"
+
+#include <errno.h>
+#include <error.h>
+#include <glusterfs/api/glfs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Size of the window over the source. It has to hold at least two blocks.
+ */
+#define DELTA_BUFFER_SIZE 4*1024*1024
+
+/**
+ * Signature of one block of the destination.
+ *
+ * weak: rsync style rolling checksum.
+ * strong: Checksum confirming a match of the weak checksum.
+ * next: Next block in the same hash bucket, or -1.
+ */
+struct block_sig {
+        uint32_t weak;
+        uint64_t strong;
+        int64_t next;
+};
+
+/**
+ * State of a single copy_file_delta () call.
+ *
+ * block_size, count, sigs: The destination split into count full blocks.
+ * buckets, bucket_bits: Hash table of the distinct signatures; identical
+ *                       blocks are only stored once, at their last offset.
+ * tail_len, tail_strong: The last partial block of the destination.
+ * server_copy: Whether blocks that moved towards the start of the file are
+ *              copied by the server; cleared as soon as the server refuses.
+ * buf, buf_off, buf_len, eof: Window over the source data.
+ * literal: Offset from which the source data has not been written yet.
+ */
+struct delta {
+        struct copy_file *src;
+        struct copy_file *dst;
+        enum checksum_type strong_type;
+        size_t block_size;
+        size_t count;
+        struct block_sig *sigs;
+        int64_t *buckets;
+        int bucket_bits;
+        size_t tail_len;
+        uint64_t tail_strong;
+        bool server_copy;
+        char *buf;
+        off_t buf_off;
+        size_t buf_len;
+        off_t size;
+        bool eof;
+        off_t literal;
+};
+
+/**
+ * A range of destination blocks signed by one of the pool threads.
+ */
+struct sig_job {
+        struct delta *delta;
+        size_t first;
+        size_t count;
+        int err;
+};
+
+enum match {
+        MATCH_NONE,
+        MATCH_SAME,
+        MATCH_MOVED,
+        MATCH_ELSEWHERE
+};
+
+/**
+ * Picks a block size of about the square root of the file size, as rsync
+ * does, which balances the size of the signature against the amount of data
+ * written around each change.
+ */
+static size_t
+delta_block_size (off_t size)
+{
+        size_t block_size = DELTA_MIN_BLOCK_SIZE;
+
+        while (block_size < DELTA_MAX_BLOCK_SIZE &&
+               (off_t) block_size * block_size < size) {
+                block_size *= 2;
+        }
+
+        return block_size;
+}
+
+static uint32_t
+weak_sum (const unsigned char *p, size_t len, uint32_t *s1, uint32_t *s2)
+{
+        uint32_t a = 0;
+        uint32_t b = 0;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                a += p[i];
+                b += a;
+        }
+
+        *s1 = a & 0xffff;
+        *s2 = b & 0xffff;
+
+        return *s1 | (*s2 << 16);
+}
+
+static size_t
+weak_bucket (struct delta *delta, uint32_t weak)
+{
+        return (uint32_t) (weak * 2654435761u) >> (32 - delta->bucket_bits);
+}
+
+static void
+sign_blocks (void *arg)
+{
+        struct sig_job *job = arg;
+        struct delta *delta = job->delta;
+        size_t block_size = delta->block_size;
+        size_t per_read = COPY_BUFFER_SIZE / block_size;
+        struct block_sig *sig;
+        uint32_t s1;
+        uint32_t s2;
+        size_t done = 0;
+        size_t count;
+        size_t len;
+        ssize_t ret;
+        char *buf;
+
+        buf = malloc (COPY_BUFFER_SIZE);
+        if (buf == NULL) {
+                job->err = errno;
+                return;
+        }
+
+        while (done < job->count) {
+                count = job->count - done < per_read ?
+                        job->count - done : per_read;
+
+                for (len = 0; len < count * block_size; len += ret) {
+                        ret = copy_pread (delta->dst, &buf[len],
+                                          count * block_size - len,
+                                          (off_t) (job->first + done) * block_size + len);
+                        if (ret == -1) {
+                                job->err = errno;
+                                goto out;
+                        }
+
+                        // The destination shrank since it was checked.
+                        if (ret == 0) {
+                                job->err = EIO;
+                                goto out;
+                        }
+                }
+
+                for (size_t i = 0; i < count; i++) {
+                        sig = &delta->sigs[job->first + done + i];
+                        sig->weak = weak_sum ((unsigned char *) &buf[i * block_size],
+                                              block_size, &s1, &s2);
+                        sig->strong = checksum_buffer (delta->strong_type,
+                                                       &buf[i * block_size],
+                                                       block_size);
+                }
+
+                done += count;
+        }
+
+out:
+        free (buf);
+}
+
+/**
+ * Computes the signature of every block of the destination with parallel
+ * ranged reads, and indexes the distinct ones by weak checksum.
+ */
+static int
+delta_sign (struct delta *delta, off_t dst_size)
+{
+        size_t per_job = VERIFY_CHUNK_SIZE / delta->block_size;
+        struct sig_job *jobs = NULL;
+        struct pool *pool = NULL;
+        size_t njobs;
+        size_t bucket;
+        size_t i;
+        int64_t j;
+        char *tail = NULL;
+        ssize_t ret;
+        size_t len;
+
+        delta->count = dst_size / delta->block_size;
+        delta->tail_len = dst_size % delta->block_size;
+
+        for (delta->bucket_bits = 1;
+             ((size_t) 1 << delta->bucket_bits) < delta->count * 2;
+             delta->bucket_bits++);
+
+        delta->sigs = calloc (delta->count + 1, sizeof (*delta->sigs));
+        delta->buckets = malloc (sizeof (*delta->buckets) << delta->bucket_bits);
+        njobs = (delta->count + per_job - 1) / per_job;
+        jobs = calloc (njobs + 1, sizeof (*jobs));
+        if (delta->sigs == NULL || delta->buckets == NULL || jobs == NULL) {
+                error (0, errno, "calloc");
+                goto err;
+        }
+
+        pool = pool_create (VERIFY_THREADS, VERIFY_THREADS * 2);
+        if (pool == NULL) {
+                error (0, errno, "failed to start signature threads");
+                goto err;
+        }
+
+        for (i = 0; i < njobs; i++) {
+                jobs[i].delta = delta;
+                jobs[i].first = i * per_job;
+                jobs[i].count = delta->count - jobs[i].first < per_job ?
+                        delta->count - jobs[i].first : per_job;
+                pool_submit (pool, sign_blocks, &jobs[i]);
+        }
+
+        // Sign the last partial block while the pool works on the others.
+        if (delta->tail_len > 0) {
+                tail = malloc (delta->tail_len);
+                if (tail == NULL) {
+                        error (0, errno, "malloc");
+                        pool_destroy (pool);
+                        goto err;
+                }
+
+                for (len = 0; len < delta->tail_len; len += ret) {
+                        ret = copy_pread (delta->dst, &tail[len],
+                                          delta->tail_len - len,
+                                          dst_size - delta->tail_len + len);
+                        if (ret <= 0) {
+                                error (0, ret == 0 ? EIO : errno,
+                                       "read error: %s", delta->dst->path);
+                                pool_destroy (pool);
+                                goto err;
+                        }
+                }
+
+                delta->tail_strong = checksum_buffer (delta->strong_type, tail,
+                                                      delta->tail_len);
+        }
+
+        pool_wait (pool);
+        pool_destroy (pool);
+
+        for (i = 0; i < njobs; i++) {
+                if (jobs[i].err != 0) {
+                        error (0, jobs[i].err, "read error: %s at offset %jd",
+                               delta->dst->path,
+                               (intmax_t) jobs[i].first * delta->block_size);
+                        goto err;
+                }
+        }
+
+        memset (delta->buckets, -1, sizeof (*delta->buckets) << delta->bucket_bits);
+
+        // Walk backwards so that the last copy of repeated blocks (runs of
+        // zeroes, typically) is the one kept, which keeps the chains short
+        // and favors matches ahead of the scan.
+        for (i = delta->count; i-- > 0;) {
+                delta->sigs[i].next = -1;
+                bucket = weak_bucket (delta, delta->sigs[i].weak);
+
+                for (j = delta->buckets[bucket]; j != -1; j = delta->sigs[j].next) {
+                        if (delta->sigs[j].weak == delta->sigs[i].weak &&
+                            delta->sigs[j].strong == delta->sigs[i].strong) {
+                                break;
+                        }
+                }
+
+                if (j == -1) {
+                        delta->sigs[i].next = delta->buckets[bucket];
+                        delta->buckets[bucket] = i;
+                }
+        }
+
+        free (tail);
+        free (jobs);
+
+        return 0;
+
+err:
+        free (tail);
+        free (jobs);
+
+        return -1;
+}
+
+/**
+ * Looks up the window at pos among the blocks of the destination. A block at
+ * the same offset needs no write at all. A block further ahead, which the
+ * scan has not overwritten yet, can be copied by the server; its index is
+ * returned in block.
+ */
+static enum match
+delta_match (struct delta *delta, const char *p, uint32_t weak, off_t pos,
+             size_t *block)
+{
+        size_t block_size = delta->block_size;
+        size_t index = pos / block_size;
+        bool have_strong = false;
+        uint64_t strong = 0;
+        int64_t j;
+
+        if (pos % block_size == 0 && index < delta->count &&
+            delta->sigs[index].weak == weak) {
+                strong = checksum_buffer (delta->strong_type, p, block_size);
+                have_strong = true;
+
+                if (delta->sigs[index].strong == strong) {
+                        return MATCH_SAME;
+                }
+        }
+
+        for (j = delta->buckets[weak_bucket (delta, weak)]; j != -1;
+             j = delta->sigs[j].next) {
+                if (delta->sigs[j].weak != weak) {
+                        continue;
+                }
+
+                if (!have_strong) {
+                        strong = checksum_buffer (delta->strong_type, p,
+                                                  block_size);
+                        have_strong = true;
+                }
+
+                if (delta->sigs[j].strong != strong) {
+                        continue;
+                }
+
+                if (delta->server_copy &&
+                    (off_t) j * block_size >= pos + (off_t) block_size) {
+                        *block = j;
+                        return MATCH_MOVED;
+                }
+
+                return MATCH_ELSEWHERE;
+        }
+
+        return MATCH_NONE;
+}
+
+/**
+ * Writes the source data from delta->literal up to end.
+ */
+static int
+delta_flush (struct delta *delta, off_t end)
+{
+        if (delta->literal < end &&
+            copy_pwrite_all (delta->dst,
+                             &delta->buf[delta->literal - delta->buf_off],
+                             end - delta->literal, delta->literal) == -1) {
+                return -1;
+        }
+
+        delta->literal = end;
+
+        return 0;
+}
+
+/**
+ * Slides the window to start at pos and reads as much of the source as fits.
+ * Pending data before pos is written out first, since no later match can
+ * cover it.
+ */
+static int
+delta_fill (struct delta *delta, off_t pos)
+{
+        ssize_t num_read;
+        size_t keep;
+
+        if (delta_flush (delta, pos) == -1) {
+                return -1;
+        }
+
+        keep = delta->buf_off + delta->buf_len - pos;
+        memmove (delta->buf, &delta->buf[pos - delta->buf_off], keep);
+        delta->buf_off = pos;
+        delta->buf_len = keep;
+
+        while (delta->buf_len < DELTA_BUFFER_SIZE &&
+               delta->buf_off + (off_t) delta->buf_len < delta->size) {
+                num_read = copy_pread (delta->src, &delta->buf[delta->buf_len],
+                                       DELTA_BUFFER_SIZE - delta->buf_len,
+                                       delta->buf_off + delta->buf_len);
+                if (num_read == -1) {
+                        error (0, errno, "read error: %s", delta->src->path);
+                        return -1;
+                }
+
+                // The source shrank during the transfer.
+                if (num_read == 0) {
+                        delta->size = delta->buf_off + delta->buf_len;
+                        break;
+                }
+
+                delta->buf_len += num_read;
+        }
+
+        delta->eof = delta->buf_off + (off_t) delta->buf_len >= delta->size;
+
+        return 0;
+}
+
+/**
+ * Asks the server to move a block of the destination to pos, within the same
+ * file. Returns -1 if the block has to be written by the client instead.
+ */
+static int
+delta_server_copy (struct delta *delta, size_t block, off_t pos)
+{
+#ifdef HAVE_GLFS_COPY_FILE_RANGE
+        off_t off_in = (off_t) block * delta->block_size;
+        off_t off_out = pos;
+        ssize_t ret;
+
+        ret = glfs_copy_file_range (delta->dst->glfd, &off_in,
+                                    delta->dst->glfd, &off_out,
+                                    delta->block_size, 0, NULL, NULL, NULL);
+        if (ret == (ssize_t) delta->block_size) {
+                return 0;
+        }
+
+        if (ret == -1) {
+                delta->server_copy = false;
+        }
+#endif
+
+        return -1;
+}
+
+/**
+ * Runs the rolling checksum over the source, writing everything that does not
+ * match the destination in place.
+ */
+static int
+delta_scan (struct delta *delta)
+{
+        size_t block_size = delta->block_size;
+        enum match match;
+        const unsigned char *p;
+        bool have_sum = false;
+        uint32_t s1 = 0;
+        uint32_t s2 = 0;
+        size_t block;
+        size_t avail;
+        off_t pos = 0;
+
+        while (true) {
+                // The window and the byte rolled into it must be buffered.
+                if (pos + (off_t) block_size >= delta->buf_off + (off_t) delta->buf_len &&
+                    !delta->eof) {
+                        if (delta_fill (delta, pos) == -1) {
+                                return -1;
+                        }
+
+                        continue;
+                }
+
+                avail = delta->buf_off + delta->buf_len - pos;
+                if (avail < block_size) {
+                        break;
+                }
+
+                p = (const unsigned char *) &delta->buf[pos - delta->buf_off];
+                if (!have_sum) {
+                        weak_sum (p, block_size, &s1, &s2);
+                        have_sum = true;
+                }
+
+                match = delta_match (delta, (const char *) p, s1 | (s2 << 16),
+                                     pos, &block);
+                switch (match) {
+                case MATCH_SAME:
+                        if (delta_flush (delta, pos) == -1) {
+                                return -1;
+                        }
+
+                        delta->literal = pos + block_size;
+                        break;
+                case MATCH_MOVED:
+                        if (delta_flush (delta, pos) == -1) {
+                                return -1;
+                        }
+
+                        if (delta_server_copy (delta, block, pos) == 0) {
+                                delta->literal = pos + block_size;
+                        }
+
+                        break;
+                case MATCH_ELSEWHERE:
+                        // The data has to be written anyway, so skip ahead
+                        // instead of rolling through it.
+                        break;
+                case MATCH_NONE:
+                        if (avail == block_size) {
+                                goto tail;
+                        }
+
+                        s1 = (s1 - p[0] + p[block_size]) & 0xffff;
+                        s2 = (s2 - block_size * p[0] + s1) & 0xffff;
+                        pos++;
+                        continue;
+                }
+
+                pos += block_size;
+                have_sum = false;
+        }
+
+tail:
+        // A last partial block can only match the destination's own.
+        avail = delta->buf_off + delta->buf_len - pos;
+        if (delta->tail_len > 0 && avail == delta->tail_len &&
+            pos == (off_t) (delta->count * block_size) &&
+            checksum_buffer (delta->strong_type, &delta->buf[pos - delta->buf_off],
+                             avail) == delta->tail_strong) {
+                if (delta_flush (delta, pos) == -1) {
+                        return -1;
+                }
+
+                delta->literal = pos + avail;
+        }
+
+        return delta_flush (delta, delta->buf_off + delta->buf_len);
+}
+
+/**
+ * Updates dst, which holds dst_size bytes of an older version of src, to the
+ * contents of src. Only the blocks that differ are written, and blocks found
+ * further ahead in dst are moved by the server when it can copy ranges, so
+ * the amount of data sent scales with the size of the change.
+ */
+int
+copy_file_delta (struct copy_file *src, struct copy_file *dst,
+                 const struct stat *src_stat, off_t dst_size)
+{
+        int ret = -1;
+        struct delta delta = {
+                .src = src,
+                .dst = dst,
+                .strong_type = CHECKSUM_CRC32C,
+                .block_size = delta_block_size (src_stat->st_size),
+                .size = src_stat->st_size,
+#ifdef HAVE_GLFS_COPY_FILE_RANGE
+                .server_copy = dst->glfd != NULL,
+#endif
+        };
+
+        // Prefer a 64 bit strong checksum when the library is available.
+        checksum_parse ("xxh3", &delta.strong_type);
+
+        delta.buf = malloc (DELTA_BUFFER_SIZE);
+        if (delta.buf == NULL) {
+                error (0, errno, "malloc");
+                goto out;
+        }
+
+        if (delta_sign (&delta, dst_size) == -1) {
+                goto out;
+        }
+
+        if (delta_scan (&delta) == -1) {
+                goto out;
+        }
+
+        ret = copy_ftruncate (dst, src_stat->st_size);
+        if (ret == -1) {
+                error (0, errno, "failed to truncate %s", dst->path);
+        }
+
+out:
+        free (delta.buf);
+        free (delta.sigs);
+        free (delta.buckets);
+
+        return ret;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_DELTA_H
+#define GLFS_DELTA_H
+
+#include "glfs-copy.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define DELTA_MIN_BLOCK_SIZE 4096
+#define DELTA_MAX_BLOCK_SIZE 128*1024
+
+int
+copy_file_delta (struct copy_file *src, struct copy_file *dst,
+                 const struct stat *src_stat, off_t dst_size);
+
+#endif /* GLFS_DELTA_H */
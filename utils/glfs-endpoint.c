@@ -0,0 +1,208 @@
+/**
+ * The sources and destination of the utilities that transfer between local
+ * paths and Gluster volumes, and their connections.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-endpoint.h"
+#include "glfs-util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <glusterfs/api/glfs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Parses a file:// url into a string with just the path.
+ */
+static char*
+parse_file_url (char *file_url)
+{
+        char *file_path = NULL;
+
+        // file_url should be minimum of 8 characters: file:///
+        if (strlen (file_url) <= 7) {
+                goto out;
+        }
+
+        // length of file:// is 7 characters
+        if (strncmp (file_url, "file://", 7) == 0) {
+                file_path = file_url + 7;
+        }
+
+out:
+        return file_path;
+}
+
+/**
+ * Fills endpoint from a command line argument: a glfs:// url, a file:// url,
+ * or a plain path, which refers to the connected volume in the shell and to
+ * a local path otherwise.
+ */
+int
+parse_endpoint (char *arg, struct endpoint *endpoint, uint16_t port,
+                bool has_connection)
+{
+        char *file_path;
+
+        endpoint->arg = strdup (arg);
+        if (endpoint->arg == NULL) {
+                error (0, errno, "strdup");
+                return -1;
+        }
+
+        if (gluster_parse_url (arg, &endpoint->url) == 0) {
+                endpoint->url->port = port;
+                endpoint->path = strdup (endpoint->url->path);
+        } else {
+                endpoint->url = NULL;
+                file_path = parse_file_url (arg);
+                endpoint->path = strdup (file_path ? file_path : arg);
+                endpoint->connected = has_connection && file_path == NULL;
+        }
+
+        if (endpoint->path == NULL) {
+                error (0, errno, "strdup");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Whether the path of endpoint is local.
+ */
+bool
+endpoint_is_local (const struct endpoint *endpoint)
+{
+        return endpoint->url == NULL && !endpoint->connected;
+}
+
+/**
+ * Connects endpoint to its volume, reusing the connection of one of the
+ * count endpoints before it when they live on the same volume.
+ */
+static int
+connect_endpoint (struct endpoint *endpoint, struct endpoint **before,
+                  int count, glfs_t *connected, struct xlator_option **options,
+                  bool debug)
+{
+        struct endpoint *other;
+
+        if (endpoint->connected) {
+                endpoint->fs = connected;
+                return 0;
+        }
+
+        if (endpoint->url == NULL) {
+                return 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+                other = before[i];
+                if (other->url != NULL && other->fs != NULL &&
+                    strcmp (endpoint->url->host, other->url->host) == 0 &&
+                    strcmp (endpoint->url->volume, other->url->volume) == 0) {
+                        endpoint->fs = other->fs;
+                        return 0;
+                }
+        }
+
+        if (gluster_getfs (&endpoint->fs, endpoint->url) == -1) {
+                error (0, errno, "failed to connect to `%s'", endpoint->arg);
+                return -1;
+        }
+
+        if (apply_xlator_options (endpoint->fs, options) == -1) {
+                error (0, errno, "failed to apply translator options");
+                return -1;
+        }
+
+        if (debug &&
+            glfs_set_logging (endpoint->fs, "/dev/stderr", GF_LOG_DEBUG) == -1) {
+                error (0, errno, "failed to set logging level");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Connects the endpoints in order, one connection per volume. Paths on the
+ * volume of the shell use connected.
+ */
+int
+connect_endpoints (struct endpoint **endpoints, int count, glfs_t *connected,
+                   struct xlator_option **options, bool debug)
+{
+        for (int i = 0; i < count; i++) {
+                if (connect_endpoint (endpoints[i], endpoints, i, connected,
+                                      options, debug) == -1) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Closes the connections opened for the endpoints, once each.
+ */
+void
+disconnect_endpoints (struct endpoint **endpoints, int count)
+{
+        glfs_t *fs;
+        bool shared;
+
+        for (int i = 0; i < count; i++) {
+                fs = endpoints[i]->fs;
+                if (fs == NULL || endpoints[i]->connected) {
+                        continue;
+                }
+
+                shared = false;
+                for (int j = 0; j < i && !shared; j++) {
+                        shared = fs == endpoints[j]->fs;
+                }
+
+                if (!shared) {
+                        glfs_fini (fs);
+                }
+        }
+}
+
+/**
+ * Frees endpoint; its connection may be shared, so it is closed by
+ * disconnect_endpoints ().
+ */
+void
+free_endpoint (struct endpoint *endpoint)
+{
+        free (endpoint->path);
+        free (endpoint->target);
+        free (endpoint->arg);
+
+        if (endpoint->url != NULL) {
+                gluster_url_free (endpoint->url);
+        }
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_ENDPOINT_H
+#define GLFS_ENDPOINT_H
+
+#include "glfs-util.h"
+
+#include <glusterfs/api/glfs.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A source or the destination of a transfer between local paths and
+ * Gluster volumes.
+ *
+ * url: The parsed glfs:// url, or NULL for local paths and paths on the
+ *      volume of the shell connection.
+ * connected: Whether the path lives on the volume of the shell connection.
+ * fs: The volume holding the path, or NULL for local paths.
+ * path: The path on its volume, or locally.
+ * target: For sources, the path they are moved to on the volume of the
+ *         destination, when the utility computes one.
+ * arg: Raw string supplied by the user, for messages.
+ */
+struct endpoint {
+        struct gluster_url *url;
+        bool connected;
+        glfs_t *fs;
+        char *path;
+        char *target;
+        char *arg;
+};
+
+int
+parse_endpoint (char *arg, struct endpoint *endpoint, uint16_t port,
+                bool has_connection);
+
+bool
+endpoint_is_local (const struct endpoint *endpoint);
+
+int
+connect_endpoints (struct endpoint **endpoints, int count, glfs_t *connected,
+                   struct xlator_option **options, bool debug);
+
+void
+disconnect_endpoints (struct endpoint **endpoints, int count);
+
+void
+free_endpoint (struct endpoint *endpoint);
+
+#endif /* GLFS_ENDPOINT_H */
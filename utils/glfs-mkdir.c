@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include "glfs-mkdir.h"
+#include "glfs-tree.h"
 #include "glfs-util.h"
 
 #include <errno.h>
@@ -44,13 +45,17 @@
  * url: Full url used to find the remote file (supplied by user).
  * debug: Whether to log additional debug information.
  * parents: Whether all parent directories in the path are created.
+ * manifest: File listing directories to create under the path, or NULL.
+ * jobs: Number of directories of the manifest created concurrently.
  */
 struct state {
         struct gluster_url *gluster_url;
         struct xlator_option *xlator_options;
         char *url;
+        char *manifest;
         bool debug;
         bool parents;
+        int jobs;
 };
 
 static struct state *state;
@@ -59,6 +64,8 @@ static struct option const long_options[] =
 {
         {"debug", no_argument, NULL, 'd'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"manifest", required_argument, NULL, 'm'},
         {"parents", no_argument, NULL, 'r'},
         {"port", required_argument, NULL, 'p'},
         {"version", no_argument, NULL, 'v'},
@@ -70,6 +77,11 @@ static void
 usage ()
 {
         printf ("Usage: %s [OPTION]... URL\n\n"
+                "  -j, --jobs=N                 create up to N directories of a manifest\n"
+                "                               concurrently (default %d)\n"
+                "  -m, --manifest=FILE          create the directories listed in FILE, one\n"
+                "                               per line, under the directory URL, along with\n"
+                "                               their parents. With FILE -, read standard input.\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the \n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
@@ -85,11 +97,15 @@ usage ()
                 "  gfmkdir -r glfs://localhost/groot/directory/subdirectory\n"
                 "          Recursively create the directory /directory/subdirectory\n"
                 "          on the Gluster volume of groot host localhost.\n"
+                "  gfmkdir -m dirs.txt glfs://localhost/groot/job\n"
+                "          Create the directory /job and the directories listed in\n"
+                "          dirs.txt under it, on the Gluster volume of groot on host\n"
+                "          localhost.\n"
                 "  gfcli (localhost/groot)> mkdir /directory\n"
                 "          In the context of a shell with a connection established,\n"
                 "          create a directory on the root of the Gluster volume groot\n"
                 "          on localhost.\n",
-                program_invocation_name);
+                program_invocation_name, TREE_MKDIR_JOBS);
 }
 
 static int
@@ -99,12 +115,14 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt since other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "do:p:rv", long_options,
+                opt = getopt_long (argc, argv, "dj:m:o:p:rv", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -114,6 +132,26 @@ parse_options (int argc, char *argv[], bool has_connection)
                 switch (opt) {
                         case 'd':
                                 state->debug = true;
+                                break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->jobs = jobs;
+                                break;
+                        case 'm':
+                                free (state->manifest);
+                                state->manifest = strdup (optarg);
+                                if (state->manifest == NULL) {
+                                        error (0, errno, "strdup");
+                                        goto out;
+                                }
+
                                 break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
@@ -221,6 +259,8 @@ init_state ()
 
         state->debug = false;
         state->gluster_url = NULL;
+        state->jobs = TREE_MKDIR_JOBS;
+        state->manifest = NULL;
         state->parents = false;
         state->url = NULL;
         state->xlator_options = NULL;
@@ -229,12 +269,82 @@ out:
         return state;
 }
 
+/**
+ * Creates the directory of the url and the directories of the manifest
+ * under it, level by level.
+ */
+static int
+mkdir_manifest (glfs_t *fs)
+{
+        struct tree_mkdirs tm;
+        FILE *file;
+        char *line = NULL;
+        char *path;
+        size_t size = 0;
+        ssize_t len;
+        int ret;
+
+        if (strcmp (state->manifest, "-") == 0) {
+                file = stdin;
+        } else {
+                file = fopen (state->manifest, "r");
+                if (file == NULL) {
+                        error (0, errno, "%s", state->manifest);
+                        return -1;
+                }
+        }
+
+        tree_mkdirs_init (&tm, fs, get_default_dir_mode_perm ());
+        tm.jobs = state->jobs;
+
+        ret = tree_mkdirs_add (&tm, state->gluster_url->path);
+        while (ret == 0 && (len = getline (&line, &size, file)) != -1) {
+                if (len > 0 && line[len - 1] == '\n') {
+                        line[--len] = '\0';
+                }
+
+                if (len == 0) {
+                        continue;
+                }
+
+                path = append_path (state->gluster_url->path, line);
+                ret = path == NULL ? -1 : tree_mkdirs_add (&tm, path);
+                free (path);
+        }
+
+        if (ret == -1 || ferror (file)) {
+                error (0, errno, "%s", state->manifest);
+                ret = -1;
+        } else {
+                ret = tree_mkdirs (&tm);
+        }
+
+        if (state->debug) {
+                fprintf (stderr, "%ju created, %ju existing, %ju failed\n",
+                         tm.created, tm.existing, tm.errors);
+        }
+
+        tree_mkdirs_fini (&tm);
+        free (line);
+
+        if (file != stdin) {
+                fclose (file);
+        }
+
+        return ret;
+}
+
 static int
 mkdir_with_fs (glfs_t *fs)
 {
         int ret;
         mode_t mode = get_default_dir_mode_perm ();
 
+        // Failures are reported for each directory of the manifest.
+        if (state->manifest) {
+                return mkdir_manifest (fs);
+        }
+
         if (state->parents) {
                 ret = gluster_create_path (fs, state->gluster_url->path, mode);
         } else {
@@ -325,6 +435,7 @@ do_mkdir (struct cli_context *ctx)
 out:
         if (state) {
                 gluster_url_free (state->gluster_url);
+                free (state->manifest);
                 free (state->url);
         }
 
@@ -1,6 +1,6 @@
 /**
- * A utility to copy a file to or from a remote Gluster volume locally or to or
- * from another remote Gluster volume.
+ * A utility to move files and directories to or from a remote Gluster volume
+ * locally or to or from another remote Gluster volume.
  *
  * Copyright (C) 2017 RedHat Inc.
  *
@@ -22,60 +22,53 @@
 #include <config.h>
 
 #include "glfs-mv.h"
+#include "glfs-endpoint.h"
+#include "glfs-pool.h"
+#include "glfs-tree.h"
 #include "glfs-util.h"
 
 #include <errno.h>
 #include <error.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <glusterfs/api/glfs.h>
-#include <linux/limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <unistd.h>
 
 #define AUTHORS "Written by Akshay Venugopal."
-#define BUFFER_SIZE 1024*1024
-
-/**
- * Represents the various transfer modes supported by gfcp.
- * In this context, ESTABLISHED refers to the case where a
- * connection has already been established in the CLI and we
- * are getting a connection passed to us via cli_context.
- */
-enum transfer_mode {
-        ESTABLISHED_TO_ESTABLISHED,
-        ESTABLISHED_TO_LOCAL,
-        ESTABLISHED_TO_REMOTE,
-        LOCAL_TO_ESTABLISHED,
-        LOCAL_TO_REMOTE,
-        REMOTE_TO_ESTABLISHED,
-        REMOTE_TO_LOCAL,
-        REMOTE_TO_REMOTE
-};
 
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_dest: Struct of the parsed destination url supplied by the user.
- * gluster_source: Struct of the parsed source url supplied by the user.
- * dest: Raw destination string supplied by the user.
- * source: Raw source string supplied by the user.
+ * sources, source_count: The paths to move.
+ * dest: Where to move them; a directory when there are several sources.
  * debug: Whether to log additional debug information.
- * mode: The detected transfer mode (deduced from the supplied source and dest).
+ * jobs: Number of renames or file transfers in flight.
+ * errors: Number of failed renames, updated by the workers.
  */
 struct state {
-        struct gluster_url *gluster_dest;
-        struct gluster_url *gluster_source;
         struct xlator_option *xlator_options;
-        char *dest;
-        char *source;
+        struct endpoint *sources;
+        int source_count;
+        struct endpoint dest;
         bool debug;
-        enum transfer_mode mode;
+        int jobs;
+        pthread_mutex_t lock;
+        int errors;
+};
+
+/**
+ * A rename queued to the workers, for a source on the volume of the
+ * destination.
+ */
+struct rename_job {
+        glfs_t *fs;
+        const char *source;
+        const char *target;
 };
 
 static struct state *state;
@@ -83,34 +76,13 @@ static struct option const long_options[] =
 {
         {"debug", no_argument, NULL, 'd'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
         {"port", required_argument, NULL, 'p'},
         {"version", no_argument, NULL, 'v'},
         {"xlator-option", required_argument, NULL, 'o'},
         {NULL, no_argument, NULL, 0}
 };
 
-/**
- * Parses a file:// url into a string with just the path.
- */
-static char*
-parse_file_url (char *file_url)
-{
-        char *file_path = NULL;
-
-        // file_url should be minimum of 8 characters: file:///
-        if (strlen (file_url) <= 7) {
-                goto out;
-        }
-
-        // length of file:// is 7 characters
-        if (strncmp (file_url, "file://", 7) == 0) {
-                file_path = file_url + 7;
-        }
-
-out:
-        return file_path;
-}
-
 /**
  * Prints usage information.
  */
@@ -118,7 +90,13 @@ static void
 usage ()
 {
         printf ("Usage: %s [OPTION]... SOURCE DEST\n"
-                "Move SOURCE to DEST; one of local to remote, remote to local, or remote to remote.\n\n"
+                "  or:  %s [OPTION]... SOURCE... DIRECTORY\n"
+                "Move SOURCE to DEST, or several SOURCEs to DIRECTORY; one of local to\n"
+                "remote, remote to local, or remote to remote. Sources on the volume of\n"
+                "the destination are renamed, others are copied and removed once their\n"
+                "copy is committed. Directories are moved with their contents.\n\n"
+                "  -j, --jobs=N                 keep up to N renames or file transfers in\n"
+                "                               flight (default %d)\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
@@ -135,17 +113,20 @@ usage ()
                 "  gfmv glfs://localhost/groot/remote_file ./file\n"
                 "       Moves the file 'remote_file' on the remote Gluster gluster\n"
                 "       volume of groot on the host localhost to the local file 'file'.\n"
-                "  gfmv glfs://localhost/groot/remote_file glfs://remote_host/groot/file\n"
-                "       Moves the file 'remote_file' on the remote Gluster gluster\n"
-                "       volume of groot on the host localhost to a second remote Gluster\n"
-                "       volume of groot on the host remote_host to the file 'file'.\n"
-                "  gfcli (localhost/groot)> cp /example file://example\n"
+                "  gfmv glfs://localhost/groot/a glfs://localhost/groot/b glfs://localhost/groot/dir\n"
+                "       Renames the files 'a' and 'b' into the directory 'dir' of the\n"
+                "       volume groot on the host localhost.\n"
+                "  gfmv glfs://localhost/groot/dir glfs://remote_host/groot/\n"
+                "       Moves the directory 'dir' on the remote Gluster volume of groot on\n"
+                "       the host localhost, with its contents, to a second remote Gluster\n"
+                "       volume of groot on the host remote_host.\n"
+                "  gfcli (localhost/groot)> mv /example file://example\n"
                 "       Move the file example relative to the root of the connected\n"
                 "       Gluster volume to a local file called example.\n"
-                "  gfcli (localhost/groot)> cp file://example glfs://host/volume/example\n"
+                "  gfcli (localhost/groot)> mv file://example glfs://host/volume/example\n"
                 "       Move the local file example to a remote Gluster volume on the\n"
                 "       host 'host'.\n",
-                program_invocation_name);
+                program_invocation_name, program_invocation_name, TREE_COPY_JOBS);
 }
 
 /**
@@ -158,13 +139,15 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt as other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "o:p:", long_options,
-                                &option_index);
+                opt = getopt_long (argc, argv, "j:o:p:", long_options,
+                                   &option_index);
 
                 if (opt == -1) {
                         break;
@@ -174,6 +157,17 @@ parse_options (int argc, char *argv[], bool has_connection)
                         case 'd':
                                 state->debug = true;
                                 break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->jobs = jobs;
+                                break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
                                 if (option == NULL) {
@@ -213,228 +207,37 @@ parse_options (int argc, char *argv[], bool has_connection)
                 }
         }
 
-        if ((argc - option_index) < 3) {
+        if (argc - optind < 2) {
                 error (0, 0, "missing operand");
                 goto err;
-        } else {
-                /*
-                 * The following block of code parses the source and destination
-                 * arguments. Depending on what the user has indicated, the
-                 * transfer mode of the application will differ. There are a few
-                 * possibilities:
-                 *
-                 *   -> Source and destination are identical: show an invalid error
-                 *   -> Local source and remote destination
-                 *   -> Remote source and local destination
-                 *   -> Remote source and remote destination
-                 *   -> Local source and local destination: show an invalid error
-                 *
-                 * The transfer mode is decided based upon parsing outcomes. For
-                 * example, if gluster_parse_url () fails on the second to last
-                 * argument, we assume that we will be doing a LOCAL_TO_REMOTE
-                 * transfer. Then, if gluster_parse_url () succeeds on the last
-                 * argument, then we are definitely in that mode. If it fails,
-                 * that must mean the user is attempting to execute a local to
-                 * local transfer, which this application does not support.
-                 */
-
-                if (strcmp (argv[argc - 1], argv[argc - 2]) == 0) {
-                        error (0, EINVAL, "source and destination are the same");
-                        goto err;
-                }
-
-                /*
-                 * If we have a connection passed to us from the shell, then
-                 * there are a few differences. One is that local paths must be
-                 * prefixed with file://. Otherwise, there is no way to
-                 * distinguish between a local path and a path relative to the
-                 * volume of the open connection. However, there is still the
-                 * chance that there will be a remote source or destination, so
-                 * we will still attempt to parse either parameter into a
-                 * gluster_url.
-                 *
-                 *   -> Local (file://) source and remote (current conn) destination
-                 *   -> Local (file://) source and remote (differknt conn) destination
-                 *   -> Remote (current conn) source and local (file://) destination
-                 *   -> Remote (different conn) source and local (file://) destination
-                 *   -> Remote (current conn) source and remote (different conn) destination
-                 *   -> Remote (different conn) source and remote (current conn) destination
-                 *   -> Remote (current conn) source and remote (different conn) destination
-                 *   -> Remote (different conn) source and remote (different conn) destination
-                 */
-
-                if (has_connection) {
-                        char *file_path;
-
-                        // Part 1: Parse the source string and guess our destination.
-                        // We'll assume that we'll be interacting with the connected
-                        // volume, so start with that.
-                        ret = gluster_parse_url (argv[argc - 2], &(state->gluster_source));
-                        if (ret == -1) {
-                                file_path = parse_file_url (argv[argc - 2]);
-                                if (file_path == NULL) {
-                                        state->source = strdup (argv[argc - 2]);
-                                        if (state->source == NULL) {
-                                                error (0, errno, "strdup");
-                                                goto out;
-                                        }
-
-                                        // Parsed source is neither a valid glfs://
-                                        // url or a valid file:// url, so assuming
-                                        // a path relative to the connected volume.
-                                        state->mode = ESTABLISHED_TO_REMOTE;
-                                } else {
-                                        state->source = strdup (file_path);
-                                        if (state->source == NULL) {
-                                                error (0, errno, "strdup");
-                                                goto out;
-                                        }
-
-                                        // Parsed source is a valid file:// url.
-                                        state->mode = LOCAL_TO_ESTABLISHED;
-                                }
-                        } else {
-                                state->source = strdup (argv[argc - 2]);
-                                if (state->source == NULL) {
-                                        error (0, errno, "strdup");
-                                        goto out;
-                                }
-
-                                // Parsed source is a valid glfs:// url.
-                                state->mode = REMOTE_TO_ESTABLISHED;
-                                state->gluster_source->port = port;
-                        }
-
-                        // Part 2: Fix our destination based on our source and
-                        // the result of parsing the destination string.
-                        ret = gluster_parse_url (argv[argc - 1], &(state->gluster_dest));
-                        if (ret == -1) {
-                                file_path = parse_file_url (argv[argc - 1]);
-                                if (file_path == NULL) {
-                                        state->dest = strdup (argv[argc - 1]);
-                                        if (state->dest == NULL) {
-                                                error (0, errno, "strdup");
-                                                goto out;
-                                        }
-
-                                        // If the source argument is a path relative
-                                        // to the root of the connected volume, and the
-                                        // destination argument is neither a glfs:// url
-                                        // or a file:// url, then we must be cp'ing
-                                        // to and from the connected volume.
-                                        if (state->mode == ESTABLISHED_TO_REMOTE) {
-                                                state->mode = ESTABLISHED_TO_ESTABLISHED;
-                                        }
-
-                                        ret = 0;
-                                        goto out;
-                                } else {
-                                        state->dest = strdup (file_path);
-                                        if (state->dest == NULL) {
-                                                error (0, errno, "strdup");
-                                                goto out;
-                                        }
-
-                                        switch (state->mode) {
-                                                // If the source argument is glfs:// url
-                                                // and the destination argument is a valid
-                                                // file:// url, then we must be copying from
-                                                // a different remote volume to the local
-                                                // system.
-                                                case REMOTE_TO_ESTABLISHED:
-                                                        state->mode = REMOTE_TO_LOCAL;
-                                                        ret = 0;
-                                                        goto out;
-                                                // If the source argument is a path relative
-                                                // to the connected volume, and the destination
-                                                // argument is a valid file:// url, then we must
-                                                // be copying from the connected volume to the
-                                                // local system.
-                                                case ESTABLISHED_TO_REMOTE:
-                                                        state->mode = ESTABLISHED_TO_LOCAL;
-                                                        ret = 0;
-                                                        goto out;
-                                                default:
-                                                        error (0, 0, "unknown transfer mode");
-                                                        goto out;
-                                        }
-                                }
-                        } else {
-                                state->dest = strdup (argv[argc - 1]);
-                                if (state->source == NULL) {
-                                        error (0, errno, "strdup");
-                                        goto out;
-                                }
+        }
 
-                                state->gluster_dest->port = port;
-
-                                switch (state->mode) {
-                                        // Source arugment is a path relative to
-                                        // connected the volume, and the destination
-                                        // argument is a valid glfs:// url.
-                                        case ESTABLISHED_TO_REMOTE:
-                                                ret = 0;
-                                                goto out;
-                                        // If the source argument is a valid glfs:// url and the
-                                        // destination argument is a valid glfs:// url, then the
-                                        // copy action is from the remote volume to another remote
-                                        // volume.
-                                        case REMOTE_TO_ESTABLISHED:
-                                                state->mode = REMOTE_TO_REMOTE;
-                                                ret = 0;
-                                                goto out;
-                                        // If the source argument is a valid file:// url and the
-                                        // destination argument is a valid glfs:// url, then the
-                                        // copy action is from the local system to a remote
-                                        // volume.
-                                        case LOCAL_TO_ESTABLISHED:
-                                                state->mode = LOCAL_TO_REMOTE;
-                                                ret = 0;
-                                                goto out;
-                                        default:
-                                                error (0, 0, "unknown transfer mode");
-                                                goto out;
-                                }
-                        }
-                }
+        if (argc - optind == 2 && strcmp (argv[argc - 1], argv[argc - 2]) == 0) {
+                error (0, EINVAL, "source and destination are the same");
+                goto err;
+        }
 
-                free (state->dest);
-                free (state->source);
+        if (parse_endpoint (argv[argc - 1], &state->dest, port, has_connection) == -1) {
+                goto out;
+        }
 
-                state->source = strdup (argv[argc - 2]);
-                if (state->source == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
+        state->source_count = argc - optind - 1;
+        state->sources = calloc (state->source_count, sizeof (*state->sources));
+        if (state->sources == NULL) {
+                error (0, errno, "calloc");
+                goto out;
+        }
 
-                state->dest = strdup (argv[argc - 1]);
-                if (state->dest == NULL) {
-                        error (0, errno, "strdup");
+        for (int i = 0; i < state->source_count; i++) {
+                if (parse_endpoint (argv[optind + i], &state->sources[i], port,
+                                    has_connection) == -1) {
                         goto out;
                 }
 
-                ret = gluster_parse_url (argv[argc - 2], &(state->gluster_source));
-                if (ret == -1) {
-                        state->mode = LOCAL_TO_REMOTE;
-                } else {
-                        state->mode = REMOTE_TO_LOCAL;
-                        state->gluster_source->port = port;
-                }
-
-                ret = gluster_parse_url (argv[argc - 1], &(state->gluster_dest));
-                if (ret == -1) {
-                        if (state->mode == LOCAL_TO_REMOTE) {
-                                error (0, EINVAL, "local source and destination");
-                                goto err;
-                        }
-
-                        state->mode = REMOTE_TO_LOCAL;
-                } else {
-                        if (state->mode == REMOTE_TO_LOCAL) {
-                                state->mode = REMOTE_TO_REMOTE;
-                        }
-
-                        state->gluster_dest->port = port;
+                if (endpoint_is_local (&state->sources[i]) &&
+                    endpoint_is_local (&state->dest)) {
+                        error (0, EINVAL, "local source and destination");
+                        goto err;
                 }
         }
 
@@ -453,479 +256,203 @@ out:
 static struct state*
 init_state ()
 {
-        struct state *state = malloc (sizeof (*state));
+        struct state *state = calloc (1, sizeof (*state));
 
         if (state == NULL) {
                 goto out;
         }
 
-        state->debug = false;
-        state->dest = NULL;
-        state->gluster_dest = NULL;
-        state->gluster_source = NULL;
-        state->source = NULL;
-        state->xlator_options = NULL;
+        state->jobs = TREE_COPY_JOBS;
+        pthread_mutex_init (&state->lock, NULL);
 
 out:
         return state;
 }
 
 /**
- * Helper function that will complete the destination path, given the full local
- * path, the user supplied destination path, and an initialized stat struct for
- * the supplied destination path.
- *
- * For example, presume the following is executed:
- *
- *   $ glfs-cp /tmp/some_data glfs://some_host/some_volume
- *
- * In this case, the source path is '/tmp/some_data' and the destination path is
- * '/' (the default case when the user has not supplied an explicit path in a
- * Gluster URL). We execute a stat () on '/' in the context of the Gluster
- * connection, which indicates that the path is a directory. Since a file
- * cannot overwrite a directory, we complete the path of the destination:
- * '/some_data'. This behavior is much in the same vain as the GNU coreutils cp
- * utility.
- *
- * It is the responsibility of the caller to free the return value.
+ * Whether source lives on the volume of the destination, and can be renamed
+ * instead of copied.
  */
-static char *
-complete_path (const char *source_path, const char *dest_path, const struct stat *statbuf)
+static bool
+is_rename (const struct endpoint *source)
 {
-        char *full_path;
-
-        if (statbuf && S_ISDIR (statbuf->st_mode)) {
-                char *fmt = "%s/%s";
-                size_t fmt_length = 2;
-                size_t dest_path_length = strlen (dest_path);
-
-                if (dest_path[dest_path_length - 1] == '/') {
-                        fmt_length = 1;
-                        fmt = "%s%s";
-                }
-
-                char *base_file = basename (source_path);
-                size_t length = dest_path_length + strlen (base_file) + fmt_length;
-
-                full_path = malloc (length);
-                if (full_path == NULL) {
-                        error (0, errno, "complete_path");
-                        goto out;
-                }
-
-                snprintf (full_path, length, fmt, dest_path, base_file);
-        } else {
-                full_path = strdup (dest_path);
-        }
-
-out:
-        return full_path;
+        return source->fs != NULL && source->fs == state->dest.fs;
 }
 
 /**
- * Perform a LOCAL_TO_REMOTE transfer, given the local source and remote
- * destination, and an active connection to the remote destination.
+ * Computes the target of each source: the destination itself, or the name
+ * of the source within the destination when the latter is a directory.
  */
 static int
-local_to_remote (const char *local_path, const char *remote_path, glfs_t *fs)
+complete_targets ()
 {
-        int ret = -1;
-        int fd;
-        glfs_fd_t *remote_fd = NULL;
         struct stat statbuf;
-        char *full_path = NULL;
-
-        fd = open (local_path, O_RDONLY);
-        if (fd == -1) {
-                error (0, errno, "%s", local_path);
-                goto out;
-        }
+        struct endpoint *source;
+        bool is_dir;
+        char *name;
+        size_t len;
 
-        ret = glfs_lstat (fs, remote_path, &statbuf);
+        is_dir = tree_stat (state->dest.fs, state->dest.path, &statbuf) == 0 &&
+                S_ISDIR (statbuf.st_mode);
 
-        if (ret == -1) {
-                full_path = complete_path (local_path, remote_path, NULL);
-        } else {
-                full_path = complete_path (local_path, remote_path, &statbuf);
+        if (state->source_count > 1 && !is_dir) {
+                error (0, ENOTDIR, "target `%s'", state->dest.arg);
+                return -1;
         }
 
-        if (full_path == NULL) {
-                ret = -1;
-                goto out;
-        }
-
-        remote_fd = glfs_creat (fs, full_path, O_RDWR, get_default_file_mode_perm ());
-        if (remote_fd == NULL) {
-                error (0, errno, "failed to create %s", full_path);
-                ret = -1;
-                goto out;
-        }
-
-        ret = gluster_lock (remote_fd, F_WRLCK, false);
-        if (ret == -1) {
-                error (0, errno, "failed to lock %s", full_path);
-                goto out;
-        }
-
-#ifdef HAVE_GLFS_7_6
-        ret = glfs_ftruncate (remote_fd, 0, NULL, NULL);
-#else
-        ret = glfs_ftruncate (remote_fd, 0);
-#endif
-        if (ret == -1) {
-                error (0, errno, "failed to truncate %s", full_path);
-                goto out;
-        }
-
-        if (gluster_write (fd, remote_fd) == 0) {
-                ret = -1;
-                error (0, errno, "failed to transfer %s", local_path);
-        }
+        for (int i = 0; i < state->source_count; i++) {
+                source = &state->sources[i];
 
-out:
-        free (full_path);
+                // Trailing slashes name the directory itself.
+                len = strlen (source->path);
+                while (len > 1 && source->path[len - 1] == '/') {
+                        source->path[--len] = '\0';
+                }
 
-        if (fd != -1) {
-                close (fd);
-        }
+                if (is_dir) {
+                        name = strrchr (source->path, '/');
+                        name = name ? name + 1 : source->path;
+                        source->target = append_path (state->dest.path, name);
+                } else {
+                        source->target = strdup (state->dest.path);
+                }
 
-        if (remote_fd) {
-                glfs_close (remote_fd);
+                if (source->target == NULL) {
+                        error (0, errno, "%s", source->arg);
+                        return -1;
+                }
         }
 
-        return ret;
+        return 0;
 }
 
-/**
- * Perform a REMOTE_TO_LOCAL transfer, given the remote path and local
- * destination, and an active connection to the remote source.
- */
-static int
-remote_to_local (const char *remote_path, const char *local_path, glfs_t *fs)
+static void
+rename_job (void *arg)
 {
-        int ret = -1;
-        int local_fd = -1;
-        glfs_fd_t *remote_fd = NULL;
-        struct stat statbuf;
-        char *full_path;
+        struct rename_job *job = arg;
 
-        ret = stat (local_path, &statbuf);
-        if (ret == -1) {
-                full_path = complete_path (remote_path, local_path, NULL);
-        } else {
-                full_path = complete_path (remote_path, local_path, &statbuf);
-        }
+        if (glfs_rename (job->fs, job->source, job->target) == -1) {
+                error (0, errno, "cannot move `%s' to `%s'", job->source,
+                       job->target);
 
-        if (full_path == NULL) {
-                ret = -1;
-                goto out;
-        }
-
-        remote_fd = glfs_open (fs, remote_path, O_RDONLY);
-        if (remote_fd == NULL) {
-                error (0, errno, "%s", remote_path);
-                goto out;
+                pthread_mutex_lock (&state->lock);
+                state->errors++;
+                pthread_mutex_unlock (&state->lock);
         }
 
-        local_fd = open (full_path, O_CREAT | O_WRONLY, get_default_file_mode_perm ());
-        if (local_fd == -1) {
-                error (0, errno, "%s", full_path);
-                goto out;
-        }
-
-        ret = gluster_lock (remote_fd, F_WRLCK, false);
-        if (ret == -1) {
-                error (0, errno, "failed to lock %s", remote_path);
-                goto out;
-        }
-
-        if ((ret = gluster_read (remote_fd, local_fd)) == -1) {
-                error (0, errno, "write error");
-        }
-
-out:
-        free (full_path);
-
-        if (local_fd != -1) {
-                close (local_fd);
-        }
-
-        if (remote_fd) {
-                glfs_close (remote_fd);
-        }
-
-        return ret;
+        free (job);
 }
 
 /**
- * Perform a REMOTE_TO_REMOTE transfer, given both source and destination remote
- * paths and active connections to both the source and destination.
+ * Renames the sources living on the volume of the destination. The renames
+ * are independent, so they are kept in flight together instead of waiting
+ * for each reply in turn.
  */
 static int
-remote_to_remote (const char *source_path, const char *dest_path, glfs_t *source_fs, glfs_t *dest_fs)
+rename_sources ()
 {
-        int ret = -1;
-        size_t num_read = 0;
-        size_t num_written = 0;
-        glfs_fd_t *source_fd = NULL;
-        glfs_fd_t *dest_fd = NULL;
-        struct stat statbuf;
-        char buf[BUFFER_SIZE];
-        char *full_path;
-
-        ret = glfs_lstat (dest_fs, dest_path, &statbuf);
-
-        if (ret == -1) {
-                full_path = complete_path (source_path, dest_path, NULL);
-        } else {
-                full_path = complete_path (source_path, dest_path, &statbuf);
-        }
-
-        if (full_path == NULL) {
-                ret = -1;
-                goto out;
-        }
-
-        source_fd = glfs_open (source_fs, source_path, O_RDONLY);
-        if (source_fd == NULL) {
-                error (0, errno, "%s", source_path);
-                goto out;
-        }
+        struct pool *pool = NULL;
+        struct rename_job *job;
+        int ret = 0;
 
-        dest_fd = glfs_creat (dest_fs, full_path, O_CREAT | O_WRONLY, get_default_file_mode_perm ());
-        if (dest_fd == NULL) {
-                error (0, errno, "%s", full_path);
-                goto out;
-        }
-
-        while (true) {
-                num_read = glfs_read (source_fd, buf, BUFFER_SIZE, 0);
-                if (num_read == -1) {
-                        ret = -1;
-                        goto out;
+        for (int i = 0; i < state->source_count; i++) {
+                if (!is_rename (&state->sources[i])) {
+                        continue;
                 }
 
-                if (num_read == 0) {
-                        goto out;
-                }
-
-                for (num_written = 0; num_written < num_read;) {
-                        ret = glfs_write (dest_fd,
-                                        &buf[num_written],
-                                        num_read - num_written, 0);
-                        if (ret == -1) {
-                                error (0, errno, "write error");
-                                goto out;
+                if (pool == NULL) {
+                        pool = pool_create (state->jobs, state->jobs * 4);
+                        if (pool == NULL) {
+                                error (0, errno, "failed to start rename threads");
+                                return -1;
                         }
-
-                        num_written += ret;
                 }
-        }
 
-out:
-        free (full_path);
+                job = malloc (sizeof (*job));
+                if (job == NULL) {
+                        error (0, errno, "failed to queue %s", state->sources[i].arg);
+                        ret = -1;
+                        continue;
+                }
 
-        if (source_fd) {
-                glfs_close (source_fd);
-        }
+                job->fs = state->dest.fs;
+                job->source = state->sources[i].path;
+                job->target = state->sources[i].target;
 
-        if (dest_fd) {
-                glfs_close (dest_fd);
+                if (pool_submit (pool, rename_job, job) == -1) {
+                        error (0, errno, "failed to queue %s", state->sources[i].arg);
+                        free (job);
+                        ret = -1;
+                }
         }
 
-        return ret;
-}
-
-static int
-rm_local( char *path )
-{
-  int ret = -1;
-  ret = unlink ( path );
-  return ret;
-}
+        pool_destroy (pool);
 
-static int
-rm_remote( glfs_t *fs, char *source )
-{
-  int ret = -1;
-  ret = glfs_unlink (fs, source);
-  return ret;
+        return ret == 0 && state->errors == 0 ? 0 : -1;
 }
 
+/**
+ * Moves the sources living on another volume than the destination, or
+ * locally, with one tree copy per source volume. Each source file is
+ * removed once its copy is committed, so a failure leaves the file intact
+ * in the source.
+ */
 static int
-mv_without_context ()
+copy_sources ()
 {
-        glfs_t *dest_fs = NULL;
-        glfs_t *source_fs = NULL;
-        int ret = -1;
-
-        switch (state->mode) {
-                case LOCAL_TO_REMOTE:
-                        ret = gluster_getfs (&dest_fs, state->gluster_dest);
-                        if (ret == -1) {
-                                error (0, errno, "%s", state->dest);
-                                goto out;
-                        }
-
-                        ret = apply_xlator_options (dest_fs, &state->xlator_options);
-                        if (ret == -1) {
-                                error (0, errno, "failed to apply translator options");
-                                goto out;
-                        }
-
-                        ret = local_to_remote (state->source,
-                                                state->gluster_dest->path,
-                                                dest_fs);
-                        ret = rm_local( state->source );
-                        if (ret == -1) {
-                                goto out;
-                        }
-
-                        break;
-                case REMOTE_TO_LOCAL:
-                        ret = gluster_getfs (&source_fs, state->gluster_source);
-                        if (ret == -1) {
-                                error (0, errno, "%s", state->source);
-                                goto out;
-                        }
-
-                        ret = apply_xlator_options (source_fs, &state->xlator_options);
-                        if (ret == -1) {
-                                error (0, errno, "failed to apply translator options");
-                                goto out;
-                        }
-
-                        ret = remote_to_local (state->gluster_source->path,
-                                                state->dest,
-                                                source_fs);
-                        ret = rm_remote( source_fs, state->gluster_source->path );
-                        if (ret == -1) {
-                                goto out;
-                        }
-
-                        break;
-                case REMOTE_TO_REMOTE:
-                        ret = gluster_getfs (&dest_fs, state->gluster_dest);
-                        if (ret == -1) {
-                                error (0, errno, "%s", state->dest);
-                                goto out;
-                        }
-
-                        ret = apply_xlator_options (dest_fs, &state->xlator_options);
-                        if (ret == -1) {
-                                error (0, errno, "failed to apply translator options");
-                                goto out;
-                        }
-
-                        /**
-                         * If the host and volume of the source and destination
-                         * are the same, then simply rename the source file to
-                         * the destination file
-                         */
-                        ret = glfs_rename(dest_fs, state->gluster_source->path, state->gluster_dest->path );
-                        if (ret == -1) {
-                                goto out;
-                        }
+        struct tree_copy tc;
+        struct endpoint *source;
+        bool *done;
+        int ret = 0;
 
-                        if (dest_fs == source_fs) {
-                                glfs_fini (dest_fs);
-                                dest_fs = source_fs = NULL;
-                        }
-
-                        break;
-                default:
-                        error (0, errno, "unknown error");
+        done = calloc (state->source_count, sizeof (*done));
+        if (done == NULL) {
+                error (0, errno, "calloc");
+                return -1;
         }
 
-out:
-        if (dest_fs) {
-                glfs_fini (dest_fs);
-        }
-
-        if (source_fs) {
-                glfs_fini (source_fs);
-        }
+        for (int i = 0; i < state->source_count; i++) {
+                if (done[i] || is_rename (&state->sources[i])) {
+                        continue;
+                }
 
-        return ret;
-}
+                tree_copy_init (&tc, state->sources[i].fs, state->dest.fs);
+                tc.jobs = state->jobs;
+                tc.move = true;
+                tc.options.preserve_times = true;
 
-static int
-mv_with_context (glfs_t *fs)
-{
-        glfs_t *dest_fs = NULL;
-        glfs_t *source_fs = NULL;
-        int ret = -1;
-        switch (state->mode) {
-                case ESTABLISHED_TO_ESTABLISHED:
-                      /*
-                       * If the host and volume of the source and destination
-                       * are the same, then simply rename the source file to
-                       * the destination file
-                       */
-                        ret = glfs_rename(fs, state->source, state->dest);
-                        break;
-                case ESTABLISHED_TO_LOCAL:
-                        ret = remote_to_local (state->source, state->dest, fs);
-                        ret = rm_remote( fs, state->source );
+                if (tree_copy_start (&tc) == -1) {
+                        tree_copy_fini (&tc);
+                        ret = -1;
                         break;
-                case ESTABLISHED_TO_REMOTE:
-                        ret = gluster_getfs (&dest_fs, state->gluster_dest);
-                        if (ret == -1) {
-                                error (0, errno, "%s", state->dest);
-                                goto out;
-                        }
-
-                        ret = apply_xlator_options (dest_fs, &state->xlator_options);
-                        if (ret == -1) {
-                                error (0, errno, "failed to apply translator options");
-                                goto out;
-                        }
-
-                        ret = remote_to_remote (state->source, state->gluster_dest->path, fs, dest_fs);
+                }
 
-                        break;
-                case LOCAL_TO_ESTABLISHED:
-                        ret = local_to_remote (state->source, state->dest, fs);
-                        ret = rm_local( state->source );
-                        break;
-                case REMOTE_TO_ESTABLISHED:
-                        ret = gluster_getfs (&source_fs, state->gluster_source);
-                        if (ret == -1) {
-                                error (0, errno, "%s", state->source);
-                                goto out;
+                for (int j = i; j < state->source_count; j++) {
+                        source = &state->sources[j];
+                        if (done[j] || is_rename (source) ||
+                            source->fs != state->sources[i].fs) {
+                                continue;
                         }
 
-                        ret = apply_xlator_options (source_fs, &state->xlator_options);
-                        if (ret == -1) {
-                                error (0, errno, "failed to apply translator options");
-                                goto out;
+                        done[j] = true;
+                        if (tree_copy_add (&tc, source->path, source->target) == -1) {
+                                ret = -1;
                         }
+                }
 
-                        ret = remote_to_remote (state->gluster_source->path,
-                                                state->dest,
-                                                source_fs,
-                                                fs);
+                if (tree_copy_finish (&tc) == -1) {
+                        ret = -1;
+                }
 
-                        break;
-                // Fall through to mv_without_context () for the normal
-                // transfer functions.
-                case LOCAL_TO_REMOTE:
-                case REMOTE_TO_LOCAL:
-                case REMOTE_TO_REMOTE:
-                        ret = mv_without_context ();
-                        break;
-                default:
-                        error (0, 0, "unknown error");
-        }
+                if (state->debug) {
+                        fprintf (stderr, "%ju moved, %ju linked, %ju failed\n",
+                                 tc.copied, tc.linked, tc.errors);
+                }
 
-out:
-        if (dest_fs) {
-                glfs_fini (dest_fs);
+                tree_copy_fini (&tc);
         }
 
-        if (source_fs) {
-                glfs_fini (source_fs);
-        }
+        free (done);
 
         return ret;
 }
@@ -938,6 +465,7 @@ do_mv (struct cli_context *ctx)
 {
         int argc = ctx->argc;
         char **argv = ctx->argv;
+        struct endpoint **endpoints = NULL;
         int ret = -1;
 
         state = init_state ();
@@ -946,40 +474,61 @@ do_mv (struct cli_context *ctx)
                 goto out;
         }
 
-        if (ctx->fs) {
-                ret = parse_options (argc, argv, true);
-                if (ret != 0) {
+        state->debug = ctx->options->debug;
+
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
+                        ret = 0;
+                case -1:
                         goto out;
-                }
+        }
 
-                ret = mv_with_context (ctx->fs);
-        } else {
-                ret = parse_options (argc, argv, false);
-                switch (ret) {
-                        case -2:
-                                // Fall through
-                                ret = 0;
-                        case -1:
-                                goto out;
-                }
+        // The destination is connected first, for the sources to share.
+        endpoints = calloc (state->source_count + 1, sizeof (*endpoints));
+        if (endpoints == NULL) {
+                error (0, errno, "calloc");
+                ret = -1;
+                goto out;
+        }
 
-                ret = mv_without_context ();
+        endpoints[0] = &state->dest;
+        for (int i = 0; i < state->source_count; i++) {
+                endpoints[i + 1] = &state->sources[i];
+        }
+
+        ret = connect_endpoints (endpoints, state->source_count + 1, ctx->fs,
+                                 &state->xlator_options, state->debug);
+
+        if (ret == 0) {
+                ret = complete_targets ();
+        }
+
+        if (ret == 0) {
+                ret = rename_sources ();
+                if (copy_sources () == -1) {
+                        ret = -1;
+                }
         }
 
 out:
         if (state) {
-                if (state->gluster_dest) {
-                        gluster_url_free (state->gluster_dest);
+                if (endpoints) {
+                        disconnect_endpoints (endpoints, state->source_count + 1);
                 }
 
-                if (state->gluster_source) {
-                        gluster_url_free (state->gluster_source);
+                for (int i = 0; i < state->source_count; i++) {
+                        free_endpoint (&state->sources[i]);
                 }
 
-                free (state->dest);
-                free (state->source);
+                free (state->sources);
+                free_endpoint (&state->dest);
+                free_xlator_options (&state->xlator_options);
+                pthread_mutex_destroy (&state->lock);
         }
 
+        free (endpoints);
         free (state);
 
         return ret;
@@ -0,0 +1,216 @@
+/**
+ * A fixed size pool of worker threads fed through a bounded queue. Used to
+ * keep several requests to the remote volume in flight at once.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct pool_job {
+        pool_func_t func;
+        void *arg;
+};
+
+/**
+ * jobs: Ring buffer of queue_depth pending jobs.
+ * head, count: Position of the oldest pending job and number of pending jobs.
+ * busy: Number of jobs currently executed by a worker.
+ * not_empty, not_full, idle: Signaled when a job is queued, when a slot is
+ *                            freed and when the pool has drained.
+ */
+struct pool {
+        pthread_t *threads;
+        int nthreads;
+        struct pool_job *jobs;
+        int queue_depth;
+        int head;
+        int count;
+        int busy;
+        bool stopping;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        pthread_cond_t idle;
+};
+
+static void *
+pool_worker (void *data)
+{
+        struct pool *pool = data;
+        struct pool_job job;
+
+        pthread_mutex_lock (&pool->lock);
+        while (true) {
+                while (pool->count == 0 && !pool->stopping) {
+                        pthread_cond_wait (&pool->not_empty, &pool->lock);
+                }
+
+                if (pool->count == 0) {
+                        break;
+                }
+
+                job = pool->jobs[pool->head];
+                pool->head = (pool->head + 1) % pool->queue_depth;
+                pool->count--;
+                pool->busy++;
+                pthread_cond_signal (&pool->not_full);
+                pthread_mutex_unlock (&pool->lock);
+
+                job.func (job.arg);
+
+                pthread_mutex_lock (&pool->lock);
+                pool->busy--;
+                if (pool->count == 0 && pool->busy == 0) {
+                        pthread_cond_broadcast (&pool->idle);
+                }
+        }
+        pthread_mutex_unlock (&pool->lock);
+
+        return NULL;
+}
+
+/**
+ * Creates a pool of the given number of threads. At most queue_depth jobs
+ * wait for a free thread; pool_submit () blocks beyond that, which bounds
+ * the memory used by producers that walk large trees.
+ */
+struct pool *
+pool_create (int threads, int queue_depth)
+{
+        struct pool *pool;
+
+        if (threads < 1 || queue_depth < 1) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        pool = calloc (1, sizeof (*pool));
+        if (pool == NULL) {
+                return NULL;
+        }
+
+        pool->threads = calloc (threads, sizeof (*pool->threads));
+        pool->jobs = calloc (queue_depth, sizeof (*pool->jobs));
+        if (pool->threads == NULL || pool->jobs == NULL) {
+                goto err;
+        }
+
+        pool->queue_depth = queue_depth;
+        pthread_mutex_init (&pool->lock, NULL);
+        pthread_cond_init (&pool->not_empty, NULL);
+        pthread_cond_init (&pool->not_full, NULL);
+        pthread_cond_init (&pool->idle, NULL);
+
+        for (pool->nthreads = 0; pool->nthreads < threads; pool->nthreads++) {
+                errno = pthread_create (&pool->threads[pool->nthreads], NULL,
+                                        pool_worker, pool);
+                if (errno != 0) {
+                        if (pool->nthreads > 0) {
+                                // Run with the threads we managed to start.
+                                break;
+                        }
+
+                        pool_destroy (pool);
+                        return NULL;
+                }
+        }
+
+        return pool;
+
+err:
+        free (pool->threads);
+        free (pool->jobs);
+        free (pool);
+
+        return NULL;
+}
+
+/**
+ * Queues func (arg) for execution by one of the workers, waiting for a free
+ * slot if the queue is full.
+ */
+int
+pool_submit (struct pool *pool, pool_func_t func, void *arg)
+{
+        int tail;
+
+        pthread_mutex_lock (&pool->lock);
+        while (pool->count == pool->queue_depth) {
+                pthread_cond_wait (&pool->not_full, &pool->lock);
+        }
+
+        tail = (pool->head + pool->count) % pool->queue_depth;
+        pool->jobs[tail].func = func;
+        pool->jobs[tail].arg = arg;
+        pool->count++;
+        pthread_cond_signal (&pool->not_empty);
+        pthread_mutex_unlock (&pool->lock);
+
+        return 0;
+}
+
+/**
+ * Waits until every submitted job has completed. Jobs may submit further
+ * jobs to the same pool, as long as the queue cannot fill up with jobs that
+ * all wait for each other.
+ */
+void
+pool_wait (struct pool *pool)
+{
+        pthread_mutex_lock (&pool->lock);
+        while (pool->count > 0 || pool->busy > 0) {
+                pthread_cond_wait (&pool->idle, &pool->lock);
+        }
+        pthread_mutex_unlock (&pool->lock);
+}
+
+/**
+ * Waits for the pending jobs and releases the pool.
+ */
+void
+pool_destroy (struct pool *pool)
+{
+        if (pool == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock (&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast (&pool->not_empty);
+        pthread_mutex_unlock (&pool->lock);
+
+        for (int i = 0; i < pool->nthreads; i++) {
+                pthread_join (pool->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy (&pool->lock);
+        pthread_cond_destroy (&pool->not_empty);
+        pthread_cond_destroy (&pool->not_full);
+        pthread_cond_destroy (&pool->idle);
+
+        free (pool->threads);
+        free (pool->jobs);
+        free (pool);
+}
@@ -0,0 +1,40 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_POOL_H
+#define GLFS_POOL_H
+
+#define POOL_DEFAULT_THREADS 4
+
+struct pool;
+
+typedef void (*pool_func_t) (void *arg);
+
+struct pool *
+pool_create (int threads, int queue_depth);
+
+int
+pool_submit (struct pool *pool, pool_func_t func, void *arg);
+
+void
+pool_wait (struct pool *pool);
+
+void
+pool_destroy (struct pool *pool);
+
+#endif /* GLFS_POOL_H */
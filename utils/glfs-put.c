@@ -1,6 +1,5 @@
 /**
- * A utility to read a file from a remote Gluster volume and stream it to
- * stdout.
+ * A utility to stream standard input to a file on a remote NFS server.
  *
  * Copyright (C) 2015 Facebook Inc.
  *
@@ -19,14 +18,15 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
 #include <config.h>
-
-#include "glfs-util.h"
+#endif
 
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
-#include <glusterfs/api/glfs.h>
+#include <libgen.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -34,21 +34,36 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include <virtfs.h>
+#include <virtfs_log.h>
+
+#include "glfs-cli.h"
+
 #define AUTHORS "Written by Craig Cabrey."
 
+/**
+ * Standard input is gathered in chunks of PUT_CHUNK_SIZE bytes, aligned to
+ * the chunk size in the file, and up to PUT_JOBS chunks are written at once
+ * by default while the next ones are read.
+ */
+#define PUT_CHUNK_SIZE (1024 * 1024)
+#define PUT_JOBS 8
+
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_url: Struct of the parsed url supplied by the user.
+ * fs: The filesystem of the URL, mounted once the options are parsed.
  * url: Full url used to find the remote file (supplied by user).
+ * jobs: Number of chunks written concurrently.
  * append: Whether to append to the file instead of replacing it.
  * debug: Whether to log additional debug information.
+ * overwrite: Whether an existing file is replaced.
  * parents: Whether all parent directories in the path are created.
  */
 struct state {
-        struct gluster_url *gluster_url;
-        struct xlator_option *xlator_options;
+        virtfs_t fs;
         char *url;
+        int jobs;
         bool append;
         bool debug;
         bool overwrite;
@@ -62,11 +77,10 @@ static struct option const long_options[] =
         {"append", no_argument, NULL, 'a'},
         {"debug", no_argument, NULL, 'd'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
         {"overwrite", no_argument, NULL, 'f'},
-        {"parents", required_argument, NULL, 'r'},
-        {"port", required_argument, NULL, 'p'},
-        {"version", no_argument, NULL, 'v'},
-        {"xlator-option", required_argument, NULL, 'o'},
+        {"parents", no_argument, NULL, 'r'},
+        {"version", no_argument, NULL, 'V'},
         {NULL, no_argument, NULL, 0}
 };
 
@@ -74,40 +88,39 @@ static void
 usage (const int status)
 {
         printf ("Usage: %s [OPTION]... URL\n"
-                "Put data from standard input on a remote Gluster volume.\n\n"
+                "Put data from standard input on a remote NFS server.\n\n"
                 "  -a, --append                 append data to the end of the file\n"
                 "  -f, --overwrite              overwrite the existing file\n"
-                "  -o, --xlator-option=OPTION   specify a translator option for the\n"
-                "                               connection. Multiple options are supported\n"
-                "                               and take the form xlator.key=value.\n"
-                "  -p, --port=PORT              specify the port on which to connect\n"
+                "  -j, --jobs=N                 write up to N chunks of %d bytes at\n"
+                "                               once while reading the next ones\n"
+                "                               (default %d)\n"
                 "  -r, --parents                no error if existing, make parent\n"
                 "                               directories as needed\n"
                 "      --help       display this help and exit\n"
                 "      --version    output version information and exit\n\n"
                 "Examples:\n"
-                "  gfput glfs://localhost/groot/file\n"
-                "        Write the contents of standard input to /file on the\n"
-                "        Gluster volume of groot on host localhost.\n"
-                "  gfput -r glfs://localhost/groot/path/to/file\n"
+                "  virtfs-put nfs://localhost/export/file\n"
                 "        Write the contents of standard input to /file on the\n"
-                "        Gluster volume of groot on host localhost, creating\n"
-                "        the parent directories as necessary.\n",
-                program_invocation_name);
+                "        export /export of host localhost.\n"
+                "  pg_dump db | virtfs-put -r nfs://localhost/export/path/to/dump\n"
+                "        Write the dump to /path/to/dump on the export /export of\n"
+                "        host localhost, creating the parent directories as\n"
+                "        necessary.\n",
+                program_invocation_name, PUT_CHUNK_SIZE, PUT_JOBS);
         exit (status);
 }
 
-void
+static void
 parse_options (int argc, char *argv[])
 {
-        uint16_t port = GLUSTER_DEFAULT_PORT;
-        int ret = -1;
+        int ret;
         int opt = 0;
         int option_index = 0;
-        struct xlator_option *option;
+        long jobs;
+        char *end;
 
         while (true) {
-                opt = getopt_long (argc, argv, "adfo:p:r", long_options,
+                opt = getopt_long (argc, argv, "adfj:r", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -124,36 +137,22 @@ parse_options (int argc, char *argv[])
                         case 'f':
                                 state->overwrite = true;
                                 break;
-                        case 'o':
-                                option = parse_xlator_option (optarg);
-                                if (option == NULL) {
-                                        error (0, errno, "%s", optarg);
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
                                         goto err;
                                 }
 
-                                if (append_xlator_option (&state->xlator_options, option) == -1) {
-                                        error (EXIT_FAILURE, errno, "append_xlator_option: %s", optarg);
-                                }
-
-                                break;
-                        case 'p':
-                                port = strtoport (optarg);
-                                if (port == 0) {
-                                        exit (EXIT_FAILURE);
-                                }
-
+                                state->jobs = jobs;
                                 break;
                         case 'r':
                                 state->parents = true;
                                 break;
-                        case 'v':
-                                printf ("%s (%s) %s\n%s\n%s\n%s\n",
-                                        program_invocation_name,
-                                        PACKAGE_NAME,
-                                        PACKAGE_VERSION,
-                                        COPYRIGHT,
-                                        LICENSE,
-                                        AUTHORS);
+                        case 'V':
+                                PRINT_VERSION;
                                 exit (EXIT_SUCCESS);
                         case 'x':
                                 usage (EXIT_SUCCESS);
@@ -162,34 +161,29 @@ parse_options (int argc, char *argv[])
                 }
         }
 
-        if ((argc - option_index) < 2) {
+        if (optind >= argc) {
                 error (0, 0, "missing operand");
                 goto err;
-        } else {
-                state->url = strdup (argv[argc - 1]);
-                if (state->url == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
+        }
 
-                ret = gluster_parse_url (argv[argc - 1], &(state->gluster_url));
-                if (ret == -1) {
-                        error (0, EINVAL, "%s", state->url);
-                        goto err;
-                }
+        state->url = strdup (argv[argc - 1]);
+        if (state->url == NULL) {
+                error (EXIT_FAILURE, errno, "strdup");
+        }
 
-                state->gluster_url->port = port;
+        ret = virtfs_new (state->url, &state->fs);
+        if (ret < 0) {
+                error (0, -ret, "%s", state->url);
+                goto err;
         }
 
-        goto out;
+        return;
 
 err:
         error (EXIT_FAILURE, 0, "Try --help for more information.");
-out:
-        return;
 }
 
-struct state*
+static struct state*
 init_state ()
 {
         struct state *state = malloc (sizeof (*state));
@@ -200,7 +194,8 @@ init_state ()
 
         state->append = false;
         state->debug = false;
-        state->gluster_url = NULL;
+        state->fs = NULL;
+        state->jobs = PUT_JOBS;
         state->overwrite = false;
         state->parents = false;
         state->url = NULL;
@@ -209,73 +204,116 @@ out:
         return state;
 }
 
-int
-gluster_put (glfs_t *fs, struct state *state)
+/**
+ * Creates the missing parent directories of path, from the top down.
+ */
+static int
+create_parents (virtfs_t fs, const char *path, mode_t mode)
 {
-        int ret = -1;
-        glfs_fd_t *fd = NULL;
-        char *filename = state->gluster_url->path;
-        char *dir_path = strdup (state->gluster_url->path);
-        struct stat statbuf;
+        char *dir = strdup (path);
+        char *slash;
+        int ret = 0;
 
-        if (dir_path == NULL) {
-                error (EXIT_FAILURE, errno, "strdup");
-                goto out;
+        if (dir == NULL) {
+                return -ENOMEM;
         }
 
-        ret = glfs_lstat (fs, filename, &statbuf);
-        if (ret != -1 && !state->append && !state->overwrite) {
-                errno = EEXIST;
-                ret = -1;
+        slash = strrchr (dir, '/');
+        if (slash == NULL || slash == dir) {
                 goto out;
         }
 
+        *slash = '\0';
+        for (slash = strchr (dir + 1, '/'); ; slash = strchr (slash + 1, '/')) {
+                if (slash != NULL) {
+                        *slash = '\0';
+                }
+
+                if (*dir != '\0') {
+                        ret = virtfs_mkdir (fs, dir, mode);
+                        if (ret == -EEXIST) {
+                                ret = 0;
+                        } else if (ret < 0) {
+                                goto out;
+                        }
+                }
+
+                if (slash == NULL) {
+                        break;
+                }
+
+                *slash = '/';
+        }
+
+out:
+        free (dir);
+
+        return ret;
+}
+
+/**
+ * Streams standard input to path. The writes are positional, starting at the
+ * end of the file when appending, so several of them stay in flight while
+ * standard input is read, and the data is committed once at the end.
+ */
+static int
+put (virtfs_t fs, const char *path)
+{
+        virtfs_writer_t writer;
+        vfd_t fd = NULL;
+        struct stat statbuf;
+        off_t offset = 0;
+        int flags = O_WRONLY | O_CREAT;
+        mode_t mask = umask (0);
+        ssize_t n;
+        int ret;
+
+        umask (mask);
+
         if (state->parents) {
-                ret = gluster_create_path (fs, dir_path,
-                                get_default_dir_mode_perm ());
-                if (ret == -1) {
+                ret = create_parents (fs, path, 0777 & ~mask);
+                if (ret < 0) {
                         goto out;
                 }
         }
 
-        fd = glfs_creat (fs, filename, O_RDWR, get_default_file_mode_perm ());
-        if (fd == NULL) {
-                ret = -1;
-                goto out;
+        if (!state->append) {
+                flags |= state->overwrite ? O_TRUNC : O_EXCL;
         }
 
-        ret = gluster_lock (fd, F_WRLCK, false);
-        if (ret == -1) {
+        fd = virtfs_open (fs, path, flags, 0666 & ~mask);
+        if (fd == NULL) {
+                ret = -errno;
                 goto out;
         }
 
         if (state->append) {
-                ret = glfs_lseek (fd, 0, SEEK_END);
-                if (ret == -1) {
-                        error (0, errno, "seek error: %s", filename);
-                        goto out;
-                }
-        } else {
-#ifdef HAVE_GLFS_7_6
-                ret = glfs_ftruncate (fd, 0, NULL, NULL);
-#else
-                ret = glfs_ftruncate (fd, 0);
-#endif
-                if (ret == -1) {
-                        error (0, errno, "truncate error: %s", filename);
+                ret = virtfs_fstat (fd, &statbuf);
+                if (ret < 0) {
                         goto out;
                 }
+
+                offset = statbuf.st_size;
         }
 
-        if (gluster_write (STDIN_FILENO, fd) == 0) {
-                ret = -1;
+        ret = virtfs_writer_new (fd, offset, PUT_CHUNK_SIZE, state->jobs,
+                                 &writer);
+        if (ret < 0) {
+                goto out;
         }
 
-out:
-        free (dir_path);
+        do {
+                n = virtfs_writer_fill (writer, STDIN_FILENO);
+        } while (n > 0);
+
+        ret = virtfs_writer_close (writer);
+        if (n < 0) {
+                ret = n;
+        }
 
+out:
         if (fd) {
-                glfs_close (fd);
+                virtfs_close (fd);
         }
 
         return ret;
@@ -284,11 +322,10 @@ out:
 int
 main (int argc, char *argv[])
 {
-        glfs_t *fs;
+        char *path = NULL;
         int ret;
 
         program_invocation_name = basename (argv[0]);
-        atexit (close_stdout);
 
         state = init_state ();
         if (state == NULL) {
@@ -298,30 +335,25 @@ main (int argc, char *argv[])
 
         parse_options (argc, argv);
 
-        ret = gluster_getfs (&fs, state->gluster_url);
-        if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto err;
-        }
-
-        ret = apply_xlator_options (fs, &state->xlator_options);
-        if (ret == -1) {
-                error (0, errno, "failed to apply translator options");
+        ret = virtfs_init (state->fs);
+        if (ret < 0) {
+                error (0, -ret, "%s", state->url);
                 goto err;
         }
 
         if (state->debug) {
-                ret = glfs_set_logging (fs, "/dev/stderr", GF_LOG_DEBUG);
+                virtfs_set_log_level (state->fs, VIRTFS_LOG_DEBUG);
+        }
 
-                if (ret == -1) {
-                        error (0, errno, "failed to set logging level");
-                        goto err;
-                }
+        path = virtfs_url_get_file (state->fs);
+        if (path == NULL) {
+                error (0, EISDIR, "%s", state->url);
+                goto err;
         }
 
-        ret = gluster_put (fs, state);
-        if (ret == -1) {
-                error (0, errno, "%s", state->url);
+        ret = put (state->fs, path);
+        if (ret < 0) {
+                error (0, -ret, "%s", state->url);
                 goto err;
         }
 
@@ -331,12 +363,13 @@ main (int argc, char *argv[])
 err:
         ret = EXIT_FAILURE;
 out:
-        if (fs) {
-                glfs_fini (fs);
-        }
+        free (path);
 
         if (state) {
-                gluster_url_free (state->gluster_url);
+                if (state->fs) {
+                        virtfs_fini (state->fs);
+                }
+
                 free (state->url);
         }
 
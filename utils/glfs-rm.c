@@ -21,6 +21,7 @@
 #include <config.h>
 
 #include "glfs-rm.h"
+#include "glfs-tree.h"
 #include "glfs-util.h"
 
 #include <errno.h>
@@ -32,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #define AUTHORS "Written by Craig Cabrey."
 
@@ -41,8 +43,9 @@
  * gluster_url: Struct of the parsed url supplied by the user.
  * url: Full url used to find the remote file or directory (supplied by user).
  * debug: Whether to log additional debug information.
- * directory: Whether to allow removal of a directory.
+ * directory: Whether to remove a directory, along with its contents.
  * force: Whether to ignore non-existent files or directories.
+ * jobs: Number of removals kept in flight when removing a directory.
  */
 struct state {
         struct gluster_url *gluster_url;
@@ -51,6 +54,7 @@ struct state {
         bool debug;
         bool directory;
         bool force;
+        int jobs;
 };
 
 static struct state *state;
@@ -60,6 +64,7 @@ static struct option const long_options[] =
         {"debug", no_argument, NULL, 'd'},
         {"force", no_argument, NULL, 'f'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
         {"port", required_argument, NULL, 'p'},
         {"recursive", no_argument, NULL, 'r'},
         {"version", no_argument, NULL, 'v'},
@@ -73,6 +78,8 @@ usage ()
         printf ("Usage: %s [OPTION]... URL\n"
                 "Remove (unlink) the files (or directories) from a remote Gluster volume.\n\n"
                 "  -f, --force                  ignore nonexistent files, never prompt\n"
+                "  -j, --jobs=N                 keep up to N removals in flight when\n"
+                "                               removing a directory (default %d)\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
@@ -91,7 +98,7 @@ usage ()
                 "       In the context of a shell with a connection established,\n"
                 "       remove the file on the root of the Gluster volume groot\n"
                 "       on localhost.\n",
-                program_invocation_name);
+                program_invocation_name, TREE_REMOVE_JOBS);
 }
 
 static int
@@ -101,12 +108,14 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt since other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "fro:p:", long_options,
+                opt = getopt_long (argc, argv, "fj:ro:p:", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -120,6 +129,17 @@ parse_options (int argc, char *argv[], bool has_connection)
                         case 'f':
                                 state->force = true;
                                 break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->jobs = jobs;
+                                break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
                                 if (option == NULL) {
@@ -220,6 +240,7 @@ init_state ()
         state->debug = false;
         state->directory = false;
         state->force = false;
+        state->jobs = TREE_REMOVE_JOBS;
         state->gluster_url = NULL;
         state->url = NULL;
         state->xlator_options = NULL;
@@ -228,13 +249,49 @@ out:
         return state;
 }
 
+/**
+ * Removes the directory at the path of the url with its contents. Failures
+ * within the tree are reported as they happen.
+ */
+static int
+rm_tree (glfs_t *fs)
+{
+        struct tree_remove tr;
+        int ret;
+
+        tree_remove_init (&tr, fs);
+        tr.jobs = state->jobs;
+        tr.force = state->force;
+
+        ret = tree_remove (&tr, state->gluster_url->path);
+
+        if (state->debug) {
+                fprintf (stderr, "%ju removed, %ju failed\n", tr.removed,
+                         tr.errors);
+        }
+
+        tree_remove_fini (&tr);
+
+        return ret;
+}
+
 static int
 rm (glfs_t *fs)
 {
+        struct stat statbuf;
         int ret = -1;
 
         if (state->directory) {
-                ret = glfs_rmdir (fs, state->gluster_url->path);
+                ret = glfs_lstat (fs, state->gluster_url->path, &statbuf);
+                if (ret == 0 && !S_ISDIR (statbuf.st_mode)) {
+                        errno = ENOTDIR;
+                        ret = -1;
+                }
+
+                if (ret == 0) {
+                        ret = rm_tree (fs);
+                        goto out;
+                }
         } else {
                 ret = glfs_unlink (fs, state->gluster_url->path);
         }
@@ -0,0 +1,311 @@
+/**
+ * A utility to mirror a directory tree to or from a remote Gluster volume,
+ * copying only the files that changed since the previous run.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-sync.h"
+#include "glfs-copy.h"
+#include "glfs-endpoint.h"
+#include "glfs-tree.h"
+#include "glfs-util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <getopt.h>
+#include <glusterfs/api/glfs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AUTHORS "Written by Feng Shuo."
+
+/**
+ * Used to store the state of the program, including user supplied options.
+ *
+ * source, dest: The trees to compare and copy from and to.
+ * checksum: Whether files of the same size are compared by their contents
+ *           instead of their modification times.
+ * dry_run: Whether the files that differ are only printed.
+ * jobs: Number of files transferred concurrently.
+ */
+struct state {
+        struct xlator_option *xlator_options;
+        struct endpoint source;
+        struct endpoint dest;
+        bool debug;
+        bool checksum;
+        bool dry_run;
+        int jobs;
+};
+
+static struct state *state;
+
+static struct option const long_options[] =
+{
+        {"checksum", no_argument, NULL, 'c'},
+        {"debug", no_argument, NULL, 'd'},
+        {"dry-run", no_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"port", required_argument, NULL, 'p'},
+        {"version", no_argument, NULL, 'v'},
+        {"xlator-option", required_argument, NULL, 'o'},
+        {NULL, no_argument, NULL, 0}
+};
+
+/**
+ * Prints usage information.
+ */
+static void
+usage ()
+{
+        printf ("Usage: %s [OPTION]... SOURCE DEST\n"
+                "Make the directory DEST a copy of the directory SOURCE, copying only\n"
+                "the files that are missing from DEST or differ in size or modification\n"
+                "time. Either side may be local or a Gluster URL.\n\n"
+                "  -c, --checksum               compare files of the same size by their\n"
+                "                               contents instead of their modification time\n"
+                "  -j, --jobs=N                 transfer up to N files concurrently\n"
+                "                               (default %d)\n"
+                "  -n, --dry-run                only print the files that would be copied\n"
+                "  -o, --xlator-option=OPTION   specify a translator option for the\n"
+                "                               connection. Multiple options are supported\n"
+                "                               and take the form xlator.key=value.\n"
+                "  -p, --port=PORT              specify the port on which to connect\n"
+                "      --help     display this help and exit\n"
+                "      --version  output version information and exit\n\n"
+                "Examples:\n"
+                "  gfsync ./data glfs://localhost/groot/data\n"
+                "       Mirror the local directory 'data' to the directory 'data' on\n"
+                "       the Gluster volume groot on the host localhost.\n"
+                "  gfsync -c glfs://localhost/groot/data ./data\n"
+                "       Mirror the directory 'data' of the volume to the local directory\n"
+                "       'data', comparing the contents of files of the same size.\n"
+                "  gfcli (localhost/groot)> sync /data file:///backup/data\n"
+                "       In the context of a shell with a connection established, mirror\n"
+                "       the directory /data of the connected volume to a local directory.\n",
+                program_invocation_name, TREE_COPY_JOBS);
+}
+
+/**
+ * Parses command line flags into a global application state.
+ */
+static int
+parse_options (int argc, char *argv[], bool has_connection)
+{
+        uint16_t port = GLUSTER_DEFAULT_PORT;
+        int ret = -1;
+        int opt = 0;
+        int option_index = 0;
+        char *end;
+        long jobs;
+        struct xlator_option *option;
+
+        // Reset getopt as other utilities may have called it already.
+        optind = 0;
+        while (true) {
+                opt = getopt_long (argc, argv, "cj:no:p:", long_options,
+                                   &option_index);
+
+                if (opt == -1) {
+                        break;
+                }
+
+                switch (opt) {
+                        case 'c':
+                                state->checksum = true;
+                                break;
+                        case 'd':
+                                state->debug = true;
+                                break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->jobs = jobs;
+                                break;
+                        case 'n':
+                                state->dry_run = true;
+                                break;
+                        case 'o':
+                                option = parse_xlator_option (optarg);
+                                if (option == NULL) {
+                                        error (0, errno, "%s", optarg);
+                                        goto err;
+                                }
+
+                                if (append_xlator_option (&state->xlator_options, option) == -1) {
+                                        error (0, errno, "append_xlator_option: %s", optarg);
+                                        goto err;
+                                }
+
+                                break;
+                        case 'p':
+                                port = strtoport (optarg);
+                                if (port == 0) {
+                                        goto out;
+                                }
+
+                                break;
+                        case 'v':
+                                printf ("%s (%s) %s\n%s\n%s\n%s\n",
+                                        program_invocation_name,
+                                        PACKAGE_NAME,
+                                        PACKAGE_VERSION,
+                                        COPYRIGHT,
+                                        LICENSE,
+                                        AUTHORS);
+                                ret = -2;
+                                goto out;
+                        case 'x':
+                                usage ();
+                                ret = -2;
+                                goto out;
+                        default:
+                                goto err;
+                }
+        }
+
+        if (argc - optind < 2) {
+                error (0, 0, "missing operand");
+                goto err;
+        }
+
+        if (strcmp (argv[argc - 1], argv[argc - 2]) == 0) {
+                error (0, EINVAL, "source and destination are the same");
+                goto err;
+        }
+
+        if (parse_endpoint (argv[argc - 2], &state->source, port, has_connection) == -1 ||
+            parse_endpoint (argv[argc - 1], &state->dest, port, has_connection) == -1) {
+                goto out;
+        }
+
+        ret = 0;
+        goto out;
+
+err:
+        error (0, 0, "Try --help for more information.");
+out:
+        return ret;
+}
+
+/**
+ * Initializes the global application state.
+ */
+static struct state*
+init_state ()
+{
+        struct state *state = calloc (1, sizeof (*state));
+
+        if (state == NULL) {
+                goto out;
+        }
+
+        state->jobs = TREE_COPY_JOBS;
+
+out:
+        return state;
+}
+
+static int
+sync_tree ()
+{
+        struct tree_copy tc;
+        int ret;
+
+        tree_copy_init (&tc, state->source.fs, state->dest.fs);
+        tc.jobs = state->jobs;
+        tc.dry_run = state->dry_run;
+        tc.options.update = true;
+        tc.options.preserve_times = true;
+        if (state->checksum) {
+                tc.options.compare = CHECKSUM_CRC32C;
+        }
+
+        ret = tree_copy (&tc, state->source.path, state->dest.path);
+
+        if (state->debug) {
+                fprintf (stderr, "%ju copied, %ju linked, %ju up to date, %ju failed\n",
+                         tc.copied, tc.linked, tc.current, tc.errors);
+        }
+
+        tree_copy_fini (&tc);
+
+        return ret;
+}
+
+/**
+ * Main entry point into application (called from glfs-cli.c)
+ */
+int
+do_sync (struct cli_context *ctx)
+{
+        int argc = ctx->argc;
+        char **argv = ctx->argv;
+        struct endpoint *endpoints[2];
+        int ret = -1;
+
+        state = init_state ();
+        if (state == NULL) {
+                error (0, errno, "failed to initialize state");
+                goto out;
+        }
+
+        state->debug = ctx->options->debug;
+        endpoints[0] = &state->source;
+        endpoints[1] = &state->dest;
+
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
+                        ret = 0;
+                case -1:
+                        goto out;
+        }
+
+        ret = connect_endpoints (endpoints, 2, ctx->fs, &state->xlator_options,
+                                 state->debug);
+
+        if (ret == 0) {
+                ret = sync_tree ();
+        }
+
+out:
+        if (state) {
+                disconnect_endpoints (endpoints, 2);
+                free_endpoint (&state->dest);
+                free_endpoint (&state->source);
+                free_xlator_options (&state->xlator_options);
+        }
+
+        free (state);
+
+        return ret;
+}
@@ -22,6 +22,9 @@
 #include <config.h>
 
 #include "glfs-tail.h"
+#include "glfs-batch.h"
+#include "glfs-copy.h"
+#include "glfs-pool.h"
 #include "glfs-util.h"
 
 #include <errno.h>
@@ -39,8 +42,26 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#endif
+
 #define AUTHORS "Written by Craig Cabrey."
 
+/**
+ * tail -n reads the file backwards TAIL_BLOCK_SIZE bytes at a time, and keeps
+ * the reads of TAIL_PREFETCH blocks in flight while it scans the others.
+ */
+#define TAIL_BLOCK_SIZE (256 * 1024)
+#define TAIL_PREFETCH 4
+
+/**
+ * tail -f polls the files up to TAIL_BACKOFF times more often than the sleep
+ * interval while data arrives, and backs off to TAIL_BACKOFF times less often
+ * while they are idle.
+ */
+#define TAIL_BACKOFF 8
+
 static volatile int keep_running = 1;
 
 static void
@@ -58,19 +79,18 @@ enum tail_mode
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_url: Struct of the parsed url supplied by the user.
- * url: Full url used to find the remote file.
+ * files: The files to tail, supplied by the user.
  * bytes: Number of bytes to print from the end of the file.
  * debug: Whether to log additional debug information.
  * follow: Whether to continue tailing the output of the file as new data appears.
  * lines: Number of lines to print from the end of the file.
- * sleep_interval: Length of time to sleep in between polling the file for changes.
+ * sleep_interval: Length of time to sleep in between polling the files for
+ *                 changes, adapted to their activity.
  * mode: The mode the application is in (bytes vs lines).
  */
 struct state {
-        struct gluster_url *gluster_url;
+        struct batch files;
         struct xlator_option *xlator_options;
-        char *url;
         unsigned int bytes;
         bool debug;
         bool follow;
@@ -101,17 +121,20 @@ static struct option const long_options[] =
 static void
 usage ()
 {
-        printf ("Usage: %s [OPTION]... URL\n"
-                "Print the last 10 lines (default) of the file to standard output.\n\n"
+        printf ("Usage: %s [OPTION]... URL...\n"
+                "Print the last 10 lines (default) of each file to standard output.\n"
+                "With more than one file, precede each with a header giving its name.\n\n"
                 "  -c, --bytes=K                output the last K bytes\n"
-                "  -f, --follow                 output appended data as the file grows\n"
+                "  -f, --follow                 output appended data as the files grow\n"
                 "  -n, --lines=K                output the last K lines, instead of the last 10\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
                 "  -p, --port=PORT              specify the port on which to connect\n"
-                "  -s, --sleep-internal=N       with -f, sleep for approximately N \n"
-                "                               microseconds (default is 50,000)\n"
+                "  -s, --sleep-internal=N       with -f, sleep for approximately N\n"
+                "                               microseconds (default is 500,000) between\n"
+                "                               polls, down to N/%d while data arrives and\n"
+                "                               up to %d*N while the files are idle\n"
                 "      --help     display this help and exit\n"
                 "      --version  output version information and exit\n\n"
                 "Examples:\n"
@@ -125,11 +148,14 @@ usage ()
                 "         Tail the last 10 lines of the file /file on the Gluster\n"
                 "         volume groot on host localhost, following the file\n"
                 "         until an interrupt is received.\n"
+                "  gftail -f glfs://localhost/groot/a.log glfs://localhost/groot/b.log\n"
+                "         Follow both files over a single connection, printing the\n"
+                "         name of the file before the data of each.\n"
                 "  gfcli (localhost/groot)> tail /example\n"
                 "        In the context of a shell with a connection established,\n"
                 "        tail the file example on the root of the Gluster volume\n"
                 "        groot on localhost.\n",
-                program_invocation_name);
+                program_invocation_name, TAIL_BACKOFF, TAIL_BACKOFF);
 }
 
 /**
@@ -251,32 +277,18 @@ parse_options (int argc, char *argv[], bool has_connection)
                 }
         }
 
-        if ((argc - option_index) < 2) {
+        if (optind == argc) {
                 error (0, 0, "missing operand");
                 goto err;
-        } else {
-                state->url = strdup (argv[argc - 1]);
-                if (state->url == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
-
-                if (has_connection) {
-                        state->gluster_url = gluster_url_init ();
-                        state->gluster_url->path = strdup (argv[argc -1]);
-                        ret = 0;
-                        goto out;
-                }
+        }
 
-                ret = gluster_parse_url (argv[argc - 1], &(state->gluster_url));
-                if (ret == -1) {
-                        error (0, EINVAL, "%s", state->url);
+        for (int i = optind; i < argc; i++) {
+                if (batch_add (&state->files, argv[i], port, has_connection) == -1) {
                         goto err;
                 }
-
-                state->gluster_url->port = port;
         }
 
+        ret = 0;
         goto out;
 
 err:
@@ -297,14 +309,13 @@ init_state ()
                 goto out;
         }
 
+        batch_init (&state->files);
         state->bytes = 0;
         state->debug = false;
         state->follow = false;
-        state->gluster_url = NULL;
         state->lines = 10;
         state->mode = LINES;
         state->sleep_interval = 500000;
-        state->url = NULL;
         state->xlator_options = NULL;
 
 out:
@@ -334,228 +345,573 @@ tail_bytes (glfs_fd_t *fd, struct stat *statbuf)
 }
 
 /**
- * Sets the offset of the fd object based on the number of newlines.
+ * Reports the newlines of a 64 byte chunk starting at base, given as a bit
+ * mask with bit i set when byte i is a newline. The newlines are counted from
+ * the highest bit down, and the offset of the one that brings *count to
+ * target is returned, or -1 when the chunk does not hold it.
  */
-static int
-tail_lines (glfs_fd_t *fd, struct stat *statbuf)
+static inline ssize_t
+newline_mask (uint64_t mask, size_t base, uintmax_t *count, uintmax_t target)
 {
-        int ret = 0;
-        int newline_count = 0;
-        ssize_t num_read;
-        char buffer[BUFSIZE];
-        long long offset;
-        long long size = (long long) statbuf->st_size;
+        unsigned int bit;
 
-        offset = size - BUFSIZE;
-        if (offset < 0) {
-                offset = 0;
+        if ((uintmax_t) __builtin_popcountll (mask) < target - *count) {
+                *count += __builtin_popcountll (mask);
+                return -1;
         }
 
-        if (state->lines == 0) {
-                offset = size;
-                goto finished;
+        while (true) {
+                bit = 63 - __builtin_clzll (mask);
+                if (++*count == target) {
+                        return base + bit;
+                }
+
+                mask &= ~((uint64_t) 1 << bit);
+        }
+}
+
+/**
+ * Scans buf backwards for newlines, adding them to *count. Returns the offset
+ * of the newline that brings *count to target, or -1 when buf does not hold
+ * it. glibc's memrchr () is vectorized already, so this is only slower than
+ * the variants below on buffers dense with newlines.
+ */
+static ssize_t
+newline_scan_scalar (const char *buf, size_t len, uintmax_t *count,
+                     uintmax_t target)
+{
+        const char *p;
+
+        while ((p = memrchr (buf, '\n', len)) != NULL) {
+                len = p - buf;
+                if (++*count == target) {
+                        return len;
+                }
         }
 
-        while (true) {
-                ret = glfs_lseek (fd, offset, SEEK_SET);
-                if (ret == -1) {
-                        error (0, errno, "seek error");
-                        goto err;
+        return -1;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+/**
+ * Same as newline_scan_scalar (), comparing 64 bytes at a time with AVX2 and
+ * counting the newlines of each chunk with a single popcount.
+ */
+__attribute__ ((target ("avx2,popcnt")))
+static ssize_t
+newline_scan_avx2 (const char *buf, size_t len, uintmax_t *count,
+                   uintmax_t target)
+{
+        const __m256i newline = _mm256_set1_epi8 ('\n');
+        uint64_t lo;
+        uint64_t hi;
+        ssize_t ret;
+
+        while (len >= 64) {
+                len -= 64;
+                lo = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+                        _mm256_loadu_si256 ((const __m256i *) &buf[len]), newline));
+                hi = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+                        _mm256_loadu_si256 ((const __m256i *) &buf[len + 32]), newline));
+                if ((lo | hi) == 0) {
+                        continue;
                 }
 
-                num_read = glfs_read (fd, &buffer, BUFSIZE, 0);
-                if (num_read == -1) {
-                        error (0, errno, "read error");
-                        goto err;
+                ret = newline_mask (lo | hi << 32, len, count, target);
+                if (ret != -1) {
+                        return ret;
                 }
+        }
 
-                for (int i = num_read - 1; i >= 0; i--) {
-                        if (buffer[i] == '\n') {
-                                newline_count++;
-                        }
+        return newline_scan_scalar (buf, len, count, target);
+}
 
-                        if (newline_count == (state->lines + 1)) {
-                                offset += i + 1;
-                                goto finished;
-                        }
+#ifdef __SSE2__
+/**
+ * Same as newline_scan_avx2 () with the SSE2 instructions every x86-64
+ * processor has.
+ */
+static ssize_t
+newline_scan_sse2 (const char *buf, size_t len, uintmax_t *count,
+                   uintmax_t target)
+{
+        const __m128i newline = _mm_set1_epi8 ('\n');
+        uint64_t mask;
+        ssize_t ret;
+
+        while (len >= 64) {
+                len -= 64;
+                mask = 0;
+                for (int i = 3; i >= 0; i--) {
+                        mask = mask << 16 | (uint16_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+                                _mm_loadu_si128 ((const __m128i *) &buf[len + i * 16]),
+                                newline));
                 }
 
-                if ((offset - BUFSIZE) < 0) {
-                        offset -= num_read;
-                        break;
+                if (mask == 0) {
+                        continue;
+                }
+
+                ret = newline_mask (mask, len, count, target);
+                if (ret != -1) {
+                        return ret;
+                }
+        }
+
+        return newline_scan_scalar (buf, len, count, target);
+}
+#endif /* __SSE2__ */
+#endif /* __x86_64__ || __i386__ */
+
+static ssize_t
+newline_scan (const char *buf, size_t len, uintmax_t *count, uintmax_t target)
+{
+#if defined (__x86_64__) || defined (__i386__)
+        if (__builtin_cpu_supports ("avx2") &&
+            __builtin_cpu_supports ("popcnt")) {
+                return newline_scan_avx2 (buf, len, count, target);
+        }
+
+#ifdef __SSE2__
+        return newline_scan_sse2 (buf, len, count, target);
+#endif
+#endif
+        return newline_scan_scalar (buf, len, count, target);
+}
+
+/**
+ * A block of the file read ahead of the scan of tail_lines ().
+ */
+struct tail_block {
+        struct copy_file *file;
+        char *buf;
+        off_t offset;
+        size_t len;
+        int err;
+};
+
+static void
+tail_read_block (void *arg)
+{
+        struct tail_block *block = arg;
+        ssize_t ret;
+
+        block->err = 0;
+        for (size_t done = 0; done < block->len; done += ret) {
+                ret = copy_pread (block->file, &block->buf[done],
+                                  block->len - done, block->offset + done);
+                if (ret == -1) {
+                        block->err = errno;
+                        return;
+                }
+
+                // The file shrank since it was checked.
+                if (ret == 0) {
+                        block->err = EIO;
+                        return;
+                }
+        }
+}
+
+/**
+ * Queues the reads of the blocks preceding *end into window, or performs them
+ * at once without a pool. Returns the number of blocks queued.
+ */
+static int
+tail_read_window (struct pool *pool, struct tail_block *window, off_t *end)
+{
+        int count;
+
+        for (count = 0; count < TAIL_PREFETCH && *end > 0; count++) {
+                window[count].len = *end < TAIL_BLOCK_SIZE ? *end : TAIL_BLOCK_SIZE;
+                window[count].offset = *end - window[count].len;
+                *end = window[count].offset;
+
+                if (pool == NULL) {
+                        tail_read_block (&window[count]);
                 } else {
-                        offset -= BUFSIZE;
+                        pool_submit (pool, tail_read_block, &window[count]);
                 }
         }
 
-        num_read = glfs_read (fd, &buffer, BUFSIZE, 0);
-        if (num_read == -1) {
-                error (0, errno, "read error");
-                goto err;
+        return count;
+}
+
+/**
+ * Sets the offset of the fd object based on the number of newlines.
+ *
+ * The file is scanned backwards a window of TAIL_PREFETCH blocks at a time.
+ * The blocks of each window are read in parallel while the previous window is
+ * scanned, so that long tails are bound by neither the latency of each read
+ * nor the scan itself.
+ */
+static int
+tail_lines (glfs_fd_t *fd, struct stat *statbuf, const char *path)
+{
+        struct copy_file file = COPY_FILE_REMOTE (NULL, fd, path);
+        struct tail_block blocks[2][TAIL_PREFETCH];
+        struct pool *pool = NULL;
+        char *buffers = NULL;
+        uintmax_t count = 0;
+        uintmax_t target = (uintmax_t) state->lines + 1;
+        off_t size = statbuf->st_size;
+        off_t end = size;
+        off_t offset = 0;
+        ssize_t pos;
+        int ret = -1;
+        int current = 0;
+        int nblocks;
+        int next;
+
+        if (state->lines == 0 || size == 0) {
+                offset = size;
+                goto finished;
         }
 
-        for (int i = num_read - 1; i >= 0; i--) {
-                if (buffer[i] == '\n') {
-                        newline_count++;
+        buffers = malloc (2 * TAIL_PREFETCH * TAIL_BLOCK_SIZE);
+        if (buffers == NULL) {
+                error (0, errno, "malloc");
+                goto out;
+        }
+
+        for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < TAIL_PREFETCH; j++) {
+                        blocks[i][j].file = &file;
+                        blocks[i][j].buf = &buffers[(i * TAIL_PREFETCH + j) *
+                                                    TAIL_BLOCK_SIZE];
                 }
+        }
 
-                if (newline_count == (state->lines + 1)) {
-                        offset += i + 1;
-                        goto finished;
+        // Files that fit in a single block are read without any threads.
+        if (size > TAIL_BLOCK_SIZE) {
+                pool = pool_create (TAIL_PREFETCH, TAIL_PREFETCH * 2);
+                if (pool == NULL) {
+                        error (0, errno, "failed to start read threads");
+                        goto out;
                 }
         }
 
-        if (newline_count < state->lines) {
-                offset = 0;
+        nblocks = tail_read_window (pool, blocks[current], &end);
+        if (pool != NULL) {
+                pool_wait (pool);
         }
 
-        if (offset < 0) {
-                offset = 0;
+        // A last line without a newline counts as a line as well.
+        if (blocks[0][0].err == 0 &&
+            blocks[0][0].buf[blocks[0][0].len - 1] != '\n') {
+                target--;
+        }
+
+        while (nblocks > 0) {
+                next = tail_read_window (pool, blocks[!current], &end);
+
+                for (int i = 0; i < nblocks; i++) {
+                        if (blocks[current][i].err != 0) {
+                                error (0, blocks[current][i].err, "read error");
+                                goto out;
+                        }
+
+                        pos = newline_scan (blocks[current][i].buf,
+                                            blocks[current][i].len,
+                                            &count, target);
+                        if (pos != -1) {
+                                offset = blocks[current][i].offset + pos + 1;
+                                goto finished;
+                        }
+                }
+
+                if (pool != NULL) {
+                        pool_wait (pool);
+                }
+
+                nblocks = next;
+                current = !current;
         }
 
+        // Fewer lines than requested: print the whole file.
+        offset = 0;
+
 finished:
         ret = glfs_lseek (fd, offset, SEEK_SET);
         if (ret == -1) {
                 error (0, errno, "seek error");
         }
 
-        goto out;
-
-err:
-        ret = -1;
 out:
+        // Reads of the next window may still be in flight.
+        pool_destroy (pool);
+        free (buffers);
+
         return ret;
 }
 
+
+/**
+ * A file being tailed.
+ *
+ * path: The file as supplied by the user, along with its volume.
+ * fd: The open file, or NULL once it failed.
+ * pos: Offset up to which the file has been printed.
+ */
+struct tail_file {
+        struct batch_path *path;
+        glfs_fd_t *fd;
+        off_t pos;
+};
+
+/**
+ * Prints the name of file before its data when several files are tailed and
+ * the previous data came from another file.
+ */
+static void
+tail_header (struct tail_file *file)
+{
+        static struct tail_file *last;
+
+        if (state->files.count < 2 || file == last) {
+                return;
+        }
+
+        // Data is written straight to the descriptor, so do not let the
+        // header linger in the stdio buffer.
+        printf ("%s==> %s <==\n", last == NULL ? "" : "\n", file->path->arg);
+        fflush (stdout);
+        last = file;
+}
+
+/**
+ * Opens file and prints its last lines or bytes.
+ */
 static int
-tail (glfs_t *fs)
+tail_open (struct tail_file *file)
 {
-        glfs_fd_t *fd = NULL;
-        int ret;
+        struct batch_path *path = file->path;
         struct stat statbuf;
-        long long size;
+        int ret;
 
-        ret = glfs_stat (fs, state->gluster_url->path, &statbuf);
+        ret = glfs_stat (path->fs, path->path, &statbuf);
         if (ret == -1) {
-                error (0, errno, "cannot open `%s' for reading", state->url);
-                goto err;
+                error (0, errno, "cannot open `%s' for reading", path->arg);
+                return -1;
         }
 
-        fd = glfs_open (fs, state->gluster_url->path, O_RDONLY);
-        if (fd == NULL) {
-                error (0, errno, "error reading `%s'", state->url);
-                goto err;
+        file->fd = glfs_open (path->fs, path->path, O_RDONLY);
+        if (file->fd == NULL) {
+                error (0, errno, "error reading `%s'", path->arg);
+                return -1;
         }
 
-        size = (long long) statbuf.st_size;
-
         switch (state->mode) {
                 case BYTES:
-                        ret = tail_bytes (fd, &statbuf);
+                        ret = tail_bytes (file->fd, &statbuf);
                         break;
                 case LINES:
-                        ret = tail_lines (fd, &statbuf);
+                        ret = tail_lines (file->fd, &statbuf, path->arg);
                         break;
                 default:
                         error (0, 0, "unknown error");
-                        goto err;
+                        ret = -1;
         }
 
         if (ret == -1) {
-                goto err;
+                return -1;
         }
 
-        ret = gluster_read (fd, STDOUT_FILENO);
+        tail_header (file);
+
+        ret = gluster_read (file->fd, STDOUT_FILENO);
         if (ret == -1) {
                 error (0, errno, "write error");
-                goto err;
+                return -1;
         }
 
-        if (state->follow) {
-                // Use our SIGINT handler to break out of follow functionality
-                signal (SIGINT, int_handler);
+        file->pos = glfs_lseek (file->fd, 0, SEEK_CUR);
+        if (file->pos == -1) {
+                error (0, errno, "seek error");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Prints the data appended to file since the last poll. The attributes are
+ * fetched through the open file, which costs a single request instead of the
+ * lookup of the whole path. Returns 1 when data was printed, 0 when the file
+ * did not grow, and -1 on errors.
+ */
+static int
+tail_poll (struct tail_file *file, char *buf)
+{
+        struct copy_file src = COPY_FILE_REMOTE (NULL, file->fd, file->path->arg);
+        struct stat statbuf;
+        ssize_t num_read;
+        size_t len;
+
+        if (glfs_fstat (file->fd, &statbuf) == -1) {
+                error (0, errno, "cannot stat `%s'", file->path->arg);
+                return -1;
+        }
+
+        if (statbuf.st_size < file->pos) {
+                error (0, 0, "file truncated: %s", file->path->arg);
+                file->pos = 0;
+        }
+
+        if (statbuf.st_size == file->pos) {
+                return 0;
+        }
+
+        tail_header (file);
+
+        while (file->pos < statbuf.st_size) {
+                len = statbuf.st_size - file->pos < BUFSIZE ?
+                        statbuf.st_size - file->pos : BUFSIZE;
+                num_read = copy_pread (&src, buf, len, file->pos);
+                if (num_read == -1) {
+                        error (0, errno, "read error: %s", file->path->arg);
+                        return -1;
+                }
 
-                while (keep_running) {
-                        usleep (state->sleep_interval);
+                // The file shrank after its attributes were fetched.
+                if (num_read == 0) {
+                        break;
+                }
 
-                        ret = glfs_stat (fs, state->gluster_url->path, &statbuf);
+                for (ssize_t done = 0, ret; done < num_read; done += ret) {
+                        ret = write (STDOUT_FILENO, &buf[done], num_read - done);
                         if (ret == -1) {
-                                error (0, errno, "cannot open `%s' for reading", state->url);
-                                goto err;
+                                error (0, errno, "write error");
+                                return -1;
                         }
+                }
+
+                file->pos += num_read;
+        }
+
+        return 1;
+}
+
+/**
+ * Prints the data appended to the files until an interrupt is received. Files
+ * that fail are reported and no longer followed.
+ *
+ * The files are polled every sleep_interval at first. The interval shrinks to
+ * a fraction of it as soon as one of the files grows, and grows back to a
+ * multiple of it while none of them does, so that idle files cost few
+ * requests and busy files are printed promptly.
+ */
+static int
+tail_follow (struct tail_file *files, size_t count)
+{
+        unsigned long int interval = state->sleep_interval;
+        unsigned long int fastest = state->sleep_interval / TAIL_BACKOFF;
+        unsigned long int slowest = state->sleep_interval * TAIL_BACKOFF;
+        size_t followed = 0;
+        bool active;
+        char *buf;
+        int ret = 0;
 
-                        if (statbuf.st_size == size) {
+        buf = malloc (BUFSIZE);
+        if (buf == NULL) {
+                error (0, errno, "malloc");
+                return -1;
+        }
+
+        if (fastest == 0) {
+                fastest = 1;
+        }
+
+        // Use our SIGINT handler to break out of follow functionality, which
+        // may have been used by an earlier command of the shell.
+        keep_running = 1;
+        signal (SIGINT, int_handler);
+
+        for (size_t i = 0; i < count; i++) {
+                followed += files[i].fd != NULL;
+        }
+
+        while (keep_running && followed > 0) {
+                usleep (interval);
+
+                active = false;
+                for (size_t i = 0; i < count && keep_running; i++) {
+                        if (files[i].fd == NULL) {
                                 continue;
                         }
 
-                        if (statbuf.st_size < size) {
-                                error (0, 0, "file truncated: %s",
-                                                state->gluster_url->path);
-                                size = statbuf.st_size;
-                                glfs_lseek (fd, 0, SEEK_SET);
+                        switch (tail_poll (&files[i], buf)) {
+                                case 1:
+                                        active = true;
+                                        break;
+                                case -1:
+                                        glfs_close (files[i].fd);
+                                        files[i].fd = NULL;
+                                        followed--;
+                                        ret = -1;
+                                        break;
                         }
+                }
 
-                        ret = gluster_read (fd, STDOUT_FILENO);
-                        if (ret == -1) {
-                                error (0, errno, "read error: %s",
-                                                state->gluster_url->path);
-                                goto err;
-                        }
+                if (active) {
+                        interval = fastest;
+                } else if (interval < slowest) {
+                        interval = interval * 2 < slowest ? interval * 2 : slowest;
                 }
         }
 
-        goto out;
-err:
-        ret = -1;
-out:
         // Disable our signal handler
         // FIXME: This clobbers gfcli's signal handler.
         signal (SIGINT, SIG_DFL);
 
-        if (fd) {
-                if (glfs_close (fd) == -1) {
-                        error (0, errno, "failed to close file");
-                        ret = -1;
-                }
-        }
+        free (buf);
 
         return ret;
 }
 
 static int
-do_tail_without_context ()
+tail (glfs_t *fs)
 {
-        glfs_t *fs = NULL;
+        struct tail_file *files;
+        size_t count = state->files.count;
         int ret;
 
-        ret = gluster_getfs (&fs, state->gluster_url);
+        ret = batch_connect (&state->files, fs, &state->xlator_options,
+                             state->debug);
         if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto out;
+                return -1;
         }
 
-        ret = apply_xlator_options (fs, &state->xlator_options);
-        if (ret == -1) {
-                error (0, errno, "failed to apply xlator options");
-                goto out;
+        files = calloc (count, sizeof (*files));
+        if (files == NULL) {
+                error (0, errno, "calloc");
+                return -1;
         }
 
-        if (state->debug) {
-                ret = glfs_set_logging (fs, "/dev/stderr", GF_LOG_DEBUG);
-
-                if (ret == -1) {
-                        error (0, errno, "failed to set logging level");
-                        goto out;
+        for (size_t i = 0; i < count; i++) {
+                files[i].path = &state->files.paths[i];
+                if (tail_open (&files[i]) == -1) {
+                        ret = -1;
+                        if (files[i].fd != NULL) {
+                                glfs_close (files[i].fd);
+                                files[i].fd = NULL;
+                        }
                 }
         }
 
-        ret = tail (fs);
+        if (state->follow && tail_follow (files, count) == -1) {
+                ret = -1;
+        }
 
-out:
-        if (fs) {
-                glfs_fini (fs);
+        for (size_t i = 0; i < count; i++) {
+                if (files[i].fd != NULL && glfs_close (files[i].fd) == -1) {
+                        error (0, errno, "failed to close file");
+                        ret = -1;
+                }
         }
 
+        free (files);
+
         return ret;
 }
 
@@ -575,33 +931,23 @@ do_tail (struct cli_context *ctx)
                 goto out;
         }
 
-        if (ctx->fs) {
-                ret = parse_options (argc, argv, true);
-                if (ret != 0) {
-                        goto out;
-                }
-
-                ret = tail (ctx->fs);
-        } else {
-                ret = parse_options (argc, argv, false);
-                if (ret == -1) {
-                        goto out;
-                }
+        state->debug = ctx->options->debug;
 
-                // Valid options were passed and executed, but we don't want to
-                // continue with execution.
-                if (ret == -2) {
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
                         ret = 0;
+                case -1:
                         goto out;
-                }
-
-                ret = do_tail_without_context ();
         }
 
+        ret = tail (ctx->fs);
+
 out:
         if (state) {
-                gluster_url_free (state->gluster_url);
-                free (state->url);
+                batch_fini (&state->files);
+                free_xlator_options (&state->xlator_options);
         }
 
         free (state);
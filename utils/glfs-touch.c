@@ -22,10 +22,12 @@
 #include <config.h>
 
 #include "glfs-touch.h"
+#include "glfs-batch.h"
 #include "glfs-util.h"
 
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <glusterfs/api/glfs.h>
 #include <stdbool.h>
@@ -34,21 +36,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #define AUTHORS "Written by Moonblade."
 
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_url: Struct of the parsed url supplied by the user.
- * url: Full url used to find the remote file (supplied by user).
+ * files: The files to touch, supplied by the user.
  * debug: Whether to log additional debug information.
  * parents: Whether all parent directories in the path are created.
  */
 struct state {
-        struct gluster_url *gluster_url;
+        struct batch files;
         struct xlator_option *xlator_options;
-        char *url;
         bool debug;
         bool parents;
 };
@@ -58,7 +59,9 @@ static struct state *state;
 static struct option const long_options[] =
 {
         {"debug", no_argument, NULL, 'd'},
+        {"files-from", required_argument, NULL, 'f'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
         {"parents", no_argument, NULL, 'r'},
         {"port", required_argument, NULL, 'p'},
         {"version", no_argument, NULL, 'v'},
@@ -69,7 +72,13 @@ static struct option const long_options[] =
 static void
 usage ()
 {
-        printf ("Usage: %s [OPTION]... URL\n\n"
+        printf ("Usage: %s [OPTION]... URL...\n"
+                "Update the access and modification times of each file to the current\n"
+                "time, creating the files that do not exist.\n\n"
+                "  -f, --files-from=FILE        also touch the files listed in FILE, one per\n"
+                "                               line. With FILE -, read standard input.\n"
+                "  -j, --jobs=N                 touch up to N files concurrently\n"
+                "                               (default %d)\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the \n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
@@ -80,11 +89,13 @@ usage ()
                 "  gftouch glfs://localhost/groot/file\n"
                 "          Create the file /file on the Gluster\n"
                 "          volume of groot on host localhost.\n"
+                "  gftouch -f markers.txt\n"
+                "          Touch the files whose urls are listed in markers.txt.\n"
                 "  gfcli (localhost/groot)> touch /file\n"
                 "          In the context of a shell with a connection established,\n"
                 "          create a file on the root of the Gluster volume groot\n"
                 "          on localhost.\n",
-                program_invocation_name);
+                program_invocation_name, BATCH_JOBS);
 }
 
 static int
@@ -94,12 +105,15 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        char *files_from = NULL;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt since other utilities may have called it already.
         optind = 0;
         while (true) {
-                opt = getopt_long (argc, argv, "do:p:rv", long_options,
+                opt = getopt_long (argc, argv, "df:j:o:p:rv", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -110,6 +124,20 @@ parse_options (int argc, char *argv[], bool has_connection)
                         case 'd':
                                 state->debug = true;
                                 break;
+                        case 'f':
+                                files_from = optarg;
+                                break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->files.jobs = jobs;
+                                break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
                                 if (option == NULL) {
@@ -149,51 +177,24 @@ parse_options (int argc, char *argv[], bool has_connection)
                 }
         }
 
-        if ((argc - option_index) < 2) {
+        if (optind == argc && files_from == NULL) {
                 error (0, 0, "missing operand");
                 goto err;
-        } else {
-                state->url = strdup (argv[argc - 1]);
-                if (state->url == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
-
-                if (has_connection) {
-                        state->gluster_url = gluster_url_init ();
-                        if (state->gluster_url == NULL) {
-                                error (0, errno, "gluster_url_init");
-                                goto out;
-                        }
-
-                        state->gluster_url->path = strdup (argv[argc - 1]);
-                        if (state->gluster_url->path == NULL) {
-                                error (0, errno, "strdup");
-                                goto out;
-                        }
-
-                        ret = 0;
-                        goto out;
-                }
+        }
 
-                ret = gluster_parse_url (argv[argc - 1], &(state->gluster_url));
-                if (ret == -1) {
-                        error (0, EINVAL, "%s", state->url);
+        for (int i = optind; i < argc; i++) {
+                if (batch_add (&state->files, argv[i], port, has_connection) == -1) {
                         goto err;
                 }
+        }
 
-                state->gluster_url->port = port;
-
-                // gluster_create_path will not create
-                // the last directory in a path if that path does not
-                // include a trailing slash ('/'), so add one if it does not
-                // exist.
-                char *path = state->gluster_url->path;
-                if (path[strlen (path) - 1] != '/') {
-                        strncat (path, "/", strlen (path) + 2);
-                }
+        if (files_from != NULL &&
+            batch_add_files_from (&state->files, files_from, port,
+                                  has_connection) == -1) {
+                goto out;
         }
 
+        ret = 0;
         goto out;
 
 err:
@@ -211,65 +212,61 @@ init_state ()
                 goto out;
         }
 
+        batch_init (&state->files);
         state->debug = false;
-        state->gluster_url = NULL;
         state->parents = false;
-        state->url = NULL;
         state->xlator_options = NULL;
 
 out:
         return state;
 }
 
+/**
+ * Touches one file. Files that exist take a single request to set their
+ * times; the others are created.
+ */
 static int
-touch_with_fs (glfs_t *fs)
+touch_path (glfs_t *fs, const char *path, const char *arg, void *data)
 {
-        int ret;
-        mode_t mode = get_default_dir_mode_perm ();
+        struct timespec times[2];
+        glfs_fd_t *fd;
 
-        ret = glfs_creat(fs, state->gluster_url->path, 0, mode);
+        clock_gettime (CLOCK_REALTIME, &times[0]);
+        times[1] = times[0];
 
-        if (ret == -1) {
-                error (0, errno, "cannot create file `%s'", state->url);
-                goto out;
+        if (glfs_utimens (fs, path, times) == 0) {
+                return 0;
         }
 
-out:
-        return ret;
-}
-
-static int
-touch_without_context ()
-{
-        glfs_t *fs = NULL;
-        int ret = -1;
-
-        ret = gluster_getfs (&fs, state->gluster_url);
-        if (ret == -1) {
-                error (0, errno, "cannot create file `%s'", state->url);
-                goto out;
+        if (errno != ENOENT) {
+                error (0, errno, "cannot touch `%s'", arg);
+                return -1;
         }
 
-        ret = apply_xlator_options (fs, &state->xlator_options);
-        if (ret == -1) {
-                error (0, errno, "failed to apply translator options");
-                goto out;
+        fd = glfs_creat (fs, path, O_CREAT | O_WRONLY,
+                         get_default_file_mode_perm ());
+        if (fd == NULL) {
+                error (0, errno, "cannot create file `%s'", arg);
+                return -1;
         }
 
-        if (state->debug) {
-                ret = glfs_set_logging (fs, "/dev/stderr", GF_LOG_DEBUG);
-
-                if (ret == -1) {
-                        error (0, errno, "failed to set logging level");
-                        goto out;
-                }
+        if (glfs_close (fd) == -1) {
+                error (0, errno, "cannot close file `%s'", arg);
+                return -1;
         }
 
-        ret = touch_with_fs (fs);
+        return 0;
+}
+
+static int
+touch_with_fs (glfs_t *fs)
+{
+        int ret;
 
-out:
-        if (fs) {
-                glfs_fini (fs);
+        ret = batch_connect (&state->files, fs, &state->xlator_options,
+                             state->debug);
+        if (ret == 0) {
+                ret = batch_run (&state->files, touch_path, NULL);
         }
 
         return ret;
@@ -290,30 +287,21 @@ do_touch (struct cli_context *ctx)
 
         state->debug = ctx->options->debug;
 
-        if (ctx->fs) {
-                ret = parse_options (argc, argv, true);
-                if (ret != 0) {
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
+                        ret = 0;
+                case -1:
                         goto out;
-                }
-
-                ret = touch_with_fs (ctx->fs);
-        } else {
-                ret = parse_options (argc, argv, false);
-                switch (ret) {
-                        case -2:
-                                // Fall through
-                                ret = 0;
-                        case -1:
-                                goto out;
-                }
-
-                ret = touch_without_context ();
         }
 
+        ret = touch_with_fs (ctx->fs);
+
 out:
         if (state) {
-                gluster_url_free (state->gluster_url);
-                free (state->url);
+                batch_fini (&state->files);
+                free_xlator_options (&state->xlator_options);
         }
 
         free (state);
@@ -0,0 +1,1761 @@
+/**
+ * Helpers to walk directory trees that live either locally or on a remote
+ * Gluster volume.
+ *
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "glfs-tree.h"
+#include "glfs-pool.h"
+#include "glfs-util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <glusterfs/api/glfs.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A file queued for transfer by a tree copy.
+ *
+ * dst_exists: Whether the destination was found in the listing of its
+ *             directory, in which case an update compares it by contents
+ *             when the options ask for it.
+ */
+struct tree_job {
+        struct tree_copy *tc;
+        char *src_path;
+        char *dst_path;
+        struct stat st;
+        bool dst_exists;
+};
+
+/**
+ * A slot of the table of the inodes with several names, mapping an inode of
+ * the source to the destination of its first name. Empty slots have no path.
+ */
+struct tree_inode {
+        dev_t dev;
+        ino_t ino;
+        char *path;
+};
+
+/**
+ * A further name of an inode, linked to the first one once the data is
+ * copied.
+ */
+struct tree_link {
+        struct tree_link *next;
+        char *target;
+        char *path;
+        char *source;
+};
+
+/**
+ * A directory created writable for its contents to be copied, whose mode is
+ * restricted once the copy has completed.
+ */
+struct tree_mode {
+        struct tree_mode *next;
+        char *path;
+        mode_t mode;
+};
+
+/**
+ * A directory of a tree removal.
+ *
+ * parent: The directory holding it, NULL for the root of the removal.
+ * pending: Number of its entries still being removed, plus one while the
+ *          walk is listing it. The directory is removed when it drops to
+ *          zero, by whichever thread removed its last entry.
+ * failed: Whether an entry failed to be removed, which keeps the directory
+ *         and its parents in place.
+ */
+struct tree_rmnode {
+        struct tree_rmnode *parent;
+        char *path;
+        size_t pending;
+        bool failed;
+};
+
+/**
+ * A file queued for removal by a tree removal.
+ */
+struct tree_rmjob {
+        struct tree_remove *tr;
+        struct tree_rmnode *dir;
+        char *path;
+};
+
+/**
+ * A directory of a bulk creation.
+ *
+ * depth: Number of components of the path.
+ * failed: Whether the directory could not be created, in which case its
+ *         subdirectories are not attempted.
+ */
+struct tree_mkdir {
+        struct tree_mkdirs *tm;
+        char *path;
+        size_t depth;
+        bool failed;
+};
+
+/**
+ * A source path of a move, removed once the move of its contents or of its
+ * other names has completed.
+ */
+struct tree_path {
+        struct tree_path *next;
+        char *path;
+};
+
+static int
+tree_dir_add (struct tree_dir *dir, const char *name, const struct stat *st)
+{
+        struct tree_entry *entries;
+        size_t alloc;
+
+        if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0) {
+                return 0;
+        }
+
+        if (dir->count == dir->alloc) {
+                alloc = dir->alloc ? dir->alloc * 2 : 64;
+                entries = realloc (dir->entries, alloc * sizeof (*entries));
+                if (entries == NULL) {
+                        return -1;
+                }
+
+                dir->entries = entries;
+                dir->alloc = alloc;
+        }
+
+        dir->entries[dir->count].name = strdup (name);
+        if (dir->entries[dir->count].name == NULL) {
+                return -1;
+        }
+
+        dir->entries[dir->count].st = *st;
+        dir->count++;
+
+        return 0;
+}
+
+static int
+tree_entry_cmp (const void *a, const void *b)
+{
+        return strcmp (((const struct tree_entry *) a)->name,
+                       ((const struct tree_entry *) b)->name);
+}
+
+static int
+tree_list_local (const char *path, struct tree_dir *dir)
+{
+        DIR *dirp;
+        struct dirent *entry;
+        struct stat st;
+        int ret = -1;
+
+        dirp = opendir (path);
+        if (dirp == NULL) {
+                return -1;
+        }
+
+        while (true) {
+                errno = 0;
+                entry = readdir (dirp);
+                if (entry == NULL) {
+                        ret = errno == 0 ? 0 : -1;
+                        break;
+                }
+
+                if (fstatat (dirfd (dirp), entry->d_name, &st,
+                             AT_SYMLINK_NOFOLLOW) == -1) {
+                        if (errno == ENOENT) {
+                                // Removed since it was listed.
+                                continue;
+                        }
+
+                        break;
+                }
+
+                if (tree_dir_add (dir, entry->d_name, &st) == -1) {
+                        break;
+                }
+        }
+
+        closedir (dirp);
+
+        return ret;
+}
+
+/**
+ * Lists a remote directory with readdirplus, which returns the attributes of
+ * the entries along with their names, instead of looking each entry up on
+ * its own.
+ */
+static int
+tree_list_remote (glfs_t *fs, const char *path, struct tree_dir *dir)
+{
+        glfs_fd_t *fd;
+        struct dirent entry;
+        struct dirent *result;
+        struct stat st;
+        int ret = -1;
+
+        fd = glfs_opendir (fs, path);
+        if (fd == NULL) {
+                return -1;
+        }
+
+        while (true) {
+                if (glfs_readdirplus_r (fd, &st, &entry, &result) != 0) {
+                        break;
+                }
+
+                if (result == NULL) {
+                        ret = 0;
+                        break;
+                }
+
+                if (tree_dir_add (dir, result->d_name, &st) == -1) {
+                        break;
+                }
+        }
+
+        glfs_closedir (fd);
+
+        return ret;
+}
+
+/**
+ * Reads the entries of the directory at path, except . and .., into dir,
+ * which must be released with tree_dir_free (). Returns -1 with errno set on
+ * error.
+ */
+int
+tree_list_dir (glfs_t *fs, const char *path, struct tree_dir *dir)
+{
+        int ret;
+
+        dir->entries = NULL;
+        dir->count = 0;
+        dir->alloc = 0;
+
+        if (fs == NULL) {
+                ret = tree_list_local (path, dir);
+        } else {
+                ret = tree_list_remote (fs, path, dir);
+        }
+
+        if (ret == -1) {
+                int err = errno;
+
+                tree_dir_free (dir);
+                errno = err;
+
+                return -1;
+        }
+
+        if (dir->count > 1) {
+                qsort (dir->entries, dir->count, sizeof (*dir->entries),
+                       tree_entry_cmp);
+        }
+
+        return 0;
+}
+
+/**
+ * Returns the entry of dir with the given name, or NULL.
+ */
+struct tree_entry *
+tree_dir_find (const struct tree_dir *dir, const char *name)
+{
+        struct tree_entry key = { .name = (char *) name };
+
+        if (dir->count == 0) {
+                return NULL;
+        }
+
+        return bsearch (&key, dir->entries, dir->count, sizeof (*dir->entries),
+                        tree_entry_cmp);
+}
+
+void
+tree_dir_free (struct tree_dir *dir)
+{
+        for (size_t i = 0; i < dir->count; i++) {
+                free (dir->entries[i].name);
+        }
+
+        free (dir->entries);
+        dir->entries = NULL;
+        dir->count = 0;
+        dir->alloc = 0;
+}
+
+int
+tree_stat (glfs_t *fs, const char *path, struct stat *statbuf)
+{
+        if (fs == NULL) {
+                return stat (path, statbuf);
+        }
+
+        return glfs_stat (fs, path, statbuf);
+}
+
+int
+tree_lstat (glfs_t *fs, const char *path, struct stat *statbuf)
+{
+        if (fs == NULL) {
+                return lstat (path, statbuf);
+        }
+
+        return glfs_lstat (fs, path, statbuf);
+}
+
+int
+tree_chmod (glfs_t *fs, const char *path, mode_t mode)
+{
+        if (fs == NULL) {
+                return chmod (path, mode);
+        }
+
+        return glfs_chmod (fs, path, mode);
+}
+
+int
+tree_link (glfs_t *fs, const char *oldpath, const char *newpath)
+{
+        if (fs == NULL) {
+                return link (oldpath, newpath);
+        }
+
+        return glfs_link (fs, oldpath, newpath);
+}
+
+int
+tree_mkdir (glfs_t *fs, const char *path, mode_t mode)
+{
+        if (fs == NULL) {
+                return mkdir (path, mode);
+        }
+
+        return glfs_mkdir (fs, path, mode);
+}
+
+/**
+ * Opens path and describes it in file for the copy_* () functions. The path
+ * is not copied, so it must outlive the file. Returns -1 with errno set on
+ * error.
+ */
+int
+tree_open (glfs_t *fs, const char *path, int flags, mode_t mode,
+           struct copy_file *file)
+{
+        glfs_fd_t *glfd;
+        int fd;
+
+        if (fs == NULL) {
+                fd = open (path, flags, mode);
+                if (fd == -1) {
+                        return -1;
+                }
+
+                *file = COPY_FILE_LOCAL (fd, path);
+
+                return 0;
+        }
+
+        if (flags & O_CREAT) {
+                glfd = glfs_creat (fs, path, flags, mode);
+        } else {
+                glfd = glfs_open (fs, path, flags);
+        }
+
+        if (glfd == NULL) {
+                return -1;
+        }
+
+        *file = COPY_FILE_REMOTE (fs, glfd, path);
+
+        return 0;
+}
+
+void
+tree_close (struct copy_file *file)
+{
+        if (file->glfd != NULL) {
+                glfs_close (file->glfd);
+                file->glfd = NULL;
+        } else if (file->fd != -1) {
+                close (file->fd);
+                file->fd = -1;
+        }
+}
+
+/**
+ * Returns the target of the symbolic link at path, which must be freed by the
+ * caller, or NULL with errno set.
+ */
+char *
+tree_readlink (glfs_t *fs, const char *path)
+{
+        char buf[PATH_MAX];
+        ssize_t len;
+
+        if (fs == NULL) {
+                len = readlink (path, buf, sizeof (buf));
+        } else {
+                len = glfs_readlink (fs, path, buf, sizeof (buf));
+        }
+
+        if (len == -1) {
+                return NULL;
+        }
+
+        if (len == sizeof (buf)) {
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+
+        return strndup (buf, len);
+}
+
+int
+tree_symlink (glfs_t *fs, const char *target, const char *path)
+{
+        if (fs == NULL) {
+                return symlink (target, path);
+        }
+
+        return glfs_symlink (fs, target, path);
+}
+
+int
+tree_unlink (glfs_t *fs, const char *path)
+{
+        if (fs == NULL) {
+                return unlink (path);
+        }
+
+        return glfs_unlink (fs, path);
+}
+
+int
+tree_rmdir (glfs_t *fs, const char *path)
+{
+        if (fs == NULL) {
+                return rmdir (path);
+        }
+
+        return glfs_rmdir (fs, path);
+}
+
+void
+tree_copy_init (struct tree_copy *tc, glfs_t *src_fs, glfs_t *dst_fs)
+{
+        memset (tc, 0, sizeof (*tc));
+        tc->src_fs = src_fs;
+        tc->dst_fs = dst_fs;
+        tc->jobs = TREE_COPY_JOBS;
+        copy_options_init (&tc->options);
+        pthread_mutex_init (&tc->lock, NULL);
+}
+
+void
+tree_copy_fini (struct tree_copy *tc)
+{
+        struct tree_link *link;
+
+        for (size_t i = 0; i < tc->inodes_size; i++) {
+                free (tc->inodes[i].path);
+        }
+
+        free (tc->inodes);
+
+        while ((link = tc->links) != NULL) {
+                tc->links = link->next;
+                free (link->target);
+                free (link->path);
+                free (link->source);
+                free (link);
+        }
+
+        pthread_mutex_destroy (&tc->lock);
+}
+
+/**
+ * Pushes a copy of path onto list.
+ */
+static int
+tree_path_push (struct tree_path **list, const char *path)
+{
+        struct tree_path *entry;
+
+        entry = malloc (sizeof (*entry));
+        if (entry == NULL || (entry->path = strdup (path)) == NULL) {
+                free (entry);
+                return -1;
+        }
+
+        entry->next = *list;
+        *list = entry;
+
+        return 0;
+}
+
+static void
+tree_job_free (struct tree_job *job)
+{
+        free (job->src_path);
+        free (job->dst_path);
+        free (job);
+}
+
+/**
+ * Recreates a symbolic link, replacing whatever the destination held.
+ */
+static int
+tree_copy_symlink (struct tree_copy *tc, struct tree_job *job)
+{
+        char *target;
+        int ret;
+
+        target = tree_readlink (tc->src_fs, job->src_path);
+        if (target == NULL) {
+                error (0, errno, "%s", job->src_path);
+                return -1;
+        }
+
+        ret = tree_symlink (tc->dst_fs, target, job->dst_path);
+        if (ret == -1 && errno == EEXIST &&
+            tree_unlink (tc->dst_fs, job->dst_path) == 0) {
+                ret = tree_symlink (tc->dst_fs, target, job->dst_path);
+        }
+
+        if (ret == -1) {
+                error (0, errno, "cannot create symbolic link %s", job->dst_path);
+        }
+
+        free (target);
+
+        return ret;
+}
+
+/**
+ * Copies a regular file. Returns 1 if an update found it current after
+ * comparing its contents, 0 if it was copied, or -1 on error.
+ */
+static int
+tree_copy_regular (struct tree_copy *tc, struct tree_job *job)
+{
+        struct copy_file src = COPY_FILE_LOCAL (-1, job->src_path);
+        struct copy_file dst = COPY_FILE_LOCAL (-1, job->dst_path);
+        struct copy_options options = tc->options;
+        // Files found current from their attributes were skipped by the
+        // walk, so only comparisons by contents are left to do here.
+        bool compare = job->dst_exists && options.update &&
+                options.compare != CHECKSUM_NONE;
+        int ret = -1;
+
+        options.update = false;
+
+        if (tree_open (tc->src_fs, job->src_path, O_RDONLY, 0, &src) == -1) {
+                error (0, errno, "%s", job->src_path);
+                goto out;
+        }
+
+        // One create request both makes the file and empties it, instead of
+        // a lookup, a create and a truncate.
+        if (tree_open (tc->dst_fs, job->dst_path,
+                       O_CREAT | O_RDWR |
+                       (compare || copy_keeps_dest (&options) ? 0 : O_TRUNC),
+                       job->st.st_mode & 0777, &dst) == -1) {
+                error (0, errno, "%s", job->dst_path);
+                goto out;
+        }
+
+        if (compare) {
+                ret = copy_is_current (&src, &dst, &job->st, options.compare);
+                if (ret != 0) {
+                        goto out;
+                }
+
+                ret = -1;
+                if (!copy_keeps_dest (&options) && copy_ftruncate (&dst, 0) == -1) {
+                        error (0, errno, "failed to truncate %s", job->dst_path);
+                        goto out;
+                }
+        }
+
+        ret = copy_file_data (&src, &dst, &options);
+        if (ret == -1) {
+                error (0, 0, "failed to transfer %s", job->src_path);
+                goto out;
+        }
+
+        // The source of a move is only removed once its copy is durable.
+        if (tc->move && copy_fsync (&dst) == -1) {
+                error (0, errno, "failed to commit %s", job->dst_path);
+                ret = -1;
+        }
+
+out:
+        tree_close (&src);
+        tree_close (&dst);
+
+        return ret;
+}
+
+/**
+ * Transfers one entry; run by the workers of the pool of the copy.
+ */
+static void
+tree_copy_job (void *arg)
+{
+        struct tree_job *job = arg;
+        struct tree_copy *tc = job->tc;
+        int ret;
+
+        if (S_ISLNK (job->st.st_mode)) {
+                ret = tree_copy_symlink (tc, job);
+        } else {
+                ret = tree_copy_regular (tc, job);
+        }
+
+        // The other names of an inode are found by its link count, so the
+        // first one is only removed once the walk is over.
+        if (ret == 0 && tc->move && S_ISREG (job->st.st_mode) &&
+            job->st.st_nlink > 1) {
+                pthread_mutex_lock (&tc->lock);
+                if (tree_path_push (&tc->names, job->src_path) == -1) {
+                        error (0, errno, "failed to record %s", job->src_path);
+                        ret = -1;
+                }
+                pthread_mutex_unlock (&tc->lock);
+        } else if (ret == 0 && tc->move &&
+                   tree_unlink (tc->src_fs, job->src_path) == -1) {
+                error (0, errno, "cannot remove %s", job->src_path);
+                ret = -1;
+        }
+
+        pthread_mutex_lock (&tc->lock);
+        if (ret == -1) {
+                tc->errors++;
+        } else if (ret == 1) {
+                tc->current++;
+        } else {
+                tc->copied++;
+        }
+        pthread_mutex_unlock (&tc->lock);
+
+        tree_job_free (job);
+}
+
+static int
+tree_copy_queue (struct tree_copy *tc, const char *src_path,
+                 const char *dst_path, const struct stat *st, bool dst_exists)
+{
+        struct tree_job *job;
+
+        if (tc->dry_run) {
+                printf ("%s\n", dst_path);
+                return 0;
+        }
+
+        job = calloc (1, sizeof (*job));
+        if (job == NULL) {
+                return -1;
+        }
+
+        job->tc = tc;
+        job->src_path = strdup (src_path);
+        job->dst_path = strdup (dst_path);
+        if (job->src_path == NULL || job->dst_path == NULL) {
+                tree_job_free (job);
+                return -1;
+        }
+
+        job->st = *st;
+        job->dst_exists = dst_exists;
+
+        return pool_submit (tc->pool, tree_copy_job, job);
+}
+
+/**
+ * Creates a directory of the tree. Directories without write access for the
+ * owner are created writable, and given their mode by tree_copy_modes ().
+ */
+static int
+tree_copy_mkdir (struct tree_copy *tc, const char *path, mode_t mode)
+{
+        struct tree_mode *entry;
+
+        mode &= 07777;
+        if (tree_mkdir (tc->dst_fs, path, mode | S_IRWXU) == -1) {
+                return -1;
+        }
+
+        if ((mode & S_IRWXU) == S_IRWXU) {
+                return 0;
+        }
+
+        entry = malloc (sizeof (*entry));
+        if (entry == NULL || (entry->path = strdup (path)) == NULL) {
+                free (entry);
+                return -1;
+        }
+
+        // Kept in reverse order of creation, so that subdirectories are
+        // restricted before their parents.
+        entry->mode = mode;
+        entry->next = tc->modes;
+        tc->modes = entry;
+
+        return 0;
+}
+
+static int
+tree_copy_modes (struct tree_copy *tc)
+{
+        struct tree_mode *entry;
+        int ret = 0;
+
+        while ((entry = tc->modes) != NULL) {
+                if (tree_chmod (tc->dst_fs, entry->path, entry->mode) == -1) {
+                        error (0, errno, "failed to set mode of %s", entry->path);
+                        ret = -1;
+                }
+
+                tc->modes = entry->next;
+                free (entry->path);
+                free (entry);
+        }
+
+        return ret;
+}
+
+/**
+ * Removes the first names of the moved inodes with several names, then the
+ * source directories of a move. A directory still holding entries kept
+ * because they failed to be moved, and were reported as such, is left in
+ * place silently.
+ */
+static void
+tree_copy_prune (struct tree_copy *tc)
+{
+        struct tree_path *entry;
+
+        while ((entry = tc->names) != NULL) {
+                if (tree_unlink (tc->src_fs, entry->path) == -1) {
+                        error (0, errno, "cannot remove %s", entry->path);
+                        tc->errors++;
+                }
+
+                tc->names = entry->next;
+                free (entry->path);
+                free (entry);
+        }
+
+        while ((entry = tc->sources) != NULL) {
+                if (tree_rmdir (tc->src_fs, entry->path) == -1 &&
+                    errno != ENOTEMPTY && errno != EEXIST) {
+                        error (0, errno, "cannot remove %s", entry->path);
+                        tc->errors++;
+                }
+
+                tc->sources = entry->next;
+                free (entry->path);
+                free (entry);
+        }
+}
+
+static size_t
+tree_inode_hash (dev_t dev, ino_t ino)
+{
+        uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+/**
+ * Returns the slot of the inode (dev, ino) in a table of size slots, which is
+ * either empty or holds that inode. size is a power of two.
+ */
+static struct tree_inode *
+tree_inode_slot (struct tree_inode *slots, size_t size, dev_t dev, ino_t ino)
+{
+        size_t i = tree_inode_hash (dev, ino) & (size - 1);
+
+        while (slots[i].path != NULL &&
+               (slots[i].dev != dev || slots[i].ino != ino)) {
+                i = (i + 1) & (size - 1);
+        }
+
+        return &slots[i];
+}
+
+static int
+tree_inodes_grow (struct tree_copy *tc)
+{
+        size_t size = tc->inodes_size ? tc->inodes_size * 2 : 1024;
+        struct tree_inode *slots;
+        struct tree_inode *slot;
+
+        slots = calloc (size, sizeof (*slots));
+        if (slots == NULL) {
+                return -1;
+        }
+
+        for (size_t i = 0; i < tc->inodes_size; i++) {
+                if (tc->inodes[i].path != NULL) {
+                        slot = tree_inode_slot (slots, size, tc->inodes[i].dev,
+                                                tc->inodes[i].ino);
+                        *slot = tc->inodes[i];
+                }
+        }
+
+        free (tc->inodes);
+        tc->inodes = slots;
+        tc->inodes_size = size;
+
+        return 0;
+}
+
+/**
+ * Looks up the source inode of st, which has several names. The first time
+ * it is seen, dst_path is recorded as its destination and 0 is returned.
+ * Later, the destination of its first name is returned in target and 1 is
+ * returned. Returns -1 on error.
+ */
+static int
+tree_inode_lookup (struct tree_copy *tc, const struct stat *st,
+                   const char *dst_path, const char **target)
+{
+        struct tree_inode *slot;
+
+        // Keep the table at most half full for short probe sequences.
+        if ((tc->inodes_count + 1) * 2 > tc->inodes_size &&
+            tree_inodes_grow (tc) == -1) {
+                return -1;
+        }
+
+        slot = tree_inode_slot (tc->inodes, tc->inodes_size, st->st_dev,
+                                st->st_ino);
+        if (slot->path != NULL) {
+                *target = slot->path;
+                return 1;
+        }
+
+        slot->path = strdup (dst_path);
+        if (slot->path == NULL) {
+                return -1;
+        }
+
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+        tc->inodes_count++;
+
+        return 0;
+}
+
+static int
+tree_copy_defer_link (struct tree_copy *tc, const char *target,
+                      const char *src_path, const char *path)
+{
+        struct tree_link *link;
+
+        if (tc->dry_run) {
+                printf ("%s\n", path);
+                return 0;
+        }
+
+        link = calloc (1, sizeof (*link));
+        if (link == NULL) {
+                return -1;
+        }
+
+        link->target = strdup (target);
+        link->path = strdup (path);
+        link->source = tc->move ? strdup (src_path) : NULL;
+        if (link->target == NULL || link->path == NULL ||
+            (tc->move && link->source == NULL)) {
+                free (link->target);
+                free (link->path);
+                free (link->source);
+                free (link);
+                return -1;
+        }
+
+        link->next = tc->links;
+        tc->links = link;
+
+        return 0;
+}
+
+/**
+ * Creates the hard links deferred by the walk, once the first name of each
+ * inode has been copied. A move then removes the source name.
+ */
+static void
+tree_copy_links (struct tree_copy *tc)
+{
+        struct tree_link *link;
+        int ret;
+
+        while ((link = tc->links) != NULL) {
+                ret = tree_link (tc->dst_fs, link->target, link->path);
+                if (ret == -1 && errno == EEXIST &&
+                    tree_unlink (tc->dst_fs, link->path) == 0) {
+                        ret = tree_link (tc->dst_fs, link->target, link->path);
+                }
+
+                if (ret == -1) {
+                        error (0, errno, "cannot create hard link %s to %s",
+                               link->path, link->target);
+                        tc->errors++;
+                } else if (link->source != NULL &&
+                           tree_unlink (tc->src_fs, link->source) == -1) {
+                        error (0, errno, "cannot remove %s", link->source);
+                        tc->errors++;
+                } else {
+                        tc->linked++;
+                }
+
+                tc->links = link->next;
+                free (link->target);
+                free (link->path);
+                free (link->source);
+                free (link);
+        }
+}
+
+/**
+ * Queues the transfer of the files of the directory src_path, then creates
+ * and descends into its subdirectories. Each directory is created before
+ * anything is queued into it, and the files of a directory are queued before
+ * its subdirectories are listed, so the workers are kept busy while the walk
+ * goes on. The queue of the pool is bounded, which bounds the memory used
+ * by large trees.
+ *
+ * When updating, the destination directory is listed as well, and files are
+ * skipped when the listings show they are current.
+ *
+ * Only the first name of a source inode with several names is copied; the
+ * other names become hard links to it.
+ */
+static int
+tree_copy_dir (struct tree_copy *tc, const char *src_path,
+               const char *dst_path, bool dst_exists)
+{
+        struct tree_dir src_dir;
+        struct tree_dir dst_dir = { NULL, 0, 0 };
+        struct tree_entry *entry;
+        struct tree_entry *dst_entry;
+        char *src_child = NULL;
+        char *dst_child = NULL;
+        const char *target;
+        bool child_exists;
+        int ret = 0;
+        size_t i;
+
+        if (tree_list_dir (tc->src_fs, src_path, &src_dir) == -1) {
+                error (0, errno, "cannot read directory %s", src_path);
+                return -1;
+        }
+
+        // Kept in reverse order of the walk, so that subdirectories are
+        // removed before their parents.
+        if (tc->move && tree_path_push (&tc->sources, src_path) == -1) {
+                error (0, errno, "failed to record %s", src_path);
+                tree_dir_free (&src_dir);
+                return -1;
+        }
+
+        if (dst_exists && tc->options.update &&
+            tree_list_dir (tc->dst_fs, dst_path, &dst_dir) == -1) {
+                error (0, errno, "cannot read directory %s", dst_path);
+                tree_dir_free (&src_dir);
+                return -1;
+        }
+
+        for (i = 0; i < src_dir.count; i++) {
+                entry = &src_dir.entries[i];
+                if (S_ISDIR (entry->st.st_mode)) {
+                        continue;
+                }
+
+                if (!S_ISREG (entry->st.st_mode) && !S_ISLNK (entry->st.st_mode)) {
+                        error (0, 0, "skipping %s/%s: not a regular file",
+                               src_path, entry->name);
+                        // A move cannot complete without the entry.
+                        if (tc->move) {
+                                ret = -1;
+                        }
+
+                        continue;
+                }
+
+                dst_entry = tree_dir_find (&dst_dir, entry->name);
+                if (dst_entry != NULL && S_ISDIR (dst_entry->st.st_mode)) {
+                        error (0, EISDIR, "%s/%s", dst_path, entry->name);
+                        ret = -1;
+                        continue;
+                }
+
+                src_child = append_path (src_path, entry->name);
+                dst_child = append_path (dst_path, entry->name);
+                if (src_child == NULL || dst_child == NULL) {
+                        error (0, errno, "append_path");
+                        ret = -1;
+                        goto next_file;
+                }
+
+                target = NULL;
+                if (S_ISREG (entry->st.st_mode) && entry->st.st_nlink > 1 &&
+                    tree_inode_lookup (tc, &entry->st, dst_child, &target) == -1) {
+                        error (0, errno, "failed to record %s", src_child);
+                        ret = -1;
+                        goto next_file;
+                }
+
+                if (dst_entry != NULL &&
+                    (dst_entry->st.st_mode & S_IFMT) == (entry->st.st_mode & S_IFMT) &&
+                    (tc->options.compare == CHECKSUM_NONE || S_ISLNK (entry->st.st_mode)) &&
+                    copy_stat_is_current (&entry->st, &dst_entry->st)) {
+                        pthread_mutex_lock (&tc->lock);
+                        tc->current++;
+                        pthread_mutex_unlock (&tc->lock);
+                        goto next_file;
+                }
+
+                if (target != NULL) {
+                        if (tree_copy_defer_link (tc, target, src_child,
+                                                  dst_child) == -1) {
+                                error (0, errno, "failed to queue %s", src_child);
+                                ret = -1;
+                        }
+
+                        goto next_file;
+                }
+
+                if (tree_copy_queue (tc, src_child, dst_child, &entry->st,
+                                     dst_entry != NULL &&
+                                     S_ISREG (dst_entry->st.st_mode)) == -1) {
+                        error (0, errno, "failed to queue %s", src_child);
+                        ret = -1;
+                }
+
+next_file:
+                free (src_child);
+                free (dst_child);
+        }
+
+        for (i = 0; i < src_dir.count; i++) {
+                entry = &src_dir.entries[i];
+                if (!S_ISDIR (entry->st.st_mode)) {
+                        continue;
+                }
+
+                src_child = append_path (src_path, entry->name);
+                dst_child = append_path (dst_path, entry->name);
+                if (src_child == NULL || dst_child == NULL) {
+                        error (0, errno, "append_path");
+                        ret = -1;
+                        goto next;
+                }
+
+                dst_entry = tree_dir_find (&dst_dir, entry->name);
+                if (dst_entry != NULL && !S_ISDIR (dst_entry->st.st_mode)) {
+                        error (0, ENOTDIR, "%s", dst_child);
+                        ret = -1;
+                        goto next;
+                }
+
+                // A directory that was just created is known to be empty.
+                child_exists = dst_entry != NULL;
+                if (!child_exists && !tc->dry_run) {
+                        if (tree_copy_mkdir (tc, dst_child, entry->st.st_mode) == 0) {
+                                child_exists = false;
+                        } else if (errno == EEXIST) {
+                                child_exists = true;
+                        } else {
+                                error (0, errno, "cannot create directory %s",
+                                       dst_child);
+                                ret = -1;
+                                goto next;
+                        }
+                }
+
+                if (tree_copy_dir (tc, src_child, dst_child, child_exists) == -1) {
+                        ret = -1;
+                }
+
+next:
+                free (src_child);
+                free (dst_child);
+        }
+
+        tree_dir_free (&src_dir);
+        tree_dir_free (&dst_dir);
+
+        return ret;
+}
+
+/**
+ * Creates dst_path, unless it exists, and copies the tree src_path, of
+ * attributes st, into it.
+ */
+static int
+tree_copy_tree (struct tree_copy *tc, const char *src_path,
+                const char *dst_path, const struct stat *st)
+{
+        struct stat dst_st;
+        bool dst_exists = true;
+
+        if (tc->dry_run) {
+                dst_exists = tree_lstat (tc->dst_fs, dst_path, &dst_st) == 0;
+        } else if (tree_copy_mkdir (tc, dst_path, st->st_mode) == 0) {
+                dst_exists = false;
+        } else if (errno != EEXIST) {
+                error (0, errno, "cannot create directory %s", dst_path);
+                return -1;
+        }
+
+        return tree_copy_dir (tc, src_path, dst_path, dst_exists);
+}
+
+/**
+ * Starts the workers of a copy. Trees and files are then queued with
+ * tree_copy_add (), and tree_copy_finish () waits for them to be copied.
+ */
+int
+tree_copy_start (struct tree_copy *tc)
+{
+        if (tc->dry_run) {
+                return 0;
+        }
+
+        tc->pool = pool_create (tc->jobs, tc->jobs * 4);
+        if (tc->pool == NULL) {
+                error (0, errno, "failed to start transfer threads");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Queues the copy of src_path to dst_path. Directories are copied as a tree,
+ * regular files and symbolic links are handed to the workers. Returns -1 if
+ * src_path could not be queued, in full for a tree.
+ */
+int
+tree_copy_add (struct tree_copy *tc, const char *src_path,
+               const char *dst_path)
+{
+        struct stat st;
+        struct stat dst_st;
+        const char *target = NULL;
+        bool dst_exists;
+
+        if (tree_lstat (tc->src_fs, src_path, &st) == -1) {
+                error (0, errno, "%s", src_path);
+                return -1;
+        }
+
+        if (S_ISDIR (st.st_mode)) {
+                return tree_copy_tree (tc, src_path, dst_path, &st);
+        }
+
+        if (!S_ISREG (st.st_mode) && !S_ISLNK (st.st_mode)) {
+                error (0, 0, "skipping %s: not a regular file", src_path);
+                return -1;
+        }
+
+        if (S_ISREG (st.st_mode) && st.st_nlink > 1 &&
+            tree_inode_lookup (tc, &st, dst_path, &target) == -1) {
+                error (0, errno, "failed to record %s", src_path);
+                return -1;
+        }
+
+        if (target != NULL) {
+                if (tree_copy_defer_link (tc, target, src_path, dst_path) == -1) {
+                        error (0, errno, "failed to queue %s", src_path);
+                        return -1;
+                }
+
+                return 0;
+        }
+
+        dst_exists = tc->options.update &&
+                tree_lstat (tc->dst_fs, dst_path, &dst_st) == 0 &&
+                S_ISREG (dst_st.st_mode);
+
+        if (tree_copy_queue (tc, src_path, dst_path, &st, dst_exists) == -1) {
+                error (0, errno, "failed to queue %s", src_path);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Waits for the files queued by tree_copy_add () to be copied, then links,
+ * restricts and, for a move, removes what the copy left to do. Returns -1 if
+ * any entry failed to be copied.
+ */
+int
+tree_copy_finish (struct tree_copy *tc)
+{
+        int ret = 0;
+
+        pool_destroy (tc->pool);
+        tc->pool = NULL;
+
+        tree_copy_links (tc);
+
+        if (tree_copy_modes (tc) == -1) {
+                ret = -1;
+        }
+
+        tree_copy_prune (tc);
+
+        return ret == 0 && tc->errors == 0 ? 0 : -1;
+}
+
+/**
+ * Copies the directory src_path to dst_path, which is created if it does not
+ * exist. Returns -1 if any entry failed to be copied.
+ */
+int
+tree_copy (struct tree_copy *tc, const char *src_path, const char *dst_path)
+{
+        struct stat st;
+        int ret;
+
+        if (tree_stat (tc->src_fs, src_path, &st) == -1) {
+                error (0, errno, "%s", src_path);
+                return -1;
+        }
+
+        if (!S_ISDIR (st.st_mode)) {
+                error (0, ENOTDIR, "%s", src_path);
+                return -1;
+        }
+
+        if (tree_copy_start (tc) == -1) {
+                return -1;
+        }
+
+        ret = tree_copy_tree (tc, src_path, dst_path, &st);
+
+        return tree_copy_finish (tc) == 0 && ret == 0 ? 0 : -1;
+}
+
+void
+tree_remove_init (struct tree_remove *tr, glfs_t *fs)
+{
+        memset (tr, 0, sizeof (*tr));
+        tr->fs = fs;
+        tr->jobs = TREE_REMOVE_JOBS;
+        pthread_mutex_init (&tr->lock, NULL);
+}
+
+void
+tree_remove_fini (struct tree_remove *tr)
+{
+        pthread_mutex_destroy (&tr->lock);
+}
+
+static struct tree_rmnode *
+tree_rmnode_new (struct tree_rmnode *parent, const char *path)
+{
+        struct tree_rmnode *node;
+
+        node = calloc (1, sizeof (*node));
+        if (node == NULL || (node->path = strdup (path)) == NULL) {
+                free (node);
+                return NULL;
+        }
+
+        node->parent = parent;
+        node->pending = 1;
+
+        return node;
+}
+
+/**
+ * Accounts for one entry of dir, or for the walk of dir, being done with.
+ * The thread that drops the last one removes dir, then does the same for
+ * its parent.
+ */
+static void
+tree_remove_release (struct tree_remove *tr, struct tree_rmnode *dir,
+                     bool failed)
+{
+        struct tree_rmnode *parent;
+        bool done;
+
+        while (dir != NULL) {
+                pthread_mutex_lock (&tr->lock);
+                dir->failed |= failed;
+                failed = dir->failed;
+                done = --dir->pending == 0;
+                pthread_mutex_unlock (&tr->lock);
+
+                if (!done) {
+                        return;
+                }
+
+                // An entry left behind was reported already, and keeps the
+                // directory from being removed.
+                if (!failed && tree_rmdir (tr->fs, dir->path) == -1 &&
+                    !(tr->force && errno == ENOENT)) {
+                        error (0, errno, "cannot remove %s", dir->path);
+                        failed = true;
+
+                        pthread_mutex_lock (&tr->lock);
+                        tr->errors++;
+                        pthread_mutex_unlock (&tr->lock);
+                } else if (!failed) {
+                        pthread_mutex_lock (&tr->lock);
+                        tr->removed++;
+                        pthread_mutex_unlock (&tr->lock);
+                }
+
+                parent = dir->parent;
+                free (dir->path);
+                free (dir);
+                dir = parent;
+        }
+}
+
+/**
+ * Removes one file; run by the workers of the pool of the removal.
+ */
+static void
+tree_remove_job (void *arg)
+{
+        struct tree_rmjob *job = arg;
+        struct tree_remove *tr = job->tr;
+        bool failed = false;
+
+        if (tree_unlink (tr->fs, job->path) == -1 &&
+            !(tr->force && errno == ENOENT)) {
+                error (0, errno, "cannot remove %s", job->path);
+                failed = true;
+        }
+
+        pthread_mutex_lock (&tr->lock);
+        if (failed) {
+                tr->errors++;
+        } else {
+                tr->removed++;
+        }
+        pthread_mutex_unlock (&tr->lock);
+
+        tree_remove_release (tr, job->dir, failed);
+
+        free (job->path);
+        free (job);
+}
+
+static int
+tree_remove_queue (struct tree_remove *tr, struct tree_rmnode *dir,
+                   char *path)
+{
+        struct tree_rmjob *job;
+
+        job = malloc (sizeof (*job));
+        if (job == NULL) {
+                return -1;
+        }
+
+        job->tr = tr;
+        job->dir = dir;
+        job->path = path;
+
+        pthread_mutex_lock (&tr->lock);
+        dir->pending++;
+        pthread_mutex_unlock (&tr->lock);
+
+        if (pool_submit (tr->pool, tree_remove_job, job) == -1) {
+                pthread_mutex_lock (&tr->lock);
+                dir->pending--;
+                pthread_mutex_unlock (&tr->lock);
+                free (job);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * Queues the removal of the files of the directory dir, and descends into
+ * its subdirectories. Once the walk is done with dir, its last pending
+ * entry removes it. The queue of the pool is bounded, which bounds the
+ * memory used by large trees.
+ */
+static void
+tree_remove_dir (struct tree_remove *tr, struct tree_rmnode *dir)
+{
+        struct tree_dir listing;
+        struct tree_entry *entry;
+        struct tree_rmnode *child;
+        char *path;
+        bool failed = false;
+
+        if (tree_list_dir (tr->fs, dir->path, &listing) == -1) {
+                error (0, errno, "cannot read directory %s", dir->path);
+                pthread_mutex_lock (&tr->lock);
+                tr->errors++;
+                pthread_mutex_unlock (&tr->lock);
+                tree_remove_release (tr, dir, true);
+                return;
+        }
+
+        for (size_t i = 0; i < listing.count; i++) {
+                entry = &listing.entries[i];
+
+                path = append_path (dir->path, entry->name);
+                if (path == NULL) {
+                        error (0, errno, "append_path");
+                        failed = true;
+                        continue;
+                }
+
+                if (!S_ISDIR (entry->st.st_mode)) {
+                        if (tree_remove_queue (tr, dir, path) == -1) {
+                                error (0, errno, "failed to queue %s", path);
+                                free (path);
+                                failed = true;
+                        }
+
+                        continue;
+                }
+
+                child = tree_rmnode_new (dir, path);
+                free (path);
+                if (child == NULL) {
+                        error (0, errno, "%s/%s", dir->path, entry->name);
+                        failed = true;
+                        continue;
+                }
+
+                pthread_mutex_lock (&tr->lock);
+                dir->pending++;
+                pthread_mutex_unlock (&tr->lock);
+
+                tree_remove_dir (tr, child);
+        }
+
+        tree_dir_free (&listing);
+
+        if (failed) {
+                pthread_mutex_lock (&tr->lock);
+                tr->errors++;
+                pthread_mutex_unlock (&tr->lock);
+        }
+
+        tree_remove_release (tr, dir, failed);
+}
+
+/**
+ * Removes the directory path with its contents. Returns -1 if any entry
+ * failed to be removed, after reporting it.
+ */
+int
+tree_remove (struct tree_remove *tr, const char *path)
+{
+        struct tree_rmnode *root;
+
+        root = tree_rmnode_new (NULL, path);
+        if (root == NULL) {
+                error (0, errno, "%s", path);
+                return -1;
+        }
+
+        tr->pool = pool_create (tr->jobs, tr->jobs * 4);
+        if (tr->pool == NULL) {
+                error (0, errno, "failed to start removal threads");
+                free (root->path);
+                free (root);
+                return -1;
+        }
+
+        tree_remove_dir (tr, root);
+
+        pool_destroy (tr->pool);
+        tr->pool = NULL;
+
+        return tr->errors == 0 ? 0 : -1;
+}
+
+void
+tree_mkdirs_init (struct tree_mkdirs *tm, glfs_t *fs, mode_t mode)
+{
+        memset (tm, 0, sizeof (*tm));
+        tm->fs = fs;
+        tm->jobs = TREE_MKDIR_JOBS;
+        tm->mode = mode;
+        pthread_mutex_init (&tm->lock, NULL);
+}
+
+void
+tree_mkdirs_fini (struct tree_mkdirs *tm)
+{
+        for (size_t i = 0; i < tm->count; i++) {
+                free (tm->dirs[i].path);
+        }
+
+        free (tm->dirs);
+        pthread_mutex_destroy (&tm->lock);
+}
+
+static int
+tree_mkdirs_push (struct tree_mkdirs *tm, const char *path, size_t len,
+                  size_t depth)
+{
+        struct tree_mkdir *dirs;
+        size_t alloc;
+
+        if (tm->count == tm->alloc) {
+                alloc = tm->alloc ? tm->alloc * 2 : 64;
+                dirs = realloc (tm->dirs, alloc * sizeof (*dirs));
+                if (dirs == NULL) {
+                        return -1;
+                }
+
+                tm->dirs = dirs;
+                tm->alloc = alloc;
+        }
+
+        dirs = &tm->dirs[tm->count];
+        dirs->path = strndup (path, len);
+        if (dirs->path == NULL) {
+                return -1;
+        }
+
+        dirs->tm = tm;
+        dirs->depth = depth;
+        dirs->failed = false;
+        tm->count++;
+
+        return 0;
+}
+
+/**
+ * Adds path, and each of its parents, to the directories to create. Empty
+ * components and trailing slashes are ignored.
+ */
+int
+tree_mkdirs_add (struct tree_mkdirs *tm, const char *path)
+{
+        char *clean;
+        size_t len = 0;
+        size_t depth = 0;
+        int ret = 0;
+
+        // Collapse repeated slashes, so that each level has a single name.
+        clean = malloc (strlen (path) + 1);
+        if (clean == NULL) {
+                return -1;
+        }
+
+        for (const char *p = path; *p != '\0'; p++) {
+                if (*p == '/' && len > 0 && clean[len - 1] == '/') {
+                        continue;
+                }
+
+                clean[len++] = *p;
+        }
+
+        while (len > 1 && clean[len - 1] == '/') {
+                len--;
+        }
+
+        clean[len] = '\0';
+
+        for (size_t i = 1; i <= len && ret == 0; i++) {
+                if (i == len || clean[i] == '/') {
+                        ret = tree_mkdirs_push (tm, clean, i, ++depth);
+                }
+        }
+
+        free (clean);
+
+        return ret;
+}
+
+static int
+tree_mkdir_cmp (const void *a, const void *b)
+{
+        const struct tree_mkdir *x = a;
+        const struct tree_mkdir *y = b;
+
+        if (x->depth != y->depth) {
+                return x->depth < y->depth ? -1 : 1;
+        }
+
+        return strcmp (x->path, y->path);
+}
+
+/**
+ * Creates one directory; run by the workers of the pool of the creation.
+ */
+static void
+tree_mkdirs_job (void *arg)
+{
+        struct tree_mkdir *dir = arg;
+        struct tree_mkdirs *tm = dir->tm;
+        struct stat st;
+        bool existing = false;
+
+        if (tree_mkdir (tm->fs, dir->path, tm->mode) == -1) {
+                if (errno != EEXIST || tree_stat (tm->fs, dir->path, &st) == -1) {
+                        error (0, errno, "cannot create directory %s", dir->path);
+                        dir->failed = true;
+                } else if (!S_ISDIR (st.st_mode)) {
+                        error (0, ENOTDIR, "cannot create directory %s", dir->path);
+                        dir->failed = true;
+                } else {
+                        existing = true;
+                }
+        }
+
+        pthread_mutex_lock (&tm->lock);
+        if (dir->failed) {
+                tm->errors++;
+        } else if (existing) {
+                tm->existing++;
+        } else {
+                tm->created++;
+        }
+        pthread_mutex_unlock (&tm->lock);
+}
+
+/**
+ * Returns the parent of the directory at index i of the sorted directories,
+ * or NULL for a directory of depth one.
+ */
+static struct tree_mkdir *
+tree_mkdirs_parent (struct tree_mkdirs *tm, size_t i)
+{
+        struct tree_mkdir key;
+        struct tree_mkdir *parent;
+        char *slash;
+
+        if (tm->dirs[i].depth == 1) {
+                return NULL;
+        }
+
+        slash = strrchr (tm->dirs[i].path, '/');
+        key.depth = tm->dirs[i].depth - 1;
+        key.path = strndup (tm->dirs[i].path,
+                            slash == tm->dirs[i].path ? 1 : slash - tm->dirs[i].path);
+        if (key.path == NULL) {
+                return NULL;
+        }
+
+        parent = bsearch (&key, tm->dirs, i, sizeof (*tm->dirs), tree_mkdir_cmp);
+        free (key.path);
+
+        return parent;
+}
+
+/**
+ * Creates the directories added with tree_mkdirs_add (), level by level.
+ * Directories that exist already are left alone. Returns -1 if any failed
+ * to be created, after reporting it.
+ */
+int
+tree_mkdirs (struct tree_mkdirs *tm)
+{
+        struct tree_mkdir *parent;
+        struct pool *pool;
+        size_t count = 0;
+        size_t i;
+
+        if (tm->count == 0) {
+                return 0;
+        }
+
+        // Sorting by depth groups each level, and brings the parents shared
+        // by several directories together so that they are created once.
+        qsort (tm->dirs, tm->count, sizeof (*tm->dirs), tree_mkdir_cmp);
+        for (i = 0; i < tm->count; i++) {
+                if (count > 0 && tree_mkdir_cmp (&tm->dirs[count - 1],
+                                                 &tm->dirs[i]) == 0) {
+                        free (tm->dirs[i].path);
+                        continue;
+                }
+
+                tm->dirs[count++] = tm->dirs[i];
+        }
+
+        tm->count = count;
+
+        pool = pool_create (tm->jobs, tm->jobs * 4);
+        if (pool == NULL) {
+                error (0, errno, "failed to start threads");
+                return -1;
+        }
+
+        for (i = 0; i < tm->count; i++) {
+                // Wait for a level to be complete before starting the next.
+                if (i > 0 && tm->dirs[i].depth != tm->dirs[i - 1].depth) {
+                        pool_wait (pool);
+                }
+
+                // A directory under one that failed was not reported.
+                parent = tree_mkdirs_parent (tm, i);
+                if (parent != NULL && parent->failed) {
+                        tm->dirs[i].failed = true;
+                        continue;
+                }
+
+                if (pool_submit (pool, tree_mkdirs_job, &tm->dirs[i]) == -1) {
+                        error (0, errno, "failed to queue %s", tm->dirs[i].path);
+                        tm->dirs[i].failed = true;
+
+                        pthread_mutex_lock (&tm->lock);
+                        tm->errors++;
+                        pthread_mutex_unlock (&tm->lock);
+                }
+        }
+
+        pool_destroy (pool);
+
+        return tm->errors == 0 ? 0 : -1;
+}
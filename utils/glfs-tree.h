@@ -0,0 +1,245 @@
+/**
+ * Copyright (C) 2020 Feng Shuo <steve.shuo.feng@gmail.com>
+ *
+ *      This program is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GLFS_TREE_H
+#define GLFS_TREE_H
+
+#include "glfs-copy.h"
+
+#include <glusterfs/api/glfs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * Number of files a tree copy keeps in flight by default. Copying small files
+ * is bound by the latency of the few requests each of them needs, so the
+ * rate scales with the number of files copied at once.
+ */
+#define TREE_COPY_JOBS 16
+
+/**
+ * The helpers below operate on local paths when fs is NULL, and on paths of
+ * the volume fs otherwise.
+ */
+
+/**
+ * A directory entry along with the attributes of the entry itself (symbolic
+ * links are not followed).
+ */
+struct tree_entry {
+        char *name;
+        struct stat st;
+};
+
+/**
+ * The entries of a directory, sorted by name.
+ */
+struct tree_dir {
+        struct tree_entry *entries;
+        size_t count;
+        size_t alloc;
+};
+
+int
+tree_list_dir (glfs_t *fs, const char *path, struct tree_dir *dir);
+
+struct tree_entry *
+tree_dir_find (const struct tree_dir *dir, const char *name);
+
+void
+tree_dir_free (struct tree_dir *dir);
+
+int
+tree_stat (glfs_t *fs, const char *path, struct stat *statbuf);
+
+int
+tree_lstat (glfs_t *fs, const char *path, struct stat *statbuf);
+
+int
+tree_chmod (glfs_t *fs, const char *path, mode_t mode);
+
+int
+tree_link (glfs_t *fs, const char *oldpath, const char *newpath);
+
+int
+tree_mkdir (glfs_t *fs, const char *path, mode_t mode);
+
+int
+tree_open (glfs_t *fs, const char *path, int flags, mode_t mode,
+           struct copy_file *file);
+
+void
+tree_close (struct copy_file *file);
+
+char *
+tree_readlink (glfs_t *fs, const char *path);
+
+int
+tree_symlink (glfs_t *fs, const char *target, const char *path);
+
+int
+tree_unlink (glfs_t *fs, const char *path);
+
+int
+tree_rmdir (glfs_t *fs, const char *path);
+
+/**
+ * A recursive copy of a directory tree.
+ *
+ * src_fs, dst_fs: The volumes of the two trees, NULL for local trees.
+ * jobs: Number of files copied concurrently.
+ * options: Options of the data transfer of each file. With options.update
+ *          set, files are skipped when the destination is current, judging
+ *          from the attributes returned by the directory listings unless
+ *          options.compare is set.
+ * dry_run: Whether the files that would be copied are only printed.
+ * move: Whether each source file is removed once its copy is committed, and
+ *       each source directory once the move has emptied it.
+ * inodes, inodes_size, inodes_count: Open addressing table of the source
+ *                                    inodes with several names, used by the
+ *                                    walk to copy their data once.
+ * links: Hard links created once the data is copied.
+ * modes: Modes applied to the directories once their contents are copied.
+ * names: First names of the moved inodes with several names, removed at the
+ *        end of a move.
+ * sources: Source directories removed at the end of a move.
+ * copied, linked, current, errors: Statistics of the copy.
+ */
+struct tree_copy {
+        glfs_t *src_fs;
+        glfs_t *dst_fs;
+        int jobs;
+        struct copy_options options;
+        bool dry_run;
+        bool move;
+        struct pool *pool;
+        struct tree_inode *inodes;
+        size_t inodes_size;
+        size_t inodes_count;
+        struct tree_link *links;
+        struct tree_mode *modes;
+        struct tree_path *names;
+        struct tree_path *sources;
+        pthread_mutex_t lock;
+        uintmax_t copied;
+        uintmax_t linked;
+        uintmax_t current;
+        uintmax_t errors;
+};
+
+void
+tree_copy_init (struct tree_copy *tc, glfs_t *src_fs, glfs_t *dst_fs);
+
+int
+tree_copy_start (struct tree_copy *tc);
+
+int
+tree_copy_add (struct tree_copy *tc, const char *src_path,
+               const char *dst_path);
+
+int
+tree_copy_finish (struct tree_copy *tc);
+
+int
+tree_copy (struct tree_copy *tc, const char *src_path, const char *dst_path);
+
+void
+tree_copy_fini (struct tree_copy *tc);
+
+/**
+ * Number of entries a tree removal keeps in flight by default. Each removal
+ * is a single request, so the rate scales with the number in flight until
+ * the server is saturated.
+ */
+#define TREE_REMOVE_JOBS 32
+
+/**
+ * A recursive removal of a directory tree. The tree is walked while the
+ * workers remove its files, and each directory is removed as soon as the
+ * last of its entries is gone.
+ *
+ * fs: The volume of the tree, NULL for a local tree.
+ * jobs: Number of removals in flight.
+ * force: Whether entries that disappear during the removal are ignored.
+ * removed, errors: Statistics of the removal.
+ */
+struct tree_remove {
+        glfs_t *fs;
+        int jobs;
+        bool force;
+        struct pool *pool;
+        pthread_mutex_t lock;
+        uintmax_t removed;
+        uintmax_t errors;
+};
+
+void
+tree_remove_init (struct tree_remove *tr, glfs_t *fs);
+
+int
+tree_remove (struct tree_remove *tr, const char *path);
+
+void
+tree_remove_fini (struct tree_remove *tr);
+
+/**
+ * Number of directories a bulk creation keeps in flight by default.
+ */
+#define TREE_MKDIR_JOBS 32
+
+/**
+ * A bulk creation of directories, along with their missing parents. The
+ * directories of each depth are created concurrently, once all those of
+ * the depth above exist.
+ *
+ * fs: The volume of the directories, NULL for local directories.
+ * jobs: Number of directories created concurrently.
+ * mode: Mode of the directories created.
+ * dirs, count, alloc: The directories to create and their parents.
+ * created, existing, errors: Statistics of the creation.
+ */
+struct tree_mkdirs {
+        glfs_t *fs;
+        int jobs;
+        mode_t mode;
+        struct tree_mkdir *dirs;
+        size_t count;
+        size_t alloc;
+        pthread_mutex_t lock;
+        uintmax_t created;
+        uintmax_t existing;
+        uintmax_t errors;
+};
+
+void
+tree_mkdirs_init (struct tree_mkdirs *tm, glfs_t *fs, mode_t mode);
+
+int
+tree_mkdirs_add (struct tree_mkdirs *tm, const char *path);
+
+int
+tree_mkdirs (struct tree_mkdirs *tm);
+
+void
+tree_mkdirs_fini (struct tree_mkdirs *tm);
+
+#endif /* GLFS_TREE_H */
@@ -22,10 +22,13 @@
 #include <config.h>
 
 #include "glfs-truncate.h"
+#include "glfs-batch.h"
+#include "glfs-copy.h"
 #include "glfs-util.h"
 
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <glusterfs/api/glfs.h>
 #include <stdbool.h>
@@ -39,15 +42,20 @@
 /**
  * Used to store the state of the program, including user supplied options.
  *
- * gluster_url: Struct of the parsed url supplied by the user.
- * url: Full url used to find the remote file (supplied by user).
+ * files: The files to truncate, supplied by the user.
+ * size: The size the files are set to, or with punch_hole the length of the
+ *       hole.
+ * offset: Start of the hole punched with punch_hole.
+ * punch_hole: Whether the range is deallocated instead, leaving the size of
+ *             the files unchanged.
  * debug: Whether to log additional debug information.
  */
 struct state {
-        struct gluster_url *gluster_url;
+        struct batch files;
         struct xlator_option *xlator_options;
-        char *url;
         off_t size;
+        off_t offset;
+        bool punch_hole;
         bool debug;
 };
 
@@ -57,8 +65,12 @@ static struct option const long_options[] =
 {
         {"size", required_argument, 0, 's'},
         {"debug", no_argument, NULL, 'd'},
+        {"files-from", required_argument, NULL, 'f'},
         {"help", no_argument, NULL, 'x'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"offset", required_argument, NULL, 'O'},
         {"port", required_argument, NULL, 'p'},
+        {"punch-hole", no_argument, NULL, 'P'},
         {"version", no_argument, NULL, 'v'},
         {"xlator-option", required_argument, NULL, 'o'},
         {NULL, no_argument, NULL, 0}
@@ -67,23 +79,34 @@ static struct option const long_options[] =
 static void
 usage()
 {
-        printf ("Usage: %s [OPTION]... URL\n"
-                "Read a file on a remote Gluster volume and write it to standard output.\n\n"
+        printf ("Usage: %s [OPTION]... URL...\n"
+                "Set the size of each file on a remote Gluster volume, creating the files\n"
+                "that do not exist.\n\n"
+                "  -f, --files-from=FILE        also truncate the files listed in FILE, one\n"
+                "                               per line. With FILE -, read standard input.\n"
+                "  -j, --jobs=N                 truncate up to N files concurrently\n"
+                "                               (default %d)\n"
+                "      --offset=OFFSET          with --punch-hole, start the hole at OFFSET\n"
+                "                               (default 0)\n"
                 "  -o, --xlator-option=OPTION   specify a translator option for the\n"
                 "                               connection. Multiple options are supported\n"
                 "                               and take the form xlator.key=value.\n"
                 "      --size=SIZE              set or adjust the file size by SIZE bytes\n"
                 "                               size is integer and optional unit (Eg: 10, 10K, 10KB)\n"
                 "  -p, --port=PORT              specify the port on which to connect\n"
+                "      --punch-hole             deallocate SIZE bytes from OFFSET instead,\n"
+                "                               keeping the size of the files\n"
                 "      --help     display this help and exit\n"
                 "      --version  output version information and exit\n\n"
                 "Examples:\n"
                 "  gftruncate glfs://localhost/groot/path/to/file\n"
                 "        Truncate /path/to/file on the Gluster volume\n"
+                "  gftruncate --punch-hole --offset=1M --size=4M glfs://localhost/groot/file\n"
+                "        Free the 4MiB following the first MiB of /file on the volume.\n"
                 "  gfcli (localhost/groot)> cat /file\n"
                 "        In the context of a shell with a connection established,\n"
                 "        Truncate the file on the gluster volume.\n",
-                program_invocation_name);
+                program_invocation_name, BATCH_JOBS);
 }
 
 off_t
@@ -166,13 +189,17 @@ parse_options (int argc, char *argv[], bool has_connection)
         int ret = -1;
         int opt = 0;
         int option_index = 0;
+        char *end;
+        char *files_from = NULL;
+        long jobs;
         struct xlator_option *option;
 
         // Reset getopt since other utilities may have called it already.
         optind = 0;
         int hasSize = 0;
+        bool has_offset = false;
         while (true) {
-                opt = getopt_long (argc, argv, "do:p:", long_options,
+                opt = getopt_long (argc, argv, "df:j:o:p:", long_options,
                                    &option_index);
 
                 if (opt == -1) {
@@ -182,6 +209,29 @@ parse_options (int argc, char *argv[], bool has_connection)
                 switch (opt) {
                         case 'd':
                                 state->debug = true;
+                                break;
+                        case 'f':
+                                files_from = optarg;
+                                break;
+                        case 'j':
+                                errno = 0;
+                                jobs = strtol (optarg, &end, 10);
+                                if (errno != 0 || *end != '\0' || jobs < 1 ||
+                                    jobs > 1024) {
+                                        error (0, 0, "invalid number of jobs: \"%s\"", optarg);
+                                        goto err;
+                                }
+
+                                state->files.jobs = jobs;
+                                break;
+                        case 'O':
+                                has_offset = true;
+                                state->offset = parse_size (optarg);
+                                if (state->offset < 0) {
+                                        error (0, 0, "invalid offset: \"%s\"", optarg);
+                                        goto err;
+                                }
+
                                 break;
                         case 'o':
                                 option = parse_xlator_option (optarg);
@@ -202,6 +252,9 @@ parse_options (int argc, char *argv[], bool has_connection)
                                         goto out;
                                 }
 
+                                break;
+                        case 'P':
+                                state->punch_hole = true;
                                 break;
                         case 'v':
                                 printf ("%s (%s) %s\n%s\n%s\n%s\n",
@@ -237,39 +290,34 @@ parse_options (int argc, char *argv[], bool has_connection)
                 goto err;
         }
 
-        if ((argc - option_index) < 2) {
-                error (0, 0, "missing operand");
+        if (has_offset && !state->punch_hole) {
+                error (0, 0, "--offset requires --punch-hole");
                 goto err;
-        } else {
-                state->url = strdup (argv[argc - 1]);
-                if (state->url == NULL) {
-                        error (0, errno, "strdup");
-                        goto out;
-                }
+        }
 
-                if (has_connection) {
-                        state->gluster_url = gluster_url_init();
-                        if (state->gluster_url == NULL) {
-                                error (0, errno, "gluster_url_init");
-                                goto out;
-                        }
+        if (state->punch_hole && state->size == 0) {
+                error (0, 0, "--punch-hole needs a non-zero --size");
+                goto err;
+        }
 
-                        state->gluster_url->path = strdup (argv[argc - 1]);
-                        if (state->gluster_url->path == NULL) {
-                                error (0, errno, "strdup");
-                                goto out;
-                        }
-                        ret = 0;
-                        goto out;
-                }
-                ret = gluster_parse_url(argv[argc - 1], &(state->gluster_url));
-                if (ret == -1) {
-                        error (0, EINVAL, "%s", state->url);
+        if (optind == argc && files_from == NULL) {
+                error (0, 0, "missing operand");
+                goto err;
+        }
+
+        for (int i = optind; i < argc; i++) {
+                if (batch_add (&state->files, argv[i], port, has_connection) == -1) {
                         goto err;
                 }
-                state->gluster_url->port = port;
         }
 
+        if (files_from != NULL &&
+            batch_add_files_from (&state->files, files_from, port,
+                                  has_connection) == -1) {
+                goto out;
+        }
+
+        ret = 0;
         goto out;
 
 err:
@@ -287,98 +335,109 @@ init_state ()
                 goto out;
         }
 
+        batch_init (&state->files);
         state->debug = false;
-        state->gluster_url = NULL;
-        state->url = NULL;
         state->size = 0;
+        state->offset = 0;
+        state->punch_hole = false;
         state->xlator_options = NULL;
 
 out:
         return state;
 }
 
-gluster_get (glfs_t *fs, const char *filename) {
-        glfs_fd_t *fd = NULL;
-        int ret = -1;
+/**
+ * Deallocates the range of one file selected by --offset and --size. The
+ * file must exist, and keeps its size.
+ */
+static int
+punch_path (glfs_t *fs, const char *path, const char *arg)
+{
+        struct copy_file file;
+        glfs_fd_t *fd;
+        int ret;
 
-        fd = glfs_open (fs, filename, O_RDONLY);
+        fd = glfs_open (fs, path, O_WRONLY);
         if (fd == NULL) {
-                error (0, errno, "%s", state->url);
-                goto out;
+                error (0, errno, "cannot open `%s'", arg);
+                return -1;
         }
 
-        ret = gluster_lock (fd, F_WRLCK, false);
+        file = COPY_FILE_REMOTE (fs, fd, path);
+        ret = copy_fallocate (&file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              state->offset, state->size);
         if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto out;
+                error (0, errno, "cannot punch a hole in `%s'", arg);
         }
 
-        ret = 0;
-
-out:
-        if (fd) {
-                if (glfs_close (fd) == -1) {
-                        ret = -1;
-                        error (0, errno, "cannot close file %s",
-                                        state->gluster_url->path);
-                }
+        if (glfs_close (fd) == -1 && ret == 0) {
+                error (0, errno, "cannot close file `%s'", arg);
+                ret = -1;
         }
 
         return ret;
 }
 
-
-truncate_without_context ()
+/**
+ * Sets the size of one file. Files that exist take a single request; the
+ * others are created first.
+ */
+static int
+truncate_path (glfs_t *fs, const char *path, const char *arg, void *data)
 {
-        glfs_t *fs = NULL;
-        int ret = -1;
+        glfs_fd_t *fd;
+        int ret;
 
-        ret = gluster_getfs (&fs, state->gluster_url);
-        if (ret == -1) {
-                error (0, errno, "%s", state->url);
-                goto out;
+        if (state->punch_hole) {
+                return punch_path (fs, path, arg);
         }
 
-        ret = apply_xlator_options (fs, &state->xlator_options);
-        if (ret == -1) {
-                error (0, errno, "failed to apply translator options");
-                goto out;
+        if (glfs_truncate (fs, path, state->size) == 0) {
+                return 0;
         }
 
-        if (state->debug) {
-                ret = glfs_set_logging (fs, "/dev/stderr", GF_LOG_DEBUG);
-
-                if (ret == -1) {
-                        error (0, errno, "failed to set logging level");
-                        goto out;
-                }
+        if (errno != ENOENT) {
+                error (0, errno, "cannot truncate `%s'", arg);
+                return -1;
         }
-        ret = glfs_stat (fs, state->gluster_url->path, NULL);
-        if (ret != 0)
-        {
-                glfs_fd_t *fd = glfs_creat(fs, state->gluster_url->path, 0, 0777);
-                if (fd == NULL)
-                {
-                        error(0, 0, "Error creating new file");
-                        goto out;
-                }
+
+        fd = glfs_creat (fs, path, O_CREAT | O_WRONLY,
+                         get_default_file_mode_perm ());
+        if (fd == NULL) {
+                error (0, errno, "cannot create file `%s'", arg);
+                return -1;
         }
-        ret = gluster_get (fs, state->gluster_url->path);
+
+#ifdef HAVE_GLFS_7_6
+        ret = glfs_ftruncate (fd, state->size, NULL, NULL);
+#else
+        ret = glfs_ftruncate (fd, state->size);
+#endif
         if (ret == -1) {
-                goto out;
+                error (0, errno, "cannot truncate `%s'", arg);
         }
 
-        ret = 0;
-        ret = glfs_truncate(fs, state->gluster_url->path, state->size);
-
-out:
-        if (fs) {
-                glfs_fini (fs);
+        if (glfs_close (fd) == -1 && ret == 0) {
+                error (0, errno, "cannot close file `%s'", arg);
+                ret = -1;
         }
 
         return ret;
 }
 
+static int
+truncate_with_fs (glfs_t *fs)
+{
+        int ret;
+
+        ret = batch_connect (&state->files, fs, &state->xlator_options,
+                             state->debug);
+        if (ret == 0) {
+                ret = batch_run (&state->files, truncate_path, NULL);
+        }
+
+        return ret;
+}
 
 int
 do_truncate (struct cli_context *ctx)
@@ -393,41 +452,23 @@ do_truncate (struct cli_context *ctx)
                 goto out;
         }
 
-        if (ctx->fs) {
-                ret = parse_options (argc, argv, true);
-                if (ret != 0) {
-                        goto out;
-                }
-                ret = glfs_stat (ctx->fs, state->gluster_url->path, NULL);
-                if (ret != 0)
-                {
-                        glfs_fd_t *fd = glfs_creat(ctx->fs, state->gluster_url->path, 0, 0777);
-                        if (fd == NULL)
-                        {
-                                error(0, 0, "Error creating new file");
-                                goto out;
-                        }
-                }
-                ret = glfs_truncate(ctx->fs, state->gluster_url->path, state->size);
-        }else {
-                state->debug = ctx->options->debug;
-                ret = parse_options (argc, argv, false);
-                switch (ret) {
-                        case -2:
-                                // Fall through
-                                ret = 0;
-                        case -1:
-                                goto out;
-                }
+        state->debug = ctx->options->debug;
 
-                ret = truncate_without_context ();
+        ret = parse_options (argc, argv, ctx->fs != NULL);
+        switch (ret) {
+                case -2:
+                        // Fall through
+                        ret = 0;
+                case -1:
+                        goto out;
         }
 
+        ret = truncate_with_fs (ctx->fs);
 
 out:
         if (state) {
-                gluster_url_free (state->gluster_url);
-                free (state->url);
+                batch_fini (&state->files);
+                free_xlator_options (&state->xlator_options);
         }
 
         free (state);
@@ -22,10 +22,10 @@
 
 #include "glfs-util.h"
 
-#include <assert.h>
 #include <errno.h>
 #include <error.h>
 #include <glusterfs/api/glfs.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -275,55 +275,135 @@ out:
         return ret;
 }
 
+/**
+ * Checks whether the level of path ending at end is a directory. Returns 1
+ * if it is, 0 if it does not exist, or -1 with errno set.
+ */
+static int
+gluster_path_level_is_dir (glfs_t *fs, char *path, char *end, bool is_last)
+{
+        struct stat sb;
+        int ret;
+
+        *end = '\0';
+        ret = glfs_stat (fs, path, &sb);
+        *end = '/';
+
+        if (ret != EXIT_SUCCESS) {
+                return errno == ENOENT ? 0 : -1;
+        }
+
+        if (!S_ISDIR (sb.st_mode)) {
+                errno = is_last ? EEXIST : ENOTDIR;
+                return -1;
+        }
+
+        return 1;
+}
+
+/**
+ * Creates the level of path ending at end, which may already exist as a
+ * directory.
+ */
+static int
+gluster_path_level_create (glfs_t *fs, char *path, char *end, bool is_last,
+                           mode_t omode)
+{
+        int ret;
+
+        *end = '\0';
+        ret = glfs_mkdir (fs, path, omode);
+        *end = '/';
+
+        if (ret != EXIT_SUCCESS) {
+                if (errno != EEXIST && errno != EISDIR) {
+                        return -1;
+                }
+
+                if (gluster_path_level_is_dir (fs, path, end, is_last) != 1) {
+                        return -1;
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/**
+ * Creates the directories of path up to its last slash, like mkdir -p.
+ *
+ * The deepest level is created first, which takes a single request in the
+ * common case of only the last level missing, where walking down from the
+ * root costs a mkdir and a stat per level. When a parent is missing, the
+ * deepest existing level is found by a binary search over the levels, and
+ * only the levels below it are created, each one right after its parent.
+ */
 int
 gluster_create_path (glfs_t *fs, char *path, mode_t omode)
 {
-        struct stat sb;
-        int is_last = 0;
+        char **ends = NULL;
+        size_t count = 0;
+        ssize_t lo;
+        ssize_t hi;
+        ssize_t mid;
         int ret = EXIT_SUCCESS;
-        char *dir_end = NULL;
         char *next = path;
 
         if (*next == '/') {
                 next++;
         }
 
-        dir_end = strrchr (next, '/');
-        if (dir_end == NULL) {
+        for (char *p = next; (p = strchr (p, '/')) != NULL; p++) {
+                count++;
+        }
+
+        if (count == 0) {
                 goto out;
         }
 
-        do {
-                next = strchr (next, '/');
-                assert (next != NULL);
-                is_last = next == dir_end;
-                *next = '\0';
+        ends = malloc (count * sizeof (*ends));
+        if (ends == NULL) {
+                ret = -1;
+                goto out;
+        }
 
-                ret = glfs_mkdir (fs, path, omode);
+        count = 0;
+        for (char *p = next; (p = strchr (p, '/')) != NULL; p++) {
+                ends[count++] = p;
+        }
 
-                if (ret != EXIT_SUCCESS) {
-                        if (errno != EEXIST && errno != EISDIR) {
-                                goto out;
-                        }
+        ret = gluster_path_level_create (fs, path, ends[count - 1], true, omode);
+        if (ret == EXIT_SUCCESS || errno != ENOENT) {
+                goto out;
+        }
 
-                        ret = glfs_stat (fs, path, &sb);
-                        if (ret != EXIT_SUCCESS) {
-                                goto out;
-                        }
+        // Levels up to lo are directories, and level hi is missing.
+        lo = -1;
+        hi = count - 1;
+        while (hi - lo > 1) {
+                mid = lo + (hi - lo) / 2;
+                ret = gluster_path_level_is_dir (fs, path, ends[mid], false);
+                if (ret == -1) {
+                        goto out;
+                }
 
-                        if (!S_ISDIR (sb.st_mode)) {
-                                errno = is_last ? EEXIST : ENOTDIR;
-                                goto out;
-                        }
+                if (ret == 1) {
+                        lo = mid;
+                } else {
+                        hi = mid;
                 }
+        }
 
-                if (!is_last) {
-                        *next = '/';
-                        ++next;
+        for (size_t i = hi; i < count; i++) {
+                ret = gluster_path_level_create (fs, path, ends[i],
+                                                 i == count - 1, omode);
+                if (ret != EXIT_SUCCESS) {
+                        goto out;
                 }
-        } while (!is_last);
+        }
 
 out:
+        free (ends);
+
         return ret;
 }
 
@@ -550,3 +630,39 @@ err:
 out:
         return port;
 }
+
+/**
+ * Parses a number of bytes, optionally followed by one of the K, M, G or T
+ * suffixes for powers of 1024. Returns -1 when str is not a valid size.
+ */
+off_t
+strtosize (const char *str)
+{
+        const char *suffixes = "KMGT";
+        const char *suffix;
+        intmax_t size;
+        char *end;
+
+        errno = 0;
+        size = strtoimax (str, &end, 10);
+        if (errno != 0 || end == str || size < 0) {
+                return -1;
+        }
+
+        if (*end != '\0') {
+                suffix = strchr (suffixes, *end);
+                if (suffix == NULL || end[1] != '\0') {
+                        return -1;
+                }
+
+                for (; suffix >= suffixes; suffix--) {
+                        if (size > INTMAX_MAX / 1024) {
+                                return -1;
+                        }
+
+                        size *= 1024;
+                }
+        }
+
+        return size;
+}
@@ -98,4 +98,7 @@ print_xlator_options (struct xlator_option **options);
 uint16_t
 strtoport (const char *str);
 
+off_t
+strtosize (const char *str);
+
 #endif